@@ -13,6 +13,26 @@
                         // WARNING: apparently this must be defined before any other inclusion, (Learned the hard way, (do not remove this line))
 #include "3-Global-Variables-and-Functions.h"
 #include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "5-Server-User-Registry.h"
+#include "6-Server-Mailbox.h"
+#include "7-Server-Body-Store.h"
+#include "8-Server-Header-Cache.h"
+#include "9-Server-Search-Index.h"
+#include "10-Server-Substring-Filter.h"
+#include "11-Server-Archive.h"
+#include "12-Server-Fsck.h"
+#include "13-Server-Snapshot.h"
+#include "14-Server-Storage-Engine.h"
+#include "15-Server-Checksum.h"
+#include "17-Server-Disk-IO.h"
+#include "18-Compression.h"
+#include "19-Server-Cold-Tier.h"
+#include "20-Server-Auth.h"
+#include "21-Server-Resume-Token.h"
+#include "22-Server-Credential-Cache.h"
+#include "23-Server-Login-Throttle.h"
+#include "24-Header-Encoding.h"
 #include <stdio.h>      // printf, fprintf
 #include <stdlib.h>     // exit, EXIT_FAILURE, EXIT_SUCCESS
 #include <unistd.h>     // close, access
@@ -32,12 +52,11 @@
 #include <stddef.h>     // offsetof
 #include <string.h>     // strcmp, strncmp, strlen, memcpy, strstr
 #include <errno.h>      // errno, EINTR, ETIMEDOUT
-#include <signal.h>     // sigset_t, sigwait, SIGINT, SIGTERM
+#include <signal.h>     // sigset_t, sigwait, SIGINT, SIGTERM, SIGUSR1
 // #include <linux/if_link.h> // IFLA_ADDRESS
 
 
-// SIMPLE PRINT STATEMENT ON STDOUT
-#define P(fmt, ...) do{fprintf(stdout,"[SRV]>>> " fmt "\n", ##__VA_ARGS__);}while(0);
+// SIMPLE PRINT STATEMENT ON STDOUT -> MOVED TO 1-Server.h SO THAT EVERY SERVER MODULE PRINTS THE SAME WAY
 
 // Max number of pending connections in the socket listen queue
 // Also used as the maximum number of logged in users / worker threads active at a time
@@ -54,6 +73,11 @@ static char *current_loggedin_users[MAX_BACKLOG] = {0}; // Array of pointers to
 /** @warning: SCALABILITY, to increase the max number of available slots increase the size of the bitmap from unsigned int to a larger type */
 static unsigned int current_loggedin_users_bitmap = 0;  // Which slots in the current_loggedin_users array are used, bit i is 1 if current_loggedin_users[i] contains the name of a loggedin user
 static sem_t current_loggedin_users_semaphore;
+// Connection of the session holding each slot, and a generation that changes whenever a resumed session takes the slot over: the
+// session that lost it must not free it when it ends
+static int current_loggedin_users_fd[MAX_BACKLOG] = {0};
+static uint64_t current_loggedin_users_generation[MAX_BACKLOG] = {0};
+static uint64_t current_loggedin_users_next_generation = 1;
 
 // SHUTDOWN HANDLING
 static size_t number_of_current_logged_in_users = 0;
@@ -76,6 +100,14 @@ static const char *server_port_env = "PGM_SERVER_PORT";
 // Variable to shut down the server when needed, 0 false 1 true
 static volatile sig_atomic_t shutdown_now = 0;
 
+// What the server answers to REQUEST_NEGOTIATE_COMPRESSION (PGM_COMPRESSION, PGM_COMPRESSION_MIN_BYTES), read once in main
+static WIRE_COMPRESSION_OFFER server_compression_offer = {0};
+// Every compressed session adds its counters here when it ends, logged at shutdown
+static pthread_mutex_t wire_totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static WIRE_COMPRESSION wire_totals = {0};
+// Whether the server accepts REQUEST_NEGOTIATE_HEADER_ENCODING (PGM_COMPACT_HEADERS), read once in main
+static int server_compact_headers = 0;
+
 
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
 /*                                          HELPER FUNCTIONS                                                     */
@@ -442,13 +474,15 @@ static void unlock_loggedin_users_or_exit(void)
  * @brief Add the user to the list of loggedin users
  * 
  * @param username pointer to the null terminated string containing the username
+ * @param connection_fd connection of the session, shut down if a resumed session takes the slot over
  * @param out_index pointer to an integer where the assigned index of the logged in user will be written
+ * @param out_generation generation of the slot, to give to remove_loggedin_user()
  * @return ERROR_CODE 
  */
-static ERROR_CODE add_loggedin_user(const char *username, int *out_index)
+static ERROR_CODE add_loggedin_user(const char *username, int connection_fd, int *out_index, uint64_t *out_generation)
 {
     
-    if (unlikely(username == NULL || out_index == NULL))
+    if (unlikely(username == NULL || out_index == NULL || out_generation == NULL))
     {
         return NULL_PARAMETERS;
     }
@@ -502,7 +536,10 @@ static ERROR_CODE add_loggedin_user(const char *username, int *out_index)
 
     current_loggedin_users[slot] = name_copy;       // Place the username in the corresponding slot
     current_loggedin_users_bitmap |= (1u << slot);  // Set the corresponding slot as occupied in the bitmap
+    current_loggedin_users_fd[slot] = connection_fd;
+    current_loggedin_users_generation[slot] = current_loggedin_users_next_generation++;
     *out_index = slot;                              // Return the assigned slot number in the namespace of the caller
+    *out_generation = current_loggedin_users_generation[slot];
     #ifdef DEBUG
         P("current_loggedin_users_bitmap after login: 0x%08X", current_loggedin_users_bitmap);
     #endif
@@ -512,7 +549,48 @@ static ERROR_CODE add_loggedin_user(const char *username, int *out_index)
 }
 
 
-static void remove_loggedin_user(int index)
+/**
+ * @brief Gives the slot of a logged in user to a resumed session of the same user, or adds the user if no session holds one
+ *
+ * The session that held the slot has its connection shut down, so it ends on its own: under the lock, that connection is still
+ * open (a session closes its connection only after remove_loggedin_user(), which waits for the lock too).
+ * @param out_took_over set to 1 if a session still logged in lost its slot
+ * @return ERROR_CODE of add_loggedin_user() if there was no session to take over
+ */
+static ERROR_CODE take_over_loggedin_user(const char *username, int connection_fd, int *out_index, uint64_t *out_generation, int *out_took_over)
+{
+    if (unlikely(username == NULL || out_index == NULL || out_generation == NULL || out_took_over == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    *out_took_over = 0;
+    lock_loggedin_users_or_exit();
+    for (int i = 0; i < MAX_BACKLOG; i++)
+    {
+        if (current_loggedin_users[i] != NULL && strcmp(current_loggedin_users[i], username) == 0)
+        {
+            if (unlikely(shutdown(current_loggedin_users_fd[i], SHUT_RDWR) < 0))
+            {
+                PSE("Failed to shut down the previous session of [%s]", username);
+            }
+            current_loggedin_users_fd[i] = connection_fd;
+            current_loggedin_users_generation[i] = current_loggedin_users_next_generation++;
+            *out_index = i;
+            *out_generation = current_loggedin_users_generation[i];
+            *out_took_over = 1;
+            unlock_loggedin_users_or_exit();
+            return NO_ERROR;
+        }
+    }
+    unlock_loggedin_users_or_exit();
+    // A concurrent login of the same user may win the slot in between, then this is a double login like any other
+    return add_loggedin_user(username, connection_fd, out_index, out_generation);
+}
+
+/**
+ * @brief Frees the slot @p index, unless a resumed session took it over since @p generation
+ */
+static void remove_loggedin_user(int index, uint64_t generation)
 {
     if (index < 0 || index >= MAX_BACKLOG)
     {
@@ -520,6 +598,11 @@ static void remove_loggedin_user(int index)
     }
 
     lock_loggedin_users_or_exit();
+    if (current_loggedin_users_generation[index] != generation)
+    {
+        unlock_loggedin_users_or_exit();
+        return; // Not ours anymore
+    }
 #ifdef DEBUG
     P("current_loggedin_users_bitmap before logout: 0x%08X", current_loggedin_users_bitmap);
 #endif
@@ -531,6 +614,7 @@ static void remove_loggedin_user(int index)
     }
     // Clear occupancy bit even if pointer was already NULL (state self-heal-ish)
     current_loggedin_users_bitmap &= ~(1u << index);
+    current_loggedin_users_generation[index] = 0;
 #ifdef DEBUG
     P("current_loggedin_users_bitmap after logout: 0x%08X", current_loggedin_users_bitmap);
 #endif
@@ -562,159 +646,6 @@ static int starts_with(const char *value, const char *prefix)
     return strncmp(value, prefix, strlen(prefix)) == 0;
 }
 
-/**
- * @brief function that builds the list of REGISTERED (not online) users by scanning the current directory for folders that end with the folder suffix defined in 3-Global-Variables-and-Functions.h (e.g. "_user")
- * 
- * @param out_len 
- * @return char* 
- */
-static char *build_list_of_registered_users(size_t *output_length) // We use a parameter to tell the reader the lenght of the buffer we return
-{
-    if (output_length == NULL)
-    {
-        return NULL;
-    }
-
-    /* The  opendir() function opens a directory stream corresponding to the directory name, and returns a pointer to
-       the directory stream.  The stream is positioned at the first entry in the directory.
-       The opendir() and fdopendir() functions return a pointer to the directory stream.  On error, NULL is returned,
-       and errno is set to indicate the error.
-    */
-    DIR *directory = opendir("."); // Open the dir the application is running in
-    if (unlikely(directory == NULL))
-    {
-        PSE("opendir() failed");
-        return NULL;
-    }
-
-    size_t bytes_used = 0; // Bytes already used to store names in the user_list_buffer buffer
-    size_t buffer_capacity = 0; // The current max capacity of the user_list_buffer buffer
-    char *user_list_buffer = NULL; // Buffer that will hold the list of registered users
-    struct dirent *directory_entry = NULL; // Points to the current directory entry
-    size_t folder_suffix_length = strlen(folder_suffix_user); // calculate only once
-    /* The  readdir()  function  returns a pointer to a dirent structure representing the next directory entry in the
-       directory stream pointed to by dirp.  It returns NULL on reaching the end of the directory stream or if an er-
-       ror occurred.
-
-       In the glibc implementation, the dirent structure is defined as follows:
-
-           struct dirent {
-               ino_t          d_ino;       // Inode number
-               off_t          d_off;       // Not an offset; see below
-               unsigned short d_reclen;    // Length of this record
-               unsigned char  d_type;      // Type of file; not supported by all filesystem types
-               char           d_name[256]; // Null-terminated filename
-           };
-    */
-    while ((directory_entry = readdir(directory)) != NULL) // While there are still entries to read within the directory we check if they are user folders
-    {
-        if (!ends_with(directory_entry->d_name, folder_suffix_user)) // If it is not a user we do not care
-        {
-            continue;
-        }
-        //else
-
-        // check if the entry is actually a user DIRECTORY and not just a file that ends with the user suffix because the application would explode if that would be the case
-        /*
-        struct stat entry_stat = {0};
-        if (stat(directory_entry->d_name, &entry_stat) != 0)
-        {
-            continue;
-        }
-        if (!S_ISDIR(entry_stat.st_mode))
-        {
-            continue;
-        }
-        */
-
-        // Extract username from the folder name
-        size_t username_length = strlen(directory_entry->d_name) - folder_suffix_length;
-        size_t bytes_needed = username_length + 1;
-        
-        // Check if current buffer has enough space for: used bytes + new username + newline + null terminator, if not increase size
-        if (bytes_used + bytes_needed + 1 > buffer_capacity)
-        {
-            size_t next_capacity;
-            
-            // For the first time start with 128 bytes
-            if (buffer_capacity == 0)
-            {
-                next_capacity = 128;
-            }
-            else
-            {
-                // Increase capacity since it is too small to hold the names
-                next_capacity = buffer_capacity + 128;
-            }
-            
-            
-            while (bytes_used + bytes_needed + 1 > next_capacity) // Increase capacity until it's large enough to hold all data
-            {
-                next_capacity += 128; // Increase by chunks of 128 bytes 
-            }
-            
-            // Resize the buffer to the new capacity using another variable because if the allocation fails we also lose the handle to free the old buffer
-            char *reallocated_list = realloc(user_list_buffer, next_capacity);
-            if (unlikely(reallocated_list == NULL))
-            {
-                PSE("Failed to allocate memory for user list buffer");
-                free(user_list_buffer);
-                closedir(directory);
-                return NULL;
-            }
-            
-            // Update the pointer
-            user_list_buffer = reallocated_list;
-            buffer_capacity = next_capacity; // Keep track of new capacity
-        }
-
-        // Copy the username (without the suffix) into the buffer at the current position
-        // void *memcpy(void dest[restrict .n], const void src[restrict .n], size_t n);
-        memcpy(&user_list_buffer[bytes_used], directory_entry->d_name, username_length);
-        
-        // Advance the bytes_used counter by the username length
-        bytes_used += username_length;
-        
-        // Add a newline character after the username and increment bytes_used
-        user_list_buffer[bytes_used++] = '\n';
-    }
-
-    closedir(directory);
-
-    // No users found so return an empty string
-    if (user_list_buffer == NULL)
-    {
-        user_list_buffer = malloc(1); // Malloc to return something to the reader (null terminator)
-        if (unlikely(user_list_buffer == NULL))
-        {
-            PSE("Failed to allocate memory for empty user list buffer");
-            return NULL;
-        }
-        user_list_buffer[0] = '\0';
-        *output_length = 1;
-        return user_list_buffer;
-    }
-
-    if (bytes_used + 1 > buffer_capacity)
-    {
-        PSE("NO ROOM FOR NULL TERMINATOR!");
-        
-        char *reallocated_list = realloc(user_list_buffer, bytes_used + 1);
-        if (reallocated_list == NULL)
-        {
-            free(user_list_buffer);
-            return NULL;
-        }
-        user_list_buffer = reallocated_list;
-    }
-
-    user_list_buffer[bytes_used++] = '\0';
-    *output_length = bytes_used;
-    
-    return user_list_buffer;
-}
-
-
 /**
  * @brief Function that validates the name provided and returns 1 if the name contains only valid patterns (not "..", "/" or "\") and is not empty, otherwise it returns 0
  * 
@@ -845,88 +776,109 @@ static int compare_strings_desc(const void *a, const void *b) // Compare strings
 }
 
 /**
- * @brief Collects all the timestamps of the messages for the requesting user, if only_unread_messages is set to 1, then it collects only the messages that are unread (those that start with "UNREAD"), the function returns an array of strings that are the filenames of the messages, the number of files collected is returned through the output_file_count parameter
+ * @brief helper function to free the memory allocated for an array of message file names
  * 
- * @param user_directory_path string containing the path to the user directory where the message files are stored
- * @param only_unread_messages boolean flag to toggle listing of only unread messages
- * @param output_file_count pointer to a size_t variable that will be set to the number of collected message files
- * @return char** 
+ * @param files 
+ * @param count 
  */
-static char **collect_message_files(const char *user_directory_path, int only_unread_messages, size_t *output_file_count)
+static void free_message_files(char **files, size_t count)
 {
-    if (unlikely(output_file_count == NULL || user_directory_path == NULL)) // input check
+    if (files == NULL)
     {
-        ierrno = NULL_PARAMETERS;
-        PIE("Invalid parameters for collect_message_files");
-        return NULL;
+        return;
     }
-
-    DIR *directory_stream = opendir(user_directory_path);
-    if (unlikely(directory_stream == NULL))
+    for (size_t i = 0; i < count; i++)
     {
-        PSE("Failed to open user directory: %s", user_directory_path);
-        return NULL;
+        free(files[i]);
+    }
+    free(files);
+}
+
+typedef struct MESSAGE_FILES_COLLECTOR {
+    int only_unread_messages;
+    size_t collected_file_count;
+    size_t files_array_capacity;
+    char **collected_message_files;
+} MESSAGE_FILES_COLLECTOR;
+
+/**
+ * @brief Callback of storage_engine->list(), appends a copy of @p filename to the collector passed as @p context
+ */
+static ERROR_CODE collect_message_file(const char *filename, void *context)
+{
+    MESSAGE_FILES_COLLECTOR *collector = (MESSAGE_FILES_COLLECTOR *)context;
+
+    if (strcmp(filename, password_filename) == 0 || strcmp(filename, data_filename) == 0)
+    { // Skip password and data files (double check, the engines only list message files)
+        return NO_ERROR;
+    }
+    if (collector->only_unread_messages && !starts_with(filename, "UNREAD"))
+    { // if we only want unread messages and the file does not start with UNREAD, then we skip it
+        return NO_ERROR;
     }
 
-    size_t collected_file_count = 0;
-    size_t files_array_capacity = 0;
-    char **collected_message_files = NULL;
-    struct dirent *directory_entry = NULL;
+    size_t filename_length = strlen(filename);
+    char *filename_copy = malloc(filename_length + 1);
+    if (filename_copy == NULL)
+    {
+        PSE("Failed to allocate memory for filename copy");
+        return NO_ERROR; // not handled as fatal error
+    }
+    memcpy(filename_copy, filename, filename_length + 1);
 
-    while ((directory_entry = readdir(directory_stream)) != NULL)
+    if (collector->collected_file_count + 1 > collector->files_array_capacity)
     {
-        
-        if (!ends_with(directory_entry->d_name, file_suffix_user_data))
-        { // if it is not a user data file we do not care, this should also filters out the password file
-            continue;
-        }
-        else if (strcmp(directory_entry->d_name, password_filename) == 0 || strcmp(directory_entry->d_name, data_filename) == 0)
-        { // Skip password and data files (double check)
-            continue;
-        }
-        if (only_unread_messages && !starts_with(directory_entry->d_name, "UNREAD"))
-        { // if we only want unread messages and the file does not start with UNREAD, then we skip it
-            continue;
-        }
+        size_t next_array_capacity;
+        if (collector->files_array_capacity == 0) next_array_capacity = 5;
+        else next_array_capacity = collector->files_array_capacity + 5; // Increase capacity by chunks of 5 pointers
 
-        size_t filename_length = strlen(directory_entry->d_name);
-        char *filename_copy = malloc(filename_length + 1);
-        if (filename_copy == NULL)
+        // Resize the array to hold more pointers
+        char **reallocated_files_array = realloc(collector->collected_message_files, next_array_capacity * sizeof(char *));
+
+        // If realloc failed, free the filename copy and skip this file
+        if (reallocated_files_array == NULL)
         {
-            PSE("Failed to allocate memory for filename copy");
-            continue; // not handled as fatal error
+            PSE("Failed to allocate memory for collected message files array");
+            free(filename_copy);
+            return NO_ERROR; // still not fatal
         }
-        memcpy(filename_copy, directory_entry->d_name, filename_length + 1);
 
-        if (collected_file_count + 1 > files_array_capacity)
-        {
-            size_t next_array_capacity;
-            if (files_array_capacity == 0) next_array_capacity = 5;
-            else next_array_capacity = files_array_capacity + 5; // Increase capacity by chunks of 5 pointers
+        // Update the main pointer to the resized array
+        collector->collected_message_files = reallocated_files_array;
 
-            // Resize the array to hold more pointers
-            char **reallocated_files_array = realloc(collected_message_files, next_array_capacity * sizeof(char *));
-            
-            // If realloc failed, free the filename copy and skip this file
-            if (reallocated_files_array == NULL)
-            {
-                PSE("Failed to allocate memory for collected message files array");
-                free(filename_copy);
-                continue; // still not fatal
-            }
-            
-            // Update the main pointer to the resized array
-            collected_message_files = reallocated_files_array;
-            
-            // Track the new capacity
-            files_array_capacity = next_array_capacity;
-        }
-        collected_message_files[collected_file_count++] = filename_copy;
+        // Track the new capacity
+        collector->files_array_capacity = next_array_capacity;
+    }
+    collector->collected_message_files[collector->collected_file_count++] = filename_copy;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Collects all the timestamps of the messages for the requesting user, if only_unread_messages is set to 1, then it collects only the messages that are unread (those that start with "UNREAD"), the function returns an array of strings that are the filenames of the messages, the number of files collected is returned through the output_file_count parameter
+ * 
+ * @param username user whose messages are listed by the storage engine
+ * @param only_unread_messages boolean flag to toggle listing of only unread messages
+ * @param output_file_count pointer to a size_t variable that will be set to the number of collected message files
+ * @return char** 
+ */
+static char **collect_message_files(const char *username, int only_unread_messages, size_t *output_file_count)
+{
+    if (unlikely(output_file_count == NULL || username == NULL)) // input check
+    {
+        ierrno = NULL_PARAMETERS;
+        PIE("Invalid parameters for collect_message_files");
+        return NULL;
     }
 
-    closedir(directory_stream);
+    // The storage engine hands us every message filename (the file engine walks the user folder and its buckets, on a disk thread)
+    MESSAGE_FILES_COLLECTOR collector = {.only_unread_messages = only_unread_messages};
+    if (unlikely(disk_io_list(username, collect_message_file, &collector) != NO_ERROR))
+    {
+        free_message_files(collector.collected_message_files, collector.collected_file_count);
+        return NULL;
+    }
 
-    if (collected_message_files == NULL)
+    if (collector.collected_message_files == NULL)
     {   // no messages for the user
         *output_file_count = 0;
         return NULL;
@@ -935,30 +887,12 @@ static char **collect_message_files(const char *user_directory_path, int only_un
     /* qsort, qsort_r - sort an array
     void qsort(void base[.size * .nmemb], size_t nmemb, size_t size, int (*compar)(const void [.size], const void [.size]));
     */
-    qsort(collected_message_files, collected_file_count, sizeof(char *), compare_strings_desc);
+    qsort(collector.collected_message_files, collector.collected_file_count, sizeof(char *), compare_strings_desc);
 
-    *output_file_count = collected_file_count;
-    return collected_message_files;
+    *output_file_count = collector.collected_file_count;
+    return collector.collected_message_files;
 }
 
-/**
- * @brief helper function to free the memory allocated for an array of message file names
- * 
- * @param files 
- * @param count 
- */
-static void free_message_files(char **files, size_t count)
-{
-    if (files == NULL)
-    {
-        return;
-    }
-    for (size_t i = 0; i < count; i++)
-    {
-        free(files[i]);
-    }
-    free(files);
-}
 
 static char *build_list_from_files(char **files, size_t count, size_t *out_len)
 {
@@ -1023,6 +957,169 @@ static char *build_list_from_files(char **files, size_t count, size_t *out_len)
     return list;
 }
 
+typedef struct MARK_READ_JOB {
+    DISK_IO_JOB job;
+    char username[USERNAME_SIZE_CHARS];
+    char filename[MESSAGE_FILENAME_SIZE_CHARS];
+} MARK_READ_JOB;
+
+static void mark_read_work(DISK_IO_JOB *job)
+{
+    MARK_READ_JOB *mark = (MARK_READ_JOB *)job;
+    job->result = storage_engine->mark_read(mark->username, mark->filename);
+}
+
+/**
+ * @brief Completion of mark_read_work(): the indexes follow the rename, then the job is freed
+ */
+static void mark_read_completed(DISK_IO_JOB *job)
+{
+    MARK_READ_JOB *mark = (MARK_READ_JOB *)job;
+    if (job->result == NO_ERROR)
+    {
+        const char *new_name = mark->filename + strlen(UNREAD_PREFIX);
+        mailbox_message_renamed(mark->username, mark->filename, new_name);
+        header_cache_message_renamed(mark->username, mark->filename, new_name);
+    }
+    free(mark);
+}
+
+/**
+ * @brief Marks @p filename of @p username as read on a disk thread, counted in @p session
+ * @note A message that cannot be marked now stays unread, like a failed rename always did
+ */
+static void submit_mark_read(DISK_IO_SESSION *session, const char *username, const char *filename)
+{
+    MARK_READ_JOB *mark = calloc(1, sizeof(MARK_READ_JOB));
+    if (unlikely(mark == NULL ||
+                 (size_t)snprintf(mark->filename, sizeof(mark->filename), "%s", filename) >= sizeof(mark->filename)))
+    {
+        free(mark);
+        return;
+    }
+    snprintf(mark->username, sizeof(mark->username), "%s", username);
+    mark->job.work = mark_read_work;
+    mark->job.completion = mark_read_completed;
+    disk_io_session_submit(session, &mark->job);
+}
+
+/**
+ * @brief Sends @p code and, if it is NO_ERROR, @p token in one write (a second small write would wait for the delayed ACK of the first)
+ * @return 0 on success, -1 on error (like send_all())
+ */
+static int send_resume_token(int connection_fd, ERROR_CODE code, const RESUME_TOKEN *token)
+{
+    unsigned char reply[sizeof(ERROR_CODE) + sizeof(RESUME_TOKEN)];
+    memcpy(reply, &code, sizeof(code));
+    size_t length = sizeof(code);
+    if (code == NO_ERROR)
+    {
+        memcpy(reply + length, token, sizeof(*token));
+        length += sizeof(*token);
+    }
+    return send_all(connection_fd, reply, length);
+}
+
+/**
+ * @brief Second half of a resume frame (see RESUME_TOKEN): reads the token, then logs the session in with the slot of its user
+ *
+ * No password file and no KDF: the signature of the token is the proof. On success the reply carries a new token.
+ * @return NO_ERROR (logged in, @p login_env->sender set), RESUME_REJECTED (already answered, the usual login goes on), or any
+ * other code if the connection failed
+ */
+static ERROR_CODE resume_session(int connection_fd, LOGIN_SESSION_ENVIRONMENT *login_env, int *out_index, uint64_t *out_generation)
+{
+    RESUME_TOKEN token;
+    if (unlikely(recv_all(connection_fd, &token, sizeof(token)) <= 0))
+    {
+        PSE("::: Failed to receive the resume token on fd: %d", connection_fd);
+        return SYSCALL_ERROR;
+    }
+    char username[USERNAME_SIZE_CHARS] = {0};
+    ERROR_CODE code = resume_token_check(&token, username);
+    if (code == NO_ERROR && !(sanitize_username(username) && user_registry_contains(username)))
+    {
+        code = RESUME_REJECTED;
+    }
+    RESUME_TOKEN next_token;
+    if (code == NO_ERROR)
+    {
+        code = resume_token_issue(username, &next_token);
+    }
+    int took_over = 0;
+    if (code == NO_ERROR)
+    {
+        code = take_over_loggedin_user(username, connection_fd, out_index, out_generation, &took_over);
+    }
+    if (code != NO_ERROR)
+    {
+        P("[%d]::: Resume refused: %s", connection_fd, convert_error_code_to_string(code));
+        return send_resume_token(connection_fd, RESUME_REJECTED, NULL) == 0 ? RESUME_REJECTED : SYSCALL_ERROR;
+    }
+    snprintf(login_env->sender, sizeof(login_env->sender), "%s", username);
+    storage_engine->session_begin(login_env->sender); // Ended in cleanup, with the logged in slot
+    resume_token_count_resume(took_over);
+    P("[%d]::: Session of [%s] resumed%s", connection_fd, login_env->sender, took_over ? ", its previous connection was shut down" : "");
+    if (unlikely(send_resume_token(connection_fd, NO_ERROR, &next_token) < 0))
+    {
+        PSE("::: Failed to send the resume confirmation to [%s]", login_env->sender);
+        return SYSCALL_ERROR; // The caller frees the slot: it holds it now
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief Second half of a hello frame (see PROTOCOL_HELLO): reads the hello of the client, answers with what this session will use
+ * and sets it up in @p wire and @p headers
+ * @return NO_ERROR (answered, the username follows), ERROR if the hello is bogus (already answered), any other code if the
+ * connection failed
+ */
+static ERROR_CODE protocol_hello(int connection_fd, WIRE_COMPRESSION *wire, WIRE_HEADERS *headers, int *delivery_ack)
+{
+    PROTOCOL_HELLO hello;
+    if (unlikely(recv_all(connection_fd, &hello, sizeof(hello)) <= 0))
+    {
+        PSE("::: Failed to receive the hello on fd: %d", connection_fd);
+        return SYSCALL_ERROR;
+    }
+    uint32_t client_version = ntohl(hello.version);
+    if (ntohl(hello.magic) != PROTOCOL_HELLO_MAGIC || client_version == 0)
+    {
+        P("[%d]::: Bogus hello rejected", connection_fd);
+        ERROR_CODE rejected = ERROR;
+        return send_all(connection_fd, &rejected, sizeof(rejected)) == 0 ? ERROR : SYSCALL_ERROR;
+    }
+
+    uint32_t offered = PROTOCOL_CAPABILITY_DELIVERY_ACK;
+    offered |= resume_token_enabled() ? (uint32_t)PROTOCOL_CAPABILITY_RESUME_TOKENS : 0u;
+    offered |= (server_compression_offer.codecs & WIRE_CODEC_LZ77) != 0 ? (uint32_t)PROTOCOL_CAPABILITY_COMPRESSION : 0u;
+    offered |= server_compact_headers ? (uint32_t)PROTOCOL_CAPABILITY_COMPACT_HEADERS : 0u;
+    // Resume tokens are a property of the server, the rest must be spoken by both sides
+    uint32_t capabilities = (ntohl(hello.capabilities) | PROTOCOL_CAPABILITY_RESUME_TOKENS) & offered;
+    uint32_t client_min_bytes = ntohl(hello.compression_min_bytes);
+    uint32_t min_bytes = client_min_bytes > server_compression_offer.min_bytes ? client_min_bytes : server_compression_offer.min_bytes;
+    uint32_t version = client_version < PROTOCOL_VERSION ? client_version : PROTOCOL_VERSION;
+
+    unsigned char reply[sizeof(ERROR_CODE) + sizeof(PROTOCOL_HELLO)];
+    ERROR_CODE ok = NO_ERROR;
+    PROTOCOL_HELLO answer = {.magic = htonl(PROTOCOL_HELLO_MAGIC), .version = htonl(version), .capabilities = htonl(capabilities),
+                             .compression_min_bytes = htonl(min_bytes)};
+    memcpy(reply, &ok, sizeof(ok));
+    memcpy(reply + sizeof(ok), &answer, sizeof(answer)); // One write, like send_resume_token()
+    if (unlikely(send_all(connection_fd, reply, sizeof(reply)) < 0))
+    {
+        PSE("::: Failed to answer the hello on fd: %d", connection_fd);
+        return SYSCALL_ERROR;
+    }
+    wire->enabled = (capabilities & PROTOCOL_CAPABILITY_COMPRESSION) != 0;
+    wire->min_bytes = min_bytes;
+    headers->compact = (capabilities & PROTOCOL_CAPABILITY_COMPACT_HEADERS) != 0;
+    *delivery_ack = (capabilities & PROTOCOL_CAPABILITY_DELIVERY_ACK) != 0;
+    P("[%d]::: Hello: protocol %u, capabilities 0x%x (compression %s, %s headers)", connection_fd, version, capabilities,
+      wire->enabled ? "on" : "off", headers->compact ? "compact" : "fixed");
+    return NO_ERROR;
+}
+
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
 /*                                          SIGNAL HANDLER (THREAD)                                              */
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
@@ -1040,6 +1137,12 @@ static void *signal_handler_thread(void *arg)
             continue;
         }
 
+        if (sig == SIGUSR1)
+        {
+            P("Received snapshot signal");
+            snapshot_request(); // Runs in its own thread, this one keeps waiting for signals
+            continue;
+        }
         if (sig == SIGINT || sig == SIGTERM)
         {
             P("Received shutdown signal, shutting down server...");
@@ -1070,6 +1173,7 @@ static void *thread_routine(void *arg)
     thread_args_t *thread_args = (thread_args_t *)arg;
     int connection_fd = thread_args->connection_fd;
     int thread_index = thread_args->thread_index;
+    uint32_t client_address = thread_args->client_address;
     free(thread_args); // Free the allocated memory for thread arguments
 
     P("[%d]::: Thread started for connection fd: %d", connection_fd, connection_fd);
@@ -1079,13 +1183,15 @@ static void *thread_routine(void *arg)
 
     // Handle the connection
     LOGIN_SESSION_ENVIRONMENT login_env = {0};      // @note: initialized to zero but not really needed
+    DISK_IO_SESSION disk_session = DISK_IO_SESSION_INITIALIZER; // Background disk jobs of this session (marking messages as read)
+    WIRE_COMPRESSION wire = {0};                    // Uncompressed until the hello or REQUEST_NEGOTIATE_COMPRESSION turns it on
+    WIRE_HEADERS headers = {0};                     // Fixed headers until the hello or REQUEST_NEGOTIATE_HEADER_ENCODING
+    int delivery_ack = 0;                           // Final ERROR_CODE of REQUEST_SEND_MESSAGE, only when the hello turned it on
     ERROR_CODE response_code = NO_ERROR;
     char stored_password[PASSWORD_SIZE_CHARS] = {0};
     char client_password[PASSWORD_SIZE_CHARS] = {0};
     int current_loggedin_users_used_index = -1;     // Index used to track where the logged in user name is stored in the current_loggedin_users array
-    char *user_dir_path = NULL;                     // Path to the user directory
-    char *password_path = NULL;                     // Path to the password file within the user directory
-    char *data_path     = NULL;                     // Path to the data file within the user directory @warning = data file is not used in the current configuration
+    uint64_t current_loggedin_users_used_generation = 0; // Generation of that slot, see take_over_loggedin_user()
 
     /* -------------------------------------------------------------------------- */
     /*                            LOGIN / REGISTRATION                            */
@@ -1094,7 +1200,7 @@ static void *thread_routine(void *arg)
     // Login / registration
     P("[%d]::: Handling login...", connection_fd);
 
-    //  1) Receive username
+    //  1) Receive username, or a hello and/or a resume frame in its place (see PROTOCOL_HELLO, RESUME_TOKEN)
     ssize_t received = recv_all(connection_fd, &login_env.sender, sizeof(login_env.sender));
     if (unlikely(received <= 0))
     {
@@ -1105,12 +1211,54 @@ static void *thread_routine(void *arg)
         }
         goto cleanup;
     }
+    if (login_env.sender[0] == (char)HELLO_FRAME_MARKER)
+    {
+        ERROR_CODE hello_code = protocol_hello(connection_fd, &wire, &headers, &delivery_ack);
+        if (hello_code != NO_ERROR)
+        {
+            if (hello_code == ERROR)
+            {
+                login_throttle_failure(client_address, NULL); // Counted like an invalid username
+            }
+            goto cleanup;
+        }
+        // A second hello is just an invalid username
+        memset(&login_env, 0, sizeof(login_env));
+        received = recv_all(connection_fd, &login_env.sender, sizeof(login_env.sender));
+        if (unlikely(received <= 0))
+        {
+            PSE("::: Error receiving username after the hello for connection fd: %d", connection_fd);
+            goto cleanup;
+        }
+    }
+    if (login_env.sender[0] == (char)RESUME_FRAME_MARKER)
+    {
+        ERROR_CODE resume_code = resume_session(connection_fd, &login_env, &current_loggedin_users_used_index, &current_loggedin_users_used_generation);
+        if (resume_code == NO_ERROR)
+        {
+            goto login_handled;
+        }
+        if (resume_code != RESUME_REJECTED)
+        {
+            goto cleanup;
+        }
+        login_throttle_failure(client_address, NULL); // Forged tokens are guesses too, the next ban only hits the accept loop
+        // Rejected: the client logs in with its password on this connection, a second resume frame is just an invalid username
+        memset(&login_env, 0, sizeof(login_env));
+        received = recv_all(connection_fd, &login_env.sender, sizeof(login_env.sender));
+        if (unlikely(received <= 0))
+        {
+            PSE("::: Error receiving username after a rejected resume for connection fd: %d", connection_fd);
+            goto cleanup;
+        }
+    }
     login_env.sender[USERNAME_SIZE_CHARS - 1] = '\0';                     // Defensive null-termination
     login_env.sender[strcspn(login_env.sender, "\n")] = '\0';             // Strip newline if present
     P("[%d]::: Read username [%s]", connection_fd, login_env.sender);
     if (unlikely(!sanitize_username(login_env.sender)))
     {
         response_code = ERROR;
+        login_throttle_failure(client_address, NULL);
         P("[%d]::: Invalid username rejected [%s]", connection_fd, login_env.sender);
         if (unlikely(send_all(connection_fd, &response_code, sizeof(response_code)) < 0))
         {
@@ -1119,100 +1267,29 @@ static void *thread_routine(void *arg)
         goto cleanup;
     }
 
-    //  2) Decide whether to register or authenticate
-    size_t user_dir_len = strlen(login_env.sender) + strlen(folder_suffix_user) + 1;
-    user_dir_path = calloc(user_dir_len, sizeof(char));
-    if (unlikely(user_dir_path == NULL))
+    // Banned after too many failures (see 23-Server-Login-Throttle.h): refused before any password file or KDF
+    uint64_t throttle_wait = login_throttle_user_wait(login_env.sender);
+    if (unlikely(throttle_wait > 0))
     {
-        PSE("::: Failed to allocate user directory path for username: %s", login_env.sender);
+        P("[%d]::: Login of [%s] throttled for %llu ms", connection_fd, login_env.sender, (unsigned long long)throttle_wait);
+        response_code = LOGIN_THROTTLED;
+        if (unlikely(send_all(connection_fd, &response_code, sizeof(response_code)) < 0))
+        {
+            PSE("::: Failed to send LOGIN_THROTTLED to [%s]", login_env.sender);
+        }
         goto cleanup;
     }
-    if (unlikely(snprintf(user_dir_path, user_dir_len, "%s%s", login_env.sender, folder_suffix_user) < 0))
+
+    //  2) Decide whether to register or authenticate
+    /* ----------- LOOK UP THE USER REGISTRY TO VERIFY IF USER IS REGISTERED ---------- */
+    // The registry mirrors the users of the storage engine (see 5-Server-User-Registry.h), the engine is only asked on a miss
+    int user_dir_missing = !user_registry_contains(login_env.sender);
+    if (user_dir_missing && storage_engine->user_exists(login_env.sender))
     {
-        PSE("::: Failed to build user directory path for username: %s", login_env.sender);
-        goto cleanup;
+        // Complete in the engine but not in the registry (e.g. a registration that failed after storing the password)
+        user_dir_missing = user_registry_add(login_env.sender) != NO_ERROR;
     }
 
-    /* ----------- FIND USER DIRECTORY TO VERIFY IF USER IS REGISTERED ---------- */
-
-    /*
-        struct stat {
-        dev_t      st_dev;      ID of device containing file 
-        ino_t      st_ino;      Inode number 
-        mode_t     st_mode;     File type and mode 
-        nlink_t    st_nlink;    Number of hard links 
-        uid_t      st_uid;      User ID of owner 
-        gid_t      st_gid;      Group ID of owner 
-        dev_t      st_rdev;     Device ID (if special file) 
-        off_t      st_size;     Total size, in bytes 
-        blksize_t  st_blksize;  Block size for filesystem I/O 
-        blkcnt_t   st_blocks;   Number of 512 B blocks allocated 
-
-        Since POSIX.1-2008, this structure supports nanosecond
-            precision for the following timestamp fields.
-            For the details before POSIX.1-2008, see VERSIONS. 
-
-        struct timespec  st_atim;  Time of last access 
-        struct timespec  st_mtim;  Time of last modification 
-        struct timespec  st_ctim;  Time of last status change 
-
-        #define st_atime  st_atim.tv_sec  Backward compatibility 
-        #define st_mtime  st_mtim.tv_sec
-        #define st_ctime  st_ctim.tv_sec
-        };
-    */
-
-    struct stat user_dir_stat = {0};
-    int user_dir_missing = 0;
-    if (stat(user_dir_path, &user_dir_stat) == 0) // From the linux man: stat = Get file attributes for FILE and put the in BUFF
-    {
-        if (!S_ISDIR(user_dir_stat.st_mode))
-        {
-            PSE("::: User path exists but is not a directory for username: %s", login_env.sender);
-            goto cleanup; // Error is fatal since there is a need for human intervention: The user path exists but it is not a direcory
-        }
-    }
-    else
-    {
-        if (errno == ENOENT) // Missing directory
-        {
-            user_dir_missing = 1;
-        }
-        else
-        {
-            PSE("::: Failed to stat user directory for username: %s", login_env.sender);
-            goto cleanup;
-        }
-    }
-
-    /* ----------- BUILD PATHS FOR PASSWORD AND DATA FILES ---------- */
-    size_t password_path_len = strlen(user_dir_path) + 1 + strlen(password_filename) + 1; // password_filename defined in 3-Global-Variables-and-Functions.h
-    password_path = calloc(password_path_len, sizeof(char));
-    if (unlikely(password_path == NULL))
-    {
-        PSE("::: Failed to allocate password file path for username: %s", login_env.sender);
-        goto cleanup;
-    }
-    if (unlikely(snprintf(password_path, password_path_len, "%s/%s", user_dir_path, password_filename) < 0))
-    {
-        PSE("::: Failed to build password file path for username: %s", login_env.sender);
-        goto cleanup;
-    }
-
-    size_t data_path_len = strlen(user_dir_path) + 1 + strlen(data_filename) + 1;
-    data_path = calloc(data_path_len, sizeof(char));
-    if (unlikely(data_path == NULL))
-    {
-        PSE("::: Failed to allocate data file path for username: %s", login_env.sender);
-        goto cleanup;
-    }
-    if (unlikely(snprintf(data_path, data_path_len, "%s/%s", user_dir_path, data_filename) < 0))
-    {
-        PSE("::: Failed to build data file path for username: %s", login_env.sender);
-        goto cleanup;
-    }
-
-    FILE *password_file = NULL;
     // Now we start this massive if-else block, depending on whether the user folder is found or not we REGISTER or AUTHENTICATE
     if (user_dir_missing)  // If user folder is not found, then start registration
     {
@@ -1243,49 +1320,37 @@ static void *thread_routine(void *arg)
         client_password[PASSWORD_SIZE_CHARS - 1] = '\0';           // Add null-termination just in case
         client_password[strcspn(client_password, "\n")] = '\0';  // Strip newline if present
 
-        // Create user folder
-        if (unlikely(mkdir(user_dir_path, 0700) == -1 && errno != EEXIST))
+        // Only the verifier is stored, made on an authentication thread (see 20-Server-Auth.h)
+        char verifier[PASSWORD_SIZE_CHARS] = {0};
+        ERROR_CODE verifier_code = auth_make_verifier(client_password, verifier, sizeof(verifier));
+        memset(client_password, 0, sizeof(client_password));
+        if (unlikely(verifier_code != NO_ERROR))
         {
-            PSE("::: Failed to create user folder for [%s]", login_env.sender);
+            P("[%d]::: Cannot register [%s] now: %s", connection_fd, login_env.sender, convert_error_code_to_string(verifier_code));
+            response_code = verifier_code == SERVER_BUSY ? SERVER_BUSY : ERROR;
+            if (unlikely(send_all(connection_fd, &response_code, sizeof(response_code)) < 0))
+            {
+                PSE("::: Failed to send registration rejection for [%s]", login_env.sender);
+            }
             goto cleanup;
         }
-        P("[%d]::: Created user folder [%s] for [%s]", connection_fd, user_dir_path, login_env.sender);
 
-        // Create password file and store password as the first line
-        password_file = fopen(password_path, "w");
-        if (unlikely(password_file == NULL))
-        {
-            PSE("::: Failed to create password file for [%s]", login_env.sender);
-            goto cleanup;
-        }
-        P("[%d]::: Created password file [%s] for [%s]", connection_fd, password_path, login_env.sender);
-        if (unlikely(fprintf(password_file, "%s\n", client_password) < 0))
+        // Create the user folder (and its fan-out directories) with its password file, or the user in memory
+        if (unlikely(storage_engine->create_user(login_env.sender, verifier) != NO_ERROR))
         {
-            PSE("::: Failed to write password for new user [%s]", login_env.sender);
-            fclose(password_file);
+            PSE("::: Failed to create user [%s]", login_env.sender);
             goto cleanup;
         }
-        P("[%d]::: Stored password for new user [%s]", connection_fd, login_env.sender);
-        fclose(password_file);
+        P("[%d]::: Created user [%s] in the %s storage engine", connection_fd, login_env.sender, storage_engine->name);
 
-        // Create data file and initialize received message count
-        FILE *data_file = fopen(data_path, "w");
-        if (unlikely(data_file == NULL))
+        // Only now the user is complete, so other workers can start delivering to it
+        if (unlikely(user_registry_add(login_env.sender) != NO_ERROR))
         {
-            PSE("::: Failed to create data file for [%s]", login_env.sender);
+            P("[%d]::: Failed to add [%s] to the user registry", connection_fd, login_env.sender);
             goto cleanup;
         }
-        P("[%d]::: Created data file [%s] for [%s]", connection_fd, data_path, login_env.sender);
-        if (unlikely(fprintf(data_file, "%u\n", 0u) < 0))
-        {
-            PSE("::: Failed to initialize data file for [%s]", login_env.sender);
-            fclose(data_file);
-            goto cleanup;
-        }
-        P("[%d]::: Initialized data file [%s] for new user [%s]", connection_fd, data_path, login_env.sender);
-        fclose(data_file);
 
-        ERROR_CODE add_code = add_loggedin_user(login_env.sender, &current_loggedin_users_used_index);
+        ERROR_CODE add_code = add_loggedin_user(login_env.sender, connection_fd, &current_loggedin_users_used_index, &current_loggedin_users_used_generation);
         if (unlikely(add_code != NO_ERROR))
         {
             response_code = add_code;
@@ -1299,6 +1364,7 @@ static void *thread_routine(void *arg)
             }
             goto cleanup;
         }
+        storage_engine->session_begin(login_env.sender); // Ended in cleanup, with the logged in slot
 
         response_code = NO_ERROR;
         if (unlikely(send_all(connection_fd, &response_code, sizeof(response_code)) < 0))
@@ -1314,21 +1380,12 @@ static void *thread_routine(void *arg)
     }
     else // If user folder is found, then proceed with authentication
     {
-        // Read the password from the user password file
-        password_file = fopen(password_path, "r");
-        if (unlikely(password_file == NULL))
-        {
-            PSE("::: Failed to open password file for user [%s]", login_env.sender);
-            goto cleanup;
-        }
-        if (unlikely(fgets(stored_password, sizeof(stored_password), password_file) == NULL))
+        // Read the password stored at registration
+        if (unlikely(storage_engine->read_password(login_env.sender, stored_password, sizeof(stored_password)) != NO_ERROR))
         {
             PSE("::: Failed to read stored password for user [%s]", login_env.sender);
-            fclose(password_file);
             goto cleanup;
         }
-        fclose(password_file);
-        stored_password[strcspn(stored_password, "\n")] = '\0';
 
         // Notify client that the user exists and we expect a password
         response_code = NO_ERROR;
@@ -1359,9 +1416,24 @@ static void *thread_routine(void *arg)
             client_password[PASSWORD_SIZE_CHARS - 1] = '\0';
             client_password[strcspn(client_password, "\n")] = '\0';
 
-            if (strcmp(client_password, stored_password) == 0)  // Passwords match case
+            // The KDF runs on an authentication thread, a legacy plaintext password file is migrated there on success
+            int password_matches = 0;
+            ERROR_CODE check_code = auth_check_password(login_env.sender, client_password, stored_password, &password_matches);
+            memset(client_password, 0, sizeof(client_password));
+            if (unlikely(check_code != NO_ERROR))
+            {
+                P("[%d]::: Cannot check the password of [%s] now: %s", connection_fd, login_env.sender, convert_error_code_to_string(check_code));
+                response_code = check_code == SERVER_BUSY ? SERVER_BUSY : ERROR;
+                if (unlikely(send_all(connection_fd, &response_code, sizeof(response_code)) < 0))
+                {
+                    PSE("::: Failed to send login rejection to [%s]", login_env.sender);
+                }
+                goto cleanup;
+            }
+
+            if (password_matches)  // Passwords match case
             {
-                ERROR_CODE add_code = add_loggedin_user(login_env.sender, &current_loggedin_users_used_index);
+                ERROR_CODE add_code = add_loggedin_user(login_env.sender, connection_fd, &current_loggedin_users_used_index, &current_loggedin_users_used_generation);
                 if (unlikely(add_code != NO_ERROR))
                 {
                     response_code = add_code;
@@ -1375,9 +1447,11 @@ static void *thread_routine(void *arg)
                     }
                     goto cleanup;
                 }
+                storage_engine->session_begin(login_env.sender); // Ended in cleanup, with the logged in slot
 
                 authenticated = 1;
                 response_code = NO_ERROR;
+                login_throttle_success(login_env.sender);
                 P("[%d]::: User [%s] authenticated", connection_fd, login_env.sender);
             }
             else                                                // Passwords do not match case
@@ -1385,6 +1459,12 @@ static void *thread_routine(void *arg)
                 attempts++;
                 response_code = WRONG_PASSWORD;
                 P("[%d]::: Wrong password for [%s] (attempt %d/%d)", connection_fd, login_env.sender, attempts, MAX_PASSWORD_ATTEMPTS);
+                if (login_throttle_failure(client_address, login_env.sender))
+                {
+                    response_code = LOGIN_THROTTLED; // No attempts left on this connection either
+                    attempts = MAX_PASSWORD_ATTEMPTS;
+                    P("[%d]::: Too many failed logins for [%s] or its address, throttled", connection_fd, login_env.sender);
+                }
             }
 
             if (unlikely(send_all(connection_fd, &response_code, sizeof(response_code)) < 0))
@@ -1405,6 +1485,7 @@ static void *thread_routine(void *arg)
         }
     }
 
+login_handled:
     P("[%d]::: Login handled successfully for [%s]", connection_fd, login_env.sender);
 
     /* -------------------------------------------------------------------------- */
@@ -1447,6 +1528,7 @@ static void *thread_routine(void *arg)
             }
             goto cleanup;
         }
+        disk_io_session_drain(&disk_session); // Requests see the mailbox as the previous ones left it
 
         int handled = 0;
         switch (request_code)
@@ -1462,7 +1544,7 @@ static void *thread_routine(void *arg)
                 PSE("::: Failed to allocate message header");
                 goto cleanup;
             }
-            int header_recv = recv_all(connection_fd, header, header_size);
+            int header_recv = wire_recv_header(connection_fd, &headers, header);
             if (header_recv <= 0)
             {
                 PSE("::: Failed to receive MESSAGE header for [%s]", login_env.sender);
@@ -1550,31 +1632,37 @@ static void *thread_routine(void *arg)
                 break;
             }
 
-            size_t recipient_dir_len = strlen(header->recipient) + strlen(folder_suffix_user) + 1;
-            char *recipient_dir = calloc(recipient_dir_len, sizeof(char));
-            if (recipient_dir == NULL)
+            if (!user_registry_contains(header->recipient))
             {
-                PSE("::: Failed to allocate recipient directory path for [%s]", header->recipient);
+                ERROR_CODE not_found = USER_NOT_FOUND;
+                if (unlikely(send_all(connection_fd, &not_found, sizeof(not_found)) < 0))
+                {
+                    int send_errno = errno;
+                    PSE("::: Failed to send USER_NOT_FOUND to [%s]", login_env.sender);
+                    if (send_errno == EPIPE)
+                    {
+                        goto cleanup;
+                    }
+                    if (shutdown_now) {
+                        P("Shutdown flag is set, closing thread...");
+                        goto cleanup;
+                    }
+                }
                 free(header);
                 handled = 1;
                 break;
             }
-            if (unlikely(snprintf(recipient_dir, recipient_dir_len, "%s%s", header->recipient, folder_suffix_user) < 0))
-            {
-                PSE("::: Failed to build recipient directory path for [%s]", header->recipient);
-                free(recipient_dir);
-                free(header);
-                goto cleanup;
-            }
 
-            struct stat recipient_stat = {0};
-            if (stat(recipient_dir, &recipient_stat) != 0 || !S_ISDIR(recipient_stat.st_mode))
+            // Quota check before the body is even received, the room stays reserved until the delivery succeeds or fails
+            uint64_t message_bytes = (uint64_t)header_size + message_length;
+            ERROR_CODE quota = mailbox_reserve(header->recipient, message_bytes);
+            if (quota != NO_ERROR)
             {
-                ERROR_CODE not_found = USER_NOT_FOUND;
-                if (unlikely(send_all(connection_fd, &not_found, sizeof(not_found)) < 0))
+                P("[%d]::: Message for [%s] refused: %s", connection_fd, header->recipient, convert_error_code_to_string(quota));
+                if (unlikely(send_all(connection_fd, &quota, sizeof(quota)) < 0))
                 {
                     int send_errno = errno;
-                    PSE("::: Failed to send USER_NOT_FOUND to [%s]", login_env.sender);
+                    PSE("::: Failed to send %s to [%s]", convert_error_code_to_string(quota), login_env.sender);
                     if (send_errno == EPIPE)
                     {
                         goto cleanup;
@@ -1584,7 +1672,6 @@ static void *thread_routine(void *arg)
                         goto cleanup;
                     }
                 }
-                free(recipient_dir);
                 free(header);
                 handled = 1;
                 break;
@@ -1594,11 +1681,11 @@ static void *thread_routine(void *arg)
             if (unlikely(send_all(connection_fd, &ok, sizeof(ok)) < 0))
             {
                 PSE("::: Failed to send NO_ERROR to [%s]", login_env.sender);
+                mailbox_cancel_reservation(header->recipient, message_bytes);
                 if (shutdown_now) {
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
                 }
-                free(recipient_dir);
                 free(header);
                 goto cleanup;
             }
@@ -1607,13 +1694,15 @@ static void *thread_routine(void *arg)
             if (body == NULL)
             {
                 PSE("::: Failed to allocate message body");
+                mailbox_cancel_reservation(header->recipient, message_bytes);
                 free(header);
                 goto cleanup;
             }
-            int body_recv = recv_all(connection_fd, body, message_length);
+            int body_recv = wire_recv_payload(connection_fd, &wire, body, message_length);
             if (body_recv <= 0)
             {
                 PSE("::: Failed to receive MESSAGE body for [%s]", login_env.sender);
+                mailbox_cancel_reservation(header->recipient, message_bytes);
                 if (shutdown_now) {
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
@@ -1623,84 +1712,36 @@ static void *thread_routine(void *arg)
                 goto cleanup;
             }
 
-            time_t now = time(NULL);
-            struct tm now_tm = {0};
-            if (localtime_r(&now, &now_tm) == NULL)
-            {
-                PSE("::: Failed to get local time");
-                free(recipient_dir);
-                free(body);
-                free(header);
-                goto cleanup;
-            }
-            char timestamp[16] = {0};
-            if (strftime(timestamp, sizeof(timestamp), "%Y%m%d%H%M%S", &now_tm) == 0)
-            {
-                PSE("::: Failed to format timestamp");
-                free(recipient_dir);
-                free(body);
-                free(header);
-                goto cleanup;
-            }
-
             /* -------------------------- MESSAGE FILE CREATION ------------------------- */
-            int msg_fd = -1;
-            char message_path[USERNAME_SIZE_CHARS + 64] = {0};
-            for (unsigned int counter = 0; counter < 1000; counter++) // Try to create file exclusively with up to 1000 different names (in case of name clash), if this is not possible then just fail
+            // Stored durably in any case (see PGM_DURABILITY). Only a client that negotiated it reads a final ERROR_CODE, sent once the
+            // message is durable, the others get nothing more and a failure closes the connection as it always did
+            char stored_filename[MESSAGE_FILENAME_SIZE_CHARS] = {0};
+            ERROR_CODE stored = disk_io_deliver(header, body, message_length, stored_filename);
+            if (unlikely(stored != NO_ERROR))
             {
-                if (counter == 0)
-                {
-                    snprintf(message_path, sizeof(message_path), "%s/UNREAD%s%s",
-                             recipient_dir, timestamp, file_suffix_user_data);
-                }
-                else
-                {
-                    snprintf(message_path, sizeof(message_path), "%s/UNREAD%s%u%s",
-                             recipient_dir, timestamp, counter, file_suffix_user_data);
-                }
-
-                msg_fd = open(message_path, O_CREAT | O_EXCL | O_WRONLY, 0600);
-                if (msg_fd >= 0)
-                {
-                    break; // Success branch
-                }
-                if (errno != EEXIST) // If the error is NOT EEXIST then we have a bigger problem
-                {
-                    PSE("::: Failed to open message file for [%s]", header->recipient);
-                    break; // Fatal
-                }
+                P("[%d]::: Failed to store message for [%s]", connection_fd, header->recipient);
+                mailbox_cancel_reservation(header->recipient, message_bytes);
             }
-
-            if (msg_fd < 0) // handle fatal
+            else
             {
-                PSE("::: Unable to create message file for [%s]", header->recipient);
-                free(recipient_dir);
-                free(body);
-                free(header);
-                goto cleanup;
+                mailbox_commit_delivery(header->recipient, stored_filename, message_bytes);
+                header_cache_message_added(header->recipient, stored_filename, header);
+                search_index_message_added(header->recipient, stored_filename, header, body, message_length);
             }
-
-            if (unlikely(write(msg_fd, header, header_size) != (ssize_t)header_size))
+            if (!delivery_ack && stored != NO_ERROR)
             {
-                PSE("::: Failed to write message header to file");
-                close(msg_fd);
-                free(recipient_dir);
                 free(body);
                 free(header);
                 goto cleanup;
             }
-            if (unlikely(write(msg_fd, body, message_length) != (ssize_t)message_length))
+            if (delivery_ack && unlikely(send_all(connection_fd, &stored, sizeof(stored)) < 0))
             {
-                PSE("::: Failed to write message body to file");
-                close(msg_fd);
-                free(recipient_dir);
+                PSE("::: Failed to send delivery result to [%s]", login_env.sender);
                 free(body);
                 free(header);
                 goto cleanup;
             }
-            close(msg_fd);
 
-            free(recipient_dir);
             free(body);
             free(header);
             handled = 1;
@@ -1710,28 +1751,28 @@ static void *thread_routine(void *arg)
         case REQUEST_LIST_REGISTERED_USERS:
         {
             P("[%d]::: REQUEST_LIST_REGISTERED_USERS received", connection_fd);
-            size_t list_len = 0;
-            char *list = build_list_of_registered_users(&list_len);
+            // Shared pre-serialized list, rebuilt by the registry only when a user registered in the meantime
+            USER_LIST_SNAPSHOT *list = user_registry_acquire_list();
             if (list == NULL)
             {
                 PSE("::: Failed to build registered users list");
                 goto cleanup;
             }
-            if (list_len > UINT32_MAX)
+            if (list->length > UINT32_MAX)
             {
                 PSE("::: Registered users list too large");
-                free(list);
+                user_registry_release_list(list);
                 goto cleanup;
             }
-            uint32_t list_len_net = htonl((uint32_t)list_len);
+            uint32_t list_len_net = htonl((uint32_t)list->length);
             if (unlikely(send_all(connection_fd, &list_len_net, sizeof(list_len_net)) < 0))
             {
                 PSE("::: Failed to send list length to [%s]", login_env.sender);
+                user_registry_release_list(list);
                 if (shutdown_now) {
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
                 }
-                free(list);
                 goto cleanup;
             }
 
@@ -1739,32 +1780,32 @@ static void *thread_routine(void *arg)
             if (unlikely(recv_all(connection_fd, &ack, sizeof(ack)) <= 0))
             {
                 PSE("::: Failed to receive list ack from [%s]", login_env.sender);
+                user_registry_release_list(list);
                 if (shutdown_now) {
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
                 }
-                free(list);
                 goto cleanup;
             }
             if (ack != NO_ERROR)
             {
                 P("[%d]::: Client aborted list users", connection_fd);
-                free(list);
+                user_registry_release_list(list);
                 handled = 1;
                 break;
             }
 
-            if (unlikely(send_all(connection_fd, list, list_len) < 0))
+            if (unlikely(wire_send_payload(connection_fd, &wire, list->data, (uint32_t)list->length, NULL, 0) < 0))
             {
                 PSE("::: Failed to send users list to [%s]", login_env.sender);
+                user_registry_release_list(list);
                 if (shutdown_now) {
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
                 }
-                free(list);
                 goto cleanup;
             }
-            free(list);
+            user_registry_release_list(list);
             handled = 1;
             break;
         }
@@ -1777,7 +1818,7 @@ static void *thread_routine(void *arg)
         {
             P("[%d]::: REQUEST_LOAD_MESSAGE received", connection_fd);
             size_t file_count = 0;
-            char **files = collect_message_files(user_dir_path, 0, &file_count);
+            char **files = collect_message_files(login_env.sender, 0, &file_count);
             char *list = NULL;
             size_t list_len = 0;
 
@@ -1845,7 +1886,7 @@ static void *thread_routine(void *arg)
                 break;
             }
 
-            if (unlikely(send_all(connection_fd, list, list_len) < 0))
+            if (unlikely(wire_send_payload(connection_fd, &wire, list, (uint32_t)list_len, NULL, 0) < 0))
             {
                 PSE("::: Failed to send message list to [%s]", login_env.sender);
                 if (shutdown_now) {
@@ -1915,17 +1956,24 @@ static void *thread_routine(void *arg)
                 break;
             }
 
-            size_t path_len = strlen(user_dir_path) + 1 + strlen(filename) + 1;
-            char *full_path = calloc(path_len, sizeof(char));
-            if (full_path == NULL)
+            MESSAGE *message = malloc(sizeof(MESSAGE) + MESSAGE_SIZE_CHARS); // Header and body in one buffer, filled by the engine
+            if (message == NULL)
             {
-                PSE("::: Failed to allocate full path for message");
+                PSE("::: Failed to allocate message");
                 goto cleanup;
             }
-            snprintf(full_path, path_len, "%s/%s", user_dir_path, filename);
 
-            int msg_fd = open(full_path, O_RDONLY);
-            if (msg_fd < 0)
+            // The block a compressed body is stored as goes out as it is, a compressed session never compresses it again
+            char stored_block[MESSAGE_SIZE_CHARS];
+            uint32_t stored_block_length = 0;
+            ERROR_CODE fetched = wire.enabled ? disk_io_fetch_compressed(login_env.sender, filename, message, stored_block, &stored_block_length)
+                                              : disk_io_fetch(login_env.sender, filename, message, 1); // Inline, compressed, cold or from the body store
+            if (fetched == STRING_SIZE_INVALID)
+            {
+                // Bad size or checksum: never served, the session goes on as if it was not there until --fsck quarantines it
+                P("::: Message [%s] of [%s] is corrupt, run --fsck", filename, login_env.sender);
+            }
+            if (fetched == ERROR || fetched == STRING_SIZE_INVALID)
             {
                 MESSAGE_CODE not_found = MESSAGE_NOT_FOUND;
                 if (unlikely(send_all(connection_fd, &not_found, sizeof(not_found)) < 0))
@@ -1941,60 +1989,17 @@ static void *thread_routine(void *arg)
                         goto cleanup;
                     }
                 }
-                free(full_path);
+                free(message);
                 handled = 1;
                 break;
             }
-
-            size_t header_size = offsetof(MESSAGE, message);
-            MESSAGE *header = calloc(1, header_size);
-            if (header == NULL)
-            {
-                PSE("::: Failed to allocate message header");
-                close(msg_fd);
-                free(full_path);
-                goto cleanup;
-            }
-            ssize_t header_read = read(msg_fd, header, header_size);
-            if (header_read != (ssize_t)header_size)
+            if (fetched != NO_ERROR)
             {
-                PSE("::: Failed to read message header");
-                close(msg_fd);
-                free(header);
-                free(full_path);
+                PSE("::: Failed to read message [%s]: %s", filename, convert_error_code_to_string(fetched));
+                free(message);
                 goto cleanup;
             }
-
-            uint32_t body_len = ntohl(header->message_length);
-            if (body_len == 0 || body_len > MESSAGE_SIZE_CHARS)
-            {
-                PSE("::: Invalid message length in file");
-                close(msg_fd);
-                free(header);
-                free(full_path);
-                goto cleanup;
-            }
-
-            char *body = calloc(body_len, sizeof(char));
-            if (body == NULL)
-            {
-                PSE("::: Failed to allocate message body");
-                close(msg_fd);
-                free(header);
-                free(full_path);
-                goto cleanup;
-            }
-            ssize_t body_read = read(msg_fd, body, body_len);
-            if (body_read != (ssize_t)body_len)
-            {
-                PSE("::: Failed to read message body");
-                close(msg_fd);
-                free(body);
-                free(header);
-                free(full_path);
-                goto cleanup;
-            }
-            close(msg_fd);
+            uint32_t body_len = ntohl(message->message_length);
 
             ERROR_CODE ok = NO_ERROR;
             if (unlikely(send_all(connection_fd, &ok, sizeof(ok)) < 0))
@@ -2004,56 +2009,38 @@ static void *thread_routine(void *arg)
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
                 }
-                free(body);
-                free(header);
-                free(full_path);
+                free(message);
                 goto cleanup;
             }
 
-            if (unlikely(send_all(connection_fd, header, header_size) < 0))
+            if (unlikely(wire_send_header(connection_fd, &headers, message) < 0))
             {
                 PSE("::: Failed to send message header to [%s]", login_env.sender);
                 if (shutdown_now) {
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
                 }
-                free(body);
-                free(header);
-                free(full_path);
+                free(message);
                 goto cleanup;
             }
-            if (unlikely(send_all(connection_fd, body, body_len) < 0))
+            if (unlikely(wire_send_payload(connection_fd, &wire, message->message, body_len, stored_block, stored_block_length) < 0))
             {
                 PSE("::: Failed to send message body to [%s]", login_env.sender);
                 if (shutdown_now) {
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
                 }
-                free(body);
-                free(header);
-                free(full_path);
+                free(message);
                 goto cleanup;
             }
 
-            if (starts_with(filename, "UNREAD"))
+            if (starts_with(filename, UNREAD_PREFIX))
             {
-                const char *new_name = filename + strlen("UNREAD");
-                if (new_name[0] != '\0')
-                {
-                    size_t new_path_len = strlen(user_dir_path) + 1 + strlen(new_name) + 1;
-                    char *new_path = calloc(new_path_len, sizeof(char));
-                    if (new_path != NULL)
-                    {
-                        snprintf(new_path, new_path_len, "%s/%s", user_dir_path, new_name);
-                        rename(full_path, new_path);
-                        free(new_path);
-                    }
-                }
+                // The message is already sent: the rename runs while this thread waits for the next request
+                submit_mark_read(&disk_session, login_env.sender, filename);
             }
 
-            free(body);
-            free(header);
-            free(full_path);
+            free(message);
             handled = 1;
             break;
         }
@@ -2068,7 +2055,7 @@ static void *thread_routine(void *arg)
         {
             P("[%d]::: REQUEST_LOAD_UNREAD_MESSAGES received", connection_fd);
             size_t file_count = 0;
-            char **files = collect_message_files(user_dir_path, 1, &file_count);
+            char **files = collect_message_files(login_env.sender, 1, &file_count);
             char *list = NULL;
             size_t list_len = 0;
 
@@ -2136,7 +2123,7 @@ static void *thread_routine(void *arg)
                 break;
             }
 
-            if (unlikely(send_all(connection_fd, list, list_len) < 0))
+            if (unlikely(wire_send_payload(connection_fd, &wire, list, (uint32_t)list_len, NULL, 0) < 0))
             {
                 PSE("::: Failed to send unread list to [%s]", login_env.sender);
                 if (shutdown_now) {
@@ -2153,12 +2140,251 @@ static void *thread_routine(void *arg)
             handled = 1;
             break;
         }
+        /* --------------------- REQUEST_LIST_MESSAGE_SUMMARIES --------------------- */
+        case REQUEST_LIST_MESSAGE_SUMMARIES:
+        {
+            // Inbox view in one request: sender, subject, size and read flag of every message, served from the header cache (bodies are never read)
+            P("[%d]::: REQUEST_LIST_MESSAGE_SUMMARIES received", connection_fd);
+            MESSAGE_SUMMARY *summaries = NULL;
+            size_t summary_count = 0;
+            if (unlikely(header_cache_list(login_env.sender, 0, &summaries, &summary_count) != NO_ERROR))
+            {
+                PSE("::: Failed to build message summaries");
+                goto cleanup;
+            }
+
+            size_t summaries_len = summary_count * sizeof(MESSAGE_SUMMARY);
+            if (summaries_len > UINT32_MAX)
+            {
+                PSE("::: Message summaries too large");
+                free(summaries);
+                goto cleanup;
+            }
+
+            uint32_t summaries_len_net = htonl((uint32_t)summaries_len);
+            if (unlikely(send_all(connection_fd, &summaries_len_net, sizeof(summaries_len_net)) < 0))
+            {
+                PSE("::: Failed to send message summaries length to [%s]", login_env.sender);
+                if (shutdown_now) {
+                    P("Shutdown flag is set, closing thread...");
+                    goto cleanup;
+                }
+                free(summaries);
+                goto cleanup;
+            }
+
+            ERROR_CODE ack = ERROR;
+            if (unlikely(recv_all(connection_fd, &ack, sizeof(ack)) <= 0))
+            {
+                PSE("::: Failed to receive message summaries ack from [%s]", login_env.sender);
+                if (shutdown_now) {
+                    P("Shutdown flag is set, closing thread...");
+                    goto cleanup;
+                }
+                free(summaries);
+                goto cleanup;
+            }
+            if (ack != NO_ERROR)
+            {
+                P("[%d]::: Client aborted message summaries", connection_fd);
+                free(summaries);
+                handled = 1;
+                break;
+            }
+
+            if (summaries_len > 0 && unlikely(wire_send_payload(connection_fd, &wire, summaries, (uint32_t)summaries_len, NULL, 0) < 0))
+            {
+                PSE("::: Failed to send message summaries to [%s]", login_env.sender);
+                if (shutdown_now) {
+                    P("Shutdown flag is set, closing thread...");
+                    goto cleanup;
+                }
+                free(summaries);
+                goto cleanup;
+            }
+
+            free(summaries);
+            handled = 1;
+            break;
+        }
+        /* ------------------------- REQUEST_SEARCH_MESSAGES ------------------------- */
+        case REQUEST_SEARCH_MESSAGES:
+        {
+            // Ranked full-text search over subject and body, served from the inverted index of the user and joined with the header cache
+            P("[%d]::: REQUEST_SEARCH_MESSAGES received", connection_fd);
+            SEARCH_REQUEST search_request;
+            if (unlikely(recv_all(connection_fd, &search_request, sizeof(search_request)) <= 0))
+            {
+                PSE("::: Failed to receive search request from [%s]", login_env.sender);
+                goto cleanup;
+            }
+            search_request.query[sizeof(search_request.query) - 1] = '\0';
+            size_t offset = ntohl(search_request.offset);
+            size_t limit = ntohl(search_request.limit);
+            if (limit == 0 || limit > SEARCH_MAX_RESULTS_PER_PAGE)
+            {
+                limit = SEARCH_MAX_RESULTS_PER_PAGE;
+            }
+
+            message_id_t *ids = NULL;
+            size_t id_count = 0;
+            size_t total_matches = 0;
+            ERROR_CODE search_result = search_index_query(login_env.sender, search_request.query, offset, limit, &ids, &id_count, &total_matches);
+            // The page is joined with the headers before answering, so a failure there is reported like a failed search
+            char *results = NULL;
+            size_t summary_count = 0;
+            if (search_result == NO_ERROR)
+            {
+                results = calloc(1, sizeof(SEARCH_RESULTS_HEADER) + id_count * sizeof(MESSAGE_SUMMARY));
+                if (unlikely(results == NULL))
+                {
+                    PSE("::: Failed to allocate search results");
+                    search_result = SYSCALL_ERROR;
+                }
+                else if (unlikely(header_cache_summaries_for_ids(login_env.sender, ids, id_count, (MESSAGE_SUMMARY *)(results + sizeof(SEARCH_RESULTS_HEADER)), &summary_count) != NO_ERROR))
+                {
+                    PSE("::: Failed to build search result summaries");
+                    search_result = SYSCALL_ERROR;
+                }
+            }
+            free(ids);
+            if (unlikely(send_all(connection_fd, &search_result, sizeof(search_result)) < 0))
+            {
+                PSE("::: Failed to send search result to [%s]", login_env.sender);
+                free(results);
+                goto cleanup;
+            }
+            if (search_result != NO_ERROR)
+            {
+                P("[%d]::: Search of [%s] refused (%s)", connection_fd, login_env.sender, convert_error_code_to_string(search_result));
+                free(results);
+                handled = 1;
+                break;
+            }
+
+            SEARCH_RESULTS_HEADER *results_header = (SEARCH_RESULTS_HEADER *)results;
+            results_header->total_matches = htonl(total_matches > UINT32_MAX ? UINT32_MAX : (uint32_t)total_matches);
+            results_header->returned = htonl((uint32_t)summary_count);
+            size_t results_len = sizeof(SEARCH_RESULTS_HEADER) + summary_count * sizeof(MESSAGE_SUMMARY);
+            uint32_t results_len_net = htonl((uint32_t)results_len);
+            if (unlikely(send_all(connection_fd, &results_len_net, sizeof(results_len_net)) < 0))
+            {
+                PSE("::: Failed to send search results length to [%s]", login_env.sender);
+                free(results);
+                goto cleanup;
+            }
+
+            ERROR_CODE ack = ERROR;
+            if (unlikely(recv_all(connection_fd, &ack, sizeof(ack)) <= 0))
+            {
+                PSE("::: Failed to receive search results ack from [%s]", login_env.sender);
+                free(results);
+                goto cleanup;
+            }
+            if (ack != NO_ERROR)
+            {
+                P("[%d]::: Client aborted search results", connection_fd);
+                free(results);
+                handled = 1;
+                break;
+            }
+
+            if (unlikely(wire_send_payload(connection_fd, &wire, results, (uint32_t)results_len, NULL, 0) < 0))
+            {
+                PSE("::: Failed to send search results to [%s]", login_env.sender);
+                free(results);
+                goto cleanup;
+            }
+
+            free(results);
+            handled = 1;
+            break;
+        }
+        /* ------------------------- REQUEST_FILTER_MESSAGES ------------------------- */
+        case REQUEST_FILTER_MESSAGES:
+        {
+            // "From sender X" / "subject contains Y" without any index: a vectorized scan of the cached headers
+            P("[%d]::: REQUEST_FILTER_MESSAGES received", connection_fd);
+            FILTER_REQUEST filter_request;
+            if (unlikely(recv_all(connection_fd, &filter_request, sizeof(filter_request)) <= 0))
+            {
+                PSE("::: Failed to receive filter request from [%s]", login_env.sender);
+                goto cleanup;
+            }
+            filter_request.sender_contains[sizeof(filter_request.sender_contains) - 1] = '\0';
+            filter_request.subject_contains[sizeof(filter_request.subject_contains) - 1] = '\0';
+
+            SUBSTRING_NEEDLE sender_needle;
+            SUBSTRING_NEEDLE subject_needle;
+            int has_sender = substring_needle_init(&sender_needle, filter_request.sender_contains) == NO_ERROR;
+            int has_subject = substring_needle_init(&subject_needle, filter_request.subject_contains) == NO_ERROR;
+            ERROR_CODE filter_result = has_sender || has_subject ? NO_ERROR : STRING_SIZE_INVALID;
+            MESSAGE_SUMMARY *summaries = NULL;
+            size_t summary_count = 0;
+            if (filter_result == NO_ERROR &&
+                unlikely(header_cache_filter(login_env.sender, has_sender ? &sender_needle : NULL, has_subject ? &subject_needle : NULL, &summaries, &summary_count) != NO_ERROR))
+            {
+                PSE("::: Failed to filter the messages of [%s]", login_env.sender);
+                filter_result = SYSCALL_ERROR;
+            }
+            size_t summaries_len = summary_count * sizeof(MESSAGE_SUMMARY);
+            if (unlikely(summaries_len > UINT32_MAX))
+            {
+                PSE("::: Filtered summaries too large");
+                filter_result = SYSCALL_ERROR;
+            }
+            if (unlikely(send_all(connection_fd, &filter_result, sizeof(filter_result)) < 0))
+            {
+                PSE("::: Failed to send filter result to [%s]", login_env.sender);
+                free(summaries);
+                goto cleanup;
+            }
+            if (filter_result != NO_ERROR)
+            {
+                P("[%d]::: Filter of [%s] refused (%s)", connection_fd, login_env.sender, convert_error_code_to_string(filter_result));
+                free(summaries);
+                handled = 1;
+                break;
+            }
+
+            uint32_t summaries_len_net = htonl((uint32_t)summaries_len);
+            if (unlikely(send_all(connection_fd, &summaries_len_net, sizeof(summaries_len_net)) < 0))
+            {
+                PSE("::: Failed to send filtered summaries length to [%s]", login_env.sender);
+                free(summaries);
+                goto cleanup;
+            }
+            ERROR_CODE ack = ERROR;
+            if (unlikely(recv_all(connection_fd, &ack, sizeof(ack)) <= 0))
+            {
+                PSE("::: Failed to receive filtered summaries ack from [%s]", login_env.sender);
+                free(summaries);
+                goto cleanup;
+            }
+            if (ack != NO_ERROR)
+            {
+                P("[%d]::: Client aborted filtered summaries", connection_fd);
+                free(summaries);
+                handled = 1;
+                break;
+            }
+            if (summaries_len > 0 && unlikely(wire_send_payload(connection_fd, &wire, summaries, (uint32_t)summaries_len, NULL, 0) < 0))
+            {
+                PSE("::: Failed to send filtered summaries to [%s]", login_env.sender);
+                free(summaries);
+                goto cleanup;
+            }
+
+            free(summaries);
+            handled = 1;
+            break;
+        }
         /* ------------------------- REQUEST_DELETE_MESSAGE ------------------------- */
         case REQUEST_DELETE_MESSAGE:
         {
             P("[%d]::: REQUEST_DELETE_MESSAGE received", connection_fd);
             size_t file_count = 0;
-            char **files = collect_message_files(user_dir_path, 0, &file_count);
+            char **files = collect_message_files(login_env.sender, 0, &file_count);
             char *list = NULL;
             size_t list_len = 0;
 
@@ -2226,7 +2452,7 @@ static void *thread_routine(void *arg)
                 break;
             }
 
-            if (unlikely(send_all(connection_fd, list, list_len) < 0))
+            if (unlikely(wire_send_payload(connection_fd, &wire, list, (uint32_t)list_len, NULL, 0) < 0))
             {
                 PSE("::: Failed to send delete list to [%s]", login_env.sender);
                 if (shutdown_now) {
@@ -2296,20 +2522,17 @@ static void *thread_routine(void *arg)
                 break;
             }
 
-            size_t path_len = strlen(user_dir_path) + 1 + strlen(filename) + 1;
-            char *full_path = calloc(path_len, sizeof(char));
-            if (full_path == NULL)
-            {
-                PSE("::: Failed to allocate delete path");
-                goto cleanup;
-            }
-            snprintf(full_path, path_len, "%s/%s", user_dir_path, filename);
-
             int delete_response = NO_ERROR;
-            if (unlink(full_path) != 0)
+            if (disk_io_remove(login_env.sender, filename) != NO_ERROR) // Also drops the reference to a shared body
             {
                 delete_response = MESSAGE_NOT_FOUND;
             }
+            else
+            {
+                mailbox_message_removed(login_env.sender, filename);
+                header_cache_message_removed(login_env.sender, filename);
+                search_index_message_removed(login_env.sender, filename);
+            }
             if (unlikely(send_all(connection_fd, &delete_response, sizeof(delete_response)) < 0))
             {
                 PSE("::: Failed to send delete response to [%s]", login_env.sender);
@@ -2317,11 +2540,9 @@ static void *thread_routine(void *arg)
                     P("Shutdown flag is set, closing thread...");
                     goto cleanup;
                 }
-                free(full_path);
                 goto cleanup;
             }
 
-            free(full_path);
             handled = 1;
             break;
         }
@@ -2329,6 +2550,81 @@ static void *thread_routine(void *arg)
             P("[%d]::: LOGOUT received", connection_fd);
             handled = 1;
             goto cleanup;
+        /* -------------------------- REQUEST_RESUME_TOKEN -------------------------- */
+        case REQUEST_RESUME_TOKEN:
+        {
+            P("[%d]::: REQUEST_RESUME_TOKEN received", connection_fd);
+            RESUME_TOKEN token;
+            ERROR_CODE token_code = resume_token_issue(login_env.sender, &token); // ERROR if PGM_RESUME_TOKEN_SECONDS=0
+            if (unlikely(send_resume_token(connection_fd, token_code == NO_ERROR ? NO_ERROR : ERROR, &token) < 0))
+            {
+                PSE("::: Failed to send the resume token to [%s]", login_env.sender);
+                goto cleanup;
+            }
+            handled = 1;
+            break;
+        }
+        /* ---------------------- REQUEST_NEGOTIATE_COMPRESSION --------------------- */
+        case REQUEST_NEGOTIATE_COMPRESSION:
+        {
+            P("[%d]::: REQUEST_NEGOTIATE_COMPRESSION received", connection_fd);
+            ERROR_CODE ok = NO_ERROR;
+            if (unlikely(send_all(connection_fd, &ok, sizeof(ok)) < 0))
+            {
+                PSE("::: Failed to send NO_ERROR to [%s]", login_env.sender);
+                goto cleanup;
+            }
+            WIRE_COMPRESSION_OFFER client_offer = {0};
+            if (unlikely(recv_all(connection_fd, &client_offer, sizeof(client_offer)) <= 0))
+            {
+                PSE("::: Failed to receive the compression offer of [%s]", login_env.sender);
+                goto cleanup;
+            }
+            // Picked by the server: a codec both sides have, and the larger threshold
+            uint32_t client_codecs = ntohl(client_offer.codecs);
+            uint32_t client_min_bytes = ntohl(client_offer.min_bytes);
+            uint32_t codecs = client_codecs & server_compression_offer.codecs & WIRE_CODEC_LZ77;
+            uint32_t min_bytes = client_min_bytes > server_compression_offer.min_bytes ? client_min_bytes : server_compression_offer.min_bytes;
+            WIRE_COMPRESSION_OFFER answer = {.codecs = htonl(codecs), .min_bytes = htonl(min_bytes)};
+            if (unlikely(send_all(connection_fd, &answer, sizeof(answer)) < 0))
+            {
+                PSE("::: Failed to send the compression answer to [%s]", login_env.sender);
+                goto cleanup;
+            }
+            wire.enabled = codecs != WIRE_CODEC_NONE;
+            wire.min_bytes = min_bytes;
+            P("[%d]::: Wire compression %s for [%s] (bodies and lists of at least %u bytes)", connection_fd, wire.enabled ? "on" : "off", login_env.sender, min_bytes);
+            handled = 1;
+            break;
+        }
+        /* ------------------- REQUEST_NEGOTIATE_HEADER_ENCODING -------------------- */
+        case REQUEST_NEGOTIATE_HEADER_ENCODING:
+        {
+            P("[%d]::: REQUEST_NEGOTIATE_HEADER_ENCODING received", connection_fd);
+            ERROR_CODE ok = NO_ERROR;
+            if (unlikely(send_all(connection_fd, &ok, sizeof(ok)) < 0))
+            {
+                PSE("::: Failed to send NO_ERROR to [%s]", login_env.sender);
+                goto cleanup;
+            }
+            uint32_t client_encodings = 0;
+            if (unlikely(recv_all(connection_fd, &client_encodings, sizeof(client_encodings)) <= 0))
+            {
+                PSE("::: Failed to receive the header encodings of [%s]", login_env.sender);
+                goto cleanup;
+            }
+            uint32_t encoding = server_compact_headers && (ntohl(client_encodings) & WIRE_HEADER_COMPACT) != 0 ? WIRE_HEADER_COMPACT : WIRE_HEADER_FIXED;
+            uint32_t answer = htonl(encoding);
+            if (unlikely(send_all(connection_fd, &answer, sizeof(answer)) < 0))
+            {
+                PSE("::: Failed to send the header encoding to [%s]", login_env.sender);
+                goto cleanup;
+            }
+            headers.compact = encoding == WIRE_HEADER_COMPACT;
+            P("[%d]::: %s headers for [%s]", connection_fd, headers.compact ? "Compact" : "Fixed", login_env.sender);
+            handled = 1;
+            break;
+        }
         default:
             P("[%d]::: Unknown MESSAGE_CODE [%d]", connection_fd, request_code);
             break;
@@ -2350,23 +2646,37 @@ static void *thread_routine(void *arg)
     }
 
 cleanup:
+    disk_io_session_drain(&disk_session);
+    if (headers.headers_sent + headers.headers_received > 0)
+    {
+        P("[%d]::: Compact headers: sent %llu in %llu bytes, received %llu in %llu bytes (%zu bytes each when fixed)", connection_fd,
+          (unsigned long long)headers.headers_sent, (unsigned long long)headers.bytes_sent, (unsigned long long)headers.headers_received,
+          (unsigned long long)headers.bytes_received, offsetof(MESSAGE, message));
+    }
+    if (wire.payloads_sent + wire.payloads_received > 0)
+    {
+        P("[%d]::: Wire compression: sent %llu payloads, %llu bytes as %llu (%llu stored blocks reused), received %llu payloads, %llu bytes as %llu",
+          connection_fd, (unsigned long long)wire.payloads_sent, (unsigned long long)wire.raw_bytes_sent, (unsigned long long)wire.wire_bytes_sent,
+          (unsigned long long)wire.reused_blocks, (unsigned long long)wire.payloads_received, (unsigned long long)wire.raw_bytes_received,
+          (unsigned long long)wire.wire_bytes_received);
+        pthread_mutex_lock(&wire_totals_lock);
+        wire_totals.payloads_sent += wire.payloads_sent;
+        wire_totals.raw_bytes_sent += wire.raw_bytes_sent;
+        wire_totals.wire_bytes_sent += wire.wire_bytes_sent;
+        wire_totals.payloads_received += wire.payloads_received;
+        wire_totals.raw_bytes_received += wire.raw_bytes_received;
+        wire_totals.wire_bytes_received += wire.wire_bytes_received;
+        wire_totals.reused_blocks += wire.reused_blocks;
+        wire_totals.compress_nanoseconds += wire.compress_nanoseconds;
+        wire_totals.decompress_nanoseconds += wire.decompress_nanoseconds;
+        pthread_mutex_unlock(&wire_totals_lock);
+    }
     if (current_loggedin_users_used_index >= 0)
     {
-        remove_loggedin_user(current_loggedin_users_used_index);
+        storage_engine->session_end(login_env.sender);
+        remove_loggedin_user(current_loggedin_users_used_index, current_loggedin_users_used_generation);
         current_loggedin_users_used_index = -1;
     }
-    if (user_dir_path != NULL)
-    {
-        free(user_dir_path);
-    }
-    if (password_path != NULL)
-    {
-        free(password_path);
-    }
-    if (data_path != NULL)
-    {
-        free(data_path);
-    }
     // Closing the connection before exiting the thread
     P("[%d]::: Closing connection fd: %d", connection_fd, connection_fd);
     if(unlikely(close(connection_fd) < 0))
@@ -2408,6 +2718,158 @@ int main(int argc, char** argv)
         E();
     }
 
+    if (unlikely(checksum_init() != NO_ERROR)) // Before the offline tools too: --import writes checksums, --fsck and --export verify them
+    {
+        P("Unable to initialize the message checksums, exiting");
+        E();
+    }
+
+    /* -------------------------------------------------------------------------- */
+    /*                                OFFLINE TOOLS                               */
+    /* -------------------------------------------------------------------------- */
+    // ./bin/server --migrate-layout <layout>   converts the tree in the working directory and exits, the server must be stopped
+    if (argc >= 2 && strcmp(argv[1], "--migrate-layout") == 0)
+    {
+        if (argc < 3)
+        {
+            P("Usage: %s --migrate-layout <flat|sharded|<user levels>:<message levels>>", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return storage_migrate_layout(argv[2]) == NO_ERROR ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // ./bin/server --export <archive> [user...]   streams the mailboxes of every user (or of the given ones) into one archive and exits
+    if (argc >= 2 && strcmp(argv[1], "--export") == 0)
+    {
+        if (argc < 3)
+        {
+            P("Usage: %s --export <archive> [user...]", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return archive_export(argv[2], (const char *const *)(argv + 3), (size_t)(argc - 3)) == NO_ERROR ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // ./bin/server --import <archive>   loads an archive written by --export into the tree and exits
+    if (argc >= 2 && strcmp(argv[1], "--import") == 0)
+    {
+        if (argc < 3)
+        {
+            P("Usage: %s --import <archive>", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return archive_import(argv[2]) == NO_ERROR ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // ./bin/server --fsck [--repair]   checks message files, shared bodies and search index logs, with --repair fixes them, and exits
+    if (argc >= 2 && strcmp(argv[1], "--fsck") == 0)
+    {
+        if (argc > 3 || (argc == 3 && strcmp(argv[2], "--repair") != 0))
+        {
+            P("Usage: %s --fsck [--repair]", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return fsck_run(argc == 3) == NO_ERROR ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // ./bin/server --benchmark-filter [headers]   times the substring kernels against a strstr() loop and exits
+    if (argc >= 2 && strcmp(argv[1], "--benchmark-filter") == 0)
+    {
+        long headers = argc >= 3 ? strtol(argv[2], NULL, 10) : SUBSTRING_BENCHMARK_DEFAULT_HEADERS;
+        if (headers <= 0 || headers > 100000000L)
+        {
+            P("Usage: %s --benchmark-filter [headers, 1 to 100000000]", argv[0]);
+            return EXIT_FAILURE;
+        }
+        substring_filter_init();
+        return substring_filter_benchmark((size_t)headers) == NO_ERROR ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* -------------------------------------------------------------------------- */
+    /*                               STORAGE HANDLING                             */
+    /* -------------------------------------------------------------------------- */
+
+    if (unlikely(storage_layout_init() != NO_ERROR)) // First: every other storage step builds paths
+    {
+        P("Unable to load the storage layout, exiting");
+        E();
+    }
+    if (unlikely(message_id_allocator_init() != NO_ERROR))
+    {
+        P("Unable to initialize the message id allocator, exiting");
+        E();
+    }
+    if (unlikely(storage_durability_init() != NO_ERROR))
+    {
+        P("Unable to initialize the durability settings, exiting");
+        E();
+    }
+    storage_body_compression_init();
+    server_compression_offer = wire_compression_local_offer();
+    storage_header_encoding_init();
+    server_compact_headers = header_encoding_local_compact();
+    if (unlikely(body_store_init() != NO_ERROR)) // Before the recovery: replayed records may point to shared bodies
+    {
+        P("Unable to initialize the body store, exiting");
+        E();
+    }
+    if (unlikely(delivery_log_recover_and_open() != NO_ERROR))
+    {
+        P("Unable to recover the delivery log, exiting");
+        E();
+    }
+    if (unlikely(storage_engine_init() != NO_ERROR)) // PGM_STORAGE_ENGINE, before anything that lists users or messages
+    {
+        P("Unable to initialize the storage engine, exiting");
+        E();
+    }
+    if (unlikely(user_registry_init() != NO_ERROR)) // After the recovery: it may still touch user folders
+    {
+        P("Unable to load the user registry, exiting");
+        E();
+    }
+    credential_cache_preload(); // PGM_CREDENTIAL_CACHE_PRELOAD=on: no login of a known user reads its password file
+    if (unlikely(header_cache_init() != NO_ERROR))
+    {
+        P("Unable to initialize the header cache, exiting");
+        E();
+    }
+    if (unlikely(substring_filter_init() != NO_ERROR))
+    {
+        P("Unable to initialize the substring filter, exiting");
+        E();
+    }
+    if (unlikely(search_index_init() != NO_ERROR))
+    {
+        P("Unable to initialize the search index, exiting");
+        E();
+    }
+    if (unlikely(mailbox_init() != NO_ERROR))
+    {
+        P("Unable to initialize quotas and retention, exiting");
+        E();
+    }
+    if (unlikely(cold_tier_init() != NO_ERROR))
+    {
+        P("Unable to initialize the cold tier, exiting");
+        E();
+    }
+    if (unlikely(disk_io_init() != NO_ERROR))
+    {
+        P("Unable to start the disk I/O threads, exiting");
+        E();
+    }
+    if (unlikely(auth_init() != NO_ERROR))
+    {
+        P("Unable to start the authentication threads, exiting");
+        E();
+    }
+    if (unlikely(resume_token_init() != NO_ERROR))
+    {
+        P("Unable to draw the resume token key, exiting");
+        E();
+    }
+    if (unlikely(login_throttle_init() != NO_ERROR))
+    {
+        P("Unable to allocate the login throttling table, exiting");
+        E();
+    }
+
     /* -------------------------------------------------------------------------- */
     /*                           MAIN ARGUMENT HANDLING                           */
     /* -------------------------------------------------------------------------- */
@@ -2527,6 +2989,7 @@ int main(int argc, char** argv)
     // Block both signals
     sigaddset(&set, SIGINT); // MAN sigaddset() and sigdelset() add and delete respectively signal signum from set. -NOT-> sigfillset() initializes set to full, including all signals.
     sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1); // Online snapshot (13-Server-Snapshot.h)
     if (unlikely(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)) // LINUX MAN: A new thread inherits a copy of its creator's signal mask.
     {
         PSE("Failed to block signals in main thread");
@@ -2571,6 +3034,12 @@ int main(int argc, char** argv)
             }
             continue; // We do not exit the program, we just continue to accept new connections
         }
+        // Banned for failed logins: dropped before any thread, log line or keepalive setup, each retry costs an accept() and a close()
+        if (login_throttle_address_wait(client_address.sin_addr.s_addr) > 0)
+        {
+            close(new_connection);
+            continue;
+        }
         P("Connection accepted from IP: %s, Port: %d, New socket file descriptor: %d", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port), new_connection);
         
         /* ----- Close connection if the max number of active workers is reached ---- */
@@ -2626,6 +3095,7 @@ int main(int argc, char** argv)
         }
         thread_args->connection_fd = new_connection;
         thread_args->thread_index = thread_args_connections_index;
+        thread_args->client_address = client_address.sin_addr.s_addr;
         lock_shutdown_arrays_or_exit(5);
         connections_array[thread_args_connections_index] = new_connection;
         unlock_shutdown_arrays_or_exit(5);
@@ -2706,6 +3176,22 @@ int main(int argc, char** argv)
         }
     }
     
+    disk_io_shutdown(); // Every session drained its jobs, nothing is left queued
+    auth_shutdown();
+    resume_token_shutdown();
+    login_throttle_shutdown();
+    snapshot_shutdown();
+    mailbox_shutdown();
+    cold_tier_shutdown(); // Before the directory cache goes away with the storage engine
+    header_cache_shutdown();
+    search_index_shutdown();
+    user_registry_destroy();
+    storage_engine_shutdown();
+    checksum_log_statistics();
+    P("Wire compression: sent %llu bytes as %llu (%llu stored blocks reused, %llu us compressing), received %llu bytes as %llu (%llu us decompressing)",
+      (unsigned long long)wire_totals.raw_bytes_sent, (unsigned long long)wire_totals.wire_bytes_sent, (unsigned long long)wire_totals.reused_blocks,
+      (unsigned long long)(wire_totals.compress_nanoseconds / 1000), (unsigned long long)wire_totals.raw_bytes_received,
+      (unsigned long long)wire_totals.wire_bytes_received, (unsigned long long)(wire_totals.decompress_nanoseconds / 1000));
     printf("Exiting program!\n");
     return 0;
 }
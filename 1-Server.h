@@ -10,6 +10,14 @@
  */
 #pragma once /** @note Not truly necessary but you never know...*/
 
+#include "3-Global-Variables-and-Functions.h"
+
+// SIMPLE PRINT STATEMENT ON STDOUT (shared by every server translation unit)
+#define P(fmt, ...) do{fprintf(stdout,"[SRV]>>> " fmt "\n", ##__VA_ARGS__);}while(0);
+
+// ierror, an internal debug substitute to errno when needed (defined in 1-Server.c)
+extern ERROR_CODE ierrno;
+
 enum server_sizes_and_costants {
     MAX_AQUIRE_SEMAPHORE_RETRY = 3,
     MAX_AQUIRE_SEMAPHORE_TIME_WAIT_SECONDS = 10
@@ -18,4 +26,5 @@ enum server_sizes_and_costants {
 typedef struct {
     int connection_fd;
     int thread_index;
-} thread_args_t;
\ No newline at end of file
+    uint32_t client_address; // IPv4 of the peer, network byte order, for the login throttling
+} thread_args_t;
@@ -0,0 +1,404 @@
+/**
+ * @file 10-Server-Substring-Filter.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the vectorized substring matching used by REQUEST_FILTER_MESSAGES over the fixed width sender/subject fields
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c (strcasestr for the benchmark), must be defined before any other inclusion
+#include "1-Server.h"
+#include "10-Server-Substring-Filter.h"
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // getenv, calloc, free
+#include <string.h>     // strlen, strcasecmp, strstr, strcasestr, memset
+#include <stdint.h>     // uint32_t, uint64_t
+#include <time.h>       // clock_gettime
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SUBSTRING_FILTER_X86 1
+#include <immintrin.h>  // _mm256_*, _mm_cmpestri. Compiled per function with target(), the rest of the server keeps the baseline ISA
+#else
+#define SUBSTRING_FILTER_X86 0
+#endif
+
+// CONFIGURATION, written once by substring_filter_init()
+static SUBSTRING_KERNEL substring_selected_kernel = SUBSTRING_KERNEL_SCALAR;
+static int substring_cpu_has_avx2 = 0;
+static int substring_cpu_has_sse42 = 0;
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              SCALAR KERNEL                                                    */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static inline unsigned char fold_byte(unsigned char c)
+{
+    // Not tolower(): the locale must not change what matches
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c | 0x20) : c;
+}
+
+static inline int substring_matches_at(const char *haystack, const SUBSTRING_NEEDLE *needle)
+{
+    for (size_t k = 0; k < needle->length; k++)
+    {
+        if (fold_byte((unsigned char)haystack[k]) != (unsigned char)needle->folded[k])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Scalar search of the positions from @p start on, also the tail of the vector kernels
+ */
+static int substring_contains_scalar_from(const char *haystack, size_t start, size_t length, const SUBSTRING_NEEDLE *needle)
+{
+    if (needle->length > length)
+    {
+        return 0;
+    }
+    unsigned char first = (unsigned char)needle->folded[0];
+    for (size_t i = start; i + needle->length <= length; i++)
+    {
+        if (fold_byte((unsigned char)haystack[i]) == first && substring_matches_at(haystack + i, needle))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              VECTOR KERNELS                                                   */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+#if SUBSTRING_FILTER_X86
+
+__attribute__((target("avx2")))
+static inline __m256i fold_256(__m256i bytes)
+{
+    // Signed compares: bytes >= 0x80 are negative, so never taken for 'A'..'Z'
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), bytes));
+    return _mm256_or_si256(bytes, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+/**
+ * @brief 32 candidate positions per step: a position survives if both the first and the last byte of the needle match there,
+ * only the survivors are compared entirely
+ */
+__attribute__((target("avx2")))
+static int substring_contains_avx2(const char *haystack, size_t length, size_t readable_size, const SUBSTRING_NEEDLE *needle)
+{
+    if (needle->length > length)
+    {
+        return 0;
+    }
+    size_t last_start = length - needle->length;
+    __m256i first = _mm256_set1_epi8(needle->folded[0]);
+    __m256i last = _mm256_set1_epi8(needle->folded[needle->length - 1]);
+    size_t i = 0;
+    for (; i <= last_start && i + needle->length - 1 + 32 <= readable_size; i += 32)
+    {
+        __m256i block_first = fold_256(_mm256_loadu_si256((const __m256i *)(const void *)(haystack + i)));
+        __m256i block_last = fold_256(_mm256_loadu_si256((const __m256i *)(const void *)(haystack + i + needle->length - 1)));
+        uint32_t candidates = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        if (last_start - i < 31)
+        {
+            candidates &= (1u << (last_start - i + 1)) - 1; // Positions past the end of the string
+        }
+        while (candidates != 0)
+        {
+            if (substring_matches_at(haystack + i + (size_t)__builtin_ctz(candidates), needle))
+            {
+                return 1;
+            }
+            candidates &= candidates - 1;
+        }
+    }
+    return substring_contains_scalar_from(haystack, i, length, needle);
+}
+
+__attribute__((target("sse4.2")))
+static inline __m128i fold_128(__m128i bytes)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), bytes));
+    return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+/**
+ * @brief PCMPESTRI "equal ordered" finds the first position of a 16 byte block where the needle (its first 16 bytes) starts,
+ * also a needle that only starts inside the block and goes on in the next one. Each hit is compared entirely.
+ */
+__attribute__((target("sse4.2")))
+static int substring_contains_sse42(const char *haystack, size_t length, size_t readable_size, const SUBSTRING_NEEDLE *needle)
+{
+    if (needle->length > length)
+    {
+        return 0;
+    }
+    __m128i prefix = _mm_loadu_si128((const __m128i *)(const void *)needle->folded); // folded is zero padded to SUBSTRING_NEEDLE_MAX_CHARS
+    int prefix_length = needle->length < 16 ? (int)needle->length : 16;
+    size_t i = 0;
+    while (i + needle->length <= length && i + 16 <= readable_size)
+    {
+        int block_length = length - i < 16 ? (int)(length - i) : 16;
+        __m128i block = fold_128(_mm_loadu_si128((const __m128i *)(const void *)(haystack + i)));
+        int position = _mm_cmpestri(prefix, prefix_length, block, block_length, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ORDERED);
+        if (position == 16)
+        {
+            i += 16;
+            continue;
+        }
+        if (i + (size_t)position + needle->length > length)
+        {
+            return 0; // Every later start is even closer to the end
+        }
+        if (substring_matches_at(haystack + i + (size_t)position, needle))
+        {
+            return 1;
+        }
+        i += (size_t)position + 1;
+    }
+    return substring_contains_scalar_from(haystack, i, length, needle);
+}
+
+#endif // SUBSTRING_FILTER_X86
+
+/**
+ * @brief The kernel @p wanted if the CPU has it, the best one it has otherwise
+ */
+static SUBSTRING_KERNEL substring_supported_kernel(SUBSTRING_KERNEL wanted)
+{
+    if ((wanted == SUBSTRING_KERNEL_AVX2 && substring_cpu_has_avx2) || (wanted == SUBSTRING_KERNEL_SSE42 && substring_cpu_has_sse42) ||
+        wanted == SUBSTRING_KERNEL_SCALAR)
+    {
+        return wanted;
+    }
+    return substring_cpu_has_avx2 ? SUBSTRING_KERNEL_AVX2 : (substring_cpu_has_sse42 ? SUBSTRING_KERNEL_SSE42 : SUBSTRING_KERNEL_SCALAR);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              PUBLIC API                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE substring_filter_init(void)
+{
+#if SUBSTRING_FILTER_X86
+    __builtin_cpu_init();
+    substring_cpu_has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    substring_cpu_has_sse42 = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+    const char *mode = getenv("PGM_SUBSTRING_KERNEL");
+    SUBSTRING_KERNEL wanted = SUBSTRING_KERNEL_AVX2; // Best first, substring_supported_kernel() steps down
+    if (mode != NULL && strcasecmp(mode, "scalar") == 0)
+    {
+        wanted = SUBSTRING_KERNEL_SCALAR;
+    }
+    else if (mode != NULL && strcasecmp(mode, "sse4.2") == 0)
+    {
+        wanted = SUBSTRING_KERNEL_SSE42;
+    }
+    else if (mode != NULL && strcasecmp(mode, "avx2") != 0 && strcasecmp(mode, "auto") != 0)
+    {
+        P("Unknown PGM_SUBSTRING_KERNEL [%s], using auto", mode);
+    }
+    substring_selected_kernel = substring_supported_kernel(wanted);
+    P("Substring filter kernel: %s", convert_substring_kernel_to_string(substring_selected_kernel));
+    return NO_ERROR;
+}
+
+SUBSTRING_KERNEL substring_filter_kernel(void)
+{
+    return substring_selected_kernel;
+}
+
+const char *convert_substring_kernel_to_string(SUBSTRING_KERNEL kernel)
+{
+    switch (kernel)
+    {
+    case SUBSTRING_KERNEL_AVX2:
+        return "avx2";
+    case SUBSTRING_KERNEL_SSE42:
+        return "sse4.2";
+    case SUBSTRING_KERNEL_SCALAR:
+        return "scalar";
+    default:
+        return "unknown";
+    }
+}
+
+ERROR_CODE substring_needle_init(SUBSTRING_NEEDLE *needle, const char *text)
+{
+    if (unlikely(needle == NULL || text == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    memset(needle, 0, sizeof(*needle));
+    size_t length = strlen(text);
+    if (length == 0)
+    {
+        return STRING_SIZE_INVALID;
+    }
+    if (length >= SUBSTRING_NEEDLE_MAX_CHARS)
+    {
+        return STRING_SIZE_EXCEEDING_MAXIMUM;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        needle->folded[i] = (char)fold_byte((unsigned char)text[i]);
+    }
+    needle->length = length;
+    return NO_ERROR;
+}
+
+int substring_contains_with(SUBSTRING_KERNEL kernel, const char *haystack, size_t length, size_t readable_size, const SUBSTRING_NEEDLE *needle)
+{
+#if SUBSTRING_FILTER_X86
+    if (kernel == SUBSTRING_KERNEL_AVX2 && substring_cpu_has_avx2)
+    {
+        return substring_contains_avx2(haystack, length, readable_size, needle);
+    }
+    if (kernel == SUBSTRING_KERNEL_SSE42 && substring_cpu_has_sse42)
+    {
+        return substring_contains_sse42(haystack, length, readable_size, needle);
+    }
+#else
+    (void)kernel;
+    (void)readable_size;
+#endif
+    return substring_contains_scalar_from(haystack, 0, length, needle);
+}
+
+int substring_contains(const char *haystack, size_t length, size_t readable_size, const SUBSTRING_NEEDLE *needle)
+{
+    // A switch on a value written once: predicted every time, cheaper than a call through a function pointer
+    switch (substring_selected_kernel)
+    {
+#if SUBSTRING_FILTER_X86
+    case SUBSTRING_KERNEL_AVX2:
+        return substring_contains_avx2(haystack, length, readable_size, needle);
+    case SUBSTRING_KERNEL_SSE42:
+        return substring_contains_sse42(haystack, length, readable_size, needle);
+#endif
+    default:
+        return substring_contains_scalar_from(haystack, 0, length, needle);
+    }
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              BENCHMARK                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct SUBSTRING_BENCHMARK_HEADER {
+    char sender[USERNAME_SIZE_CHARS];
+    char subject[SUBJECT_SIZE_CHARS];
+    size_t subject_length;
+} SUBSTRING_BENCHMARK_HEADER;
+
+static uint64_t benchmark_now_nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Matches of @p needle among the subjects, @p kernel < 0 for the strstr() (-1) and strcasestr() (-2) loops
+ */
+static size_t benchmark_scan(const SUBSTRING_BENCHMARK_HEADER *headers, size_t count, int kernel, const char *text, const SUBSTRING_NEEDLE *needle)
+{
+    size_t matches = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (kernel == -1)
+        {
+            matches += strstr(headers[i].subject, text) != NULL;
+        }
+        else if (kernel == -2)
+        {
+            matches += strcasestr(headers[i].subject, text) != NULL;
+        }
+        else
+        {
+            matches += (size_t)substring_contains_with((SUBSTRING_KERNEL)kernel, headers[i].subject, headers[i].subject_length, sizeof(headers[i].subject), needle);
+        }
+    }
+    return matches;
+}
+
+ERROR_CODE substring_filter_benchmark(size_t headers)
+{
+    static const char *words[] = {"Re:", "Fwd:", "Quarterly", "budget", "review", "meeting", "on", "Monday", "the", "project",
+                                  "kickoff", "lunch", "invoice", "#4521", "status", "update", "for", "team", "ALL-HANDS", "notes"};
+    const size_t word_count = sizeof(words) / sizeof(words[0]);
+    SUBSTRING_BENCHMARK_HEADER *table = calloc(headers, sizeof(SUBSTRING_BENCHMARK_HEADER));
+    if (unlikely(table == NULL))
+    {
+        PSE("Failed to allocate the benchmark headers");
+        return SYSCALL_ERROR;
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ull; // xorshift64, same data at every run
+    for (size_t i = 0; i < headers; i++)
+    {
+        snprintf(table[i].sender, sizeof(table[i].sender), "user%05zu", i % 5000);
+        size_t used = 0;
+        size_t subject_words = 3 + i % 8;
+        for (size_t w = 0; w < subject_words && used < sizeof(table[i].subject) - 16; w++)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            used += (size_t)snprintf(table[i].subject + used, sizeof(table[i].subject) - used, "%s%s", w == 0 ? "" : " ", words[state % word_count]);
+        }
+        table[i].subject_length = strlen(table[i].subject);
+    }
+
+    static const char *queries[] = {"budget", "all-hands", "Quarterly budget review", "xyzzy"};
+    P("Substring filter benchmark: %zu subjects x %d rounds per query, ns per subject", headers, SUBSTRING_BENCHMARK_ROUNDS);
+    ERROR_CODE result = NO_ERROR;
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++)
+    {
+        SUBSTRING_NEEDLE needle;
+        substring_needle_init(&needle, queries[q]);
+        // strstr, strcasestr, then the kernels the CPU has (unavailable ones would silently run the scalar code)
+        int methods[] = {-1, -2, SUBSTRING_KERNEL_SCALAR, SUBSTRING_KERNEL_SSE42, SUBSTRING_KERNEL_AVX2};
+        size_t reference = 0;
+        char line[256];
+        size_t line_used = (size_t)snprintf(line, sizeof(line), "[%s]", queries[q]);
+        for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); m++)
+        {
+            if (methods[m] >= 0 && substring_supported_kernel((SUBSTRING_KERNEL)methods[m]) != (SUBSTRING_KERNEL)methods[m])
+            {
+                continue;
+            }
+            size_t matches = 0;
+            uint64_t start = benchmark_now_nanoseconds();
+            for (int round = 0; round < SUBSTRING_BENCHMARK_ROUNDS; round++)
+            {
+                matches = benchmark_scan(table, headers, methods[m], queries[q], &needle);
+            }
+            double per_subject = (double)(benchmark_now_nanoseconds() - start) / ((double)headers * SUBSTRING_BENCHMARK_ROUNDS);
+            if (methods[m] == -2)
+            {
+                reference = matches;
+            }
+            else if (methods[m] >= 0 && matches != reference)
+            {
+                PSE("Substring filter: kernel %s found %zu matches of [%s], strcasestr found %zu",
+                    convert_substring_kernel_to_string((SUBSTRING_KERNEL)methods[m]), matches, queries[q], reference);
+                result = ERROR;
+            }
+            const char *name = methods[m] == -1 ? "strstr" : (methods[m] == -2 ? "strcasestr" : convert_substring_kernel_to_string((SUBSTRING_KERNEL)methods[m]));
+            if (line_used < sizeof(line))
+            {
+                line_used += (size_t)snprintf(line + line_used, sizeof(line) - line_used, "  %s %.1f (%zu)", name, per_subject, matches);
+            }
+        }
+        P("%s", line);
+    }
+    free(table);
+    return result;
+}
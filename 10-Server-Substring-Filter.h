@@ -0,0 +1,82 @@
+/**
+ * @file 10-Server-Substring-Filter.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the vectorized substring matching used by REQUEST_FILTER_MESSAGES over the fixed width sender/subject fields
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+
+/**
+ * "Subject contains X" / "from sender Y" filters need no index: they scan the headers of a mailbox (kept in memory by the
+ * header cache) with a substring kernel that compares a whole vector of positions at once. Matching ignores the case of
+ * ASCII letters, other bytes must be equal.
+ *
+ * Kernels, picked once at startup by substring_filter_init() from what the CPU supports:
+ *  - avx2    32 candidate positions per step: compare the first and the last byte of the needle, verify the (rare) survivors
+ *  - sse4.2  PCMPESTRI "equal ordered" over 16 byte blocks
+ *  - scalar  byte by byte, any CPU
+ * PGM_SUBSTRING_KERNEL ("auto" default, "avx2", "sse4.2", "scalar") forces one, a kernel the CPU lacks falls back to auto.
+ *
+ * Vector loads never go past readable_size bytes from the start of the field, the tail that would is matched by the scalar code,
+ * so a field can be scanned in place (no copy, no padding).
+ */
+
+typedef enum SUBSTRING_KERNEL
+{
+    SUBSTRING_KERNEL_SCALAR = 0,
+    SUBSTRING_KERNEL_SSE42 = 1,
+    SUBSTRING_KERNEL_AVX2 = 2,
+} SUBSTRING_KERNEL;
+
+enum substring_filter_constants {
+    SUBSTRING_NEEDLE_MAX_CHARS = 128,        // SUBJECT_SIZE_CHARS - 1 fits
+    SUBSTRING_BENCHMARK_DEFAULT_HEADERS = 100000,
+    SUBSTRING_BENCHMARK_ROUNDS = 20,
+};
+
+/**
+ * @brief A needle ready to be searched: case folded once instead of at every comparison
+ */
+typedef struct SUBSTRING_NEEDLE {
+    char folded[SUBSTRING_NEEDLE_MAX_CHARS];
+    size_t length;
+} SUBSTRING_NEEDLE;
+
+/**
+ * @brief Reads PGM_SUBSTRING_KERNEL and picks the kernel, must be called once before any worker thread starts
+ */
+extern ERROR_CODE substring_filter_init(void);
+
+extern SUBSTRING_KERNEL substring_filter_kernel(void);
+extern const char *convert_substring_kernel_to_string(SUBSTRING_KERNEL kernel);
+
+/**
+ * @brief Prepares @p text (null terminated) as a needle
+ * @return NO_ERROR on success, STRING_SIZE_INVALID if @p text is empty, STRING_SIZE_EXCEEDING_MAXIMUM if it is too long
+ */
+extern ERROR_CODE substring_needle_init(SUBSTRING_NEEDLE *needle, const char *text);
+
+/**
+ * @brief 1 if @p needle appears in the first @p length bytes of @p haystack (ASCII case insensitive), 0 otherwise
+ * @param readable_size bytes that can be read from @p haystack (the width of the field, >= @p length)
+ */
+extern int substring_contains(const char *haystack, size_t length, size_t readable_size, const SUBSTRING_NEEDLE *needle);
+
+/**
+ * @brief Same as substring_contains() with the given kernel, for the benchmark. A kernel the CPU lacks falls back to the scalar one
+ * @note substring_filter_init() must have been called (it detects the CPU features)
+ */
+extern int substring_contains_with(SUBSTRING_KERNEL kernel, const char *haystack, size_t length, size_t readable_size, const SUBSTRING_NEEDLE *needle);
+
+/**
+ * @brief Offline tool (after substring_filter_init()): times every available kernel against a naive strstr()/strcasestr() loop over @p headers synthetic headers
+ * @return NO_ERROR on success (every kernel agreed with strcasestr()), ERROR if a kernel disagreed, SYSCALL_ERROR if memory runs out
+ */
+extern ERROR_CODE substring_filter_benchmark(size_t headers);
@@ -0,0 +1,1123 @@
+/**
+ * @file 11-Server-Archive.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the mailbox archive: offline export/import of user folders as one sequential, checksummed stream
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "7-Server-Body-Store.h"
+#include "11-Server-Archive.h"
+#include "15-Server-Checksum.h"
+#include "18-Compression.h"
+#include "19-Server-Cold-Tier.h"
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, malloc, realloc, free
+#include <string.h>     // memcpy, memset, strlen, strnlen, strcmp
+#include <stddef.h>     // offsetof
+#include <unistd.h>     // read, write, close, fsync, syncfs, sync
+#include <fcntl.h>      // open, posix_fadvise
+#include <sys/stat.h>   // stat
+#include <arpa/inet.h>  // htonl, ntohl
+#include <pthread.h>    // pthread_t, pthread_mutex_t, pthread_cond_t
+#include <stdatomic.h>  // atomic_size_t, atomic_int, atomic_uint_fast64_t
+#include <time.h>       // time, clock_gettime
+#include <errno.h>      // errno, EINTR, ENOENT, EINVAL
+
+static const char *archive_threads_env = "PGM_ARCHIVE_THREADS";
+
+// A MESSAGE record: filename + header + body
+#define ARCHIVE_MESSAGE_RECORD_BYTES(body_length) ((size_t)MESSAGE_FILENAME_SIZE_CHARS + offsetof(MESSAGE, message) + (size_t)(body_length))
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              SHARED HELPERS                                                   */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief FNV-1a 32 bit continued from @p hash (start with 2166136261u), same checksum as the other logs of the server
+ */
+static uint32_t archive_checksum_update(uint32_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Checksum of a segment whose header fields are already in network byte order
+ */
+static uint32_t archive_segment_checksum(const ARCHIVE_SEGMENT_HEADER *header, const char *payload, size_t payload_bytes)
+{
+    uint32_t hash = archive_checksum_update(2166136261u, header, offsetof(ARCHIVE_SEGMENT_HEADER, checksum));
+    return archive_checksum_update(hash, payload, payload_bytes);
+}
+
+static int archive_write_all(int fd, const void *buffer, size_t length)
+{
+    const char *p = (const char *)buffer;
+    while (length > 0)
+    {
+        ssize_t n = write(fd, p, length);
+        if (likely(n > 0))
+        {
+            p += n;
+            length -= (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief read() that loops until @p length bytes or end of file (archives can be pipes, short reads are normal there)
+ * @return bytes read (less than @p length only at end of file), -1 on error
+ */
+static ssize_t archive_read_all(int fd, void *buffer, size_t length)
+{
+    char *p = (char *)buffer;
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = read(fd, p + done, length - done);
+        if (likely(n > 0))
+        {
+            done += (size_t)n;
+            continue;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        return -1;
+    }
+    return (ssize_t)done;
+}
+
+/**
+ * @brief Same rules the login applies: 1 to USERNAME_SIZE_CHARS - 1 characters among [A-Za-z0-9_-], null terminated inside the field
+ */
+static int archive_username_is_valid(const char *username)
+{
+    size_t length = strnlen(username, USERNAME_SIZE_CHARS);
+    if (length == 0 || length >= USERNAME_SIZE_CHARS)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = username[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief A name the storage layer would have created: no path separator, not hidden, message suffix and a recognizable id
+ */
+static int archive_message_filename_is_valid(const char *filename)
+{
+    size_t length = strnlen(filename, MESSAGE_FILENAME_SIZE_CHARS);
+    size_t suffix_length = strlen(file_suffix_user_data);
+    return length > suffix_length && length < MESSAGE_FILENAME_SIZE_CHARS && filename[0] != '.' && strchr(filename, '/') == NULL &&
+           strcmp(filename + length - suffix_length, file_suffix_user_data) == 0 && message_id_from_filename(filename) != 0;
+}
+
+static char *archive_join_path(const char *directory, const char *name)
+{
+    size_t path_length = strlen(directory) + 1 + strlen(name) + 1;
+    char *path = calloc(path_length, sizeof(char));
+    if (likely(path != NULL))
+    {
+        snprintf(path, path_length, "%s/%s", directory, name);
+    }
+    return path;
+}
+
+static size_t archive_thread_count(void)
+{
+    return (size_t)read_environment_long(archive_threads_env, ARCHIVE_DEFAULT_THREADS, 1, ARCHIVE_MAX_THREADS);
+}
+
+static double archive_elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                                  EXPORT                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct ARCHIVE_NAME_LIST {
+    char **names;
+    size_t count;
+    size_t capacity;
+} ARCHIVE_NAME_LIST;
+
+typedef struct ARCHIVE_EXPORT {
+    int fd;
+    pthread_mutex_t write_lock;         // One segment at a time reaches the archive
+    const char *const *users;
+    size_t user_count;
+    atomic_size_t next_user;            // Index of the next user a worker picks up
+    atomic_int failed;
+    atomic_uint_fast64_t users_done;
+    atomic_uint_fast64_t messages;
+    atomic_uint_fast64_t bytes;         // Written to the archive, headers included
+} ARCHIVE_EXPORT;
+
+/**
+ * @brief Segment being filled by one export worker: ARCHIVE_SEGMENT_HEADER followed by the records, one contiguous write when full
+ */
+typedef struct ARCHIVE_SEGMENT_BUILDER {
+    ARCHIVE_EXPORT *export;
+    char *buffer;
+    size_t payload_used;
+    uint32_t records;
+    char username[USERNAME_SIZE_CHARS];
+    const char *user_directory;
+} ARCHIVE_SEGMENT_BUILDER;
+
+static ERROR_CODE archive_name_list_append(const char *name, void *context)
+{
+    ARCHIVE_NAME_LIST *list = (ARCHIVE_NAME_LIST *)context;
+    if (list->count == list->capacity)
+    {
+        size_t next_capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        char **reallocated = realloc(list->names, next_capacity * sizeof(char *));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Failed to grow the user list");
+            return SYSCALL_ERROR;
+        }
+        list->names = reallocated;
+        list->capacity = next_capacity;
+    }
+    list->names[list->count] = strdup(name);
+    if (unlikely(list->names[list->count] == NULL))
+    {
+        PSE("Failed to copy a username");
+        return SYSCALL_ERROR;
+    }
+    list->count++;
+    return NO_ERROR;
+}
+
+static void archive_name_list_free(ARCHIVE_NAME_LIST *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->names[i]);
+    }
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+}
+
+static char *archive_segment_payload(ARCHIVE_SEGMENT_BUILDER *builder)
+{
+    return builder->buffer + sizeof(ARCHIVE_SEGMENT_HEADER);
+}
+
+/**
+ * @brief Seals the segment (header + checksum) and appends it to the archive, nothing to do if it has no record
+ */
+static ERROR_CODE archive_segment_flush(ARCHIVE_SEGMENT_BUILDER *builder)
+{
+    if (builder->records == 0)
+    {
+        return NO_ERROR;
+    }
+    ARCHIVE_SEGMENT_HEADER header;
+    memset(&header, 0, sizeof(header));
+    header.magic = htonl(ARCHIVE_SEGMENT_MAGIC);
+    header.payload_bytes = htonl((uint32_t)builder->payload_used);
+    header.records = htonl(builder->records);
+    memcpy(header.username, builder->username, USERNAME_SIZE_CHARS);
+    header.checksum = htonl(archive_segment_checksum(&header, archive_segment_payload(builder), builder->payload_used));
+    memcpy(builder->buffer, &header, sizeof(header));
+
+    size_t segment_bytes = sizeof(header) + builder->payload_used;
+    pthread_mutex_lock(&builder->export->write_lock);
+    int written = archive_write_all(builder->export->fd, builder->buffer, segment_bytes);
+    pthread_mutex_unlock(&builder->export->write_lock);
+    if (unlikely(written < 0))
+    {
+        PSE("Failed to write a segment of [%s] to the archive", builder->username);
+        return SYSCALL_ERROR;
+    }
+    atomic_fetch_add(&builder->export->bytes, segment_bytes);
+    builder->payload_used = 0;
+    builder->records = 0;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Room for a record of up to @p max_payload_bytes, flushing the segment first if it is too full
+ * @return where the payload goes (the record is only added by archive_record_commit()), NULL if the flush failed
+ */
+static char *archive_record_reserve(ARCHIVE_SEGMENT_BUILDER *builder, size_t max_payload_bytes)
+{
+    if (builder->payload_used + sizeof(ARCHIVE_RECORD_HEADER) + max_payload_bytes > ARCHIVE_SEGMENT_MAX_PAYLOAD_BYTES &&
+        unlikely(archive_segment_flush(builder) != NO_ERROR))
+    {
+        return NULL;
+    }
+    return archive_segment_payload(builder) + builder->payload_used + sizeof(ARCHIVE_RECORD_HEADER);
+}
+
+static void archive_record_commit(ARCHIVE_SEGMENT_BUILDER *builder, ARCHIVE_RECORD_TYPE type, size_t payload_bytes)
+{
+    ARCHIVE_RECORD_HEADER record = {htonl((uint32_t)type), htonl((uint32_t)payload_bytes)};
+    memcpy(archive_segment_payload(builder) + builder->payload_used, &record, sizeof(record));
+    builder->payload_used += sizeof(record) + payload_bytes;
+    builder->records++;
+}
+
+/**
+ * @brief Adds the password or data file of the user as a record
+ * @return NO_ERROR on success, ERROR if the file does not exist, SYSCALL_ERROR on I/O errors
+ */
+static ERROR_CODE archive_export_user_file(ARCHIVE_SEGMENT_BUILDER *builder, const char *name, ARCHIVE_RECORD_TYPE type)
+{
+    char *destination = archive_record_reserve(builder, ARCHIVE_USER_FILE_MAX_BYTES);
+    char *path = destination == NULL ? NULL : archive_join_path(builder->user_directory, name);
+    if (unlikely(path == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        int missing = errno == ENOENT;
+        if (!missing)
+        {
+            PSE("Failed to open [%s]", path);
+        }
+        free(path);
+        return missing ? ERROR : SYSCALL_ERROR;
+    }
+    ssize_t length = archive_read_all(fd, destination, ARCHIVE_USER_FILE_MAX_BYTES);
+    close(fd);
+    if (unlikely(length < 0))
+    {
+        PSE("Failed to read [%s]", path);
+        free(path);
+        return SYSCALL_ERROR;
+    }
+    free(path);
+    archive_record_commit(builder, type, (size_t)length);
+    return NO_ERROR;
+}
+
+/**
+ * @brief storage_for_each_message() callback: the message file is read straight into the segment, shared bodies are resolved
+ */
+static ERROR_CODE archive_export_message(const char *filename, void *context)
+{
+    ARCHIVE_SEGMENT_BUILDER *builder = (ARCHIVE_SEGMENT_BUILDER *)context;
+    if (unlikely(atomic_load(&builder->export->failed)))
+    {
+        return ERROR;
+    }
+    size_t filename_length = strlen(filename);
+    if (unlikely(filename_length >= MESSAGE_FILENAME_SIZE_CHARS))
+    {
+        P("Skipping [%s] of [%s]: name too long", filename, builder->username);
+        return NO_ERROR;
+    }
+    // One byte more than the biggest message (and its checksum), so a file that is too long is noticed
+    size_t file_capacity = offsetof(MESSAGE, message) + MESSAGE_SIZE_CHARS + sizeof(MESSAGE_CHECKSUM) + 1;
+    char *destination = archive_record_reserve(builder, MESSAGE_FILENAME_SIZE_CHARS + file_capacity);
+    if (unlikely(destination == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+    char *path = storage_message_path(builder->user_directory, filename);
+    int fd = path == NULL ? -1 : open(path, O_RDONLY);
+    if (unlikely(fd < 0))
+    {
+        PSE("Failed to open message [%s] of [%s]", filename, builder->username);
+        free(path);
+        return SYSCALL_ERROR;
+    }
+    char *file_bytes = destination + MESSAGE_FILENAME_SIZE_CHARS;
+    ssize_t file_size = archive_read_all(fd, file_bytes, file_capacity);
+    close(fd);
+    free(path);
+    if (unlikely(file_size < 0))
+    {
+        PSE("Failed to read message [%s] of [%s]", filename, builder->username);
+        return SYSCALL_ERROR;
+    }
+
+    // The record is the header and the body: the checksum trailer stays behind (the archive has its own) and --import writes a new one.
+    // Records always carry the fixed header, a compact one is expanded here and --import picks the encoding again
+    size_t header_size = offsetof(MESSAGE, message);
+    uint32_t message_length = 0;
+    MESSAGE_CHECKSUM tail = {0};
+    size_t expanded_size = (size_t)file_size;
+    if (!storage_expand_file_header(file_bytes, &expanded_size, file_capacity))
+    {
+        P("Skipping message [%s] of [%s]: corrupt compact header, run --fsck", filename, builder->username);
+        return NO_ERROR;
+    }
+    file_size = (ssize_t)expanded_size;
+    if ((size_t)file_size >= header_size)
+    {
+        memcpy(&message_length, file_bytes + offsetof(MESSAGE, message_length), sizeof(message_length));
+        message_length = ntohl(message_length);
+    }
+    if ((size_t)file_size >= header_size + sizeof(tail))
+    {
+        memcpy(&tail, file_bytes + file_size - sizeof(tail), sizeof(tail));
+    }
+    MESSAGE_FILE_SHAPE shape;
+    int complete = (size_t)file_size >= header_size && storage_message_file_shape((uint64_t)file_size, message_length, tail.magic, &shape);
+    if (complete && shape.shared_body)
+    {
+        BODY_REFERENCE reference;
+        memcpy(&reference, file_bytes + header_size, sizeof(reference));
+        complete = reference.magic == BODY_REFERENCE_MAGIC && body_store_read(&reference, file_bytes + header_size, message_length) == NO_ERROR;
+    }
+    if (complete && shape.cold_body)
+    {
+        // Exported hot: the archive of the cold tier is not part of the export
+        COLD_REFERENCE reference;
+        memcpy(&reference, file_bytes + header_size, sizeof(reference));
+        complete = cold_tier_read_body(((const MESSAGE *)file_bytes)->recipient, &reference, file_bytes + header_size, message_length) == NO_ERROR;
+    }
+    if (complete && shape.compressed_body)
+    {
+        // Exported raw, --import compresses it again with its own settings
+        char body[MESSAGE_SIZE_CHARS];
+        complete = decompress_block(file_bytes + header_size, (size_t)file_size - header_size - sizeof(tail), body, message_length) == NO_ERROR;
+        memcpy(file_bytes + header_size, body, complete ? message_length : 0);
+    }
+    if (unlikely(!complete))
+    {
+        P("Skipping incomplete message [%s] of [%s]", filename, builder->username);
+        return NO_ERROR;
+    }
+    if (shape.checksummed && unlikely(!checksum_verify_message((const MESSAGE *)file_bytes, file_bytes + header_size, message_length, tail.crc32c)))
+    {
+        P("Skipping corrupt message [%s] of [%s]: checksum mismatch, run --fsck", filename, builder->username);
+        return NO_ERROR;
+    }
+
+    memset(destination, 0, MESSAGE_FILENAME_SIZE_CHARS);
+    memcpy(destination, filename, filename_length);
+    archive_record_commit(builder, ARCHIVE_RECORD_MESSAGE, ARCHIVE_MESSAGE_RECORD_BYTES(message_length));
+    atomic_fetch_add(&builder->export->messages, 1);
+    return NO_ERROR;
+}
+
+static ERROR_CODE archive_export_user(ARCHIVE_SEGMENT_BUILDER *builder, const char *username)
+{
+    char *user_directory = storage_user_directory_path(username);
+    if (unlikely(user_directory == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+    memset(builder->username, 0, sizeof(builder->username));
+    memcpy(builder->username, username, strlen(username));
+    builder->user_directory = user_directory;
+
+    ERROR_CODE result = archive_export_user_file(builder, password_filename, ARCHIVE_RECORD_PASSWORD);
+    if (unlikely(result == ERROR))
+    {
+        // Without its password the user could not log in after an import, better to leave it out and say so
+        P("Skipping user [%s]: it has no password file", username);
+        free(user_directory);
+        return NO_ERROR;
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = archive_export_user_file(builder, data_filename, ARCHIVE_RECORD_DATA);
+        result = result == ERROR ? NO_ERROR : result; // The data file is optional
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = storage_for_each_message(user_directory, archive_export_message, builder);
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = archive_segment_flush(builder);
+    }
+    builder->records = 0; // A failed user leaves nothing behind for the next one
+    builder->payload_used = 0;
+    free(user_directory);
+    if (likely(result == NO_ERROR))
+    {
+        atomic_fetch_add(&builder->export->users_done, 1);
+    }
+    return result;
+}
+
+static void *archive_export_worker(void *argument)
+{
+    ARCHIVE_EXPORT *export = (ARCHIVE_EXPORT *)argument;
+    ARCHIVE_SEGMENT_BUILDER builder;
+    memset(&builder, 0, sizeof(builder));
+    builder.export = export;
+    builder.buffer = malloc(sizeof(ARCHIVE_SEGMENT_HEADER) + ARCHIVE_SEGMENT_MAX_PAYLOAD_BYTES);
+    if (unlikely(builder.buffer == NULL))
+    {
+        PSE("Failed to allocate an export segment");
+        atomic_store(&export->failed, 1);
+        return NULL;
+    }
+    while (!atomic_load(&export->failed))
+    {
+        size_t index = atomic_fetch_add(&export->next_user, 1);
+        if (index >= export->user_count)
+        {
+            break;
+        }
+        if (unlikely(archive_export_user(&builder, export->users[index]) != NO_ERROR))
+        {
+            atomic_store(&export->failed, 1);
+        }
+    }
+    free(builder.buffer);
+    return NULL;
+}
+
+/**
+ * @brief Writes the trailer segment: it tells a complete archive from a truncated one
+ */
+static ERROR_CODE archive_export_trailer(ARCHIVE_EXPORT *export)
+{
+    struct {
+        ARCHIVE_SEGMENT_HEADER header;
+        ARCHIVE_RECORD_HEADER record;
+        ARCHIVE_TRAILER trailer;
+    } segment;
+    memset(&segment, 0, sizeof(segment));
+    segment.record.type = htonl(ARCHIVE_RECORD_END);
+    segment.record.payload_bytes = htonl((uint32_t)sizeof(segment.trailer));
+    segment.trailer.users = host_to_network_64((uint64_t)atomic_load(&export->users_done));
+    segment.trailer.messages = host_to_network_64((uint64_t)atomic_load(&export->messages));
+    segment.header.magic = htonl(ARCHIVE_SEGMENT_MAGIC);
+    segment.header.payload_bytes = htonl((uint32_t)(sizeof(segment.record) + sizeof(segment.trailer)));
+    segment.header.records = htonl(1);
+    uint32_t hash = archive_checksum_update(2166136261u, &segment.header, offsetof(ARCHIVE_SEGMENT_HEADER, checksum));
+    hash = archive_checksum_update(hash, &segment.record, sizeof(segment.record));
+    hash = archive_checksum_update(hash, &segment.trailer, sizeof(segment.trailer));
+    segment.header.checksum = htonl(hash);
+    if (unlikely(archive_write_all(export->fd, &segment.header, sizeof(segment.header)) < 0 ||
+                 archive_write_all(export->fd, &segment.record, sizeof(segment.record)) < 0 ||
+                 archive_write_all(export->fd, &segment.trailer, sizeof(segment.trailer)) < 0))
+    {
+        PSE("Failed to write the archive trailer");
+        return SYSCALL_ERROR;
+    }
+    atomic_fetch_add(&export->bytes, sizeof(segment.header) + sizeof(segment.record) + sizeof(segment.trailer));
+    return NO_ERROR;
+}
+
+ERROR_CODE archive_export(const char *archive_path, const char *const *users, size_t user_count)
+{
+    if (unlikely(archive_path == NULL || (user_count > 0 && users == NULL)))
+    {
+        return NULL_PARAMETERS;
+    }
+    ERROR_CODE result = storage_open_offline();
+    if (unlikely(result != NO_ERROR))
+    {
+        return result;
+    }
+
+    ARCHIVE_NAME_LIST all_users = {0};
+    if (user_count == 0)
+    {
+        result = storage_for_each_user(archive_name_list_append, &all_users);
+        if (unlikely(result != NO_ERROR))
+        {
+            archive_name_list_free(&all_users);
+            return SYSCALL_ERROR;
+        }
+        users = (const char *const *)all_users.names;
+        user_count = all_users.count;
+    }
+    for (size_t i = 0; i < user_count && result == NO_ERROR; i++)
+    {
+        char *user_directory = archive_username_is_valid(users[i]) ? storage_user_directory_path(users[i]) : NULL;
+        struct stat user_stat = {0};
+        if (user_directory == NULL || stat(user_directory, &user_stat) != 0 || !S_ISDIR(user_stat.st_mode))
+        {
+            P("Unknown user [%s]", users[i]);
+            result = ERROR;
+        }
+        free(user_directory);
+    }
+    int fd = result != NO_ERROR ? -1 : open(archive_path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (unlikely(result == NO_ERROR && fd < 0))
+    {
+        PSE("Failed to create the archive [%s]", archive_path);
+        result = SYSCALL_ERROR;
+    }
+    if (unlikely(result != NO_ERROR))
+    {
+        archive_name_list_free(&all_users);
+        return result;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ARCHIVE_EXPORT export;
+    memset(&export, 0, sizeof(export));
+    export.fd = fd;
+    export.users = users;
+    export.user_count = user_count;
+    pthread_mutex_init(&export.write_lock, NULL);
+
+    ARCHIVE_FILE_HEADER file_header = {htonl(ARCHIVE_MAGIC), htonl(ARCHIVE_VERSION), host_to_network_64((uint64_t)time(NULL))};
+    if (unlikely(archive_write_all(fd, &file_header, sizeof(file_header)) < 0))
+    {
+        PSE("Failed to write the archive header");
+        atomic_store(&export.failed, 1);
+    }
+    atomic_fetch_add(&export.bytes, sizeof(file_header));
+
+    // Workers pick the next user when they are done with one, so a single huge mailbox does not hold the others back
+    size_t thread_count = archive_thread_count();
+    thread_count = thread_count > user_count ? (user_count == 0 ? 1 : user_count) : thread_count;
+    pthread_t threads[ARCHIVE_MAX_THREADS];
+    size_t started = 0;
+    for (; started < thread_count && !atomic_load(&export.failed); started++)
+    {
+        if (unlikely(pthread_create(&threads[started], NULL, archive_export_worker, &export) != 0))
+        {
+            PSE("Failed to start an export worker");
+            atomic_store(&export.failed, 1);
+            break;
+        }
+    }
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    result = atomic_load(&export.failed) ? SYSCALL_ERROR : archive_export_trailer(&export);
+    // fsync() is not possible on a pipe (EINVAL), there the reader is the one that makes the data durable
+    if (likely(result == NO_ERROR) && unlikely(fsync(fd) != 0 && errno != EINVAL))
+    {
+        PSE("Failed to sync the archive [%s]", archive_path);
+        result = SYSCALL_ERROR;
+    }
+    close(fd);
+    pthread_mutex_destroy(&export.write_lock);
+    archive_name_list_free(&all_users);
+
+    double seconds = archive_elapsed_seconds(&start);
+    double mebibytes = (double)atomic_load(&export.bytes) / (1024.0 * 1024.0);
+    if (unlikely(result != NO_ERROR))
+    {
+        P("Export failed, [%s] is incomplete", archive_path);
+        return result;
+    }
+    P("Export completed: %llu users, %llu messages, %.1f MiB in %.2f s (%.1f MiB/s, %zu threads)",
+      (unsigned long long)atomic_load(&export.users_done), (unsigned long long)atomic_load(&export.messages),
+      mebibytes, seconds, seconds > 0 ? mebibytes / seconds : 0.0, thread_count);
+    return NO_ERROR;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                                  IMPORT                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * The main thread reads the archive sequentially and hands each segment to the worker of its user (hash of the username), so the
+ * segments of one user are applied in order by a single thread and never race with each other. Each worker owns a ring of
+ * ARCHIVE_QUEUE_DEPTH segment buffers: the reader blocks when the ring of the target worker is full, that is the memory bound.
+ * Checksums are verified by the workers, the reader only moves bytes.
+ */
+
+typedef struct ARCHIVE_IMPORT_SLOT {
+    ARCHIVE_SEGMENT_HEADER header; // As read, network byte order
+    uint64_t offset;               // Of the segment in the archive, for the error messages
+    char *payload;                 // ARCHIVE_SEGMENT_MAX_PAYLOAD_BYTES
+} ARCHIVE_IMPORT_SLOT;
+
+struct ARCHIVE_IMPORT;
+
+typedef struct ARCHIVE_IMPORT_WORKER {
+    pthread_t thread;
+    struct ARCHIVE_IMPORT *import;
+    ARCHIVE_IMPORT_SLOT slots[ARCHIVE_QUEUE_DEPTH];
+    size_t head;                   // Next slot to apply
+    size_t queued;                 // Slots filled by the reader and not applied yet
+    uint32_t *written;             // Offsets (in the payload) of the message records written as partial files, published together
+} ARCHIVE_IMPORT_WORKER;
+
+typedef struct ARCHIVE_IMPORT {
+    pthread_mutex_t lock;          // Protects head/queued of every worker and reading_done
+    pthread_cond_t changed;        // A slot was filled or freed, or the reading is over
+    int reading_done;
+    atomic_int failed;
+    ARCHIVE_IMPORT_WORKER *workers;
+    size_t worker_count;
+    atomic_uint_fast64_t messages;        // Message records seen, imported or skipped (checked against the trailer)
+    atomic_uint_fast64_t imported;
+    atomic_uint_fast64_t skipped;         // Already in the tree
+    atomic_uint_fast64_t users_created;
+} ARCHIVE_IMPORT;
+
+static size_t archive_worker_for(const ARCHIVE_IMPORT *import, const char *username)
+{
+    uint32_t hash = archive_checksum_update(2166136261u, username, strnlen(username, USERNAME_SIZE_CHARS));
+    return hash % import->worker_count;
+}
+
+static void archive_import_fail(ARCHIVE_IMPORT *import)
+{
+    pthread_mutex_lock(&import->lock);
+    atomic_store(&import->failed, 1);
+    pthread_cond_broadcast(&import->changed);
+    pthread_mutex_unlock(&import->lock);
+}
+
+static ERROR_CODE archive_write_user_file(const char *user_directory, const char *name, const char *content, size_t length)
+{
+    char *path = archive_join_path(user_directory, name);
+    int fd = path == NULL ? -1 : open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    ERROR_CODE result = NO_ERROR;
+    if (unlikely(fd < 0 || archive_write_all(fd, content, length) < 0))
+    {
+        PSE("Failed to write [%s]", path == NULL ? name : path);
+        result = SYSCALL_ERROR;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(path);
+    return result;
+}
+
+/**
+ * @brief Makes partial files durable: syncfs() of the filesystem holding @p user_directory (and the body store, same working directory)
+ */
+static ERROR_CODE archive_sync_filesystem(const char *user_directory)
+{
+    if (storage_durability_mode() == DURABILITY_NONE)
+    {
+        return NO_ERROR;
+    }
+    int fd = open(user_directory, O_RDONLY | O_DIRECTORY);
+    if (unlikely(fd < 0 || syncfs(fd) != 0))
+    {
+        PSE("Failed to sync the imported messages of [%s]", user_directory);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return SYSCALL_ERROR;
+    }
+    close(fd);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Applies one segment: user files, then every message as a partial file, one sync, then every message published
+ */
+static ERROR_CODE archive_import_segment(ARCHIVE_IMPORT_WORKER *worker, ARCHIVE_IMPORT_SLOT *slot)
+{
+    ARCHIVE_IMPORT *import = worker->import;
+    uint32_t payload_bytes = ntohl(slot->header.payload_bytes);
+    uint32_t records = ntohl(slot->header.records);
+    if (unlikely(archive_segment_checksum(&slot->header, slot->payload, payload_bytes) != ntohl(slot->header.checksum)))
+    {
+        P("Corrupted segment at offset %llu of the archive (checksum mismatch)", (unsigned long long)slot->offset);
+        return ERROR;
+    }
+    char username[USERNAME_SIZE_CHARS];
+    memcpy(username, slot->header.username, USERNAME_SIZE_CHARS);
+    if (unlikely(!archive_username_is_valid(username)))
+    {
+        P("Invalid username in the segment at offset %llu of the archive", (unsigned long long)slot->offset);
+        return ERROR;
+    }
+    char *user_directory = storage_user_directory_path(username);
+    char *password_path = user_directory == NULL ? NULL : archive_join_path(user_directory, password_filename);
+    if (unlikely(password_path == NULL))
+    {
+        free(user_directory);
+        return SYSCALL_ERROR;
+    }
+    // A user exists once its password file does, a folder left behind by an interrupted import gets completed
+    struct stat password_stat = {0};
+    int user_exists = stat(password_path, &password_stat) == 0;
+    int user_created = 0;
+    free(password_path);
+
+    ERROR_CODE result = NO_ERROR;
+    size_t written = 0;
+    message_id_t highest_id = 0;
+    size_t position = 0;
+    for (uint32_t i = 0; i < records && result == NO_ERROR; i++)
+    {
+        ARCHIVE_RECORD_HEADER record;
+        if (unlikely(payload_bytes - position < sizeof(record)))
+        {
+            result = ERROR;
+            break;
+        }
+        memcpy(&record, slot->payload + position, sizeof(record));
+        uint32_t type = ntohl(record.type);
+        uint32_t length = ntohl(record.payload_bytes);
+        size_t record_offset = position + sizeof(record);
+        if (unlikely(length > payload_bytes - record_offset))
+        {
+            result = ERROR;
+            break;
+        }
+        const char *payload = slot->payload + record_offset;
+        position = record_offset + length;
+
+        if (type == ARCHIVE_RECORD_PASSWORD && !user_exists)
+        {
+            result = storage_create_user_directory(username);
+            if (likely(result == NO_ERROR))
+            {
+                result = archive_write_user_file(user_directory, password_filename, payload, length);
+            }
+            user_exists = user_created = result == NO_ERROR;
+            atomic_fetch_add(&import->users_created, (uint_fast64_t)user_created);
+        }
+        else if (type == ARCHIVE_RECORD_DATA && user_created)
+        {
+            result = archive_write_user_file(user_directory, data_filename, payload, length);
+        }
+        else if (type == ARCHIVE_RECORD_MESSAGE)
+        {
+            atomic_fetch_add(&import->messages, 1);
+            MESSAGE header;
+            char filename[MESSAGE_FILENAME_SIZE_CHARS];
+            uint32_t body_length = 0;
+            if (length >= ARCHIVE_MESSAGE_RECORD_BYTES(0))
+            {
+                memcpy(filename, payload, MESSAGE_FILENAME_SIZE_CHARS);
+                memcpy(&header, payload + MESSAGE_FILENAME_SIZE_CHARS, offsetof(MESSAGE, message));
+                body_length = ntohl(header.message_length);
+            }
+            if (unlikely(length < ARCHIVE_MESSAGE_RECORD_BYTES(0) || body_length > MESSAGE_SIZE_CHARS ||
+                         length != ARCHIVE_MESSAGE_RECORD_BYTES(body_length) || !archive_message_filename_is_valid(filename)))
+            {
+                P("Invalid message record in the segment at offset %llu of the archive", (unsigned long long)slot->offset);
+                result = ERROR;
+                break;
+            }
+            if (unlikely(!user_exists))
+            {
+                P("The archive has messages for [%s] but not its password", username);
+                result = ERROR;
+                break;
+            }
+            result = storage_import_message_write(user_directory, filename, &header, payload + ARCHIVE_MESSAGE_RECORD_BYTES(0), body_length);
+            if (result == OPERATION_ABORTED)
+            {
+                atomic_fetch_add(&import->skipped, 1);
+                result = NO_ERROR;
+            }
+            else if (likely(result == NO_ERROR))
+            {
+                worker->written[written++] = (uint32_t)record_offset;
+                message_id_t id = message_id_from_filename(filename);
+                highest_id = id > highest_id ? id : highest_id;
+            }
+        }
+    }
+    if (result == ERROR)
+    {
+        P("Malformed records in the segment at offset %llu of the archive", (unsigned long long)slot->offset);
+    }
+
+    // The partial files (and the body references they hold) and the ids reach the disk before any name gets listed
+    if (result == NO_ERROR && written > 0)
+    {
+        result = archive_sync_filesystem(user_directory);
+        if (likely(result == NO_ERROR))
+        {
+            result = message_id_advance_past(highest_id);
+        }
+        for (size_t i = 0; i < written && result == NO_ERROR; i++)
+        {
+            char filename[MESSAGE_FILENAME_SIZE_CHARS];
+            memcpy(filename, slot->payload + worker->written[i], MESSAGE_FILENAME_SIZE_CHARS);
+            result = storage_import_message_publish(user_directory, filename);
+        }
+        if (likely(result == NO_ERROR))
+        {
+            atomic_fetch_add(&import->imported, written);
+        }
+    }
+    free(user_directory);
+    return result;
+}
+
+static void *archive_import_worker(void *argument)
+{
+    ARCHIVE_IMPORT_WORKER *worker = (ARCHIVE_IMPORT_WORKER *)argument;
+    ARCHIVE_IMPORT *import = worker->import;
+    for (;;)
+    {
+        pthread_mutex_lock(&import->lock);
+        while (worker->queued == 0 && !import->reading_done)
+        {
+            pthread_cond_wait(&import->changed, &import->lock);
+        }
+        if (worker->queued == 0)
+        {
+            pthread_mutex_unlock(&import->lock);
+            return NULL;
+        }
+        ARCHIVE_IMPORT_SLOT *slot = &worker->slots[worker->head];
+        pthread_mutex_unlock(&import->lock);
+
+        // After a failure the queue is still drained, so the reader never waits forever
+        if (!atomic_load(&import->failed) && unlikely(archive_import_segment(worker, slot) != NO_ERROR))
+        {
+            archive_import_fail(import);
+        }
+
+        pthread_mutex_lock(&import->lock);
+        worker->head = (worker->head + 1) % ARCHIVE_QUEUE_DEPTH;
+        worker->queued--;
+        pthread_cond_broadcast(&import->changed);
+        pthread_mutex_unlock(&import->lock);
+    }
+}
+
+/**
+ * @brief Reads and checks the trailer segment, which must be the last thing in the archive
+ */
+static ERROR_CODE archive_import_trailer(int fd, const ARCHIVE_SEGMENT_HEADER *header, uint64_t offset, ARCHIVE_TRAILER *out_trailer)
+{
+    struct {
+        ARCHIVE_RECORD_HEADER record;
+        ARCHIVE_TRAILER trailer;
+    } payload;
+    char extra = 0;
+    if (unlikely(ntohl(header->payload_bytes) != sizeof(payload) || ntohl(header->records) != 1 ||
+                 archive_read_all(fd, &payload, sizeof(payload)) != (ssize_t)sizeof(payload) ||
+                 archive_segment_checksum(header, (const char *)&payload, sizeof(payload)) != ntohl(header->checksum) ||
+                 ntohl(payload.record.type) != ARCHIVE_RECORD_END || ntohl(payload.record.payload_bytes) != sizeof(payload.trailer)))
+    {
+        P("Corrupted trailer at offset %llu of the archive", (unsigned long long)offset);
+        return ERROR;
+    }
+    if (unlikely(archive_read_all(fd, &extra, 1) != 0))
+    {
+        P("Unexpected data after the trailer of the archive");
+        return ERROR;
+    }
+    out_trailer->users = network_to_host_64(payload.trailer.users);
+    out_trailer->messages = network_to_host_64(payload.trailer.messages);
+    return NO_ERROR;
+}
+
+/**
+ * @brief The reader: hands every segment to its worker, stops at the trailer
+ */
+static ERROR_CODE archive_import_read(ARCHIVE_IMPORT *import, int fd, ARCHIVE_TRAILER *out_trailer)
+{
+    uint64_t offset = sizeof(ARCHIVE_FILE_HEADER);
+    for (;;)
+    {
+        ARCHIVE_SEGMENT_HEADER header;
+        ssize_t header_read = archive_read_all(fd, &header, sizeof(header));
+        if (unlikely(header_read < 0))
+        {
+            PSE("Failed to read the archive");
+            return SYSCALL_ERROR;
+        }
+        if (unlikely(header_read != (ssize_t)sizeof(header)))
+        {
+            P("The archive is truncated (no trailer after offset %llu)", (unsigned long long)offset);
+            return ERROR;
+        }
+        uint32_t payload_bytes = ntohl(header.payload_bytes);
+        if (unlikely(ntohl(header.magic) != ARCHIVE_SEGMENT_MAGIC || payload_bytes > ARCHIVE_SEGMENT_MAX_PAYLOAD_BYTES))
+        {
+            P("Corrupted segment header at offset %llu of the archive", (unsigned long long)offset);
+            return ERROR;
+        }
+        if (header.username[0] == '\0')
+        {
+            return archive_import_trailer(fd, &header, offset, out_trailer);
+        }
+
+        ARCHIVE_IMPORT_WORKER *worker = &import->workers[archive_worker_for(import, header.username)];
+        pthread_mutex_lock(&import->lock);
+        while (worker->queued == ARCHIVE_QUEUE_DEPTH && !atomic_load(&import->failed))
+        {
+            pthread_cond_wait(&import->changed, &import->lock);
+        }
+        // The slot after the queued ones is not touched by the worker until queued grows, so it is filled without the lock
+        ARCHIVE_IMPORT_SLOT *slot = &worker->slots[(worker->head + worker->queued) % ARCHIVE_QUEUE_DEPTH];
+        pthread_mutex_unlock(&import->lock);
+        if (atomic_load(&import->failed))
+        {
+            return ERROR;
+        }
+
+        slot->header = header;
+        slot->offset = offset;
+        ssize_t payload_read = archive_read_all(fd, slot->payload, payload_bytes);
+        if (unlikely(payload_read != (ssize_t)payload_bytes))
+        {
+            if (payload_read < 0)
+            {
+                PSE("Failed to read the archive");
+                return SYSCALL_ERROR;
+            }
+            P("The archive is truncated (segment at offset %llu)", (unsigned long long)offset);
+            return ERROR;
+        }
+        offset += sizeof(header) + payload_bytes;
+
+        pthread_mutex_lock(&import->lock);
+        worker->queued++;
+        pthread_cond_broadcast(&import->changed);
+        pthread_mutex_unlock(&import->lock);
+    }
+}
+
+ERROR_CODE archive_import(const char *archive_path)
+{
+    if (unlikely(archive_path == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    ERROR_CODE result = storage_open_offline();
+    if (unlikely(result != NO_ERROR))
+    {
+        return result;
+    }
+    int fd = open(archive_path, O_RDONLY);
+    if (unlikely(fd < 0))
+    {
+        PSE("Failed to open the archive [%s]", archive_path);
+        return SYSCALL_ERROR;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // Bigger read-ahead, fails harmlessly on a pipe
+
+    ARCHIVE_FILE_HEADER file_header;
+    if (unlikely(archive_read_all(fd, &file_header, sizeof(file_header)) != (ssize_t)sizeof(file_header) ||
+                 ntohl(file_header.magic) != ARCHIVE_MAGIC || ntohl(file_header.version) != ARCHIVE_VERSION))
+    {
+        P("[%s] is not a PGM archive (or was written by an unsupported version)", archive_path);
+        close(fd);
+        return ERROR;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ARCHIVE_IMPORT import;
+    memset(&import, 0, sizeof(import));
+    pthread_mutex_init(&import.lock, NULL);
+    pthread_cond_init(&import.changed, NULL);
+    import.worker_count = archive_thread_count();
+    import.workers = calloc(import.worker_count, sizeof(ARCHIVE_IMPORT_WORKER));
+    size_t max_message_records = ARCHIVE_SEGMENT_MAX_PAYLOAD_BYTES / (sizeof(ARCHIVE_RECORD_HEADER) + ARCHIVE_MESSAGE_RECORD_BYTES(0)) + 1;
+    size_t started = 0;
+    result = import.workers == NULL ? SYSCALL_ERROR : NO_ERROR;
+    for (size_t i = 0; i < import.worker_count && result == NO_ERROR; i++)
+    {
+        ARCHIVE_IMPORT_WORKER *worker = &import.workers[i];
+        worker->import = &import;
+        worker->written = calloc(max_message_records, sizeof(uint32_t));
+        result = worker->written == NULL ? SYSCALL_ERROR : NO_ERROR;
+        for (size_t j = 0; j < ARCHIVE_QUEUE_DEPTH && result == NO_ERROR; j++)
+        {
+            worker->slots[j].payload = malloc(ARCHIVE_SEGMENT_MAX_PAYLOAD_BYTES);
+            result = worker->slots[j].payload == NULL ? SYSCALL_ERROR : NO_ERROR;
+        }
+        if (likely(result == NO_ERROR) && unlikely(pthread_create(&worker->thread, NULL, archive_import_worker, worker) != 0))
+        {
+            result = SYSCALL_ERROR;
+        }
+        started += result == NO_ERROR;
+    }
+    if (unlikely(result != NO_ERROR))
+    {
+        PSE("Failed to start the import workers");
+    }
+
+    ARCHIVE_TRAILER trailer = {0, 0};
+    if (likely(result == NO_ERROR))
+    {
+        result = archive_import_read(&import, fd, &trailer);
+    }
+    if (unlikely(result != NO_ERROR))
+    {
+        archive_import_fail(&import);
+    }
+    pthread_mutex_lock(&import.lock);
+    import.reading_done = 1;
+    pthread_cond_broadcast(&import.changed);
+    pthread_mutex_unlock(&import.lock);
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(import.workers[i].thread, NULL);
+    }
+    close(fd);
+
+    if (result == NO_ERROR && atomic_load(&import.failed))
+    {
+        result = ERROR;
+    }
+    if (result == NO_ERROR && unlikely(trailer.messages != (uint64_t)atomic_load(&import.messages)))
+    {
+        P("The archive announces %llu messages but has %llu", (unsigned long long)trailer.messages, (unsigned long long)atomic_load(&import.messages));
+        result = ERROR;
+    }
+    sync(); // Every publish (rename) on disk, also the ones of a failed run: they are complete messages
+    for (size_t i = 0; import.workers != NULL && i < import.worker_count; i++)
+    {
+        for (size_t j = 0; j < ARCHIVE_QUEUE_DEPTH; j++)
+        {
+            free(import.workers[i].slots[j].payload);
+        }
+        free(import.workers[i].written);
+    }
+    free(import.workers);
+    pthread_cond_destroy(&import.changed);
+    pthread_mutex_destroy(&import.lock);
+
+    double seconds = archive_elapsed_seconds(&start);
+    if (unlikely(result != NO_ERROR))
+    {
+        P("Import failed after %llu messages, fix the archive (or the error) and run it again: imported messages are skipped",
+          (unsigned long long)atomic_load(&import.imported));
+        return result;
+    }
+    P("Import completed: %llu users created (%llu in the archive), %llu messages imported, %llu already present, %.2f s (%zu threads)",
+      (unsigned long long)atomic_load(&import.users_created), (unsigned long long)trailer.users,
+      (unsigned long long)atomic_load(&import.imported), (unsigned long long)atomic_load(&import.skipped), seconds, import.worker_count);
+    return NO_ERROR;
+}
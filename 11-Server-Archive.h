@@ -0,0 +1,95 @@
+/**
+ * @file 11-Server-Archive.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the mailbox archive: offline export/import of user folders as one sequential, checksummed stream
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+/**
+ * Moving a mailbox used to mean copying its user folder: a password file, a data file and one small file per message. An archive
+ * is a single file written and read strictly in order, so it can also be a pipe:
+ *
+ *   ARCHIVE_FILE_HEADER
+ *   ARCHIVE_SEGMENT_HEADER + payload_bytes of records   (repeated, at most ARCHIVE_SEGMENT_MAX_PAYLOAD_BYTES of records each)
+ *   ...
+ *   ARCHIVE_SEGMENT_HEADER + ARCHIVE_RECORD_END         (trailer, empty username: an archive without it is truncated)
+ *
+ * Every record of a segment belongs to the user named in the segment header: ARCHIVE_RECORD_HEADER + payload_bytes of payload.
+ *  - ARCHIVE_RECORD_PASSWORD / ARCHIVE_RECORD_DATA  content of the password/data file, in the first segment of the user
+ *  - ARCHIVE_RECORD_MESSAGE                         message filename (MESSAGE_FILENAME_SIZE_CHARS bytes) + MESSAGE header + body,
+ *                                                   the body is always inline (shared bodies of the body store are resolved)
+ *  - ARCHIVE_RECORD_END                             ARCHIVE_TRAILER
+ * Segments of different users are interleaved (users are processed in parallel), the segments of one user keep their order.
+ * Multibyte fields are in network byte order: unlike the logs, archives do leave the server machine.
+ *
+ * Both tools run with the server stopped (they take the working directory lock) and use PGM_ARCHIVE_THREADS workers
+ * (default ARCHIVE_DEFAULT_THREADS), memory stays below threads * ARCHIVE_QUEUE_DEPTH segments whatever the size of the tree.
+ *  - ./bin/server --export <archive> [user...]   every user, or only the given ones
+ *  - ./bin/server --import <archive>             users missing from the tree are created with their password and data files,
+ *                                                existing users keep theirs; messages keep their filename (id, read state)
+ *                                                and the ones already present are skipped, so an interrupted import can be rerun
+ */
+
+typedef enum ARCHIVE_RECORD_TYPE
+{
+    ARCHIVE_RECORD_PASSWORD = 1,
+    ARCHIVE_RECORD_DATA = 2,
+    ARCHIVE_RECORD_MESSAGE = 3,
+    ARCHIVE_RECORD_END = 4,
+} ARCHIVE_RECORD_TYPE;
+
+typedef struct ARCHIVE_FILE_HEADER {
+    uint32_t magic;         // ARCHIVE_MAGIC
+    uint32_t version;       // ARCHIVE_VERSION
+    uint64_t created;       // Seconds since the epoch
+} ARCHIVE_FILE_HEADER;
+
+typedef struct ARCHIVE_SEGMENT_HEADER {
+    uint32_t magic;         // ARCHIVE_SEGMENT_MAGIC
+    uint32_t payload_bytes; // Records that follow
+    uint32_t records;
+    char username[USERNAME_SIZE_CHARS];
+    uint32_t checksum;      // FNV-1a of the header bytes before this field and of the payload
+} ARCHIVE_SEGMENT_HEADER;
+
+typedef struct ARCHIVE_RECORD_HEADER {
+    uint32_t type;          // ARCHIVE_RECORD_TYPE
+    uint32_t payload_bytes;
+} ARCHIVE_RECORD_HEADER;
+
+typedef struct ARCHIVE_TRAILER {
+    uint64_t users;
+    uint64_t messages;      // ARCHIVE_RECORD_MESSAGE records in the whole archive
+} ARCHIVE_TRAILER;
+
+enum archive_constants {
+    ARCHIVE_MAGIC = 0x50474D41,                       // "PGMA"
+    ARCHIVE_SEGMENT_MAGIC = 0x50474D53,               // "PGMS"
+    ARCHIVE_VERSION = 1,
+    ARCHIVE_SEGMENT_MAX_PAYLOAD_BYTES = 1 << 20,      // Big sequential writes/reads, one checksum and one sync per MiB
+    ARCHIVE_USER_FILE_MAX_BYTES = 1024,               // Password and data files are a line each
+    ARCHIVE_DEFAULT_THREADS = 4,                      // PGM_ARCHIVE_THREADS
+    ARCHIVE_MAX_THREADS = 64,
+    ARCHIVE_QUEUE_DEPTH = 4,                          // Segments read ahead for each import worker
+};
+
+/**
+ * @brief Offline tool: writes the mailboxes of @p users (every user if @p user_count is 0) to @p archive_path
+ * @return NO_ERROR on success, ERROR on invalid arguments or unknown users, SYSCALL_ERROR on I/O errors (the archive is then incomplete)
+ */
+extern ERROR_CODE archive_export(const char *archive_path, const char *const *users, size_t user_count);
+
+/**
+ * @brief Offline tool: loads an archive written by archive_export() into the tree in the working directory
+ * @return NO_ERROR on success, ERROR if the archive is corrupted or truncated (what was imported before stays), SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE archive_import(const char *archive_path);
@@ -0,0 +1,672 @@
+/**
+ * @file 12-Server-Fsck.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the offline consistency checker (fsck) of the tree: message files, shared bodies and search index logs
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "7-Server-Body-Store.h"
+#include "9-Server-Search-Index.h"
+#include "12-Server-Fsck.h"
+#include "15-Server-Checksum.h"
+#include "18-Compression.h"
+#include "19-Server-Cold-Tier.h"
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, malloc, realloc, free, qsort
+#include <string.h>     // memcpy, memchr, memset, strdup, strlen, strrchr
+#include <stddef.h>     // offsetof
+#include <unistd.h>     // read, close, sync, access
+#include <fcntl.h>      // open
+#include <sys/stat.h>   // stat, mkdir
+#include <arpa/inet.h>  // ntohl
+#include <pthread.h>    // pthread_t, pthread_create, pthread_join
+#include <stdatomic.h>  // atomic_size_t, atomic_int, atomic_uint_fast64_t
+#include <time.h>       // clock_gettime
+#include <errno.h>      // errno, EINTR, EEXIST
+
+const char *fsck_quarantine_directory = ".QUARANTINE";
+static const char *fsck_threads_env = "PGM_FSCK_THREADS";
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              STATE                                                            */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct FSCK_NAME_LIST {
+    char **names;
+    size_t count;
+    size_t capacity;
+} FSCK_NAME_LIST;
+
+typedef struct FSCK {
+    int repair;
+    int rebuild_search_index;           // --repair with PGM_SEARCH_INDEX on
+    FSCK_NAME_LIST users;
+    atomic_size_t next_user;            // Index of the next user a worker picks up
+    atomic_int failed;                  // I/O error, the check stops
+    atomic_uint_fast64_t files;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t corrupt_messages;
+    atomic_uint_fast64_t cold_messages;     // Body in a cold archive (19-Server-Cold-Tier.h)
+    atomic_uint_fast64_t compressed_messages; // Body stored compressed (18-Compression.h)
+    atomic_uint_fast64_t quarantined;
+    atomic_uint_fast64_t users_without_password;
+    atomic_uint_fast64_t indexes_rebuilt;
+} FSCK;
+
+typedef struct FSCK_WORKER {
+    pthread_t thread;
+    FSCK *fsck;
+    MESSAGE *message;                   // Read buffer: header + MESSAGE_SIZE_CHARS + checksum + 1, one byte more to notice files that are too long
+    BODY_REFERENCE *references;         // Every record pointing to an intact shared body, counted against the bodies at the end
+    size_t references_used;
+    size_t references_capacity;
+} FSCK_WORKER;
+
+/**
+ * @brief What a worker carries through the walk of one user folder
+ */
+typedef struct FSCK_USER {
+    FSCK_WORKER *worker;
+    const char *username;
+    const char *user_directory;
+    SEARCH_INDEX_REBUILD *rebuild;      // NULL unless the index log is rebuilt
+    FSCK_NAME_LIST corrupt;             // Moved to the quarantine after the walk, not while the folder is being read
+} FSCK_USER;
+
+static ERROR_CODE fsck_name_list_append(const char *name, void *context)
+{
+    FSCK_NAME_LIST *list = (FSCK_NAME_LIST *)context;
+    if (list->count == list->capacity)
+    {
+        size_t next_capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        char **reallocated = realloc(list->names, next_capacity * sizeof(char *));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Failed to grow a name list");
+            return SYSCALL_ERROR;
+        }
+        list->names = reallocated;
+        list->capacity = next_capacity;
+    }
+    list->names[list->count] = strdup(name);
+    if (unlikely(list->names[list->count] == NULL))
+    {
+        PSE("Failed to copy a name");
+        return SYSCALL_ERROR;
+    }
+    list->count++;
+    return NO_ERROR;
+}
+
+static void fsck_name_list_free(FSCK_NAME_LIST *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->names[i]);
+    }
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              QUARANTINE                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief Moves @p path to <fsck_quarantine_directory>/<folder>/<name>, with a numeric suffix if that name is taken
+ * @param folder username, or body_store_directory for bodies (usernames never start with a dot, so they never clash)
+ */
+static ERROR_CODE fsck_quarantine(const char *folder, const char *path)
+{
+    const char *name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+    size_t directory_size = strlen(fsck_quarantine_directory) + 1 + strlen(folder) + 1;
+    size_t target_size = directory_size + strlen(name) + 16;
+    char *directory = malloc(directory_size);
+    char *target = malloc(target_size);
+    if (unlikely(directory == NULL || target == NULL))
+    {
+        PSE("Failed to allocate a quarantine path");
+        free(directory);
+        free(target);
+        return SYSCALL_ERROR;
+    }
+    snprintf(directory, directory_size, "%s/%s", fsck_quarantine_directory, folder);
+    ERROR_CODE result = NO_ERROR;
+    if (unlikely((mkdir(fsck_quarantine_directory, 0700) != 0 && errno != EEXIST) || (mkdir(directory, 0700) != 0 && errno != EEXIST)))
+    {
+        PSE("Failed to create the quarantine directory [%s]", directory);
+        result = SYSCALL_ERROR;
+    }
+    int copy = 0;
+    for (; result == NO_ERROR && copy <= FSCK_MAX_QUARANTINE_COPIES; copy++)
+    {
+        if (copy == 0)
+            snprintf(target, target_size, "%s/%s", directory, name);
+        else
+            snprintf(target, target_size, "%s/%s.%d", directory, name, copy);
+        if (access(target, F_OK) != 0)
+        {
+            break;
+        }
+    }
+    if (result == NO_ERROR && (copy > FSCK_MAX_QUARANTINE_COPIES || rename(path, target) != 0))
+    {
+        PSE("Failed to quarantine [%s]", path);
+        result = SYSCALL_ERROR;
+    }
+    free(directory);
+    free(target);
+    return result;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              MESSAGE FILES                                                    */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief read() that loops until @p length bytes or end of file
+ * @return bytes read, -1 on error
+ */
+static ssize_t fsck_read_all(int fd, void *buffer, size_t length)
+{
+    char *p = (char *)buffer;
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = read(fd, p + done, length - done);
+        if (likely(n > 0))
+        {
+            done += (size_t)n;
+            continue;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        return -1;
+    }
+    return (ssize_t)done;
+}
+
+static ERROR_CODE fsck_remember_reference(FSCK_WORKER *worker, const BODY_REFERENCE *reference)
+{
+    if (worker->references_used == worker->references_capacity)
+    {
+        size_t next_capacity = worker->references_capacity == 0 ? 256 : worker->references_capacity * 2;
+        BODY_REFERENCE *reallocated = realloc(worker->references, next_capacity * sizeof(BODY_REFERENCE));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Failed to grow the body reference list");
+            return SYSCALL_ERROR;
+        }
+        worker->references = reallocated;
+        worker->references_capacity = next_capacity;
+    }
+    worker->references[worker->references_used++] = *reference;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Checks the message file open in @p fd (already read into @p worker->message)
+ * @return NULL if it is sound (the body is then in worker->message->message), otherwise what is wrong with it
+ */
+static const char *fsck_check_message(FSCK_WORKER *worker, const char *filename, ssize_t file_size, int need_body, char *problem, size_t problem_size)
+{
+    MESSAGE *message = worker->message;
+    size_t header_size = offsetof(MESSAGE, message);
+    if (message_id_from_filename(filename) == 0)
+    {
+        return "the name carries no message id";
+    }
+    if ((size_t)file_size < header_size)
+    {
+        snprintf(problem, problem_size, "truncated header (%zd bytes)", file_size);
+        return problem;
+    }
+    if (memchr(message->sender, '\0', sizeof(message->sender)) == NULL || memchr(message->recipient, '\0', sizeof(message->recipient)) == NULL ||
+        memchr(message->subject, '\0', sizeof(message->subject)) == NULL)
+    {
+        return "unterminated sender, recipient or subject";
+    }
+    uint32_t message_length = ntohl(message->message_length);
+    if (message_length == 0 || message_length > MESSAGE_SIZE_CHARS)
+    {
+        snprintf(problem, problem_size, "message_length %u out of range", message_length);
+        return problem;
+    }
+    MESSAGE_CHECKSUM tail = {0};
+    if ((size_t)file_size >= header_size + sizeof(tail))
+    {
+        memcpy(&tail, (const char *)message + file_size - sizeof(tail), sizeof(tail)); // Before a shared body overwrites it
+    }
+    MESSAGE_FILE_SHAPE shape;
+    if (!storage_message_file_shape((uint64_t)file_size, message_length, tail.magic, &shape))
+    {
+        snprintf(problem, problem_size, "%zd bytes on disk but message_length says %u", file_size, message_length);
+        return problem;
+    }
+    if (shape.shared_body)
+    {
+        BODY_REFERENCE reference;
+        memcpy(&reference, message->message, sizeof(reference));
+        if (!body_store_contains(&reference, message_length))
+        {
+            return "its shared body is missing or corrupt";
+        }
+        // Counted even if the record is quarantined later: the body must outlive the quarantined copy (leaked at worst)
+        if (unlikely(fsck_remember_reference(worker, &reference) != NO_ERROR))
+        {
+            atomic_store(&worker->fsck->failed, 1);
+            return NULL;
+        }
+        if ((need_body || shape.checksummed) && unlikely(body_store_read(&reference, message->message, message_length) != NO_ERROR))
+        {
+            return "its shared body cannot be read";
+        }
+    }
+    if (shape.cold_body)
+    {
+        // Always checksummed: the body is read back from its archive to verify it
+        COLD_REFERENCE reference;
+        memcpy(&reference, message->message, sizeof(reference));
+        if (cold_tier_read_body(message->recipient, &reference, message->message, message_length) != NO_ERROR)
+        {
+            return "its cold body is missing or corrupt";
+        }
+        atomic_fetch_add(&worker->fsck->cold_messages, 1);
+    }
+    if (shape.compressed_body)
+    {
+        char body[MESSAGE_SIZE_CHARS];
+        if (decompress_block(message->message, (size_t)file_size - header_size - sizeof(tail), body, message_length) != NO_ERROR)
+        {
+            return "its compressed body is corrupt";
+        }
+        memcpy(message->message, body, message_length);
+        atomic_fetch_add(&worker->fsck->compressed_messages, 1);
+    }
+    if (!shape.checksummed)
+    {
+        checksum_count_unchecked();
+        return NULL;
+    }
+    if (!checksum_verify_message(message, message->message, message_length, tail.crc32c))
+    {
+        return "checksum mismatch";
+    }
+    return NULL;
+}
+
+/**
+ * @brief storage_for_each_message() callback: one read() per file, then the checks
+ */
+static ERROR_CODE fsck_message(const char *filename, void *context)
+{
+    FSCK_USER *user = (FSCK_USER *)context;
+    FSCK_WORKER *worker = user->worker;
+    FSCK *fsck = worker->fsck;
+    if (unlikely(atomic_load(&fsck->failed)))
+    {
+        return ERROR;
+    }
+    char *path = storage_message_path(user->user_directory, filename);
+    int fd = path == NULL ? -1 : open(path, O_RDONLY);
+    free(path);
+    if (unlikely(fd < 0))
+    {
+        PSE("Failed to open message [%s] of [%s]", filename, user->username);
+        return SYSCALL_ERROR;
+    }
+    memset(worker->message, 0, offsetof(MESSAGE, message));
+    size_t capacity = offsetof(MESSAGE, message) + MESSAGE_SIZE_CHARS + sizeof(MESSAGE_CHECKSUM) + 1;
+    ssize_t file_size = fsck_read_all(fd, worker->message, capacity);
+    close(fd);
+    if (unlikely(file_size < 0))
+    {
+        PSE("Failed to read message [%s] of [%s]", filename, user->username);
+        return SYSCALL_ERROR;
+    }
+    atomic_fetch_add(&fsck->files, 1);
+    atomic_fetch_add(&fsck->bytes, (uint_fast64_t)file_size);
+
+    // A compact header is checked like a fixed one once expanded
+    char problem_text[96];
+    size_t expanded_size = (size_t)file_size;
+    const char *problem = !storage_expand_file_header((char *)worker->message, &expanded_size, capacity)
+                              ? "corrupt compact header"
+                              : fsck_check_message(worker, filename, (ssize_t)expanded_size, user->rebuild != NULL, problem_text, sizeof(problem_text));
+    if (problem != NULL)
+    {
+        P("Corrupt message [%s] of [%s]: %s", filename, user->username, problem);
+        atomic_fetch_add(&fsck->corrupt_messages, 1);
+        return fsck->repair ? fsck_name_list_append(filename, &user->corrupt) : NO_ERROR;
+    }
+    if (user->rebuild != NULL)
+    {
+        return search_index_rebuild_add(user->rebuild, filename, worker->message, worker->message->message, ntohl(worker->message->message_length));
+    }
+    return NO_ERROR;
+}
+
+static ERROR_CODE fsck_user(FSCK_WORKER *worker, const char *username)
+{
+    FSCK *fsck = worker->fsck;
+    char *user_directory = storage_user_directory_path(username);
+    size_t password_path_size = user_directory == NULL ? 0 : strlen(user_directory) + 1 + strlen(password_filename) + 1;
+    char *password_path = user_directory == NULL ? NULL : malloc(password_path_size);
+    if (unlikely(password_path == NULL))
+    {
+        PSE("Failed to allocate the paths of [%s]", username);
+        free(user_directory);
+        return SYSCALL_ERROR;
+    }
+    snprintf(password_path, password_path_size, "%s/%s", user_directory, password_filename);
+    struct stat password_stat = {0};
+    if (stat(password_path, &password_stat) != 0)
+    {
+        P("User [%s] has no password file, nobody can log in as [%s] (not repairable)", username, username);
+        atomic_fetch_add(&fsck->users_without_password, 1);
+    }
+    free(password_path);
+
+    FSCK_USER user;
+    memset(&user, 0, sizeof(user));
+    user.worker = worker;
+    user.username = username;
+    user.user_directory = user_directory;
+    ERROR_CODE result = NO_ERROR;
+    if (fsck->rebuild_search_index)
+    {
+        user.rebuild = search_index_rebuild_begin(username);
+        result = user.rebuild == NULL ? SYSCALL_ERROR : NO_ERROR;
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = storage_for_each_message(user_directory, fsck_message, &user);
+    }
+    if (user.rebuild != NULL)
+    {
+        ERROR_CODE finish_result = search_index_rebuild_finish(user.rebuild, result == NO_ERROR);
+        if (likely(result == NO_ERROR && finish_result == NO_ERROR))
+        {
+            atomic_fetch_add(&fsck->indexes_rebuilt, 1);
+        }
+        result = result == NO_ERROR ? finish_result : result;
+    }
+    for (size_t i = 0; i < user.corrupt.count && result == NO_ERROR; i++)
+    {
+        char *path = storage_message_path(user_directory, user.corrupt.names[i]);
+        result = path == NULL ? SYSCALL_ERROR : fsck_quarantine(username, path);
+        atomic_fetch_add(&fsck->quarantined, (uint_fast64_t)(result == NO_ERROR));
+        free(path);
+    }
+    fsck_name_list_free(&user.corrupt);
+    free(user_directory);
+    return result;
+}
+
+static void *fsck_worker(void *argument)
+{
+    FSCK_WORKER *worker = (FSCK_WORKER *)argument;
+    FSCK *fsck = worker->fsck;
+    while (!atomic_load(&fsck->failed))
+    {
+        size_t index = atomic_fetch_add(&fsck->next_user, 1);
+        if (index >= fsck->users.count)
+        {
+            break;
+        }
+        if (unlikely(fsck_user(worker, fsck->users.names[index]) != NO_ERROR))
+        {
+            atomic_store(&fsck->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              SHARED BODIES                                                    */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct FSCK_BODIES {
+    int repair;
+    const BODY_REFERENCE *references; // Every counted record, sorted by hash then probe
+    size_t reference_count;
+    uint64_t bodies;
+    uint64_t wrong_counts;
+    uint64_t orphans;
+    uint64_t corrupt;
+    uint64_t repaired;
+} FSCK_BODIES;
+
+static int compare_references(const void *a, const void *b)
+{
+    const BODY_REFERENCE *left = (const BODY_REFERENCE *)a;
+    const BODY_REFERENCE *right = (const BODY_REFERENCE *)b;
+    if (left->hash != right->hash)
+    {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    return left->probe < right->probe ? -1 : (left->probe > right->probe);
+}
+
+/**
+ * @brief How many records point to @p reference (binary search of the first one, then a scan of the equal ones)
+ */
+static uint64_t fsck_count_references(const FSCK_BODIES *bodies, const BODY_REFERENCE *reference)
+{
+    size_t low = 0;
+    size_t high = bodies->reference_count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (compare_references(&bodies->references[middle], reference) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    uint64_t count = 0;
+    for (size_t i = low; i < bodies->reference_count && compare_references(&bodies->references[i], reference) == 0; i++)
+    {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief body_store_for_each() callback: compares the stored reference count with the records found by the workers
+ */
+static ERROR_CODE fsck_body(const char *path, const BODY_REFERENCE *reference, const BODY_STORE_HEADER *header, int intact, void *context)
+{
+    FSCK_BODIES *bodies = (FSCK_BODIES *)context;
+    bodies->bodies++;
+    uint64_t counted = fsck_count_references(bodies, reference);
+    ERROR_CODE result = NO_ERROR;
+    if (!intact)
+    {
+        // Records pointing to it failed their check too (body_store_contains()), so nothing counted references it
+        P("Corrupt body [%s]", path);
+        bodies->corrupt++;
+        if (bodies->repair)
+        {
+            result = fsck_quarantine(body_store_directory, path);
+            bodies->repaired += result == NO_ERROR;
+        }
+        return result;
+    }
+    if (header->references == counted)
+    {
+        return NO_ERROR;
+    }
+    if (counted == 0)
+    {
+        P("Orphan body [%s]: %llu references recorded, no record points to it", path, (unsigned long long)header->references);
+        bodies->orphans++;
+    }
+    else
+    {
+        // Too high only leaks the body, too low would free it while records still point to it
+        P("Body [%s] records %llu references but %llu records point to it%s", path, (unsigned long long)header->references,
+          (unsigned long long)counted, header->references < counted ? " (would be freed too early)" : "");
+        bodies->wrong_counts++;
+    }
+    if (bodies->repair)
+    {
+        result = body_store_set_references(reference, counted);
+        bodies->repaired += result == NO_ERROR;
+    }
+    return result;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              ENTRY POINT                                                      */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE fsck_run(int repair)
+{
+    ERROR_CODE result = storage_open_offline();
+    if (unlikely(result != NO_ERROR))
+    {
+        return result;
+    }
+    search_index_init(); // Reads PGM_SEARCH_INDEX: with the index off there is no log to rebuild
+
+    FSCK fsck;
+    memset(&fsck, 0, sizeof(fsck));
+    fsck.repair = repair;
+    fsck.rebuild_search_index = repair && search_index_enabled();
+    result = storage_for_each_user(fsck_name_list_append, &fsck.users);
+    if (unlikely(result != NO_ERROR))
+    {
+        fsck_name_list_free(&fsck.users);
+        return SYSCALL_ERROR;
+    }
+    P("fsck: checking %zu users%s", fsck.users.count, repair ? ", repairing" : " (read only, --repair to fix what is found)");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t thread_count = (size_t)read_environment_long(fsck_threads_env, FSCK_DEFAULT_THREADS, 1, FSCK_MAX_THREADS);
+    FSCK_WORKER *workers = calloc(thread_count, sizeof(FSCK_WORKER));
+    size_t started = 0;
+    result = workers == NULL ? SYSCALL_ERROR : NO_ERROR;
+    for (size_t i = 0; i < thread_count && result == NO_ERROR; i++)
+    {
+        workers[i].fsck = &fsck;
+        workers[i].message = malloc(sizeof(MESSAGE) + MESSAGE_SIZE_CHARS + sizeof(MESSAGE_CHECKSUM) + 1);
+        if (unlikely(workers[i].message == NULL || pthread_create(&workers[i].thread, NULL, fsck_worker, &workers[i]) != 0))
+        {
+            PSE("Failed to start the fsck workers");
+            atomic_store(&fsck.failed, 1);
+            result = SYSCALL_ERROR;
+            break;
+        }
+        started++;
+    }
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double seconds = 0;
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    if (atomic_load(&fsck.failed))
+    {
+        result = SYSCALL_ERROR;
+    }
+
+    // Shared bodies, once every record has been counted
+    FSCK_BODIES bodies;
+    memset(&bodies, 0, sizeof(bodies));
+    bodies.repair = repair;
+    BODY_REFERENCE *references = NULL;
+    size_t reference_count = 0;
+    for (size_t i = 0; workers != NULL && i < thread_count; i++)
+    {
+        reference_count += workers[i].references_used;
+    }
+    if (result == NO_ERROR && reference_count > 0)
+    {
+        references = malloc(reference_count * sizeof(BODY_REFERENCE));
+        result = references == NULL ? SYSCALL_ERROR : NO_ERROR;
+        size_t used = 0;
+        for (size_t i = 0; references != NULL && i < thread_count; i++)
+        {
+            if (workers[i].references_used == 0)
+            {
+                continue;
+            }
+            memcpy(references + used, workers[i].references, workers[i].references_used * sizeof(BODY_REFERENCE));
+            used += workers[i].references_used;
+        }
+        if (references != NULL)
+        {
+            qsort(references, reference_count, sizeof(BODY_REFERENCE), compare_references);
+        }
+    }
+    if (result == NO_ERROR)
+    {
+        bodies.references = references;
+        bodies.reference_count = reference_count;
+        result = body_store_for_each(fsck_body, &bodies);
+    }
+    free(references);
+    for (size_t i = 0; workers != NULL && i < thread_count; i++)
+    {
+        free(workers[i].message);
+        free(workers[i].references);
+    }
+    free(workers);
+    if (repair)
+    {
+        sync(); // Quarantine renames, rebuilt logs and reference counts on disk before the server can start again
+    }
+
+    uint64_t files = (uint64_t)atomic_load(&fsck.files);
+    double mebibytes = (double)atomic_load(&fsck.bytes) / (1024.0 * 1024.0);
+    P("fsck: %llu message files (%.1f MiB) of %zu users in %.2f s, %.0f files/s (%zu threads)", (unsigned long long)files, mebibytes,
+      fsck.users.count, seconds, seconds > 0 ? (double)files / seconds : 0.0, thread_count);
+    P("fsck: %llu corrupt messages (%llu quarantined), %llu users without password file", (unsigned long long)atomic_load(&fsck.corrupt_messages),
+      (unsigned long long)atomic_load(&fsck.quarantined), (unsigned long long)atomic_load(&fsck.users_without_password));
+    P("fsck: %llu messages with their body in the cold tier", (unsigned long long)atomic_load(&fsck.cold_messages));
+    P("fsck: %llu messages with their body stored compressed", (unsigned long long)atomic_load(&fsck.compressed_messages));
+    CHECKSUM_STATISTICS checksums;
+    checksum_statistics(&checksums);
+    P("fsck: %llu checksums verified (%llu mismatches, %.0f ns per message), %llu messages without checksum", (unsigned long long)checksums.verified,
+      (unsigned long long)checksums.mismatches, checksums.verified ? (double)checksums.verify_nanoseconds / (double)checksums.verified : 0.0,
+      (unsigned long long)checksums.unchecked);
+    P("fsck: %llu shared bodies, %llu with a wrong reference count, %llu orphans, %llu corrupt (%llu repaired)", (unsigned long long)bodies.bodies,
+      (unsigned long long)bodies.wrong_counts, (unsigned long long)bodies.orphans, (unsigned long long)bodies.corrupt, (unsigned long long)bodies.repaired);
+    if (fsck.rebuild_search_index)
+    {
+        P("fsck: %llu search index logs rebuilt", (unsigned long long)atomic_load(&fsck.indexes_rebuilt));
+    }
+    fsck_name_list_free(&fsck.users);
+    if (unlikely(result != NO_ERROR))
+    {
+        P("fsck: stopped by an I/O error, the results above are partial");
+        return result;
+    }
+
+    uint64_t problems = (uint64_t)atomic_load(&fsck.corrupt_messages) + bodies.wrong_counts + bodies.orphans + bodies.corrupt;
+    uint64_t repaired = (uint64_t)atomic_load(&fsck.quarantined) + bodies.repaired;
+    if (atomic_load(&fsck.users_without_password) > 0 || (problems > 0 && (!repair || repaired < problems)))
+    {
+        return ERROR;
+    }
+    return NO_ERROR;
+}
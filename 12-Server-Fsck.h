@@ -0,0 +1,44 @@
+/**
+ * @file 12-Server-Fsck.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the offline consistency checker (fsck) of the tree: message files, shared bodies and search index logs
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+
+/**
+ * ./bin/server --fsck [--repair]   (server stopped, it takes the working directory lock)
+ *
+ * PGM_FSCK_THREADS workers (default FSCK_DEFAULT_THREADS) take one user folder at a time and check every message file with the
+ * same rules the read path relies on:
+ *  - the name carries a message id
+ *  - the header is complete, its strings are null terminated and message_length is 1 to MESSAGE_SIZE_CHARS
+ *  - the size of the file is header + message_length, or it is a record whose shared body is intact in the body store
+ * Then the reference count of every shared body is compared with the records that point to it.
+ *
+ * With --repair:
+ *  - corrupt message files are moved to <fsck_quarantine_directory>/<username>/ (never deleted, never listed again)
+ *  - the search index log of every user is rebuilt from the messages that passed the check
+ *  - wrong reference counts are rewritten, bodies no record points to are removed, corrupt bodies are quarantined too
+ * Pending deliveries are recovered before the check, like at server startup.
+ */
+
+enum fsck_constants {
+    FSCK_DEFAULT_THREADS = 4,   // PGM_FSCK_THREADS
+    FSCK_MAX_THREADS = 64,
+    FSCK_MAX_QUARANTINE_COPIES = 100, // Same name quarantined again gets ".1", ".2", ...
+};
+
+extern const char *fsck_quarantine_directory; // In the server working directory
+
+/**
+ * @brief Offline tool: checks (and with @p repair fixes) the tree in the working directory
+ * @return NO_ERROR if the tree is consistent (or every problem was repaired), ERROR if problems are left, SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE fsck_run(int repair);
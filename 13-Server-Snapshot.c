@@ -0,0 +1,597 @@
+/**
+ * @file 13-Server-Snapshot.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the online snapshots: point-in-time views of the tree made of hard links, taken while the server runs
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "7-Server-Body-Store.h"
+#include "13-Server-Snapshot.h"
+#include "14-Server-Storage-Engine.h"
+#include "19-Server-Cold-Tier.h"
+#include <stdio.h>      // snprintf, fopen, fprintf, fclose
+#include <stdlib.h>     // realloc, free
+#include <string.h>     // strlen, strncmp, strchr, strrchr, strcmp
+#include <unistd.h>     // link, access, fsync, syncfs, close
+#include <fcntl.h>      // open
+#include <sys/stat.h>   // mkdir, lstat
+#include <dirent.h>     // opendir, readdir, closedir
+#include <limits.h>     // PATH_MAX
+#include <pthread.h>    // pthread_rwlock_t, pthread_mutex_t, pthread_create, pthread_join
+#include <stdatomic.h>  // atomic_int
+#include <time.h>       // time, localtime_r, strftime, clock_gettime
+#include <errno.h>      // errno, EEXIST, ENOENT
+
+const char *snapshot_directory = ".SNAPSHOTS";
+static const char *snapshot_manifest_suffix = ".manifest";
+static const char *snapshot_temp_suffix = ".tmp";
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              STATE                                                            */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+// Shared by the workers around each rename()/unlink(), exclusive while a snapshot starts or ends. Writers are preferred,
+// otherwise a steady flow of deliveries could keep the snapshot from ever starting
+static pthread_rwlock_t snapshot_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP; // Ready for the offline tools too
+
+// Written under the exclusive lock only, so reading them with the shared lock held is enough
+static int snapshot_active = 0;
+static message_id_t snapshot_mark = 0;       // message_id_watermark() when the snapshot started
+static char snapshot_root[PATH_MAX];         // <snapshot_directory>/<name>
+static atomic_int snapshot_failed = 0;       // A link failed, the snapshot gets no manifest
+
+// Ids at most snapshot_mark whose delivery was still running when the snapshot started: not part of it
+static pthread_mutex_t snapshot_excluded_lock = PTHREAD_MUTEX_INITIALIZER;
+static message_id_t *snapshot_excluded = NULL;
+static size_t snapshot_excluded_count = 0;
+static size_t snapshot_excluded_capacity = 0;
+
+// Only touched by the signal thread (request) and by main() once it is gone (shutdown)
+static atomic_int snapshot_running = 0;
+static pthread_t snapshot_thread;
+static int snapshot_thread_joinable = 0;
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LINKS                                                            */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief mkdir -p of the parent directories of @p path
+ */
+static ERROR_CODE snapshot_make_parent_directories(const char *path)
+{
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    for (char *slash = strchr(directory + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdir(directory, 0700) != 0 && errno != EEXIST)
+        {
+            return SYSCALL_ERROR;
+        }
+        *slash = '/';
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief Links @p path (relative to the working directory) at the same place inside the snapshot
+ * @return NO_ERROR if the snapshot has it (linked now or before), OPERATION_ABORTED if @p path is gone, SYSCALL_ERROR otherwise
+ */
+static ERROR_CODE snapshot_preserve(const char *path)
+{
+    char target[PATH_MAX];
+    if (unlikely(snprintf(target, sizeof(target), "%s/%s", snapshot_root, path) >= (int)sizeof(target)))
+    {
+        P("Snapshot: path too long [%s]", path);
+        atomic_store(&snapshot_failed, 1);
+        return SYSCALL_ERROR;
+    }
+    if (link(path, target) == 0 || errno == EEXIST)
+    {
+        return NO_ERROR;
+    }
+    if (errno == ENOENT)
+    {
+        if (access(path, F_OK) != 0)
+        {
+            return OPERATION_ABORTED; // Renamed or removed meanwhile: whoever did it preserved it first
+        }
+        // Missing directory in the snapshot (first file of a user folder or of a bucket)
+        if (likely(snapshot_make_parent_directories(target) == NO_ERROR && (link(path, target) == 0 || errno == EEXIST)))
+        {
+            return NO_ERROR;
+        }
+        if (errno == ENOENT && access(path, F_OK) != 0)
+        {
+            return OPERATION_ABORTED;
+        }
+    }
+    PSE("Snapshot: failed to link [%s]", path);
+    atomic_store(&snapshot_failed, 1);
+    return SYSCALL_ERROR;
+}
+
+/**
+ * @brief Whether the message (or body, id 0) named in @p path belongs to the running snapshot
+ */
+static int snapshot_includes(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    message_id_t id = message_id_from_filename(name == NULL ? path : name + 1);
+    if (id == 0)
+    {
+        return 1;
+    }
+    if (id > snapshot_mark)
+    {
+        return 0;
+    }
+    int excluded = 0;
+    pthread_mutex_lock(&snapshot_excluded_lock);
+    for (size_t i = 0; i < snapshot_excluded_count && !excluded; i++)
+    {
+        excluded = snapshot_excluded[i] == id;
+    }
+    pthread_mutex_unlock(&snapshot_excluded_lock);
+    return !excluded;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              WORKER HOOKS                                                     */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+void snapshot_change_begin(const char *path)
+{
+    pthread_rwlock_rdlock(&snapshot_lock);
+    if (likely(!snapshot_active) || path == NULL)
+    {
+        return;
+    }
+    if (snapshot_includes(path))
+    {
+        snapshot_preserve(path); // Before the change: the snapshot keeps the file as it was when it started
+    }
+}
+
+void snapshot_create_begin(const char *path)
+{
+    pthread_rwlock_rdlock(&snapshot_lock);
+    if (likely(!snapshot_active) || path == NULL)
+    {
+        return;
+    }
+    const char *name = strrchr(path, '/');
+    message_id_t id = message_id_from_filename(name == NULL ? path : name + 1);
+    if (id == 0 || id > snapshot_mark)
+    {
+        return; // Allocated after the start, left out by the id alone
+    }
+    pthread_mutex_lock(&snapshot_excluded_lock);
+    if (snapshot_excluded_count == snapshot_excluded_capacity)
+    {
+        size_t next_capacity = snapshot_excluded_capacity == 0 ? 64 : snapshot_excluded_capacity * 2;
+        message_id_t *reallocated = realloc(snapshot_excluded, next_capacity * sizeof(message_id_t));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Snapshot: failed to grow the excluded ids");
+            atomic_store(&snapshot_failed, 1);
+            pthread_mutex_unlock(&snapshot_excluded_lock);
+            return;
+        }
+        snapshot_excluded = reallocated;
+        snapshot_excluded_capacity = next_capacity;
+    }
+    snapshot_excluded[snapshot_excluded_count++] = id;
+    pthread_mutex_unlock(&snapshot_excluded_lock);
+}
+
+void snapshot_change_end(void)
+{
+    pthread_rwlock_unlock(&snapshot_lock);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              SNAPSHOT THREAD                                                  */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static ERROR_CODE snapshot_message(const char *filename, void *context)
+{
+    const char *user_directory = (const char *)context;
+    char *path = storage_message_path(user_directory, filename);
+    if (unlikely(path == NULL))
+    {
+        atomic_store(&snapshot_failed, 1);
+        return SYSCALL_ERROR;
+    }
+    if (!snapshot_includes(path))
+    {
+        free(path);
+        return NO_ERROR;
+    }
+
+    // A worker that renamed it after the start already linked its old name, which is the one the snapshot wants
+    char other_name[MESSAGE_FILENAME_SIZE_CHARS + sizeof(UNREAD_PREFIX)];
+    size_t prefix_length = strlen(UNREAD_PREFIX);
+    if (strncmp(filename, UNREAD_PREFIX, prefix_length) == 0)
+        snprintf(other_name, sizeof(other_name), "%s", filename + prefix_length);
+    else
+        snprintf(other_name, sizeof(other_name), "%s%s", UNREAD_PREFIX, filename);
+    char *other_path = storage_message_path(user_directory, other_name);
+    char other_target[PATH_MAX];
+    int preserved = other_path != NULL && snprintf(other_target, sizeof(other_target), "%s/%s", snapshot_root, other_path) < (int)sizeof(other_target) &&
+                    access(other_target, F_OK) == 0;
+    ERROR_CODE result = preserved ? NO_ERROR : snapshot_preserve(path);
+    free(other_path);
+    free(path);
+    return result == SYSCALL_ERROR ? SYSCALL_ERROR : NO_ERROR;
+}
+
+static ERROR_CODE snapshot_user(const char *username, void *context)
+{
+    (void)context;
+    char *user_directory = storage_user_directory_path(username);
+    if (unlikely(user_directory == NULL))
+    {
+        atomic_store(&snapshot_failed, 1);
+        return SYSCALL_ERROR;
+    }
+    const char *user_files[] = {password_filename, data_filename};
+    ERROR_CODE result = NO_ERROR;
+    for (size_t i = 0; i < sizeof(user_files) / sizeof(user_files[0]) && result == NO_ERROR; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", user_directory, user_files[i]);
+        result = snapshot_preserve(path) == SYSCALL_ERROR ? SYSCALL_ERROR : NO_ERROR;
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = storage_for_each_message(user_directory, snapshot_message, user_directory);
+    }
+    free(user_directory);
+    return result;
+}
+
+/**
+ * @brief Links every body file: bodies stored after the start come along too, they are only unreferenced in the snapshot
+ */
+static ERROR_CODE snapshot_bodies(void)
+{
+    DIR *store = opendir(body_store_directory);
+    if (store == NULL)
+    {
+        return errno == ENOENT ? NO_ERROR : SYSCALL_ERROR;
+    }
+    ERROR_CODE result = NO_ERROR;
+    size_t partial_length = strlen(partial_message_suffix);
+    struct dirent *bucket_entry;
+    while (result == NO_ERROR && (bucket_entry = readdir(store)) != NULL)
+    {
+        if (bucket_entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        char bucket[PATH_MAX];
+        snprintf(bucket, sizeof(bucket), "%s/%s", body_store_directory, bucket_entry->d_name);
+        DIR *directory = opendir(bucket);
+        if (directory == NULL)
+        {
+            continue; // Not a bucket
+        }
+        struct dirent *entry;
+        while (result == NO_ERROR && (entry = readdir(directory)) != NULL)
+        {
+            size_t length = strlen(entry->d_name);
+            if (entry->d_name[0] == '.' || (length >= partial_length && strcmp(entry->d_name + length - partial_length, partial_message_suffix) == 0))
+            {
+                continue;
+            }
+            char path[PATH_MAX];
+            if (unlikely(snprintf(path, sizeof(path), "%s/%s", bucket, entry->d_name) >= (int)sizeof(path)))
+            {
+                continue; // Not a body file name
+            }
+            result = snapshot_preserve(path) == SYSCALL_ERROR ? SYSCALL_ERROR : NO_ERROR;
+        }
+        closedir(directory);
+    }
+    closedir(store);
+    return result;
+}
+
+/**
+ * @brief Appends a line for every file below @p path, named relative to the snapshot root (the first @p root_length characters of @p path)
+ */
+static ERROR_CODE snapshot_manifest_directory(FILE *manifest, char *path, size_t path_size, size_t root_length, uint64_t *files, uint64_t *bytes)
+{
+    DIR *directory = opendir(path);
+    if (unlikely(directory == NULL))
+    {
+        PSE("Snapshot: failed to open [%s]", path);
+        return SYSCALL_ERROR;
+    }
+    size_t length = strlen(path);
+    ERROR_CODE result = NO_ERROR;
+    struct dirent *entry;
+    while (result == NO_ERROR && (entry = readdir(directory)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (unlikely(snprintf(path + length, path_size - length, "/%s", entry->d_name) >= (int)(path_size - length)))
+        {
+            result = SYSCALL_ERROR;
+            break;
+        }
+        struct stat entry_stat;
+        if (unlikely(lstat(path, &entry_stat) != 0))
+        {
+            PSE("Snapshot: failed to stat [%s]", path);
+            result = SYSCALL_ERROR;
+        }
+        else if (S_ISDIR(entry_stat.st_mode))
+        {
+            result = snapshot_manifest_directory(manifest, path, path_size, root_length, files, bytes);
+        }
+        else if (unlikely(fprintf(manifest, "%s\t%llu\n", path + root_length + 1, (unsigned long long)entry_stat.st_size) < 0))
+        {
+            result = SYSCALL_ERROR;
+        }
+        else
+        {
+            (*files)++;
+            *bytes += (uint64_t)entry_stat.st_size;
+        }
+        path[length] = '\0';
+    }
+    closedir(directory);
+    return result;
+}
+
+/**
+ * @brief Writes <snapshot_root><snapshot_manifest_suffix>: temp file, fsync, rename, so it only exists for complete snapshots
+ */
+static ERROR_CODE snapshot_write_manifest(const char *name, time_t created, uint64_t *out_files, uint64_t *out_bytes)
+{
+    char manifest_path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    if (unlikely(snprintf(manifest_path, sizeof(manifest_path), "%s%s", snapshot_root, snapshot_manifest_suffix) >= (int)sizeof(manifest_path) ||
+                 snprintf(temp_path, sizeof(temp_path), "%s%s", manifest_path, snapshot_temp_suffix) >= (int)sizeof(temp_path)))
+    {
+        P("Snapshot: manifest path too long");
+        return SYSCALL_ERROR;
+    }
+    FILE *manifest = fopen(temp_path, "w");
+    if (unlikely(manifest == NULL))
+    {
+        PSE("Snapshot: failed to create [%s]", temp_path);
+        return SYSCALL_ERROR;
+    }
+    fprintf(manifest, "# PGM snapshot %s\n# created %lld, message id mark %llu\n", name, (long long)created, (unsigned long long)snapshot_mark);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", snapshot_root);
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    ERROR_CODE result = snapshot_manifest_directory(manifest, path, sizeof(path), strlen(snapshot_root), &files, &bytes);
+    if (likely(result == NO_ERROR))
+    {
+        fprintf(manifest, "# end %llu files %llu bytes\n", (unsigned long long)files, (unsigned long long)bytes);
+    }
+    if (unlikely(result != NO_ERROR || fflush(manifest) != 0 || fsync(fileno(manifest)) != 0))
+    {
+        PSE("Snapshot: failed to write [%s]", temp_path);
+        result = SYSCALL_ERROR;
+    }
+    fclose(manifest);
+    if (likely(result == NO_ERROR) && unlikely(rename(temp_path, manifest_path) != 0))
+    {
+        PSE("Snapshot: failed to rename [%s]", temp_path);
+        result = SYSCALL_ERROR;
+    }
+    if (unlikely(result != NO_ERROR))
+    {
+        unlink(temp_path);
+        return result;
+    }
+    *out_files = files;
+    *out_bytes = bytes;
+    return NO_ERROR;
+}
+
+static long long snapshot_elapsed_microseconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)(now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * @brief cold_tier_for_each_archive() callback, archives written after the start come along too, like the bodies
+ */
+static ERROR_CODE snapshot_cold_archive(const char *path, void *context)
+{
+    (void)context;
+    return snapshot_preserve(path) == SYSCALL_ERROR ? SYSCALL_ERROR : NO_ERROR;
+}
+
+static ERROR_CODE snapshot_take(void)
+{
+    // 1) A fresh directory named after the local time
+    time_t created = time(NULL);
+    struct tm created_tm;
+    char name[32];
+    if (unlikely(localtime_r(&created, &created_tm) == NULL || strftime(name, sizeof(name), "%Y%m%d%H%M%S", &created_tm) == 0))
+    {
+        PSE("Snapshot: failed to format the name");
+        return SYSCALL_ERROR;
+    }
+    if (unlikely(mkdir(snapshot_directory, 0700) != 0 && errno != EEXIST))
+    {
+        PSE("Snapshot: failed to create [%s]", snapshot_directory);
+        return SYSCALL_ERROR;
+    }
+    size_t name_length = strlen(name);
+    char root[PATH_MAX];
+    int suffix = 0;
+    for (; suffix <= SNAPSHOT_MAX_NAME_SUFFIX; suffix++)
+    {
+        if (suffix > 0)
+        {
+            snprintf(name + name_length, sizeof(name) - name_length, "-%d", suffix);
+        }
+        snprintf(root, sizeof(root), "%s/%s", snapshot_directory, name);
+        if (mkdir(root, 0700) == 0)
+        {
+            break;
+        }
+        if (unlikely(errno != EEXIST))
+        {
+            PSE("Snapshot: failed to create [%s]", root);
+            return SYSCALL_ERROR;
+        }
+    }
+    if (unlikely(suffix > SNAPSHOT_MAX_NAME_SUFFIX))
+    {
+        P("Snapshot: too many snapshots named [%s]", root);
+        return OPERATION_ABORTED;
+    }
+
+    // 2) The point in time: from here on every rename()/unlink() of a message in the snapshot preserves it first
+    // Workers are held from the request of the lock (new readers queue behind it) to its release
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_wrlock(&snapshot_lock);
+    snprintf(snapshot_root, sizeof(snapshot_root), "%s", root);
+    snapshot_mark = message_id_watermark();
+    atomic_store(&snapshot_failed, 0);
+    snapshot_active = 1;
+    pthread_rwlock_unlock(&snapshot_lock);
+    long long held_microseconds = snapshot_elapsed_microseconds(&start);
+
+    // 3) Everything else, ids past the mark are skipped
+    ERROR_CODE result = NO_ERROR;
+    const char *tree_files[] = {storage_layout_filename, message_id_filename};
+    for (size_t i = 0; i < sizeof(tree_files) / sizeof(tree_files[0]) && result == NO_ERROR; i++)
+    {
+        result = snapshot_preserve(tree_files[i]) == SYSCALL_ERROR ? SYSCALL_ERROR : NO_ERROR;
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = storage_for_each_user(snapshot_user, NULL);
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = snapshot_bodies();
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = cold_tier_for_each_archive(snapshot_cold_archive, NULL);
+    }
+
+    // 4) Back to the fast path for the workers
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_rwlock_wrlock(&snapshot_lock);
+    snapshot_active = 0;
+    pthread_mutex_lock(&snapshot_excluded_lock);
+    size_t in_flight = snapshot_excluded_count;
+    snapshot_excluded_count = 0;
+    pthread_mutex_unlock(&snapshot_excluded_lock);
+    pthread_rwlock_unlock(&snapshot_lock);
+    long long end_held_microseconds = snapshot_elapsed_microseconds(&end);
+    held_microseconds = end_held_microseconds > held_microseconds ? end_held_microseconds : held_microseconds;
+
+    if (unlikely(result != NO_ERROR || atomic_load(&snapshot_failed)))
+    {
+        P("Snapshot [%s] failed, it has no manifest and can be removed", root);
+        return SYSCALL_ERROR;
+    }
+
+    // 5) On disk before the manifest says the snapshot is complete
+    if (storage_durability_mode() != DURABILITY_NONE)
+    {
+        int fd = open(root, O_RDONLY | O_DIRECTORY);
+        if (unlikely(fd < 0 || syncfs(fd) != 0))
+        {
+            PSE("Snapshot: failed to sync [%s]", root);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return SYSCALL_ERROR;
+        }
+        close(fd);
+    }
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    if (unlikely(snapshot_write_manifest(name, created, &files, &bytes) != NO_ERROR))
+    {
+        P("Snapshot [%s] failed, it has no manifest and can be removed", root);
+        return SYSCALL_ERROR;
+    }
+    P("Snapshot [%s] done: %llu files (%.1f MiB), %zu deliveries in flight left out, workers held at most %lld us, %.2f s", root,
+      (unsigned long long)files, (double)bytes / (1024.0 * 1024.0), in_flight, held_microseconds,
+      (double)snapshot_elapsed_microseconds(&start) / 1e6);
+    return NO_ERROR;
+}
+
+static void *snapshot_routine(void *arg)
+{
+    (void)arg;
+    snapshot_take();
+    atomic_store(&snapshot_running, 0);
+    return NULL;
+}
+
+ERROR_CODE snapshot_request(void)
+{
+    if (!storage_engine->persistent)
+    {
+        P("Snapshots need the file storage engine (PGM_STORAGE_ENGINE is %s), request ignored", storage_engine->name);
+        return OPERATION_ABORTED;
+    }
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&snapshot_running, &expected, 1))
+    {
+        P("Snapshot already running, request ignored");
+        return OPERATION_ABORTED;
+    }
+    if (snapshot_thread_joinable)
+    {
+        pthread_join(snapshot_thread, NULL); // The previous one is over (snapshot_running was 0)
+        snapshot_thread_joinable = 0;
+    }
+    if (unlikely(pthread_create(&snapshot_thread, NULL, snapshot_routine, NULL) != 0))
+    {
+        PSE("Failed to start the snapshot thread");
+        atomic_store(&snapshot_running, 0);
+        return SYSCALL_ERROR;
+    }
+    snapshot_thread_joinable = 1;
+    P("Snapshot started");
+    return NO_ERROR;
+}
+
+void snapshot_shutdown(void)
+{
+    if (snapshot_thread_joinable)
+    {
+        if (atomic_load(&snapshot_running))
+        {
+            P("Waiting for the snapshot in progress...");
+        }
+        pthread_join(snapshot_thread, NULL);
+        snapshot_thread_joinable = 0;
+    }
+    free(snapshot_excluded);
+    snapshot_excluded = NULL;
+    snapshot_excluded_capacity = 0;
+}
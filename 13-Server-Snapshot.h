@@ -0,0 +1,65 @@
+/**
+ * @file 13-Server-Snapshot.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the online snapshots: point-in-time views of the tree made of hard links, taken while the server runs
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+
+/**
+ * kill -USR1 <server pid> takes a snapshot of the tree in <snapshot_directory>/<YYYYMMDDHHMMSS>/ without stopping the server.
+ * Files are never copied: every message, password, data, body and cold archive file is hard linked, so the snapshot costs one directory
+ * entry per file and the same filesystem as the tree.
+ *
+ * The point in time is the instant the snapshot starts, when message_id_watermark() is recorded (the mark):
+ *  - messages with an id past the mark, or still being delivered at that instant, are left out
+ *  - a message that is about to be renamed (marked as read) or removed while the snapshot runs is linked first, with the
+ *    name it had, by the worker that changes it (copy on write, done by the link of a directory entry)
+ *  - the snapshot thread links everything else, skipping what the workers already preserved
+ * Workers hold a shared lock only around the rename()/unlink() itself, the start and the end of a snapshot take it exclusively:
+ * deliveries are never held for more than the rename()s already in progress.
+ *
+ * Once the links are in place <snapshot_directory>/<name>.manifest is written (temp file + rename, so a snapshot without its
+ * manifest is incomplete and can be removed): a "#" header, then one "<path>\t<bytes>" line per file, paths relative to the
+ * snapshot, then a "# end" line with the totals. Backup tools stream it, for example:
+ *   grep -v '^#' <name>.manifest | cut -f1 | tar -C <snapshot_directory>/<name> -cf - -T -
+ * A snapshot is restored by copying its directory in place of the tree, followed by ./bin/server --fsck --repair: the reference
+ * count of a shared body lives in the (linked) body file, so it keeps following the live tree, and search index logs are not
+ * part of the snapshot.
+ */
+
+enum snapshot_constants {
+    SNAPSHOT_MAX_NAME_SUFFIX = 100, // Two snapshots in the same second: <name>-1, <name>-2, ...
+};
+
+extern const char *snapshot_directory; // In the server working directory
+
+/**
+ * @brief Starts a snapshot in the background (called by the signal thread on SIGUSR1)
+ * @return NO_ERROR once started, OPERATION_ABORTED if a snapshot is already running, SYSCALL_ERROR if the thread cannot be started
+ */
+extern ERROR_CODE snapshot_request(void);
+
+/**
+ * @brief Waits for the snapshot in progress, if any, only to be called once every worker thread has been joined
+ */
+extern void snapshot_shutdown(void);
+
+/**
+ * @brief To be called right before the message or body file @p path is renamed or removed, snapshot_change_end() right after
+ * @note No other storage call between the two: the shared lock is not recursive
+ */
+extern void snapshot_change_begin(const char *path);
+
+/**
+ * @brief To be called right before a new message file gets its final name @p path, snapshot_change_end() right after
+ */
+extern void snapshot_create_begin(const char *path);
+
+extern void snapshot_change_end(void);
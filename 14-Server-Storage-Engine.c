@@ -0,0 +1,871 @@
+/**
+ * @file 14-Server-Storage-Engine.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the storage engines: the file engine (one file per message) and the memory engine (benchmarks)
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "13-Server-Snapshot.h"
+#include "14-Server-Storage-Engine.h"
+#include "16-Server-Directory-Cache.h"
+#include "22-Server-Credential-Cache.h"
+#include <stdio.h>      // snprintf, fdopen, fprintf, fflush, fileno, fgets, fclose, renameat
+#include <stdlib.h>     // malloc, calloc, realloc, free, getenv
+#include <string.h>     // strlen, strcmp, strncmp, strcspn, memcpy, memmove
+#include <unistd.h>     // close, unlinkat
+#include <fcntl.h>      // openat, O_CLOEXEC
+#include <sys/stat.h>   // fstatat
+#include <arpa/inet.h>  // ntohl
+#include <pthread.h>    // pthread_rwlock_t, pthread_mutex_t
+#include <errno.h>      // errno, ENOENT
+
+static const char *storage_engine_env = "PGM_STORAGE_ENGINE";
+static const char *password_temp_suffix = ".tmp"; // "<password_filename>.tmp" while a new password replaces the old one
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              FILE ENGINE                                                      */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief Message @p filename of @p directory, relative to the folder for the *at() calls and from the working directory for the snapshot hooks
+ * @param snapshot_path optional, STORAGE_MESSAGE_PATH_SIZE_CHARS bytes
+ * @return NO_ERROR, STRING_SIZE_EXCEEDING_MAXIMUM if a path does not fit
+ */
+static ERROR_CODE file_engine_message_paths(const USER_DIRECTORY *directory, const char *filename, char relative_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS],
+                                            char *snapshot_path)
+{
+    ERROR_CODE result = storage_message_relative_path(filename, relative_path, STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS);
+    if (likely(result == NO_ERROR) && snapshot_path != NULL &&
+        (size_t)snprintf(snapshot_path, STORAGE_MESSAGE_PATH_SIZE_CHARS, "%s/%s", directory->path, relative_path) >= STORAGE_MESSAGE_PATH_SIZE_CHARS)
+    {
+        result = STRING_SIZE_EXCEEDING_MAXIMUM;
+    }
+    return result;
+}
+
+/**
+ * @brief user_directory_acquire() with the errno turned into the ERROR_CODE of the engine operations
+ * @param out_result ERROR if @p username has no folder (so no such message either), SYSCALL_ERROR otherwise
+ */
+static USER_DIRECTORY *file_engine_acquire(const char *username, ERROR_CODE *out_result)
+{
+    USER_DIRECTORY *directory = user_directory_acquire(username);
+    if (unlikely(directory == NULL))
+    {
+        *out_result = errno == ENOENT ? ERROR : SYSCALL_ERROR;
+    }
+    return directory;
+}
+
+static ERROR_CODE file_engine_init(void)
+{
+    ERROR_CODE result = directory_cache_init(); // The layout, the delivery log and the body store are set up by main() before any engine
+    return result == NO_ERROR ? credential_cache_init() : result;
+}
+
+static void file_engine_shutdown(void)
+{
+    credential_cache_shutdown();
+    directory_cache_shutdown();
+}
+
+static void file_engine_session_begin(const char *username)
+{
+    // The session keeps the pin, session_end() gives it back. If the folder cannot be opened now every operation just tries again
+    user_directory_acquire(username);
+}
+
+static void file_engine_session_end(const char *username)
+{
+    user_directory_unpin(username);
+}
+
+static int file_engine_user_exists(const char *username)
+{
+    // The password file, not the folder: a registration interrupted before the password was stored must be able to start over
+    USER_DIRECTORY *directory = user_directory_acquire(username);
+    if (directory == NULL)
+    {
+        return 0;
+    }
+    struct stat password_stat = {0};
+    int exists = fstatat(directory->fd, password_filename, &password_stat, 0) == 0 && S_ISREG(password_stat.st_mode);
+    user_directory_release(directory);
+    return exists;
+}
+
+/**
+ * @brief Writes @p line followed by a newline to the file @p name of the user folder (created or truncated)
+ */
+static ERROR_CODE file_engine_write_user_file(const USER_DIRECTORY *directory, const char *name, const char *line)
+{
+    int fd = openat(directory->fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666); // Same mode as fopen(), the umask applies
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (unlikely(file == NULL))
+    {
+        PSE("Failed to create [%s] for [%s]", name, directory->username);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return SYSCALL_ERROR;
+    }
+    int written = fprintf(file, "%s\n", line) >= 0;
+    written = fclose(file) == 0 && written;
+    if (unlikely(!written))
+    {
+        PSE("Failed to write [%s] for [%s]", name, directory->username);
+        return SYSCALL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+static ERROR_CODE file_engine_create_user(const char *username, const char *password)
+{
+    if (unlikely(storage_create_user_directory(username) != NO_ERROR)) // And its fan-out directories
+    {
+        PSE("Failed to create the user folder of [%s]", username);
+        return SYSCALL_ERROR;
+    }
+    USER_DIRECTORY *directory = user_directory_acquire(username);
+    if (unlikely(directory == NULL))
+    {
+        PSE("Failed to open the user folder of [%s]", username);
+        return SYSCALL_ERROR;
+    }
+    // No .DATA anymore (the received message count was never used), the ones of older users are still exported and snapshotted
+    ERROR_CODE result = file_engine_write_user_file(directory, password_filename, password);
+    user_directory_release(directory);
+    credential_cache_invalidate(username); // A registration may start over one interrupted after a login read the old file
+    return result;
+}
+
+static ERROR_CODE file_engine_read_password(const char *username, char *out, size_t out_size)
+{
+    uint64_t ticket = 0;
+    if (credential_cache_lookup(username, out, out_size, &ticket))
+    {
+        return NO_ERROR; // No folder, no file
+    }
+    ERROR_CODE result = NO_ERROR;
+    USER_DIRECTORY *directory = file_engine_acquire(username, &result);
+    if (directory == NULL)
+    {
+        return result == ERROR ? USER_NOT_FOUND : result;
+    }
+    int fd = openat(directory->fd, password_filename, O_RDONLY | O_CLOEXEC);
+    int open_errno = errno;
+    user_directory_release(directory);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "r");
+    if (file == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return fd < 0 && open_errno == ENOENT ? USER_NOT_FOUND : SYSCALL_ERROR;
+    }
+    int read = fgets(out, (int)out_size, file) != NULL;
+    fclose(file);
+    if (unlikely(!read))
+    {
+        return SYSCALL_ERROR;
+    }
+    out[strcspn(out, "\n")] = '\0';
+    credential_cache_fill(username, out, ticket);
+    return NO_ERROR;
+}
+
+static ERROR_CODE file_engine_write_password(const char *username, const char *password)
+{
+    ERROR_CODE result = NO_ERROR;
+    USER_DIRECTORY *directory = file_engine_acquire(username, &result);
+    if (directory == NULL)
+    {
+        return result == ERROR ? USER_NOT_FOUND : result;
+    }
+    // Written aside and renamed over the old file: never a truncated password file, and snapshots keep the one they linked
+    char temp_name[64];
+    snprintf(temp_name, sizeof(temp_name), "%s%s", password_filename, password_temp_suffix);
+    int fd = openat(directory->fd, temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (unlikely(file == NULL))
+    {
+        PSE("Failed to create [%s] for [%s]", temp_name, username);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        user_directory_release(directory);
+        return SYSCALL_ERROR;
+    }
+    int written = fprintf(file, "%s\n", password) >= 0 && fflush(file) == 0;
+    // The new file is durable before it replaces the old one, a crash in between keeps the old password
+    written = written && storage_make_durable_at(fileno(file), directory->fd, NULL) == NO_ERROR;
+    written = fclose(file) == 0 && written;
+    if (unlikely(!written || renameat(directory->fd, temp_name, directory->fd, password_filename) != 0))
+    {
+        PSE("Failed to replace [%s] for [%s]", password_filename, username);
+        unlinkat(directory->fd, temp_name, 0);
+        user_directory_release(directory);
+        return SYSCALL_ERROR;
+    }
+    user_directory_release(directory);
+    credential_cache_invalidate(username); // After the rename: a login that read the old file before cannot cache it anymore
+    return NO_ERROR;
+}
+
+static ERROR_CODE file_engine_deliver(const MESSAGE *header, const char *body, uint32_t body_length, char *out_filename)
+{
+    USER_DIRECTORY *directory = user_directory_acquire(header->recipient);
+    if (unlikely(directory == NULL))
+    {
+        PSE("Failed to open the folder of the recipient [%s]", header->recipient);
+        return SYSCALL_ERROR;
+    }
+    ERROR_CODE result = storage_deliver_message(directory->fd, directory->path, header, body, body_length, out_filename);
+    user_directory_release(directory);
+    return result;
+}
+
+static ERROR_CODE file_engine_list(const char *username, ERROR_CODE (*callback)(const char *filename, void *context), void *context)
+{
+    ERROR_CODE result = NO_ERROR;
+    USER_DIRECTORY *directory = file_engine_acquire(username, &result);
+    if (unlikely(directory == NULL))
+    {
+        PSE("Failed to open the folder of [%s]", username);
+        return SYSCALL_ERROR;
+    }
+    // The storage layer walks the user folder (and its buckets with a sharded layout). The pin keeps the fd open for the callbacks too
+    result = storage_for_each_message_at(directory->fd, callback, context);
+    user_directory_release(directory);
+    return result;
+}
+
+/**
+ * @brief Opens the message @p filename of @p username for reading
+ * @return the fd, -1 with @p out_result set to ERROR if there is no such message or to the error otherwise
+ */
+static int file_engine_open_message(const char *username, const char *filename, ERROR_CODE *out_result)
+{
+    USER_DIRECTORY *directory = file_engine_acquire(username, out_result);
+    if (directory == NULL)
+    {
+        return -1;
+    }
+    char relative_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    int fd = file_engine_message_paths(directory, filename, relative_path, NULL) != NO_ERROR ? -1 : openat(directory->fd, relative_path, O_RDONLY | O_CLOEXEC);
+    int open_errno = errno;
+    user_directory_release(directory);
+    if (fd < 0)
+    {
+        *out_result = open_errno == ENOENT ? ERROR : SYSCALL_ERROR;
+    }
+    return fd;
+}
+
+static ERROR_CODE file_engine_fetch(const char *username, const char *filename, MESSAGE *message, int with_body)
+{
+    ERROR_CODE result = NO_ERROR;
+    int fd = file_engine_open_message(username, filename, &result);
+    if (fd < 0)
+    {
+        return result;
+    }
+    result = storage_read_message(fd, message, with_body); // Inline, compressed, cold or from the body store, checksum verified with the body
+    close(fd);
+    return result;
+}
+
+static ERROR_CODE file_engine_fetch_compressed(const char *username, const char *filename, MESSAGE *message, char *compressed, uint32_t *out_compressed_length)
+{
+    ERROR_CODE result = NO_ERROR;
+    int fd = file_engine_open_message(username, filename, &result);
+    if (fd < 0)
+    {
+        return result;
+    }
+    result = storage_read_message_compressed(fd, message, compressed, out_compressed_length);
+    close(fd);
+    return result;
+}
+
+static ERROR_CODE file_engine_mark_read(const char *username, const char *filename)
+{
+    size_t prefix_length = strlen(UNREAD_PREFIX);
+    if (strncmp(filename, UNREAD_PREFIX, prefix_length) != 0 || filename[prefix_length] == '\0')
+    {
+        return ERROR;
+    }
+    ERROR_CODE result = NO_ERROR;
+    USER_DIRECTORY *directory = file_engine_acquire(username, &result);
+    if (directory == NULL)
+    {
+        return result;
+    }
+    char relative_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    char new_relative_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    char snapshot_path[STORAGE_MESSAGE_PATH_SIZE_CHARS];
+    result = SYSCALL_ERROR;
+    // Same bucket: the UNREAD prefix is not part of the shard hash
+    if (likely(file_engine_message_paths(directory, filename, relative_path, snapshot_path) == NO_ERROR &&
+               file_engine_message_paths(directory, filename + prefix_length, new_relative_path, NULL) == NO_ERROR))
+    {
+        snapshot_change_begin(snapshot_path);
+        int renamed = renameat(directory->fd, relative_path, directory->fd, new_relative_path) == 0;
+        int rename_errno = errno;
+        snapshot_change_end();
+        result = renamed ? NO_ERROR : rename_errno == ENOENT ? ERROR : SYSCALL_ERROR;
+    }
+    user_directory_release(directory);
+    return result;
+}
+
+static ERROR_CODE file_engine_remove(const char *username, const char *filename)
+{
+    ERROR_CODE result = NO_ERROR;
+    USER_DIRECTORY *directory = file_engine_acquire(username, &result);
+    if (directory == NULL)
+    {
+        return result;
+    }
+    result = storage_remove_message_at(directory->fd, directory->path, filename); // Also drops the reference to a shared body
+    if (result != NO_ERROR && errno == ENOENT)
+    {
+        result = ERROR;
+    }
+    user_directory_release(directory);
+    return result;
+}
+
+static ERROR_CODE file_engine_message_bytes(const char *username, const char *filename, uint64_t *out_bytes)
+{
+    ERROR_CODE result = NO_ERROR;
+    USER_DIRECTORY *directory = file_engine_acquire(username, &result);
+    if (directory == NULL)
+    {
+        return ERROR; // Deleted in the meantime
+    }
+    char relative_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    int fd = file_engine_message_paths(directory, filename, relative_path, NULL) != NO_ERROR ? -1 : openat(directory->fd, relative_path, O_RDONLY | O_CLOEXEC);
+    user_directory_release(directory);
+    result = ERROR; // Deleted in the meantime
+    if (fd >= 0)
+    {
+        *out_bytes = storage_message_bytes(fd); // Same bytes as the delivery reserved, also for shared bodies
+        close(fd);
+        result = NO_ERROR;
+    }
+    return result;
+}
+
+static const STORAGE_ENGINE file_engine = {
+    .name = "file",
+    .persistent = 1,
+    .init = file_engine_init,
+    .shutdown = file_engine_shutdown,
+    .session_begin = file_engine_session_begin,
+    .session_end = file_engine_session_end,
+    .for_each_user = storage_for_each_user,
+    .user_exists = file_engine_user_exists,
+    .create_user = file_engine_create_user,
+    .read_password = file_engine_read_password,
+    .write_password = file_engine_write_password,
+    .deliver = file_engine_deliver,
+    .list = file_engine_list,
+    .fetch = file_engine_fetch,
+    .fetch_compressed = file_engine_fetch_compressed,
+    .mark_read = file_engine_mark_read,
+    .remove = file_engine_remove,
+    .message_bytes = file_engine_message_bytes,
+};
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              MEMORY ENGINE                                                    */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct MEMORY_MESSAGE {
+    message_id_t id;
+    char filename[MESSAGE_FILENAME_SIZE_CHARS];
+    MESSAGE *message; // Header + body, message_length in network byte order like in a message file
+} MEMORY_MESSAGE;
+
+typedef struct MEMORY_USER {
+    char username[USERNAME_SIZE_CHARS];
+    char password[PASSWORD_SIZE_CHARS];
+    pthread_mutex_t lock;     // Protects everything below
+    MEMORY_MESSAGE *messages; // Sorted by id
+    size_t messages_used;
+    size_t messages_capacity;
+} MEMORY_USER;
+
+// Users are never removed, so a MEMORY_USER found under the table lock stays valid once the lock is released
+static pthread_rwlock_t memory_users_lock = PTHREAD_RWLOCK_INITIALIZER;
+static MEMORY_USER **memory_users = NULL;
+static size_t memory_users_capacity = 0;
+static size_t memory_users_count = 0;
+
+static uint64_t fnv1a_64(const char *text)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @return the slot holding @p username, or the empty slot it would go to (linear probing, @p capacity is a power of 2)
+ */
+static size_t memory_find_slot(MEMORY_USER **table, size_t capacity, const char *username)
+{
+    size_t slot = (size_t)fnv1a_64(username) & (capacity - 1);
+    while (table[slot] != NULL && strcmp(table[slot]->username, username) != 0)
+    {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+static MEMORY_USER *memory_find_user(const char *username)
+{
+    pthread_rwlock_rdlock(&memory_users_lock);
+    MEMORY_USER *user = memory_users[memory_find_slot(memory_users, memory_users_capacity, username)];
+    pthread_rwlock_unlock(&memory_users_lock);
+    return user;
+}
+
+/**
+ * @return the index of the message named @p filename, or user->messages_used if there is none
+ * @note Caller holds the user lock
+ */
+static size_t memory_find_message(const MEMORY_USER *user, const char *filename)
+{
+    message_id_t id = message_id_from_filename(filename);
+    size_t low = 0;
+    size_t high = user->messages_used;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (user->messages[middle].id < id)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (id != 0 && low < user->messages_used && user->messages[low].id == id && strcmp(user->messages[low].filename, filename) == 0)
+    {
+        return low;
+    }
+    return user->messages_used;
+}
+
+static ERROR_CODE memory_engine_init(void)
+{
+    memory_users = calloc(MEMORY_ENGINE_INITIAL_USERS, sizeof(MEMORY_USER *));
+    if (unlikely(memory_users == NULL))
+    {
+        PSE("Failed to allocate the users of the memory engine");
+        return SYSCALL_ERROR;
+    }
+    memory_users_capacity = MEMORY_ENGINE_INITIAL_USERS;
+    P("Memory storage engine: nothing is written to disk, every user and message is lost when the server stops");
+    return NO_ERROR;
+}
+
+static void memory_engine_shutdown(void)
+{
+    pthread_rwlock_wrlock(&memory_users_lock);
+    for (size_t i = 0; i < memory_users_capacity; i++)
+    {
+        MEMORY_USER *user = memory_users[i];
+        if (user == NULL)
+        {
+            continue;
+        }
+        for (size_t j = 0; j < user->messages_used; j++)
+        {
+            free(user->messages[j].message);
+        }
+        free(user->messages);
+        pthread_mutex_destroy(&user->lock);
+        free(user);
+    }
+    free(memory_users);
+    memory_users = NULL;
+    memory_users_capacity = 0;
+    memory_users_count = 0;
+    pthread_rwlock_unlock(&memory_users_lock);
+}
+
+static void memory_engine_session_begin(const char *username)
+{
+    (void)username; // Everything is already in memory
+}
+
+static void memory_engine_session_end(const char *username)
+{
+    (void)username;
+}
+
+static ERROR_CODE memory_engine_for_each_user(ERROR_CODE (*callback)(const char *username, void *context), void *context)
+{
+    // Names are copied under the lock: the callback may register users or call the engine
+    pthread_rwlock_rdlock(&memory_users_lock);
+    size_t count = memory_users_count;
+    char (*usernames)[USERNAME_SIZE_CHARS] = count == 0 ? NULL : malloc(count * USERNAME_SIZE_CHARS);
+    for (size_t i = 0, j = 0; usernames != NULL && i < memory_users_capacity; i++)
+    {
+        if (memory_users[i] != NULL)
+        {
+            memcpy(usernames[j++], memory_users[i]->username, USERNAME_SIZE_CHARS);
+        }
+    }
+    pthread_rwlock_unlock(&memory_users_lock);
+    if (unlikely(count > 0 && usernames == NULL))
+    {
+        PSE("Failed to allocate the user list of the memory engine");
+        return SYSCALL_ERROR;
+    }
+    ERROR_CODE result = NO_ERROR;
+    for (size_t i = 0; result == NO_ERROR && i < count; i++)
+    {
+        result = callback(usernames[i], context);
+    }
+    free(usernames);
+    return result;
+}
+
+static int memory_engine_user_exists(const char *username)
+{
+    return memory_find_user(username) != NULL;
+}
+
+/**
+ * @brief Doubles the user table
+ * @note Caller holds the table lock exclusively
+ */
+static ERROR_CODE memory_grow_users(void)
+{
+    size_t next_capacity = memory_users_capacity * 2;
+    MEMORY_USER **next = calloc(next_capacity, sizeof(MEMORY_USER *));
+    if (unlikely(next == NULL))
+    {
+        PSE("Failed to grow the users of the memory engine");
+        return SYSCALL_ERROR;
+    }
+    for (size_t i = 0; i < memory_users_capacity; i++)
+    {
+        if (memory_users[i] != NULL)
+        {
+            next[memory_find_slot(next, next_capacity, memory_users[i]->username)] = memory_users[i];
+        }
+    }
+    free(memory_users);
+    memory_users = next;
+    memory_users_capacity = next_capacity;
+    return NO_ERROR;
+}
+
+static ERROR_CODE memory_engine_create_user(const char *username, const char *password)
+{
+    pthread_rwlock_wrlock(&memory_users_lock);
+    if ((memory_users_count + 1) * 2 > memory_users_capacity && unlikely(memory_grow_users() != NO_ERROR))
+    {
+        pthread_rwlock_unlock(&memory_users_lock);
+        return SYSCALL_ERROR;
+    }
+    size_t slot = memory_find_slot(memory_users, memory_users_capacity, username);
+    MEMORY_USER *user = memory_users[slot];
+    if (user == NULL)
+    {
+        user = calloc(1, sizeof(MEMORY_USER));
+        if (unlikely(user == NULL))
+        {
+            PSE("Failed to allocate the memory engine user [%s]", username);
+            pthread_rwlock_unlock(&memory_users_lock);
+            return SYSCALL_ERROR;
+        }
+        snprintf(user->username, sizeof(user->username), "%s", username);
+        pthread_mutex_init(&user->lock, NULL);
+        memory_users[slot] = user;
+        memory_users_count++;
+    }
+    pthread_mutex_lock(&user->lock);
+    snprintf(user->password, sizeof(user->password), "%s", password);
+    pthread_mutex_unlock(&user->lock);
+    pthread_rwlock_unlock(&memory_users_lock);
+    return NO_ERROR;
+}
+
+static ERROR_CODE memory_engine_read_password(const char *username, char *out, size_t out_size)
+{
+    MEMORY_USER *user = memory_find_user(username);
+    if (user == NULL)
+    {
+        return USER_NOT_FOUND;
+    }
+    pthread_mutex_lock(&user->lock);
+    snprintf(out, out_size, "%s", user->password);
+    pthread_mutex_unlock(&user->lock);
+    return NO_ERROR;
+}
+
+static ERROR_CODE memory_engine_write_password(const char *username, const char *password)
+{
+    MEMORY_USER *user = memory_find_user(username);
+    if (user == NULL)
+    {
+        return USER_NOT_FOUND;
+    }
+    pthread_mutex_lock(&user->lock);
+    snprintf(user->password, sizeof(user->password), "%s", password);
+    pthread_mutex_unlock(&user->lock);
+    return NO_ERROR;
+}
+
+static ERROR_CODE memory_engine_deliver(const MESSAGE *header, const char *body, uint32_t body_length, char *out_filename)
+{
+    MEMORY_USER *user = memory_find_user(header->recipient);
+    if (unlikely(user == NULL))
+    {
+        return USER_NOT_FOUND;
+    }
+    size_t header_size = offsetof(MESSAGE, message);
+    MEMORY_MESSAGE stored = {.message = malloc(header_size + body_length)};
+    if (unlikely(stored.message == NULL))
+    {
+        PSE("Failed to allocate a message of the memory engine for [%s]", header->recipient);
+        return SYSCALL_ERROR;
+    }
+    memcpy(stored.message, header, header_size);
+    memcpy(stored.message->message, body, body_length);
+    stored.id = message_id_next();
+    if (unlikely(message_id_format_filename(stored.id, 1, stored.filename, sizeof(stored.filename)) != NO_ERROR))
+    {
+        free(stored.message);
+        return SYSCALL_ERROR;
+    }
+
+    pthread_mutex_lock(&user->lock);
+    if (user->messages_used + 1 > user->messages_capacity)
+    {
+        size_t next_capacity = user->messages_capacity == 0 ? 16 : user->messages_capacity * 2;
+        MEMORY_MESSAGE *reallocated = realloc(user->messages, next_capacity * sizeof(MEMORY_MESSAGE));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Failed to grow the messages of the memory engine for [%s]", header->recipient);
+            pthread_mutex_unlock(&user->lock);
+            free(stored.message);
+            return SYSCALL_ERROR;
+        }
+        user->messages = reallocated;
+        user->messages_capacity = next_capacity;
+    }
+    // Ids are allocated before the lock, so concurrent deliveries may land slightly out of order: insert from the end
+    size_t position = user->messages_used;
+    while (position > 0 && user->messages[position - 1].id > stored.id)
+    {
+        position--;
+    }
+    memmove(&user->messages[position + 1], &user->messages[position], (user->messages_used - position) * sizeof(MEMORY_MESSAGE));
+    user->messages[position] = stored;
+    user->messages_used++;
+    pthread_mutex_unlock(&user->lock);
+
+    if (out_filename != NULL)
+    {
+        memcpy(out_filename, stored.filename, sizeof(stored.filename));
+    }
+    return NO_ERROR;
+}
+
+static ERROR_CODE memory_engine_list(const char *username, ERROR_CODE (*callback)(const char *filename, void *context), void *context)
+{
+    MEMORY_USER *user = memory_find_user(username);
+    if (user == NULL)
+    {
+        return NO_ERROR; // No mailbox, no messages
+    }
+    // Names are copied under the lock: the callback may fetch the messages
+    pthread_mutex_lock(&user->lock);
+    size_t count = user->messages_used;
+    char (*filenames)[MESSAGE_FILENAME_SIZE_CHARS] = count == 0 ? NULL : malloc(count * MESSAGE_FILENAME_SIZE_CHARS);
+    for (size_t i = 0; filenames != NULL && i < count; i++)
+    {
+        memcpy(filenames[i], user->messages[i].filename, MESSAGE_FILENAME_SIZE_CHARS);
+    }
+    pthread_mutex_unlock(&user->lock);
+    if (unlikely(count > 0 && filenames == NULL))
+    {
+        PSE("Failed to allocate the message list of [%s]", username);
+        return SYSCALL_ERROR;
+    }
+    ERROR_CODE result = NO_ERROR;
+    for (size_t i = 0; result == NO_ERROR && i < count; i++)
+    {
+        result = callback(filenames[i], context);
+    }
+    free(filenames);
+    return result;
+}
+
+static ERROR_CODE memory_engine_fetch(const char *username, const char *filename, MESSAGE *message, int with_body)
+{
+    MEMORY_USER *user = memory_find_user(username);
+    if (user == NULL)
+    {
+        return ERROR;
+    }
+    pthread_mutex_lock(&user->lock);
+    size_t index = memory_find_message(user, filename);
+    if (index == user->messages_used)
+    {
+        pthread_mutex_unlock(&user->lock);
+        return ERROR;
+    }
+    const MESSAGE *stored = user->messages[index].message;
+    memcpy(message, stored, offsetof(MESSAGE, message));
+    if (with_body)
+    {
+        memcpy(message->message, stored->message, ntohl(stored->message_length));
+    }
+    pthread_mutex_unlock(&user->lock);
+    return NO_ERROR;
+}
+
+static ERROR_CODE memory_engine_fetch_compressed(const char *username, const char *filename, MESSAGE *message, char *compressed, uint32_t *out_compressed_length)
+{
+    (void)compressed;
+    *out_compressed_length = 0; // Kept as they arrived, the session compresses them if it wants to
+    return memory_engine_fetch(username, filename, message, 1);
+}
+
+static ERROR_CODE memory_engine_mark_read(const char *username, const char *filename)
+{
+    size_t prefix_length = strlen(UNREAD_PREFIX);
+    MEMORY_USER *user = memory_find_user(username);
+    if (user == NULL || strncmp(filename, UNREAD_PREFIX, prefix_length) != 0 || filename[prefix_length] == '\0')
+    {
+        return ERROR;
+    }
+    pthread_mutex_lock(&user->lock);
+    size_t index = memory_find_message(user, filename);
+    if (index == user->messages_used)
+    {
+        pthread_mutex_unlock(&user->lock);
+        return ERROR;
+    }
+    char *stored_filename = user->messages[index].filename;
+    memmove(stored_filename, stored_filename + prefix_length, strlen(stored_filename) - prefix_length + 1);
+    pthread_mutex_unlock(&user->lock);
+    return NO_ERROR;
+}
+
+static ERROR_CODE memory_engine_remove(const char *username, const char *filename)
+{
+    MEMORY_USER *user = memory_find_user(username);
+    if (user == NULL)
+    {
+        return ERROR;
+    }
+    pthread_mutex_lock(&user->lock);
+    size_t index = memory_find_message(user, filename);
+    if (index == user->messages_used)
+    {
+        pthread_mutex_unlock(&user->lock);
+        return ERROR;
+    }
+    free(user->messages[index].message);
+    memmove(&user->messages[index], &user->messages[index + 1], (user->messages_used - index - 1) * sizeof(MEMORY_MESSAGE));
+    user->messages_used--;
+    pthread_mutex_unlock(&user->lock);
+    return NO_ERROR;
+}
+
+static ERROR_CODE memory_engine_message_bytes(const char *username, const char *filename, uint64_t *out_bytes)
+{
+    MEMORY_USER *user = memory_find_user(username);
+    if (user == NULL)
+    {
+        return ERROR;
+    }
+    pthread_mutex_lock(&user->lock);
+    size_t index = memory_find_message(user, filename);
+    int found = index < user->messages_used;
+    if (found)
+    {
+        *out_bytes = (uint64_t)offsetof(MESSAGE, message) + ntohl(user->messages[index].message->message_length);
+    }
+    pthread_mutex_unlock(&user->lock);
+    return found ? NO_ERROR : ERROR;
+}
+
+static const STORAGE_ENGINE memory_engine = {
+    .name = "memory",
+    .persistent = 0,
+    .init = memory_engine_init,
+    .shutdown = memory_engine_shutdown,
+    .session_begin = memory_engine_session_begin,
+    .session_end = memory_engine_session_end,
+    .for_each_user = memory_engine_for_each_user,
+    .user_exists = memory_engine_user_exists,
+    .create_user = memory_engine_create_user,
+    .read_password = memory_engine_read_password,
+    .write_password = memory_engine_write_password,
+    .deliver = memory_engine_deliver,
+    .list = memory_engine_list,
+    .fetch = memory_engine_fetch,
+    .fetch_compressed = memory_engine_fetch_compressed,
+    .mark_read = memory_engine_mark_read,
+    .remove = memory_engine_remove,
+    .message_bytes = memory_engine_message_bytes,
+};
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              PUBLIC API                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+const STORAGE_ENGINE *storage_engine = &file_engine;
+
+ERROR_CODE storage_engine_init(void)
+{
+    static const STORAGE_ENGINE *const engines[] = {&file_engine, &memory_engine};
+    const char *name = getenv(storage_engine_env);
+    if (name != NULL)
+    {
+        size_t i = 0;
+        while (i < sizeof(engines) / sizeof(engines[0]) && strcmp(name, engines[i]->name) != 0)
+        {
+            i++;
+        }
+        if (i < sizeof(engines) / sizeof(engines[0]))
+            storage_engine = engines[i];
+        else
+            P("Invalid value [%s] for %s, using fallback: %s", name, storage_engine_env, storage_engine->name);
+    }
+    ERROR_CODE result = storage_engine->init();
+    if (likely(result == NO_ERROR))
+    {
+        P("Storage engine: %s", storage_engine->name);
+    }
+    return result;
+}
+
+void storage_engine_shutdown(void)
+{
+    storage_engine->shutdown();
+}
@@ -0,0 +1,111 @@
+/**
+ * @file 14-Server-Storage-Engine.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the storage engines: the operations the request handlers need from the storage, behind a table of functions
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stdint.h>     // uint32_t, uint64_t
+
+/**
+ * PGM_STORAGE_ENGINE picks the engine once at startup:
+ *  - "file" (default): one file per message in the user folders, see 4-Server-Storage.h (layout, delivery log, durability,
+ *    shared bodies). Everything the offline tools, the snapshots and the search index logs rely on.
+ *  - "memory": users and messages live in the server process only and are gone when it stops. Meant for benchmarks of the
+ *    protocol and of the caches without any disk in the way: ids, names, quotas, retention and the search index behave the same,
+ *    --export/--import/--fsck/--migrate-layout and SIGUSR1 snapshots only work with the file engine.
+ *
+ * Messages are named by their filename ([UNREAD]<id>.pgm, see 4-Server-Storage.h) with every engine: it is what the client
+ * lists, loads and deletes. The handlers validate usernames and filenames before calling an engine.
+ */
+
+typedef struct STORAGE_ENGINE {
+    const char *name;
+    int persistent; // Data outlives the process: the search index keeps its logs and snapshots can be taken
+
+    ERROR_CODE (*init)(void);
+    void (*shutdown)(void);
+
+    /**
+     * @brief A session of @p username logged in / ended, so the engine can keep what the user needs at hand in between
+     */
+    void (*session_begin)(const char *username);
+    void (*session_end)(const char *username);
+
+    /**
+     * @brief Calls @p callback for every registered user, stops at the first error it returns
+     */
+    ERROR_CODE (*for_each_user)(ERROR_CODE (*callback)(const char *username, void *context), void *context);
+    int (*user_exists)(const char *username);
+    /**
+     * @brief Creates the user @p username with @p password, its verifier (an existing user only gets the new password)
+     */
+    ERROR_CODE (*create_user)(const char *username, const char *password);
+    /**
+     * @return NO_ERROR with the null terminated password (a verifier, see 20-Server-Auth.h) in @p out, USER_NOT_FOUND, SYSCALL_ERROR on I/O errors
+     */
+    ERROR_CODE (*read_password)(const char *username, char *out, size_t out_size);
+    /**
+     * @brief Replaces the password of the existing user @p username, atomically: a crash leaves the old or the new one
+     * @return NO_ERROR, USER_NOT_FOUND, SYSCALL_ERROR on I/O errors
+     */
+    ERROR_CODE (*write_password)(const char *username, const char *password);
+
+    /**
+     * @brief Stores an unread message for header->recipient, see storage_deliver_message()
+     * @param out_filename optional, receives the name of the message (at least MESSAGE_FILENAME_SIZE_CHARS bytes)
+     */
+    ERROR_CODE (*deliver)(const MESSAGE *header, const char *body, uint32_t body_length, char *out_filename);
+    /**
+     * @brief Calls @p callback with the filename of every message of @p username, in no particular order
+     * @note The callback may call the other operations of the engine
+     */
+    ERROR_CODE (*list)(const char *username, ERROR_CODE (*callback)(const char *filename, void *context), void *context);
+    /**
+     * @brief Reads the header (and the body in message->message if @p with_body) of a message into @p message
+     * @param message room for offsetof(MESSAGE, message) bytes, plus MESSAGE_SIZE_CHARS with @p with_body
+     * @return NO_ERROR, ERROR if there is no such message, STRING_SIZE_INVALID if it is corrupt, SYSCALL_ERROR on I/O errors
+     */
+    ERROR_CODE (*fetch)(const char *username, const char *filename, MESSAGE *message, int with_body);
+    /**
+     * @brief fetch() with the body, plus the block the body is stored compressed as (18-Compression.h), sent as it is to a
+     * compressed session
+     * @param compressed room for MESSAGE_SIZE_CHARS bytes
+     * @param out_compressed_length set to the size of the block, 0 if the body is not stored compressed
+     */
+    ERROR_CODE (*fetch_compressed)(const char *username, const char *filename, MESSAGE *message, char *compressed, uint32_t *out_compressed_length);
+    /**
+     * @brief Renames the unread message @p filename to its name without UNREAD_PREFIX
+     * @return NO_ERROR, ERROR if there is no such message, SYSCALL_ERROR on I/O errors
+     */
+    ERROR_CODE (*mark_read)(const char *username, const char *filename);
+    /**
+     * @brief Deletes a message (and drops the reference to its shared body, if it has one)
+     * @return NO_ERROR, ERROR if there is no such message (another session deleted it first), SYSCALL_ERROR on I/O errors
+     */
+    ERROR_CODE (*remove)(const char *username, const char *filename);
+    /**
+     * @brief Bytes the message accounts for in the quota (header + body, also when the body is shared)
+     * @return NO_ERROR, ERROR if there is no such message
+     */
+    ERROR_CODE (*message_bytes)(const char *username, const char *filename, uint64_t *out_bytes);
+} STORAGE_ENGINE;
+
+enum storage_engine_constants {
+    MEMORY_ENGINE_INITIAL_USERS = 64, // Power of 2, the table doubles past 50% load
+};
+
+extern const STORAGE_ENGINE *storage_engine; // The file engine until storage_engine_init() picks another one
+
+/**
+ * @brief Picks the engine from PGM_STORAGE_ENGINE and initializes it, after the recovery of the delivery log and before the user registry
+ */
+extern ERROR_CODE storage_engine_init(void);
+
+extern void storage_engine_shutdown(void);
@@ -0,0 +1,293 @@
+/**
+ * @file 15-Server-Checksum.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the CRC32C of the stored messages: hardware (SSE4.2) and software kernels, verification counters
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "15-Server-Checksum.h"
+#include <stdlib.h>     // getenv
+#include <string.h>     // memcpy, strcasecmp
+#include <stddef.h>     // offsetof
+#include <stdint.h>     // uint32_t, uint64_t
+#include <stdatomic.h>  // atomic_uint_fast64_t
+#include <time.h>       // clock_gettime
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86 1
+#include <immintrin.h>  // _mm_crc32_*. Compiled per function with target(), the rest of the server keeps the baseline ISA
+#else
+#define CHECKSUM_X86 0
+#endif
+
+#define CRC32C_POLYNOMIAL_REFLECTED 0x82F63B78u
+#define CRC32C_CHECK_VALUE 0xE3069283u // CRC32C of "123456789", the check value of the catalogue
+
+// CONFIGURATION, written once by checksum_init()
+static CHECKSUM_KERNEL checksum_selected_kernel = CHECKSUM_KERNEL_SCALAR;
+static int checksum_cpu_has_sse42 = 0;
+static uint32_t crc32c_table[8][256]; // Slicing-by-8: table k advances a byte that is followed by k more bytes
+
+// COUNTERS, shared by every session
+static atomic_uint_fast64_t checksum_verified;
+static atomic_uint_fast64_t checksum_mismatches;
+static atomic_uint_fast64_t checksum_unchecked;
+static atomic_uint_fast64_t checksum_verify_nanoseconds;
+static atomic_uint_fast64_t checksum_max_verify_nanoseconds;
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              SCALAR KERNEL                                                    */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static void crc32c_build_tables(void)
+{
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL_REFLECTED : crc >> 1;
+        }
+        crc32c_table[0][byte] = crc;
+    }
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            uint32_t previous = crc32c_table[k - 1][byte];
+            crc32c_table[k][byte] = (previous >> 8) ^ crc32c_table[0][previous & 0xFF];
+        }
+    }
+}
+
+/**
+ * @brief Works on the inverted crc, like the hardware instruction
+ */
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, data, sizeof(low)); // Unaligned loads
+        memcpy(&high, data + 4, sizeof(high));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        low = __builtin_bswap32(low);
+        high = __builtin_bswap32(high);
+#endif
+        low ^= crc;
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^ crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF] ^ crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              HARDWARE KERNEL                                                  */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+#if CHECKSUM_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, data, sizeof(chunk));
+        crc64 = _mm_crc32_u64(crc64, chunk);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (length >= 4)
+    {
+        uint32_t chunk;
+        memcpy(&chunk, data, sizeof(chunk));
+        crc = _mm_crc32_u32(crc, chunk);
+        data += 4;
+        length -= 4;
+    }
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+#endif
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                                 DISPATCH                                                      */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static uint32_t crc32c_update_with(CHECKSUM_KERNEL kernel, uint32_t crc, const void *data, size_t length)
+{
+    crc = ~crc;
+#if CHECKSUM_X86
+    if (kernel == CHECKSUM_KERNEL_SSE42 && checksum_cpu_has_sse42)
+    {
+        return ~crc32c_sse42(crc, data, length);
+    }
+#else
+    (void)kernel;
+#endif
+    return ~crc32c_scalar(crc, data, length);
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length)
+{
+    return crc32c_update_with(checksum_selected_kernel, crc, data, length);
+}
+
+/**
+ * @brief Check value, plus an odd length split in two so the 8 byte steps, the tails and the chaining all get exercised
+ */
+static int checksum_self_test(CHECKSUM_KERNEL kernel)
+{
+    static const char check[] = "123456789";
+    if (crc32c_update_with(kernel, 0, check, sizeof(check) - 1) != CRC32C_CHECK_VALUE)
+    {
+        return 0;
+    }
+    unsigned char bytes[61];
+    for (size_t i = 0; i < sizeof(bytes); i++)
+    {
+        bytes[i] = (unsigned char)(i * 37 + 11);
+    }
+    uint32_t whole = crc32c_update_with(CHECKSUM_KERNEL_SCALAR, 0, bytes, sizeof(bytes));
+    uint32_t split = crc32c_update_with(kernel, crc32c_update_with(kernel, 0, bytes, 13), bytes + 13, sizeof(bytes) - 13);
+    return whole == split;
+}
+
+ERROR_CODE checksum_init(void)
+{
+    crc32c_build_tables();
+#if CHECKSUM_X86
+    __builtin_cpu_init();
+    checksum_cpu_has_sse42 = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+    const char *mode = getenv("PGM_CHECKSUM_KERNEL");
+    CHECKSUM_KERNEL wanted = checksum_cpu_has_sse42 ? CHECKSUM_KERNEL_SSE42 : CHECKSUM_KERNEL_SCALAR;
+    if (mode != NULL && strcasecmp(mode, "scalar") == 0)
+    {
+        wanted = CHECKSUM_KERNEL_SCALAR;
+    }
+    else if (mode != NULL && strcasecmp(mode, "sse4.2") != 0 && strcasecmp(mode, "auto") != 0)
+    {
+        P("Unknown PGM_CHECKSUM_KERNEL [%s], using auto", mode);
+    }
+    if (wanted == CHECKSUM_KERNEL_SSE42 && !checksum_cpu_has_sse42)
+    {
+        wanted = CHECKSUM_KERNEL_SCALAR;
+    }
+    if (!checksum_self_test(CHECKSUM_KERNEL_SCALAR))
+    {
+        // Nothing to fall back to: every checksum written or verified would be wrong
+        P("Checksum self test of the scalar kernel failed");
+        return ERROR;
+    }
+    checksum_selected_kernel = wanted;
+    if (wanted != CHECKSUM_KERNEL_SCALAR && !checksum_self_test(wanted))
+    {
+        P("Checksum self test of the %s kernel failed, using scalar", convert_checksum_kernel_to_string(wanted));
+        checksum_selected_kernel = CHECKSUM_KERNEL_SCALAR;
+    }
+    P("Checksum kernel: %s", convert_checksum_kernel_to_string(checksum_selected_kernel));
+    return NO_ERROR;
+}
+
+CHECKSUM_KERNEL checksum_kernel(void)
+{
+    return checksum_selected_kernel;
+}
+
+const char *convert_checksum_kernel_to_string(CHECKSUM_KERNEL kernel)
+{
+    switch (kernel)
+    {
+    case CHECKSUM_KERNEL_SSE42:
+        return "sse4.2";
+    case CHECKSUM_KERNEL_SCALAR:
+        return "scalar";
+    default:
+        return "unknown";
+    }
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                                 MESSAGES                                                      */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+uint32_t checksum_message(const MESSAGE *header, const char *body, uint32_t body_length)
+{
+    uint32_t crc = crc32c_update(0, header, offsetof(MESSAGE, message));
+    return crc32c_update(crc, body, body_length);
+}
+
+static uint64_t checksum_now_nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+int checksum_verify_message(const MESSAGE *header, const char *body, uint32_t body_length, uint32_t stored)
+{
+    uint64_t start = checksum_now_nanoseconds();
+    int matched = checksum_message(header, body, body_length) == stored;
+    uint64_t elapsed = checksum_now_nanoseconds() - start;
+
+    atomic_fetch_add(&checksum_verified, 1);
+    atomic_fetch_add(&checksum_verify_nanoseconds, elapsed);
+    uint_fast64_t max = atomic_load(&checksum_max_verify_nanoseconds);
+    while (elapsed > max && !atomic_compare_exchange_weak(&checksum_max_verify_nanoseconds, &max, elapsed))
+    {
+    }
+    if (unlikely(!matched))
+    {
+        atomic_fetch_add(&checksum_mismatches, 1);
+    }
+    return matched;
+}
+
+void checksum_count_unchecked(void)
+{
+    atomic_fetch_add(&checksum_unchecked, 1);
+}
+
+void checksum_statistics(CHECKSUM_STATISTICS *out)
+{
+    out->verified = atomic_load(&checksum_verified);
+    out->mismatches = atomic_load(&checksum_mismatches);
+    out->unchecked = atomic_load(&checksum_unchecked);
+    out->verify_nanoseconds = atomic_load(&checksum_verify_nanoseconds);
+    out->max_verify_nanoseconds = atomic_load(&checksum_max_verify_nanoseconds);
+}
+
+void checksum_log_statistics(void)
+{
+    CHECKSUM_STATISTICS statistics;
+    checksum_statistics(&statistics);
+    if (statistics.verified == 0 && statistics.unchecked == 0)
+    {
+        return;
+    }
+    double average = statistics.verified ? (double)statistics.verify_nanoseconds / (double)statistics.verified : 0.0;
+    P("Checksums (%s): %llu messages verified, %.0f ns per fetch on average, %llu ns at most, %llu mismatches, %llu without checksum",
+      convert_checksum_kernel_to_string(checksum_selected_kernel), (unsigned long long)statistics.verified, average,
+      (unsigned long long)statistics.max_verify_nanoseconds, (unsigned long long)statistics.mismatches, (unsigned long long)statistics.unchecked);
+}
@@ -0,0 +1,81 @@
+/**
+ * @file 15-Server-Checksum.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the CRC32C of the stored messages: hardware (SSE4.2) and software kernels, verification counters
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+/**
+ * Every message file written by the server ends with a CRC32C (Castagnoli) of its header and body, see MESSAGE_CHECKSUM in
+ * 4-Server-Storage.h. It is checked on every fetch, by --fsck and by --export.
+ *
+ * Kernels, picked once by checksum_init() from what the CPU supports:
+ *  - sse4.2  the crc32 instruction, 8 bytes per step
+ *  - scalar  slicing-by-8 tables, any CPU
+ * PGM_CHECKSUM_KERNEL ("auto" default, "sse4.2", "scalar") forces one, a kernel the CPU lacks falls back to auto.
+ *
+ * Verifications are counted (messages, time spent, mismatches, files written before checksums existed) and logged by
+ * checksum_log_statistics() when the server stops.
+ */
+
+typedef enum CHECKSUM_KERNEL
+{
+    CHECKSUM_KERNEL_SCALAR = 0,
+    CHECKSUM_KERNEL_SSE42 = 1,
+} CHECKSUM_KERNEL;
+
+typedef struct CHECKSUM_STATISTICS {
+    uint64_t verified;            // Messages whose checksum was computed and compared
+    uint64_t mismatches;          // Of those, the ones that did not match (corrupt, never served)
+    uint64_t unchecked;           // Messages without checksum (written by older versions), served as they are
+    uint64_t verify_nanoseconds;  // Time spent recomputing the checksums of the verified messages
+    uint64_t max_verify_nanoseconds;
+} CHECKSUM_STATISTICS;
+
+/**
+ * @brief Reads PGM_CHECKSUM_KERNEL, picks the kernel and builds the software tables
+ * @note Must be called once before any other function of this file, before the offline tools too
+ * @return NO_ERROR (a hardware kernel failing its self test falls back to scalar), ERROR if the scalar kernel fails it
+ */
+extern ERROR_CODE checksum_init(void);
+
+extern CHECKSUM_KERNEL checksum_kernel(void);
+extern const char *convert_checksum_kernel_to_string(CHECKSUM_KERNEL kernel);
+
+/**
+ * @brief CRC32C of @p length bytes of @p data continued from @p crc (0 to start), so a message can be checksummed in pieces
+ */
+extern uint32_t crc32c_update(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief CRC32C of a message as stored: the offsetof(MESSAGE, message) header bytes followed by the body
+ * @note A compact header is checked through the header it decodes to, see header_canonicalize()
+ */
+extern uint32_t checksum_message(const MESSAGE *header, const char *body, uint32_t body_length);
+
+/**
+ * @brief Recomputes the checksum of a message read back and compares it with the stored one, timing it into the counters
+ * @return 1 if it matches, 0 if the message is corrupt
+ */
+extern int checksum_verify_message(const MESSAGE *header, const char *body, uint32_t body_length, uint32_t stored);
+
+/**
+ * @brief Counts one message served without checksum
+ */
+extern void checksum_count_unchecked(void);
+
+extern void checksum_statistics(CHECKSUM_STATISTICS *out);
+
+/**
+ * @brief Logs the counters, nothing if no message was fetched
+ */
+extern void checksum_log_statistics(void);
@@ -0,0 +1,267 @@
+/**
+ * @file 16-Server-Directory-Cache.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the cache of open user folder fds, what the file engine resolves every message operation against
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "16-Server-Directory-Cache.h"
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, free
+#include <string.h>     // strcmp
+#include <stdint.h>     // uint64_t
+#include <unistd.h>     // close
+#include <fcntl.h>      // open, O_DIRECTORY, O_CLOEXEC
+#include <pthread.h>    // pthread_mutex_t
+#include <errno.h>      // errno, EINVAL, ENAMETOOLONG, ENOMEM
+
+static const char *directory_cache_size_env = "PGM_DIRFD_CACHE_SIZE";
+
+// Written once by directory_cache_init(), then under the lock
+static pthread_mutex_t directory_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static USER_DIRECTORY **directory_cache_table = NULL; // Chained by hash_next
+static size_t directory_cache_table_capacity = 0;     // Power of two
+static size_t directory_cache_max_unpinned = DIRECTORY_CACHE_DEFAULT_SIZE;
+static size_t directory_cache_unpinned = 0;
+static USER_DIRECTORY *directory_cache_lru_head = NULL; // Most recently released
+static USER_DIRECTORY *directory_cache_lru_tail = NULL; // Next to be closed
+static uint64_t directory_cache_hits = 0;
+static uint64_t directory_cache_misses = 0;
+static uint64_t directory_cache_evictions = 0;
+
+static uint64_t fnv1a_64(const char *text)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @note Caller holds the lock
+ */
+static USER_DIRECTORY **directory_cache_slot(const char *username)
+{
+    USER_DIRECTORY **slot = &directory_cache_table[fnv1a_64(username) & (directory_cache_table_capacity - 1)];
+    while (*slot != NULL && strcmp((*slot)->username, username) != 0)
+    {
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+/**
+ * @note Caller holds the lock
+ */
+static void directory_cache_lru_remove(USER_DIRECTORY *directory)
+{
+    if (directory->lru_previous != NULL)
+    {
+        directory->lru_previous->lru_next = directory->lru_next;
+    }
+    else
+    {
+        directory_cache_lru_head = directory->lru_next;
+    }
+    if (directory->lru_next != NULL)
+    {
+        directory->lru_next->lru_previous = directory->lru_previous;
+    }
+    else
+    {
+        directory_cache_lru_tail = directory->lru_previous;
+    }
+    directory->lru_previous = NULL;
+    directory->lru_next = NULL;
+    directory_cache_unpinned--;
+}
+
+/**
+ * @note Caller holds the lock
+ */
+static void directory_cache_lru_push(USER_DIRECTORY *directory)
+{
+    directory->lru_previous = NULL;
+    directory->lru_next = directory_cache_lru_head;
+    if (directory_cache_lru_head != NULL)
+    {
+        directory_cache_lru_head->lru_previous = directory;
+    }
+    directory_cache_lru_head = directory;
+    if (directory_cache_lru_tail == NULL)
+    {
+        directory_cache_lru_tail = directory;
+    }
+    directory_cache_unpinned++;
+}
+
+/**
+ * @brief Closes the least recently released folders until the unpinned ones fit the limit
+ * @note Caller holds the lock
+ */
+static void directory_cache_trim(void)
+{
+    while (directory_cache_unpinned > directory_cache_max_unpinned && directory_cache_lru_tail != NULL)
+    {
+        USER_DIRECTORY *victim = directory_cache_lru_tail;
+        directory_cache_lru_remove(victim);
+        USER_DIRECTORY **slot = directory_cache_slot(victim->username);
+        *slot = victim->hash_next;
+        close(victim->fd);
+        free(victim);
+        directory_cache_evictions++;
+    }
+}
+
+ERROR_CODE directory_cache_init(void)
+{
+    directory_cache_max_unpinned = (size_t)read_environment_long(directory_cache_size_env, DIRECTORY_CACHE_DEFAULT_SIZE, 1, DIRECTORY_CACHE_MAX_SIZE);
+    size_t capacity = 64;
+    while (capacity < directory_cache_max_unpinned * 2)
+    {
+        capacity *= 2;
+    }
+    directory_cache_table = calloc(capacity, sizeof(USER_DIRECTORY *));
+    if (unlikely(directory_cache_table == NULL))
+    {
+        PSE("Failed to allocate the directory cache");
+        return SYSCALL_ERROR;
+    }
+    directory_cache_table_capacity = capacity;
+    P("Directory cache: up to %zu idle user folders kept open", directory_cache_max_unpinned);
+    return NO_ERROR;
+}
+
+void directory_cache_shutdown(void)
+{
+    pthread_mutex_lock(&directory_cache_lock);
+    for (size_t i = 0; i < directory_cache_table_capacity; i++)
+    {
+        for (USER_DIRECTORY *directory = directory_cache_table[i], *next = NULL; directory != NULL; directory = next)
+        {
+            next = directory->hash_next;
+            close(directory->fd);
+            free(directory);
+        }
+    }
+    free(directory_cache_table);
+    directory_cache_table = NULL;
+    directory_cache_table_capacity = 0;
+    if (directory_cache_hits + directory_cache_misses > 0)
+    {
+        P("Directory cache: %llu hits, %llu misses, %llu folders closed to stay under the limit", (unsigned long long)directory_cache_hits,
+          (unsigned long long)directory_cache_misses, (unsigned long long)directory_cache_evictions);
+    }
+    pthread_mutex_unlock(&directory_cache_lock);
+}
+
+USER_DIRECTORY *user_directory_acquire(const char *username)
+{
+    if (unlikely(username == NULL || directory_cache_table == NULL))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_mutex_lock(&directory_cache_lock);
+    USER_DIRECTORY *directory = *directory_cache_slot(username);
+    if (likely(directory != NULL))
+    {
+        if (directory->pins++ == 0)
+        {
+            directory_cache_lru_remove(directory);
+        }
+        directory_cache_hits++;
+        pthread_mutex_unlock(&directory_cache_lock);
+        return directory;
+    }
+    directory_cache_misses++;
+    pthread_mutex_unlock(&directory_cache_lock);
+
+    // Miss: the path is built and resolved once, outside the lock
+    USER_DIRECTORY *opened = calloc(1, sizeof(USER_DIRECTORY));
+    char *path = storage_user_directory_path(username);
+    if (unlikely(opened == NULL || path == NULL))
+    {
+        free(opened);
+        free(path);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (unlikely((size_t)snprintf(opened->path, sizeof(opened->path), "%s", path) >= sizeof(opened->path) ||
+                 (size_t)snprintf(opened->username, sizeof(opened->username), "%s", username) >= sizeof(opened->username)))
+    {
+        free(opened);
+        free(path);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    free(path);
+    opened->fd = open(opened->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (opened->fd < 0)
+    {
+        int open_errno = errno;
+        free(opened);
+        errno = open_errno;
+        return NULL;
+    }
+    opened->pins = 1;
+
+    pthread_mutex_lock(&directory_cache_lock);
+    USER_DIRECTORY **slot = directory_cache_slot(username);
+    if (*slot != NULL) // Another thread opened it meanwhile, keep the one already shared
+    {
+        directory = *slot;
+        if (directory->pins++ == 0)
+        {
+            directory_cache_lru_remove(directory);
+        }
+        pthread_mutex_unlock(&directory_cache_lock);
+        close(opened->fd);
+        free(opened);
+        return directory;
+    }
+    *slot = opened;
+    pthread_mutex_unlock(&directory_cache_lock);
+    return opened;
+}
+
+void user_directory_release(USER_DIRECTORY *directory)
+{
+    if (unlikely(directory == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&directory_cache_lock);
+    if (--directory->pins == 0)
+    {
+        directory_cache_lru_push(directory);
+        directory_cache_trim();
+    }
+    pthread_mutex_unlock(&directory_cache_lock);
+}
+
+void user_directory_unpin(const char *username)
+{
+    if (unlikely(username == NULL || directory_cache_table == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&directory_cache_lock);
+    USER_DIRECTORY *directory = *directory_cache_slot(username);
+    if (likely(directory != NULL && directory->pins > 0) && --directory->pins == 0)
+    {
+        directory_cache_lru_push(directory);
+        directory_cache_trim();
+    }
+    pthread_mutex_unlock(&directory_cache_lock);
+}
@@ -0,0 +1,66 @@
+/**
+ * @file 16-Server-Directory-Cache.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the cache of open user folder fds, what the file engine resolves every message operation against
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include "4-Server-Storage.h"
+
+/**
+ * Every request used to build "<user folder>/<bucket>/<filename>" on the heap and let the kernel walk the whole path again on
+ * each open(), stat(), rename() and unlink(). Now the user folder is opened once and the file operations are openat(),
+ * fstatat(), renameat() and unlinkat() relative to it, with the relative path built on the stack:
+ *  - a logged in session pins the folder of its user for its whole duration (storage_engine->session_begin/session_end)
+ *  - deliveries, expiry and the indexes acquire the folder they need and release it when done
+ * Folders nobody pins stay open in a least recently used list, closed when more than PGM_DIRFD_CACHE_SIZE folders are open.
+ * Pinned folders are never closed, so sessions can push the count past the limit for as long as they are logged in.
+ *
+ * The cached fds stay valid as long as the folders are not moved, which only --migrate-layout does (with the server stopped).
+ */
+
+typedef struct USER_DIRECTORY {
+    int fd;                                            // O_RDONLY | O_DIRECTORY
+    char path[STORAGE_USER_DIRECTORY_PATH_SIZE_CHARS]; // From the working directory, for the logs and the snapshot hooks
+    char username[USERNAME_SIZE_CHARS];
+
+    // Under the cache lock
+    unsigned int pins;
+    struct USER_DIRECTORY *hash_next;
+    struct USER_DIRECTORY *lru_previous; // Unpinned folders only, most recently released first
+    struct USER_DIRECTORY *lru_next;
+} USER_DIRECTORY;
+
+enum directory_cache_constants {
+    DIRECTORY_CACHE_DEFAULT_SIZE = 256, // Unpinned folders kept open (PGM_DIRFD_CACHE_SIZE), well below the usual 1024 fds per process
+    DIRECTORY_CACHE_MAX_SIZE = 65536,
+};
+
+/**
+ * @brief Reads PGM_DIRFD_CACHE_SIZE, must be called once before any worker thread starts
+ */
+extern ERROR_CODE directory_cache_init(void);
+
+/**
+ * @brief Closes every folder and logs hits/misses, only to be called once every worker thread has been joined
+ */
+extern void directory_cache_shutdown(void);
+
+/**
+ * @brief Pins the open folder of @p username, opening it on a miss
+ * @return the folder, to be given back with user_directory_release(). NULL with errno set if it cannot be opened (ENOENT: no such user)
+ */
+extern USER_DIRECTORY *user_directory_acquire(const char *username);
+
+extern void user_directory_release(USER_DIRECTORY *directory);
+
+/**
+ * @brief Drops a pin taken by user_directory_acquire() whose handle was not kept (the pin of a session)
+ */
+extern void user_directory_unpin(const char *username);
@@ -0,0 +1,425 @@
+/**
+ * @file 17-Server-Disk-IO.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the disk I/O executor: a fixed pool of threads that runs the storage work of the sessions
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "14-Server-Storage-Engine.h"
+#include "17-Server-Disk-IO.h"
+#include <stdlib.h>     // calloc, free
+#include <signal.h>     // sigfillset, pthread_sigmask
+#include <stdint.h>     // uint64_t
+#include <pthread.h>    // pthread_create, pthread_join, pthread_mutex_t, pthread_cond_t
+#include <time.h>       // clock_gettime
+
+typedef struct DISK_IO_WAITER {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int done;
+} DISK_IO_WAITER;
+
+/**
+ * Deliveries hold their disk thread until they are durable (a group commit window, then syncfs()), so they get their own queue
+ * and threads: fetches, listings, deletes and read marks never wait behind a syncing batch
+ */
+typedef enum DISK_IO_LANE {
+    DISK_IO_LANE_GENERAL,
+    DISK_IO_LANE_DELIVERY,
+    DISK_IO_LANES,
+} DISK_IO_LANE;
+
+typedef struct DISK_IO_QUEUE {
+    const char *name;
+    size_t thread_count; // Written once by disk_io_init(), 0: the jobs run in the thread that submits them
+    pthread_t *threads;
+
+    // QUEUE, under disk_io_lock
+    pthread_cond_t queued;
+    DISK_IO_JOB *head;
+    DISK_IO_JOB *tail;
+    size_t length;
+
+    // COUNTERS, under disk_io_lock
+    uint64_t jobs;
+    uint64_t wait_nanoseconds;
+    uint64_t max_wait_nanoseconds;
+    uint64_t work_nanoseconds;
+    size_t max_length;
+} DISK_IO_QUEUE;
+
+static pthread_mutex_t disk_io_lock = PTHREAD_MUTEX_INITIALIZER;
+static int disk_io_stop = 0;
+static DISK_IO_QUEUE disk_io_queues[DISK_IO_LANES] = {
+    [DISK_IO_LANE_GENERAL] = {.name = "general", .queued = PTHREAD_COND_INITIALIZER},
+    [DISK_IO_LANE_DELIVERY] = {.name = "delivery", .queued = PTHREAD_COND_INITIALIZER},
+};
+
+static uint64_t disk_io_now_nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              EXECUTION                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief Runs @p job and hands its result over: to its completion(), to the waiting session, to the session counter
+ * @param queue counts the job
+ * @param started when the job left the queue, the wait before it is counted
+ */
+static void disk_io_execute(DISK_IO_QUEUE *queue, DISK_IO_JOB *job, uint64_t started)
+{
+    job->work(job);
+    uint64_t finished = disk_io_now_nanoseconds();
+
+    pthread_mutex_lock(&disk_io_lock);
+    uint64_t waited = started - job->submitted_nanoseconds;
+    queue->jobs++;
+    queue->wait_nanoseconds += waited;
+    queue->work_nanoseconds += finished - started;
+    if (waited > queue->max_wait_nanoseconds)
+    {
+        queue->max_wait_nanoseconds = waited;
+    }
+    pthread_mutex_unlock(&disk_io_lock);
+
+    // Read before completion(), which may free the job
+    DISK_IO_WAITER *waiter = job->waiter;
+    DISK_IO_SESSION *session = job->session;
+    if (job->completion != NULL)
+    {
+        job->completion(job);
+    }
+    if (waiter != NULL)
+    {
+        pthread_mutex_lock(&waiter->lock);
+        waiter->done = 1;
+        pthread_cond_signal(&waiter->done_cond);
+        pthread_mutex_unlock(&waiter->lock);
+    }
+    if (session != NULL)
+    {
+        pthread_mutex_lock(&session->lock);
+        if (--session->pending == 0)
+        {
+            pthread_cond_broadcast(&session->idle);
+        }
+        pthread_mutex_unlock(&session->lock);
+    }
+}
+
+/**
+ * @param argument the DISK_IO_QUEUE the thread serves
+ */
+static void *disk_io_thread(void *argument)
+{
+    DISK_IO_QUEUE *queue = argument;
+    pthread_mutex_lock(&disk_io_lock);
+    for (;;)
+    {
+        while (queue->head == NULL && !disk_io_stop)
+        {
+            pthread_cond_wait(&queue->queued, &disk_io_lock);
+        }
+        if (queue->head == NULL) // Stopping, and nothing left to run
+        {
+            break;
+        }
+        DISK_IO_JOB *job = queue->head;
+        queue->head = job->next;
+        if (queue->head == NULL)
+        {
+            queue->tail = NULL;
+        }
+        queue->length--;
+        pthread_mutex_unlock(&disk_io_lock);
+
+        disk_io_execute(queue, job, disk_io_now_nanoseconds());
+
+        pthread_mutex_lock(&disk_io_lock);
+    }
+    pthread_mutex_unlock(&disk_io_lock);
+    return NULL;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              SUBMISSION                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static void disk_io_enqueue(DISK_IO_LANE lane, DISK_IO_JOB *job)
+{
+    DISK_IO_QUEUE *queue = &disk_io_queues[lane];
+    job->next = NULL;
+    job->submitted_nanoseconds = disk_io_now_nanoseconds();
+    if (queue->thread_count == 0)
+    {
+        disk_io_execute(queue, job, job->submitted_nanoseconds); // No pool: inline, in the session thread
+        return;
+    }
+    pthread_mutex_lock(&disk_io_lock);
+    if (queue->tail != NULL)
+    {
+        queue->tail->next = job;
+    }
+    else
+    {
+        queue->head = job;
+    }
+    queue->tail = job;
+    if (++queue->length > queue->max_length)
+    {
+        queue->max_length = queue->length;
+    }
+    pthread_cond_signal(&queue->queued);
+    pthread_mutex_unlock(&disk_io_lock);
+}
+
+void disk_io_submit(DISK_IO_JOB *job)
+{
+    job->session = NULL;
+    job->waiter = NULL;
+    disk_io_enqueue(DISK_IO_LANE_GENERAL, job);
+}
+
+static ERROR_CODE disk_io_run_on(DISK_IO_LANE lane, DISK_IO_JOB *job)
+{
+    DISK_IO_WAITER waiter = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    job->session = NULL;
+    job->waiter = &waiter;
+    disk_io_enqueue(lane, job);
+
+    pthread_mutex_lock(&waiter.lock);
+    while (!waiter.done)
+    {
+        pthread_cond_wait(&waiter.done_cond, &waiter.lock);
+    }
+    pthread_mutex_unlock(&waiter.lock);
+    // The disk thread signalled under the lock and no longer touches the waiter once it released it
+    pthread_mutex_destroy(&waiter.lock);
+    pthread_cond_destroy(&waiter.done_cond);
+    return job->result;
+}
+
+ERROR_CODE disk_io_run(DISK_IO_JOB *job)
+{
+    return disk_io_run_on(DISK_IO_LANE_GENERAL, job);
+}
+
+void disk_io_session_submit(DISK_IO_SESSION *session, DISK_IO_JOB *job)
+{
+    pthread_mutex_lock(&session->lock);
+    session->pending++;
+    pthread_mutex_unlock(&session->lock);
+    job->session = session;
+    job->waiter = NULL;
+    disk_io_enqueue(DISK_IO_LANE_GENERAL, job);
+}
+
+void disk_io_session_drain(DISK_IO_SESSION *session)
+{
+    pthread_mutex_lock(&session->lock);
+    while (session->pending > 0)
+    {
+        pthread_cond_wait(&session->idle, &session->lock);
+    }
+    pthread_mutex_unlock(&session->lock);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LIFECYCLE                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief Starts the threads of @p queue, with every signal blocked
+ * @return NO_ERROR on success, SYSCALL_ERROR if a thread cannot be started (queue->thread_count is then the number started)
+ */
+static ERROR_CODE disk_io_start_queue(DISK_IO_QUEUE *queue)
+{
+    if (queue->thread_count == 0)
+    {
+        return NO_ERROR;
+    }
+    queue->threads = calloc(queue->thread_count, sizeof(pthread_t));
+    if (unlikely(queue->threads == NULL))
+    {
+        PSE("Failed to allocate the %s disk I/O threads", queue->name);
+        queue->thread_count = 0;
+        return SYSCALL_ERROR;
+    }
+    // Started before main() blocks SIGINT/SIGTERM: the threads must not inherit an open mask, signals belong to the signal thread
+    sigset_t all_signals, previous_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &previous_mask);
+    size_t started = 0;
+    while (started < queue->thread_count && pthread_create(&queue->threads[started], NULL, disk_io_thread, queue) == 0)
+    {
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+    if (unlikely(started < queue->thread_count))
+    {
+        PSE("Failed to start the %s disk I/O threads (%zu of %zu started)", queue->name, started, queue->thread_count);
+        queue->thread_count = started;
+        return SYSCALL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+ERROR_CODE disk_io_init(void)
+{
+    DISK_IO_QUEUE *general = &disk_io_queues[DISK_IO_LANE_GENERAL];
+    DISK_IO_QUEUE *delivery = &disk_io_queues[DISK_IO_LANE_DELIVERY];
+    general->thread_count = (size_t)read_environment_long("PGM_DISK_IO_THREADS", DISK_IO_DEFAULT_THREADS, 0, DISK_IO_MAX_THREADS);
+    delivery->thread_count = (size_t)read_environment_long("PGM_DISK_IO_DELIVERY_THREADS", DISK_IO_DEFAULT_DELIVERY_THREADS, 0, DISK_IO_MAX_THREADS);
+    if (!storage_engine->persistent)
+    {
+        general->thread_count = delivery->thread_count = 0; // Memory only: a hand-off would cost more than the work
+    }
+    if (general->thread_count == 0 && delivery->thread_count == 0)
+    {
+        P("Disk I/O: storage work runs in the session threads");
+        return NO_ERROR;
+    }
+    if (unlikely(disk_io_start_queue(general) != NO_ERROR))
+    {
+        delivery->thread_count = 0; // Not started
+        disk_io_shutdown();
+        return SYSCALL_ERROR;
+    }
+    if (unlikely(disk_io_start_queue(delivery) != NO_ERROR))
+    {
+        disk_io_shutdown();
+        return SYSCALL_ERROR;
+    }
+    P("Disk I/O: %zu threads, %zu delivery threads", general->thread_count, delivery->thread_count);
+    return NO_ERROR;
+}
+
+void disk_io_shutdown(void)
+{
+    pthread_mutex_lock(&disk_io_lock);
+    disk_io_stop = 1;
+    for (int lane = 0; lane < DISK_IO_LANES; lane++)
+    {
+        pthread_cond_broadcast(&disk_io_queues[lane].queued);
+    }
+    pthread_mutex_unlock(&disk_io_lock);
+
+    for (int lane = 0; lane < DISK_IO_LANES; lane++)
+    {
+        DISK_IO_QUEUE *queue = &disk_io_queues[lane];
+        for (size_t i = 0; i < queue->thread_count; i++)
+        {
+            pthread_join(queue->threads[i], NULL);
+        }
+        free(queue->threads);
+        queue->threads = NULL;
+        queue->thread_count = 0;
+
+        if (queue->jobs > 0)
+        {
+            P("Disk I/O (%s): %llu jobs, queued %.1f us on average and %.1f us at most (%zu jobs at most), ran %.1f us on average",
+              queue->name, (unsigned long long)queue->jobs, (double)queue->wait_nanoseconds / 1000.0 / (double)queue->jobs,
+              (double)queue->max_wait_nanoseconds / 1000.0, queue->max_length, (double)queue->work_nanoseconds / 1000.0 / (double)queue->jobs);
+        }
+    }
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                     STORAGE ENGINE CALLS ON THE DISK THREADS                                  */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * The arguments stay on the stack of the waiting session, so the jobs need no allocation.
+ */
+
+typedef struct DISK_IO_STORAGE_CALL {
+    const char *username;
+    const char *filename;
+    const MESSAGE *header;
+    const char *body;
+    uint32_t body_length;
+    char *out_filename;
+    MESSAGE *message;
+    int with_body;
+    char *compressed;
+    uint32_t *out_compressed_length;
+    ERROR_CODE (*callback)(const char *filename, void *context);
+    void *callback_context;
+} DISK_IO_STORAGE_CALL;
+
+static void disk_io_deliver_work(DISK_IO_JOB *job)
+{
+    DISK_IO_STORAGE_CALL *call = job->context;
+    job->result = storage_engine->deliver(call->header, call->body, call->body_length, call->out_filename);
+}
+
+static void disk_io_list_work(DISK_IO_JOB *job)
+{
+    DISK_IO_STORAGE_CALL *call = job->context;
+    job->result = storage_engine->list(call->username, call->callback, call->callback_context);
+}
+
+static void disk_io_fetch_work(DISK_IO_JOB *job)
+{
+    DISK_IO_STORAGE_CALL *call = job->context;
+    job->result = storage_engine->fetch(call->username, call->filename, call->message, call->with_body);
+}
+
+static void disk_io_fetch_compressed_work(DISK_IO_JOB *job)
+{
+    DISK_IO_STORAGE_CALL *call = job->context;
+    job->result = storage_engine->fetch_compressed(call->username, call->filename, call->message, call->compressed, call->out_compressed_length);
+}
+
+static void disk_io_remove_work(DISK_IO_JOB *job)
+{
+    DISK_IO_STORAGE_CALL *call = job->context;
+    job->result = storage_engine->remove(call->username, call->filename);
+}
+
+static ERROR_CODE disk_io_run_call(DISK_IO_LANE lane, void (*work)(DISK_IO_JOB *job), DISK_IO_STORAGE_CALL *call)
+{
+    DISK_IO_JOB job = {.work = work, .completion = NULL, .context = call, .result = ERROR};
+    return disk_io_run_on(lane, &job);
+}
+
+ERROR_CODE disk_io_deliver(const MESSAGE *header, const char *body, uint32_t body_length, char *out_filename)
+{
+    DISK_IO_STORAGE_CALL call = {.header = header, .body = body, .body_length = body_length, .out_filename = out_filename};
+    return disk_io_run_call(DISK_IO_LANE_DELIVERY, disk_io_deliver_work, &call);
+}
+
+ERROR_CODE disk_io_list(const char *username, ERROR_CODE (*callback)(const char *filename, void *context), void *context)
+{
+    DISK_IO_STORAGE_CALL call = {.username = username, .callback = callback, .callback_context = context};
+    return disk_io_run_call(DISK_IO_LANE_GENERAL, disk_io_list_work, &call);
+}
+
+ERROR_CODE disk_io_fetch(const char *username, const char *filename, MESSAGE *message, int with_body)
+{
+    DISK_IO_STORAGE_CALL call = {.username = username, .filename = filename, .message = message, .with_body = with_body};
+    return disk_io_run_call(DISK_IO_LANE_GENERAL, disk_io_fetch_work, &call);
+}
+
+ERROR_CODE disk_io_fetch_compressed(const char *username, const char *filename, MESSAGE *message, char *compressed, uint32_t *out_compressed_length)
+{
+    DISK_IO_STORAGE_CALL call = {.username = username, .filename = filename, .message = message, .compressed = compressed, .out_compressed_length = out_compressed_length};
+    return disk_io_run_call(DISK_IO_LANE_GENERAL, disk_io_fetch_compressed_work, &call);
+}
+
+ERROR_CODE disk_io_remove(const char *username, const char *filename)
+{
+    DISK_IO_STORAGE_CALL call = {.username = username, .filename = filename};
+    return disk_io_run_call(DISK_IO_LANE_GENERAL, disk_io_remove_work, &call);
+}
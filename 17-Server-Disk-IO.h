@@ -0,0 +1,115 @@
+/**
+ * @file 17-Server-Disk-IO.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the disk I/O executor: a fixed pool of threads that runs the storage work of the sessions
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint32_t, uint64_t
+#include <pthread.h> // pthread_mutex_t, pthread_cond_t
+
+/**
+ * The session threads talk to the network, the disk threads talk to the storage engine. A handler wraps its storage work in a
+ * DISK_IO_JOB and submits it; a disk thread runs work() and then completion(), the callback that publishes the result:
+ *  - disk_io_run() waits for the completion, for the operations whose result goes in the reply (deliver, fetch, list, delete)
+ *  - disk_io_session_submit() does not: the session goes back to its socket while the job runs (marking a message as read after
+ *    it was sent). disk_io_session_drain() waits for those jobs, before the next request of the session touches its mailbox
+ * Deliveries wait for their group commit on the disk thread, so they have their own FIFO queue and threads (disk_io_deliver()):
+ * a syncing batch never holds up the fetches, listings and deletes of the other sessions, which share the general FIFO queue.
+ * So there are never more disk operations in flight than disk threads, however many clients are connected.
+ *
+ * Configuration:
+ *  - PGM_DISK_IO_THREADS           general disk threads (default DISK_IO_DEFAULT_THREADS), 0 runs the jobs in the thread that
+ *                                  submits them
+ *  - PGM_DISK_IO_DELIVERY_THREADS  delivery threads (default DISK_IO_DEFAULT_DELIVERY_THREADS), 0 runs the deliveries in the
+ *                                  session threads. A group commit batch never gathers more deliveries than there are threads
+ * Both are always 0 with the memory storage engine, which has no disk to wait for.
+ *
+ * Jobs, time spent queued and time spent running are counted per queue and logged by disk_io_shutdown().
+ */
+
+typedef struct DISK_IO_JOB DISK_IO_JOB;
+typedef struct DISK_IO_SESSION DISK_IO_SESSION;
+
+struct DISK_IO_JOB {
+    void (*work)(DISK_IO_JOB *job);       // Disk thread: the storage calls, sets result
+    void (*completion)(DISK_IO_JOB *job); // Disk thread, right after work(): publishes the result. NULL for disk_io_run(). May free the job
+    void *context;
+    ERROR_CODE result;
+
+    // Owned by the executor
+    DISK_IO_JOB *next;
+    DISK_IO_SESSION *session;
+    struct DISK_IO_WAITER *waiter;
+    uint64_t submitted_nanoseconds;
+};
+
+/**
+ * @brief Background jobs of one session, initialized with DISK_IO_SESSION_INITIALIZER
+ */
+struct DISK_IO_SESSION {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    unsigned int pending;
+};
+#define DISK_IO_SESSION_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0}
+
+enum disk_io_constants {
+    DISK_IO_DEFAULT_THREADS = 16,
+    DISK_IO_DEFAULT_DELIVERY_THREADS = 16, // Also the largest group commit batch (PGM_DURABILITY=group): a delivery holds its thread until durable
+    DISK_IO_MAX_THREADS = 64,              // Per queue
+};
+
+/**
+ * @brief Reads PGM_DISK_IO_THREADS and PGM_DISK_IO_DELIVERY_THREADS and starts the disk threads
+ * @note Must be called once after storage_engine_init() and before any worker thread starts
+ * @return NO_ERROR on success, SYSCALL_ERROR if a thread cannot be started
+ */
+extern ERROR_CODE disk_io_init(void);
+
+/**
+ * @brief Runs the jobs still queued, stops the disk threads and logs the counters, only to be called once every worker thread has
+ * been joined
+ */
+extern void disk_io_shutdown(void);
+
+/**
+ * @brief Queues @p job on the general queue, its completion() is called on a disk thread once work() returned
+ */
+extern void disk_io_submit(DISK_IO_JOB *job);
+
+/**
+ * @brief Queues @p job and waits for it
+ * @return job->result
+ */
+extern ERROR_CODE disk_io_run(DISK_IO_JOB *job);
+
+/**
+ * @brief disk_io_submit() counted in @p session, see disk_io_session_drain()
+ */
+extern void disk_io_session_submit(DISK_IO_SESSION *session, DISK_IO_JOB *job);
+
+/**
+ * @brief Waits until every job submitted with disk_io_session_submit() to @p session completed
+ */
+extern void disk_io_session_drain(DISK_IO_SESSION *session);
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                     STORAGE ENGINE CALLS ON THE DISK THREADS                                  */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * Same parameters and results as the storage engine operations, run with disk_io_run(). disk_io_deliver() uses the delivery queue
+ */
+
+extern ERROR_CODE disk_io_deliver(const MESSAGE *header, const char *body, uint32_t body_length, char *out_filename);
+extern ERROR_CODE disk_io_list(const char *username, ERROR_CODE (*callback)(const char *filename, void *context), void *context);
+extern ERROR_CODE disk_io_fetch(const char *username, const char *filename, MESSAGE *message, int with_body);
+extern ERROR_CODE disk_io_fetch_compressed(const char *username, const char *filename, MESSAGE *message, char *compressed, uint32_t *out_compressed_length);
+extern ERROR_CODE disk_io_remove(const char *username, const char *filename);
@@ -0,0 +1,346 @@
+/**
+ * @file 18-Compression.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the block compressor (LZ77, byte oriented) shared by the server and the client
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "18-Compression.h"
+#include <stdlib.h>     // getenv, strtol, malloc, free
+#include <string.h>     // memcpy, memset
+#include <strings.h>    // strcasecmp
+#include <stdint.h>     // uint8_t, uint32_t
+#include <time.h>       // clock_gettime
+#include <arpa/inet.h>  // htonl, ntohl
+
+static uint32_t compression_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value)); // Unaligned load
+    return value;
+}
+
+static uint32_t compression_hash(uint32_t four_bytes)
+{
+    return (four_bytes * 2654435761u) >> (32 - COMPRESSION_HASH_BITS);
+}
+
+/**
+ * @brief Writes the 15 + extra bytes of a length that did not fit its nibble
+ * @return the next output position, NULL if @p end is reached
+ */
+static uint8_t *compression_put_length(uint8_t *out, const uint8_t *end, size_t length)
+{
+    for (length -= 15; length >= 255; length -= 255)
+    {
+        if (out >= end)
+        {
+            return NULL;
+        }
+        *out++ = 255;
+    }
+    if (out >= end)
+    {
+        return NULL;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+/**
+ * @brief Emits one sequence: token, @p literal_count literals from @p literals, then the match if @p match_length is not 0
+ * @return the next output position, NULL if it does not fit before @p end
+ */
+static uint8_t *compression_put_sequence(uint8_t *out, const uint8_t *end, const uint8_t *literals, size_t literal_count, size_t distance,
+                                         size_t match_length)
+{
+    if (out >= end)
+    {
+        return NULL;
+    }
+    uint8_t *token = out++;
+    size_t match_code = match_length == 0 ? 0 : match_length - COMPRESSION_MIN_MATCH;
+    *token = (uint8_t)(((literal_count < 15 ? literal_count : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literal_count >= 15 && (out = compression_put_length(out, end, literal_count)) == NULL)
+    {
+        return NULL;
+    }
+    if ((size_t)(end - out) < literal_count)
+    {
+        return NULL;
+    }
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+    if (match_length == 0)
+    {
+        return out;
+    }
+    if (end - out < 2)
+    {
+        return NULL;
+    }
+    *out++ = (uint8_t)(distance & 0xFF);
+    *out++ = (uint8_t)(distance >> 8);
+    if (match_code >= 15 && (out = compression_put_length(out, end, match_code)) == NULL)
+    {
+        return NULL;
+    }
+    return out;
+}
+
+size_t compression_bound(size_t raw_length)
+{
+    return raw_length + raw_length / 255 + 16;
+}
+
+size_t compress_block(const void *raw, size_t raw_length, void *compressed, size_t capacity)
+{
+    const uint8_t *input = (const uint8_t *)raw;
+    const uint8_t *input_end = input + raw_length;
+    uint8_t *out = (uint8_t *)compressed;
+    // Worth it only if smaller
+    const uint8_t *out_end = out + (capacity < raw_length ? capacity : raw_length);
+    uint32_t positions[1u << COMPRESSION_HASH_BITS];
+    memset(positions, 0, sizeof(positions)); // Position 0 as "empty": a false candidate is rejected by the compare
+
+    const uint8_t *anchor = input; // First literal not yet emitted
+    const uint8_t *cursor = input;
+    while (raw_length >= COMPRESSION_MIN_MATCH && cursor + COMPRESSION_MIN_MATCH <= input_end)
+    {
+        uint32_t four_bytes = compression_read32(cursor);
+        uint32_t slot = compression_hash(four_bytes);
+        const uint8_t *candidate = input + positions[slot];
+        positions[slot] = (uint32_t)(cursor - input);
+        size_t distance = (size_t)(cursor - candidate);
+        if (distance == 0 || distance > COMPRESSION_WINDOW || compression_read32(candidate) != four_bytes)
+        {
+            cursor++;
+            continue;
+        }
+        size_t match_length = COMPRESSION_MIN_MATCH;
+        while (cursor + match_length < input_end && candidate[match_length] == cursor[match_length])
+        {
+            match_length++;
+        }
+        out = compression_put_sequence(out, out_end, anchor, (size_t)(cursor - anchor), distance, match_length);
+        if (out == NULL)
+        {
+            return 0;
+        }
+        cursor += match_length;
+        anchor = cursor;
+    }
+    out = compression_put_sequence(out, out_end, anchor, (size_t)(input_end - anchor), 0, 0);
+    if (out == NULL || out >= out_end)
+    {
+        return 0;
+    }
+    return (size_t)(out - (uint8_t *)compressed);
+}
+
+/**
+ * @brief Reads the extra bytes of a length whose nibble was 15
+ * @return 0 on success, -1 if the block ends first
+ */
+static int compression_get_length(const uint8_t **in, const uint8_t *end, size_t *length)
+{
+    uint8_t byte;
+    do
+    {
+        if (*in >= end)
+        {
+            return -1;
+        }
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+ERROR_CODE decompress_block(const void *compressed, size_t compressed_length, void *raw, size_t raw_length)
+{
+    const uint8_t *in = (const uint8_t *)compressed;
+    const uint8_t *in_end = in + compressed_length;
+    uint8_t *output = (uint8_t *)raw;
+    uint8_t *out = output;
+    uint8_t *out_end = output + raw_length;
+    while (in < in_end)
+    {
+        uint8_t token = *in++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && compression_get_length(&in, in_end, &literal_count) != 0)
+        {
+            return STRING_SIZE_INVALID;
+        }
+        if ((size_t)(in_end - in) < literal_count || (size_t)(out_end - out) < literal_count)
+        {
+            return STRING_SIZE_INVALID;
+        }
+        memcpy(out, in, literal_count);
+        in += literal_count;
+        out += literal_count;
+        if (in == in_end)
+        {
+            break; // Last sequence, literals only
+        }
+
+        if (in_end - in < 2)
+        {
+            return STRING_SIZE_INVALID;
+        }
+        size_t distance = (size_t)in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        size_t match_length = token & 0x0F;
+        if (match_length == 15 && compression_get_length(&in, in_end, &match_length) != 0)
+        {
+            return STRING_SIZE_INVALID;
+        }
+        match_length += COMPRESSION_MIN_MATCH;
+        if (distance == 0 || distance > (size_t)(out - output) || (size_t)(out_end - out) < match_length)
+        {
+            return STRING_SIZE_INVALID;
+        }
+        // Byte by byte: the source may overlap what is being written (runs)
+        const uint8_t *source = out - distance;
+        for (size_t i = 0; i < match_length; i++)
+        {
+            out[i] = source[i];
+        }
+        out += match_length;
+    }
+    return out == out_end ? NO_ERROR : STRING_SIZE_INVALID;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              WIRE COMPRESSION                                                 */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static uint64_t wire_now_nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+WIRE_COMPRESSION_OFFER wire_compression_local_offer(void)
+{
+    WIRE_COMPRESSION_OFFER offer = {.codecs = WIRE_CODEC_LZ77, .min_bytes = WIRE_COMPRESSION_DEFAULT_MIN_BYTES};
+    const char *mode = getenv("PGM_COMPRESSION");
+    if (mode != NULL && strcasecmp(mode, "off") == 0)
+    {
+        offer.codecs = WIRE_CODEC_NONE;
+    }
+    const char *min_bytes = getenv("PGM_COMPRESSION_MIN_BYTES");
+    if (min_bytes != NULL)
+    {
+        char *end = NULL;
+        long value = strtol(min_bytes, &end, 10);
+        if (end != min_bytes && *end == '\0' && value >= 0 && value <= (long)UINT32_MAX)
+        {
+            offer.min_bytes = (uint32_t)value;
+        }
+    }
+    return offer;
+}
+
+int wire_send_payload(int fd, WIRE_COMPRESSION *wire, const void *data, uint32_t length, const void *compressed, uint32_t compressed_length)
+{
+    if (wire == NULL || !wire->enabled)
+    {
+        return send_all(fd, data, length);
+    }
+    if (length == 0)
+    {
+        return 0; // Nothing follows an empty list, as before
+    }
+    // Prefix and bytes in one send: two small writes would wait for the delayed ACK of the first one (Nagle)
+    uint8_t *packet = malloc(sizeof(uint32_t) + (size_t)length);
+    if (packet == NULL)
+    {
+        return -1;
+    }
+    uint32_t wire_length = length;
+    if (compressed != NULL && compressed_length > 0 && compressed_length < length)
+    {
+        memcpy(packet + sizeof(uint32_t), compressed, compressed_length);
+        wire_length = compressed_length;
+        wire->reused_blocks++;
+    }
+    else if (length >= wire->min_bytes)
+    {
+        uint64_t start = wire_now_nanoseconds();
+        size_t packed = compress_block(data, length, packet + sizeof(uint32_t), length);
+        wire->compress_nanoseconds += wire_now_nanoseconds() - start;
+        wire_length = packed == 0 ? length : (uint32_t)packed;
+    }
+    if (wire_length == length)
+    {
+        memcpy(packet + sizeof(uint32_t), data, length);
+    }
+    uint32_t wire_length_net = htonl(wire_length);
+    memcpy(packet, &wire_length_net, sizeof(wire_length_net));
+    int result = send_all(fd, packet, sizeof(uint32_t) + (size_t)wire_length);
+    free(packet);
+    if (result == 0)
+    {
+        wire->payloads_sent++;
+        wire->raw_bytes_sent += length;
+        wire->wire_bytes_sent += sizeof(uint32_t) + (uint64_t)wire_length;
+    }
+    return result;
+}
+
+int wire_recv_payload(int fd, WIRE_COMPRESSION *wire, void *data, uint32_t length)
+{
+    if (wire == NULL || !wire->enabled)
+    {
+        return recv_all(fd, data, length);
+    }
+    if (length == 0)
+    {
+        return 1;
+    }
+    uint32_t wire_length_net = 0;
+    int result = recv_all(fd, &wire_length_net, sizeof(wire_length_net));
+    if (result <= 0)
+    {
+        return result;
+    }
+    uint32_t wire_length = ntohl(wire_length_net);
+    if (wire_length == 0 || wire_length > length)
+    {
+        return -1; // Never more than the raw length announced
+    }
+    if (wire_length == length)
+    {
+        result = recv_all(fd, data, length);
+    }
+    else
+    {
+        uint8_t *packed = malloc(wire_length);
+        if (packed == NULL)
+        {
+            return -1;
+        }
+        result = recv_all(fd, packed, wire_length);
+        if (result > 0)
+        {
+            uint64_t start = wire_now_nanoseconds();
+            result = decompress_block(packed, wire_length, data, length) == NO_ERROR ? 1 : -1;
+            wire->decompress_nanoseconds += wire_now_nanoseconds() - start;
+        }
+        free(packed);
+    }
+    if (result > 0)
+    {
+        wire->payloads_received++;
+        wire->raw_bytes_received += length;
+        wire->wire_bytes_received += sizeof(uint32_t) + (uint64_t)wire_length;
+    }
+    return result;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file 18-Compression.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the block compressor (LZ77, byte oriented) shared by the server and the client
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+/**
+ * A block is a run of sequences, each one made of:
+ *  - a token byte: literal count in the high nibble, match length - COMPRESSION_MIN_MATCH in the low nibble (15 = more bytes follow,
+ *    each one added until a byte below 255)
+ *  - the literals
+ *  - the match: 2 byte little endian distance back into the output (1..COMPRESSION_WINDOW), then the extra length bytes
+ * The last sequence has literals only and ends the block. Nothing else is stored: the caller keeps both lengths.
+ *
+ * The compressor is greedy with a single hash table of positions, cheap enough to run on every message body. The decompressor
+ * checks every length and distance against both buffers, a corrupt block fails instead of writing out of bounds.
+ */
+
+enum compression_constants {
+    COMPRESSION_MIN_MATCH = 4,
+    COMPRESSION_WINDOW = 65535,
+    COMPRESSION_HASH_BITS = 12, // 4096 positions on the stack of the compressor
+};
+
+/**
+ * @return the largest size compress_block() can produce for @p raw_length bytes
+ */
+extern size_t compression_bound(size_t raw_length);
+
+/**
+ * @brief Compresses @p raw_length bytes of @p raw into @p compressed
+ * @return the compressed size, 0 if it would not be smaller than @p raw_length or does not fit @p capacity (store it raw then)
+ */
+extern size_t compress_block(const void *raw, size_t raw_length, void *compressed, size_t capacity);
+
+/**
+ * @brief Decompresses a block written by compress_block() that must expand to exactly @p raw_length bytes
+ * @return NO_ERROR, STRING_SIZE_INVALID if the block is corrupt
+ */
+extern ERROR_CODE decompress_block(const void *compressed, size_t compressed_length, void *raw, size_t raw_length);
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              WIRE COMPRESSION                                                 */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * Negotiated once per session, by the hello (PROTOCOL_CAPABILITY_COMPRESSION, see PROTOCOL_HELLO) or, with a server that does not
+ * know it, with REQUEST_NEGOTIATE_COMPRESSION right after the login:
+ *  - the client sends the code, the server answers NO_ERROR. A server that does not know the code answers MESSAGE_ERROR and the
+ *    session stays uncompressed, exactly as before
+ *  - the client sends a WIRE_COMPRESSION_OFFER with the codecs it can decode and its threshold, the server answers with another
+ *    one: the codec picked (WIRE_CODEC_NONE if compression is off on either side) and the threshold of the session, the larger one
+ * From then on every body (REQUEST_SEND_MESSAGE, REQUEST_LOAD_MESSAGE) and every list sent after its ack is a wire payload:
+ *  - the wire length (uint32, network byte order), then the bytes
+ *  - wire length == the length the receiver expects: raw bytes (below the threshold, or they did not shrink)
+ *  - wire length < the length expected: one compress_block() block
+ * Headers and length prefixes stay raw, the receiver still checks them before any payload arrives.
+ */
+
+typedef struct WIRE_COMPRESSION_OFFER {
+    uint32_t codecs;    // WIRE_CODEC_* bits
+    uint32_t min_bytes; // Payloads below this are always sent raw
+} WIRE_COMPRESSION_OFFER; // Network byte order
+
+/**
+ * @brief Compression state of one connection, on both sides, zero initialized = uncompressed
+ */
+typedef struct WIRE_COMPRESSION {
+    int enabled;
+    uint32_t min_bytes;
+
+    // Measured by wire_send_payload() / wire_recv_payload()
+    uint64_t payloads_sent;
+    uint64_t raw_bytes_sent;
+    uint64_t wire_bytes_sent;          // Length prefixes included
+    uint64_t payloads_received;
+    uint64_t raw_bytes_received;
+    uint64_t wire_bytes_received;
+    uint64_t reused_blocks;            // Sent as they were stored, never compressed again
+    uint64_t compress_nanoseconds;
+    uint64_t decompress_nanoseconds;
+} WIRE_COMPRESSION;
+
+enum wire_compression_constants {
+    WIRE_CODEC_NONE = 0,
+    WIRE_CODEC_LZ77 = 1,                   // compress_block()
+    WIRE_COMPRESSION_DEFAULT_MIN_BYTES = 256, // Smaller bodies gain a few bytes at best
+};
+
+/**
+ * @brief Reads PGM_COMPRESSION (on / off, default on) and PGM_COMPRESSION_MIN_BYTES (default WIRE_COMPRESSION_DEFAULT_MIN_BYTES)
+ * @return the offer of this side, codecs 0 if compression is off (host byte order)
+ */
+extern WIRE_COMPRESSION_OFFER wire_compression_local_offer(void);
+
+/**
+ * @brief Sends @p length bytes of @p data as a wire payload, or as they are if the session is not compressed
+ * @param compressed optional, @p data already compressed by compress_block() (@p compressed_length bytes): sent as it is
+ * @return 0 on success, -1 on error (like send_all())
+ */
+extern int wire_send_payload(int fd, WIRE_COMPRESSION *wire, const void *data, uint32_t length, const void *compressed, uint32_t compressed_length);
+
+/**
+ * @brief Receives a payload of exactly @p length bytes into @p data, see wire_send_payload()
+ * @return 1 on success, 0 on peer close, -1 on error or on a corrupt payload (like recv_all())
+ */
+extern int wire_recv_payload(int fd, WIRE_COMPRESSION *wire, void *data, uint32_t length);
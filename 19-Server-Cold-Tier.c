@@ -0,0 +1,1033 @@
+/**
+ * @file 19-Server-Cold-Tier.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the cold tier: bodies of old messages packed into compressed per-user archives
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "13-Server-Snapshot.h"
+#include "14-Server-Storage-Engine.h"
+#include "15-Server-Checksum.h"
+#include "16-Server-Directory-Cache.h"
+#include "18-Compression.h"
+#include "19-Server-Cold-Tier.h"
+#include "24-Header-Encoding.h"
+#include <stdio.h>      // snprintf, renameat2, RENAME_EXCHANGE
+#include <stdlib.h>     // malloc, calloc, realloc, free, strtoull
+#include <stddef.h>     // offsetof
+#include <string.h>     // memcpy, memchr, strchr, strcmp, strlen, strncmp
+#include <unistd.h>     // close, pread, pwrite, fdatasync, fsync, unlink
+#include <fcntl.h>      // open, openat, O_DIRECTORY
+#include <sys/stat.h>   // fstat, fstatat, mkdir
+#include <arpa/inet.h>  // ntohl
+#include <pthread.h>    // pthread_t, pthread_mutex_t, pthread_cond_t
+#include <signal.h>     // sigfillset, pthread_sigmask
+#include <stdatomic.h>  // atomic_uint_fast64_t, atomic_int
+#include <time.h>       // time, clock_gettime
+#include <errno.h>      // errno, ENOENT, EINVAL, ENOSYS, ETIMEDOUT
+#include <dirent.h>     // opendir, readdir, closedir
+#include <limits.h>     // PATH_MAX
+
+const char *cold_store_directory = ".COLD";
+static const char *cold_archive_suffix = ".pgmz";
+static const char *cold_temp_suffix = ".tmp";
+static const char *cold_swap_suffix = ".swap";
+
+static long cold_tier_age_seconds = 0;
+static long cold_tier_interval_seconds = COLD_TIER_DEFAULT_INTERVAL_SECONDS;
+
+static pthread_t cold_tier_thread_id;
+static int cold_tier_thread_started = 0;
+static pthread_mutex_t cold_tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cold_tier_cond; // Initialized with CLOCK_MONOTONIC in cold_tier_init()
+static atomic_int cold_tier_stop = 0; // Also read without the lock between two users
+
+static atomic_uint_fast64_t cold_hot_messages = 0;
+static atomic_uint_fast64_t cold_cold_messages = 0;
+static atomic_uint_fast64_t cold_moved_messages = 0;
+static atomic_uint_fast64_t cold_moved_body_bytes = 0;
+static atomic_uint_fast64_t cold_stored_bytes = 0;
+static atomic_uint_fast64_t cold_archives_written = 0;
+static atomic_uint_fast64_t cold_archives_removed = 0;
+static atomic_uint_fast64_t cold_reads = 0;
+static atomic_uint_fast64_t cold_cache_hits = 0;
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              ARCHIVES                                                         */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief A username that can be a folder name: terminated, not empty, no '/' and not starting with '.'
+ */
+static int cold_username_is_valid(const char *username)
+{
+    return username != NULL && memchr(username, '\0', USERNAME_SIZE_CHARS) != NULL && username[0] != '\0' && username[0] != '.' &&
+           strchr(username, '/') == NULL;
+}
+
+static int cold_archive_path(const char *username, uint64_t archive_id, const char *suffix, char *out, size_t out_size)
+{
+    return (size_t)snprintf(out, out_size, "%s/%s/%016llx%s%s", cold_store_directory, username, (unsigned long long)archive_id,
+                            cold_archive_suffix, suffix) < out_size;
+}
+
+/**
+ * @brief fsync() of the folder @p path, so the entries renamed in it survive a crash (nothing to do with PGM_DURABILITY=none)
+ */
+static ERROR_CODE cold_sync_directory(int directory_fd, const char *path)
+{
+    if (storage_durability_mode() == DURABILITY_NONE)
+    {
+        return NO_ERROR;
+    }
+    int fd = directory_fd >= 0 ? directory_fd : open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0 && fd != directory_fd)
+    {
+        close(fd);
+    }
+    return synced ? NO_ERROR : SYSCALL_ERROR;
+}
+
+/**
+ * @brief Reads and decompresses the block @p reference points to into @p raw (COLD_BLOCK_SIZE bytes)
+ */
+static ERROR_CODE cold_load_block(const char *username, const COLD_REFERENCE *reference, char *raw, uint32_t *out_raw_length)
+{
+    char path[PATH_MAX];
+    if (unlikely(!cold_archive_path(username, reference->archive_id, "", path, sizeof(path))))
+    {
+        return STRING_SIZE_INVALID;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        PSE("Cold tier: failed to open archive [%s]", path);
+        return SYSCALL_ERROR;
+    }
+    COLD_ARCHIVE_HEADER archive;
+    COLD_BLOCK_HEADER block;
+    ERROR_CODE result = NO_ERROR;
+    if (pread(fd, &archive, sizeof(archive), 0) != (ssize_t)sizeof(archive) || archive.magic != COLD_ARCHIVE_MAGIC ||
+        archive.archive_id != reference->archive_id ||
+        pread(fd, &block, sizeof(block), (off_t)reference->block_offset) != (ssize_t)sizeof(block) || block.magic != COLD_BLOCK_MAGIC ||
+        block.raw_length == 0 || block.raw_length > COLD_BLOCK_SIZE || block.stored_length == 0 || block.stored_length > block.raw_length)
+    {
+        result = STRING_SIZE_INVALID;
+    }
+    char *stored = NULL;
+    if (result == NO_ERROR && block.stored_length < block.raw_length)
+    {
+        stored = malloc(block.stored_length);
+        result = stored == NULL ? SYSCALL_ERROR : NO_ERROR;
+    }
+    char *destination = stored != NULL ? stored : raw; // An uncompressed block is read in place
+    if (result == NO_ERROR &&
+        pread(fd, destination, block.stored_length, (off_t)(reference->block_offset + sizeof(block))) != (ssize_t)block.stored_length)
+    {
+        result = STRING_SIZE_INVALID;
+    }
+    close(fd);
+    if (result == NO_ERROR && crc32c_update(0, destination, block.stored_length) != block.crc32c)
+    {
+        result = STRING_SIZE_INVALID;
+    }
+    if (result == NO_ERROR && stored != NULL)
+    {
+        result = decompress_block(stored, block.stored_length, raw, block.raw_length);
+    }
+    free(stored);
+    if (unlikely(result == STRING_SIZE_INVALID))
+    {
+        P("Cold tier: corrupt block at %llu of archive [%s]", (unsigned long long)reference->block_offset, path);
+    }
+    *out_raw_length = block.raw_length;
+    return result;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              BLOCK CACHE                                                      */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct COLD_CACHED_BLOCK {
+    char username[USERNAME_SIZE_CHARS];
+    uint64_t archive_id;
+    uint64_t block_offset;
+    uint64_t last_used;   // Tick of the cache, the smallest one is replaced
+    uint32_t raw_length;
+    char *raw;            // NULL: free slot
+} COLD_CACHED_BLOCK;
+
+// Written once by cold_tier_init(), then under the lock
+static pthread_mutex_t cold_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static COLD_CACHED_BLOCK *cold_cache = NULL;
+static size_t cold_cache_capacity = 0;
+static uint64_t cold_cache_tick = 0;
+
+/**
+ * @note Caller holds the lock
+ */
+static COLD_CACHED_BLOCK *cold_cache_find(const char *username, const COLD_REFERENCE *reference)
+{
+    for (size_t i = 0; i < cold_cache_capacity; i++)
+    {
+        COLD_CACHED_BLOCK *slot = &cold_cache[i];
+        if (slot->raw != NULL && slot->archive_id == reference->archive_id && slot->block_offset == reference->block_offset &&
+            strcmp(slot->username, username) == 0)
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copies the body out of a decompressed block
+ */
+static ERROR_CODE cold_copy_body(const char *raw, uint32_t raw_length, const COLD_REFERENCE *reference, char *body, uint32_t body_length)
+{
+    if (unlikely(reference->offset_in_block > raw_length || body_length > raw_length - reference->offset_in_block))
+    {
+        return STRING_SIZE_INVALID;
+    }
+    memcpy(body, raw + reference->offset_in_block, body_length);
+    return NO_ERROR;
+}
+
+ERROR_CODE cold_tier_read_body(const char *username, const COLD_REFERENCE *reference, char *body, uint32_t body_length)
+{
+    if (unlikely(reference == NULL || body == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    if (unlikely(!cold_username_is_valid(username) || reference->magic != COLD_REFERENCE_MAGIC))
+    {
+        return STRING_SIZE_INVALID;
+    }
+    atomic_fetch_add(&cold_reads, 1);
+
+    pthread_mutex_lock(&cold_cache_lock);
+    COLD_CACHED_BLOCK *cached = cold_cache_find(username, reference);
+    if (cached != NULL)
+    {
+        cached->last_used = ++cold_cache_tick;
+        ERROR_CODE result = cold_copy_body(cached->raw, cached->raw_length, reference, body, body_length);
+        pthread_mutex_unlock(&cold_cache_lock);
+        atomic_fetch_add(&cold_cache_hits, 1);
+        return result;
+    }
+    pthread_mutex_unlock(&cold_cache_lock);
+
+    // Miss: read and decompressed outside the lock, two threads missing the same block both decode it
+    char *raw = malloc(COLD_BLOCK_SIZE);
+    if (unlikely(raw == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+    uint32_t raw_length = 0;
+    ERROR_CODE result = cold_load_block(username, reference, raw, &raw_length);
+    if (result == NO_ERROR)
+    {
+        result = cold_copy_body(raw, raw_length, reference, body, body_length);
+    }
+    if (result != NO_ERROR || cold_cache_capacity == 0)
+    {
+        free(raw);
+        return result;
+    }
+
+    pthread_mutex_lock(&cold_cache_lock);
+    if (cold_cache_find(username, reference) == NULL)
+    {
+        COLD_CACHED_BLOCK *victim = &cold_cache[0];
+        for (size_t i = 0; i < cold_cache_capacity && victim->raw != NULL; i++)
+        {
+            if (cold_cache[i].raw == NULL || cold_cache[i].last_used < victim->last_used)
+            {
+                victim = &cold_cache[i];
+            }
+        }
+        free(victim->raw);
+        snprintf(victim->username, sizeof(victim->username), "%s", username);
+        victim->archive_id = reference->archive_id;
+        victim->block_offset = reference->block_offset;
+        victim->last_used = ++cold_cache_tick;
+        victim->raw_length = raw_length;
+        victim->raw = raw;
+        raw = NULL;
+    }
+    pthread_mutex_unlock(&cold_cache_lock);
+    free(raw);
+    return NO_ERROR;
+}
+
+int cold_tier_is_reference_record(uint64_t file_size, uint32_t message_length)
+{
+    return message_length != sizeof(COLD_REFERENCE) && message_length != sizeof(COLD_REFERENCE) + sizeof(MESSAGE_CHECKSUM) &&
+           file_size == offsetof(MESSAGE, message) + sizeof(COLD_REFERENCE);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              PASS                                                             */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct COLD_CANDIDATE {
+    char filename[MESSAGE_FILENAME_SIZE_CHARS];
+} COLD_CANDIDATE;
+
+typedef struct COLD_PENDING {
+    char filename[MESSAGE_FILENAME_SIZE_CHARS];
+    char header[offsetof(MESSAGE, message)];
+    COLD_REFERENCE reference;
+    uint32_t crc32c;
+} COLD_PENDING;
+
+typedef struct COLD_USER_PASS {
+    USER_DIRECTORY *directory;
+    char archive_directory[PATH_MAX];
+    time_t cutoff;                 // Messages whose id has fewer seconds than this go cold
+
+    COLD_CANDIDATE *candidates;
+    size_t candidate_count;
+    size_t candidate_capacity;
+    uint64_t *live_archives;       // Archives some record points to
+    size_t live_count;
+    size_t live_capacity;
+    uint64_t hot_messages;
+    uint64_t cold_messages;
+
+    // Packing
+    MESSAGE *message;
+    char *raw;                     // COLD_BLOCK_SIZE
+    char *compressed;              // compression_bound(COLD_BLOCK_SIZE)
+    COLD_PENDING *pending;         // COLD_ARCHIVE_MAX_MESSAGES
+    size_t pending_count;
+    size_t moved_messages;
+    size_t written_archives;
+    size_t removed_archives;
+    int exchange_unsupported;
+} COLD_USER_PASS;
+
+/**
+ * @return 1 with @p out_archive_id if @p filename is a cold record, 0 if it is a hot message, -1 if it is gone meanwhile
+ */
+static int cold_read_record(const COLD_USER_PASS *pass, const char *filename, uint64_t *out_archive_id)
+{
+    char relative_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    struct stat file_stat;
+    if (storage_message_relative_path(filename, relative_path, sizeof(relative_path)) != NO_ERROR ||
+        fstatat(pass->directory->fd, relative_path, &file_stat, 0) != 0)
+    {
+        return -1;
+    }
+
+    // Only a record with a header of at most H bytes can be cold, the size alone rules out most files
+    if ((uint64_t)file_stat.st_size > offsetof(MESSAGE, message) + sizeof(COLD_REFERENCE) + sizeof(MESSAGE_CHECKSUM))
+    {
+        return 0;
+    }
+    int fd = openat(pass->directory->fd, relative_path, O_RDONLY | O_CLOEXEC);
+    uint32_t message_length = 0;
+    size_t header_size = 0;
+    MESSAGE_FILE_SHAPE shape = {0};
+    COLD_REFERENCE reference = {0};
+    int cold = fd >= 0 && storage_message_file_shape_of(fd, &message_length, &header_size, &shape) && shape.cold_body &&
+               pread(fd, &reference, sizeof(reference), (off_t)header_size) == (ssize_t)sizeof(reference) &&
+               reference.magic == COLD_REFERENCE_MAGIC;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (cold)
+    {
+        *out_archive_id = reference.archive_id;
+    }
+    return cold;
+}
+
+static ERROR_CODE cold_add_live_archive(COLD_USER_PASS *pass, uint64_t archive_id)
+{
+    if (pass->live_count == pass->live_capacity)
+    {
+        size_t next_capacity = pass->live_capacity == 0 ? 64 : pass->live_capacity * 2;
+        uint64_t *reallocated = realloc(pass->live_archives, next_capacity * sizeof(uint64_t));
+        if (unlikely(reallocated == NULL))
+        {
+            return SYSCALL_ERROR; // The archive could look unreferenced: no pass for this user rather than a lost body
+        }
+        pass->live_archives = reallocated;
+        pass->live_capacity = next_capacity;
+    }
+    pass->live_archives[pass->live_count++] = archive_id;
+    return NO_ERROR;
+}
+
+/**
+ * @brief storage_for_each_message_at() callback: counts the cold records (and their archives), collects the old hot messages
+ */
+static ERROR_CODE cold_scan_message(const char *filename, void *context)
+{
+    COLD_USER_PASS *pass = (COLD_USER_PASS *)context;
+    uint64_t archive_id = 0;
+    int record = cold_read_record(pass, filename, &archive_id);
+    if (record < 0)
+    {
+        return NO_ERROR; // Gone meanwhile, or renamed: the second scan of cold_collect_garbage() sees it under its new name
+    }
+    if (record > 0)
+    {
+        pass->cold_messages++;
+        return cold_add_live_archive(pass, archive_id);
+    }
+    pass->hot_messages++;
+
+    message_id_t id = message_id_from_filename(filename);
+    if (id == 0 || (time_t)(id >> MESSAGE_ID_SEQUENCE_BITS) >= pass->cutoff)
+    {
+        return NO_ERROR;
+    }
+    if (pass->candidate_count == pass->candidate_capacity)
+    {
+        size_t next_capacity = pass->candidate_capacity == 0 ? 64 : pass->candidate_capacity * 2;
+        COLD_CANDIDATE *reallocated = realloc(pass->candidates, next_capacity * sizeof(COLD_CANDIDATE));
+        if (unlikely(reallocated == NULL))
+        {
+            return NO_ERROR; // The next pass takes the others
+        }
+        pass->candidates = reallocated;
+        pass->candidate_capacity = next_capacity;
+    }
+    snprintf(pass->candidates[pass->candidate_count++].filename, MESSAGE_FILENAME_SIZE_CHARS, "%s", filename);
+    return NO_ERROR;
+}
+
+/**
+ * @brief storage_for_each_message_at() callback of the second scan: only adds the archives of the cold records
+ */
+static ERROR_CODE cold_rescan_message(const char *filename, void *context)
+{
+    COLD_USER_PASS *pass = (COLD_USER_PASS *)context;
+    uint64_t archive_id = 0;
+    return cold_read_record(pass, filename, &archive_id) > 0 ? cold_add_live_archive(pass, archive_id) : NO_ERROR;
+}
+
+static int cold_archive_is_live(const COLD_USER_PASS *pass, uint64_t archive_id)
+{
+    for (size_t i = 0; i < pass->live_count; i++)
+    {
+        if (pass->live_archives[i] == archive_id)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes the leftovers of an interrupted pass and the archives no record points to anymore
+ * @note Before any archive of this pass is written: every archive in the folder was there when the records were scanned.
+ *       One scan races the sessions: a message marked as read meanwhile ([UNREAD]X -> X) can be missed, its fstatat() fails or
+ *       its new name lands behind the readdir() cursor. An archive is only removed when a second scan, started after the first
+ *       one ended, finds no record pointing to it either (a message is renamed once, the second scan sees its final name).
+ */
+static void cold_collect_garbage(COLD_USER_PASS *pass)
+{
+    DIR *directory = opendir(pass->archive_directory);
+    if (directory == NULL)
+    {
+        return;
+    }
+    size_t archive_suffix_length = strlen(cold_archive_suffix);
+    size_t temp_suffix_length = strlen(cold_temp_suffix);
+    size_t swap_suffix_length = strlen(cold_swap_suffix);
+    uint64_t *unreferenced = NULL;
+    size_t unreferenced_count = 0;
+    size_t unreferenced_capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        size_t length = strlen(entry->d_name);
+        char path[PATH_MAX];
+        if (entry->d_name[0] == '.' ||
+            (size_t)snprintf(path, sizeof(path), "%s/%s", pass->archive_directory, entry->d_name) >= sizeof(path))
+        {
+            continue;
+        }
+        if ((length > temp_suffix_length && strcmp(entry->d_name + length - temp_suffix_length, cold_temp_suffix) == 0) ||
+            (length > swap_suffix_length && strcmp(entry->d_name + length - swap_suffix_length, cold_swap_suffix) == 0))
+        {
+            unlink(path); // Never published, no record points to it
+            continue;
+        }
+        if (length != 16 + archive_suffix_length || strcmp(entry->d_name + 16, cold_archive_suffix) != 0)
+        {
+            continue;
+        }
+        char *end = NULL;
+        uint64_t archive_id = strtoull(entry->d_name, &end, 16);
+        if (end != entry->d_name + 16 || cold_archive_is_live(pass, archive_id))
+        {
+            continue;
+        }
+        if (unreferenced_count == unreferenced_capacity)
+        {
+            size_t next_capacity = unreferenced_capacity == 0 ? 16 : unreferenced_capacity * 2;
+            uint64_t *reallocated = realloc(unreferenced, next_capacity * sizeof(uint64_t));
+            if (unlikely(reallocated == NULL))
+            {
+                break; // The next pass takes the others
+            }
+            unreferenced = reallocated;
+            unreferenced_capacity = next_capacity;
+        }
+        unreferenced[unreferenced_count++] = archive_id;
+    }
+    closedir(directory);
+
+    // The second scan adds to the archives of the first one: removed are only those that neither scan saw referenced
+    if (unreferenced_count > 0 && storage_for_each_message_at(pass->directory->fd, cold_rescan_message, pass) == NO_ERROR)
+    {
+        for (size_t i = 0; i < unreferenced_count; i++)
+        {
+            char path[PATH_MAX];
+            if (cold_archive_is_live(pass, unreferenced[i]) ||
+                !cold_archive_path(pass->directory->username, unreferenced[i], "", path, sizeof(path)))
+            {
+                continue;
+            }
+            snapshot_change_begin(path); // A running snapshot may still hold records pointing to it
+            int removed = unlink(path) == 0;
+            snapshot_change_end();
+            if (removed)
+            {
+                pass->removed_archives++;
+            }
+        }
+    }
+    free(unreferenced);
+}
+
+/**
+ * @brief Compresses the bodies gathered in pass->raw and appends them as one block at @p offset
+ * @return NO_ERROR with @p offset moved past the block, SYSCALL_ERROR on write errors
+ */
+static ERROR_CODE cold_flush_block(COLD_USER_PASS *pass, int fd, uint64_t *offset, uint32_t raw_length)
+{
+    if (raw_length == 0)
+    {
+        return NO_ERROR;
+    }
+    size_t compressed_length = compress_block(pass->raw, raw_length, pass->compressed, compression_bound(COLD_BLOCK_SIZE));
+    const char *stored = compressed_length == 0 ? pass->raw : pass->compressed;
+    COLD_BLOCK_HEADER block = {
+        .magic = COLD_BLOCK_MAGIC,
+        .raw_length = raw_length,
+        .stored_length = compressed_length == 0 ? raw_length : (uint32_t)compressed_length,
+    };
+    block.crc32c = crc32c_update(0, stored, block.stored_length);
+    if (pwrite(fd, &block, sizeof(block), (off_t)*offset) != (ssize_t)sizeof(block) ||
+        pwrite(fd, stored, block.stored_length, (off_t)(*offset + sizeof(block))) != (ssize_t)block.stored_length)
+    {
+        return SYSCALL_ERROR;
+    }
+    *offset += sizeof(block) + block.stored_length;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Takes the body of an old message into the block being filled
+ * @return 1 if the message was added to pass->pending, 0 if it stays hot
+ */
+static int cold_gather_message(COLD_USER_PASS *pass, const char *filename, uint64_t archive_id, uint64_t block_offset, uint32_t *raw_length)
+{
+    char relative_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    if (storage_message_relative_path(filename, relative_path, sizeof(relative_path)) != NO_ERROR)
+    {
+        return 0;
+    }
+    int fd = openat(pass->directory->fd, relative_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    uint32_t message_length = 0;
+    MESSAGE_FILE_SHAPE shape;
+    int shaped = storage_message_file_shape_of(fd, &message_length, NULL, &shape);
+    ERROR_CODE result = shaped ? storage_read_message(fd, pass->message, 1) : STRING_SIZE_INVALID;
+    close(fd);
+    if (result != NO_ERROR || message_length != ntohl(pass->message->message_length))
+    {
+        return 0; // Corrupt: left to --fsck
+    }
+    // Only bodies the file holds, inline or compressed: a shared body is already stored once, and its reference count is not ours to move
+    int own_body = !shape.shared_body && !shape.cold_body;
+    if (!own_body || message_length == sizeof(COLD_REFERENCE) || message_length == sizeof(COLD_REFERENCE) + sizeof(MESSAGE_CHECKSUM) ||
+        memchr(pass->message->recipient, '\0', sizeof(pass->message->recipient)) == NULL ||
+        strcmp(pass->message->recipient, pass->directory->username) != 0)
+    {
+        return 0; // The archive is found through the recipient of the header
+    }
+
+    header_canonicalize(pass->message); // The record may get a compact header, the new checksum covers what it decodes to
+    memcpy(pass->raw + *raw_length, pass->message->message, message_length);
+    COLD_PENDING *pending = &pass->pending[pass->pending_count++];
+    snprintf(pending->filename, sizeof(pending->filename), "%s", filename);
+    memcpy(pending->header, pass->message, sizeof(pending->header));
+    pending->reference = (COLD_REFERENCE){
+        .magic = COLD_REFERENCE_MAGIC,
+        .offset_in_block = *raw_length,
+        .archive_id = archive_id,
+        .block_offset = block_offset,
+    };
+    pending->crc32c = checksum_message(pass->message, pass->message->message, message_length);
+    *raw_length += message_length;
+    return 1;
+}
+
+/**
+ * @brief Replaces the message file of @p pending with its cold record
+ * @return NO_ERROR once swapped, OPERATION_ABORTED if the message was renamed or removed meanwhile, SYSCALL_ERROR otherwise
+ */
+static ERROR_CODE cold_swap_message(COLD_USER_PASS *pass, const COLD_PENDING *pending)
+{
+    char relative_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    char snapshot_path[STORAGE_MESSAGE_PATH_SIZE_CHARS];
+    char swap_path[PATH_MAX];
+    if (unlikely(storage_message_relative_path(pending->filename, relative_path, sizeof(relative_path)) != NO_ERROR ||
+                 (size_t)snprintf(snapshot_path, sizeof(snapshot_path), "%s/%s", pass->directory->path, relative_path) >= sizeof(snapshot_path) ||
+                 (size_t)snprintf(swap_path, sizeof(swap_path), "%s/%s%s", pass->archive_directory, pending->filename, cold_swap_suffix) >= sizeof(swap_path)))
+    {
+        return SYSCALL_ERROR;
+    }
+
+    char record[offsetof(MESSAGE, message) + sizeof(COLD_REFERENCE) + sizeof(MESSAGE_CHECKSUM)];
+    MESSAGE_CHECKSUM trailer = {.magic = MESSAGE_CHECKSUM_MAGIC, .crc32c = pending->crc32c};
+    MESSAGE header;
+    memcpy(&header, pending->header, sizeof(pending->header));
+    size_t header_size = storage_encode_file_header(&header, record);
+    size_t record_size = header_size + sizeof(pending->reference) + sizeof(trailer);
+    memcpy(record + header_size, &pending->reference, sizeof(pending->reference));
+    memcpy(record + header_size + sizeof(pending->reference), &trailer, sizeof(trailer));
+    int fd = open(swap_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        return SYSCALL_ERROR;
+    }
+    int written = write(fd, record, record_size) == (ssize_t)record_size &&
+                  (storage_durability_mode() == DURABILITY_NONE || fdatasync(fd) == 0);
+    close(fd);
+    if (unlikely(!written))
+    {
+        unlink(swap_path);
+        return SYSCALL_ERROR;
+    }
+
+    // Both names stay valid at every instant: a crash leaves the message either hot or cold, never missing
+    snapshot_change_begin(snapshot_path);
+    int swapped = renameat2(AT_FDCWD, swap_path, pass->directory->fd, relative_path, RENAME_EXCHANGE) == 0;
+    int swap_errno = errno;
+    snapshot_change_end();
+    unlink(swap_path); // The old hot file after the exchange, the unused record otherwise
+    if (swapped)
+    {
+        return NO_ERROR;
+    }
+    if (swap_errno == EINVAL || swap_errno == ENOSYS)
+    {
+        pass->exchange_unsupported = 1;
+    }
+    errno = swap_errno;
+    return swap_errno == ENOENT ? OPERATION_ABORTED : SYSCALL_ERROR;
+}
+
+/**
+ * @brief Packs the next candidates (up to COLD_ARCHIVE_MAX_MESSAGES) into a new archive and swaps their files
+ * @param next first candidate not looked at yet, moved past the ones taken
+ */
+static ERROR_CODE cold_write_archive(COLD_USER_PASS *pass, size_t *next)
+{
+    uint64_t archive_id = message_id_next();
+    char temp_path[PATH_MAX];
+    char path[PATH_MAX];
+    if (unlikely(!cold_archive_path(pass->directory->username, archive_id, cold_temp_suffix, temp_path, sizeof(temp_path)) ||
+                 !cold_archive_path(pass->directory->username, archive_id, "", path, sizeof(path))))
+    {
+        return SYSCALL_ERROR;
+    }
+    int fd = open(temp_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        PSE("Cold tier: failed to create [%s]", temp_path);
+        return SYSCALL_ERROR;
+    }
+    COLD_ARCHIVE_HEADER archive = {.magic = COLD_ARCHIVE_MAGIC, .version = COLD_ARCHIVE_VERSION, .archive_id = archive_id};
+    snprintf(archive.username, sizeof(archive.username), "%s", pass->directory->username);
+    ERROR_CODE result = write(fd, &archive, sizeof(archive)) == (ssize_t)sizeof(archive) ? NO_ERROR : SYSCALL_ERROR;
+    uint64_t offset = sizeof(archive);
+    uint32_t raw_length = 0;
+    pass->pending_count = 0;
+    for (; result == NO_ERROR && *next < pass->candidate_count && pass->pending_count < COLD_ARCHIVE_MAX_MESSAGES; (*next)++)
+    {
+        // A body never spans two blocks: the block is flushed first when the largest body could not fit
+        if (raw_length > COLD_BLOCK_SIZE - MESSAGE_SIZE_CHARS)
+        {
+            result = cold_flush_block(pass, fd, &offset, raw_length);
+            raw_length = 0;
+        }
+        if (result == NO_ERROR)
+        {
+            cold_gather_message(pass, pass->candidates[*next].filename, archive_id, offset, &raw_length);
+        }
+    }
+    if (result == NO_ERROR)
+    {
+        result = cold_flush_block(pass, fd, &offset, raw_length);
+    }
+    if (result == NO_ERROR && pass->pending_count > 0 && storage_durability_mode() != DURABILITY_NONE && fdatasync(fd) != 0)
+    {
+        result = SYSCALL_ERROR;
+    }
+    close(fd);
+    if (result != NO_ERROR || pass->pending_count == 0)
+    {
+        if (result != NO_ERROR)
+        {
+            PSE("Cold tier: failed to write [%s]", temp_path);
+        }
+        unlink(temp_path);
+        return result;
+    }
+    // Published and durable before the first record points to it
+    if (unlikely(rename(temp_path, path) != 0 || cold_sync_directory(-1, pass->archive_directory) != NO_ERROR))
+    {
+        PSE("Cold tier: failed to publish [%s]", path);
+        unlink(temp_path);
+        return SYSCALL_ERROR;
+    }
+    pass->written_archives++;
+    atomic_fetch_add(&cold_archives_written, 1);
+    atomic_fetch_add(&cold_stored_bytes, offset);
+
+    size_t swapped = 0;
+    uint64_t swapped_bytes = 0;
+    for (size_t i = 0; i < pass->pending_count && !pass->exchange_unsupported; i++)
+    {
+        ERROR_CODE swap_result = cold_swap_message(pass, &pass->pending[i]);
+        if (swap_result == NO_ERROR)
+        {
+            swapped++;
+            swapped_bytes += ntohl(((const MESSAGE *)pass->pending[i].header)->message_length);
+        }
+        else if (swap_result == SYSCALL_ERROR)
+        {
+            PSE("Cold tier: failed to move [%s] of [%s]", pass->pending[i].filename, pass->directory->username);
+        }
+    }
+    if (swapped > 0)
+    {
+        cold_sync_directory(pass->directory->fd, pass->directory->path); // The records were synced before the exchange, now their names
+    }
+    pass->moved_messages += swapped;
+    atomic_fetch_add(&cold_moved_messages, swapped);
+    atomic_fetch_add(&cold_moved_body_bytes, swapped_bytes);
+    return NO_ERROR; // An archive no record ended up pointing to is removed by the next pass
+}
+
+/**
+ * @brief One user: scan, garbage collection, then as many archives as the old messages need
+ */
+static void cold_tier_user(const char *username, COLD_USER_PASS *pass)
+{
+    pass->directory = user_directory_acquire(username);
+    if (pass->directory == NULL)
+    {
+        return; // Removed meanwhile
+    }
+    pass->candidate_count = 0;
+    pass->live_count = 0;
+    pass->hot_messages = 0;
+    pass->cold_messages = 0;
+    snprintf(pass->archive_directory, sizeof(pass->archive_directory), "%s/%s", cold_store_directory, username);
+
+    if (storage_for_each_message_at(pass->directory->fd, cold_scan_message, pass) == NO_ERROR)
+    {
+        atomic_fetch_add(&cold_hot_messages, pass->hot_messages);
+        atomic_fetch_add(&cold_cold_messages, pass->cold_messages);
+        cold_collect_garbage(pass);
+        if (pass->candidate_count > 0 && (mkdir(pass->archive_directory, 0700) == 0 || errno == EEXIST))
+        {
+            for (size_t next = 0; next < pass->candidate_count && !pass->exchange_unsupported && !atomic_load(&cold_tier_stop);)
+            {
+                if (cold_write_archive(pass, &next) != NO_ERROR)
+                {
+                    break;
+                }
+            }
+        }
+    }
+    user_directory_release(pass->directory);
+    pass->directory = NULL;
+}
+
+typedef struct COLD_USER_LIST {
+    char (*usernames)[USERNAME_SIZE_CHARS];
+    size_t count;
+    size_t capacity;
+} COLD_USER_LIST;
+
+static ERROR_CODE cold_collect_user(const char *username, void *context)
+{
+    COLD_USER_LIST *list = (COLD_USER_LIST *)context;
+    if (!cold_username_is_valid(username))
+    {
+        return NO_ERROR;
+    }
+    if (list->count == list->capacity)
+    {
+        size_t next_capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        char(*reallocated)[USERNAME_SIZE_CHARS] = realloc(list->usernames, next_capacity * USERNAME_SIZE_CHARS);
+        if (unlikely(reallocated == NULL))
+        {
+            return SYSCALL_ERROR;
+        }
+        list->usernames = reallocated;
+        list->capacity = next_capacity;
+    }
+    snprintf(list->usernames[list->count++], USERNAME_SIZE_CHARS, "%s", username);
+    return NO_ERROR;
+}
+
+static void cold_tier_pass(void)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    COLD_USER_LIST users = {0};
+    COLD_USER_PASS pass = {0};
+    pass.cutoff = time(NULL) - cold_tier_age_seconds;
+    pass.message = malloc(sizeof(MESSAGE) + MESSAGE_SIZE_CHARS);
+    pass.raw = malloc(COLD_BLOCK_SIZE);
+    pass.compressed = malloc(compression_bound(COLD_BLOCK_SIZE));
+    pass.pending = malloc(COLD_ARCHIVE_MAX_MESSAGES * sizeof(COLD_PENDING));
+    if (unlikely(pass.message == NULL || pass.raw == NULL || pass.compressed == NULL || pass.pending == NULL ||
+                 storage_for_each_user(cold_collect_user, &users) != NO_ERROR))
+    {
+        PSE("Cold tier: pass skipped");
+    }
+    else
+    {
+        atomic_store(&cold_hot_messages, 0);
+        atomic_store(&cold_cold_messages, 0);
+        uint64_t bytes_before = atomic_load(&cold_moved_body_bytes);
+        uint64_t stored_before = atomic_load(&cold_stored_bytes);
+        for (size_t i = 0; i < users.count && !atomic_load(&cold_tier_stop) && !pass.exchange_unsupported; i++)
+        {
+            cold_tier_user(users.usernames[i], &pass);
+        }
+        if (unlikely(pass.exchange_unsupported))
+        {
+            P("Cold tier: the filesystem cannot exchange two files (renameat2), no message goes cold");
+        }
+        if (pass.moved_messages > 0 || pass.removed_archives > 0)
+        {
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            P("Cold tier pass: %zu messages moved (%.1f KiB of bodies in %zu archives of %.1f KiB), %zu archives removed, %llu hot and %llu "
+              "cold messages before the pass, %.2f s",
+              pass.moved_messages, (double)(atomic_load(&cold_moved_body_bytes) - bytes_before) / 1024.0, pass.written_archives,
+              (double)(atomic_load(&cold_stored_bytes) - stored_before) / 1024.0, pass.removed_archives,
+              (unsigned long long)atomic_load(&cold_hot_messages), (unsigned long long)atomic_load(&cold_cold_messages),
+              (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+        }
+        atomic_fetch_add(&cold_archives_removed, pass.removed_archives);
+    }
+    free(users.usernames);
+    free(pass.candidates);
+    free(pass.live_archives);
+    free(pass.message);
+    free(pass.raw);
+    free(pass.compressed);
+    free(pass.pending);
+}
+
+static void *cold_tier_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&cold_tier_lock);
+    while (!cold_tier_stop)
+    {
+        pthread_mutex_unlock(&cold_tier_lock);
+        cold_tier_pass();
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += cold_tier_interval_seconds;
+        pthread_mutex_lock(&cold_tier_lock);
+        while (!cold_tier_stop && pthread_cond_timedwait(&cold_tier_cond, &cold_tier_lock, &deadline) != ETIMEDOUT)
+        {
+            // Spurious wakeup, keep waiting
+        }
+    }
+    pthread_mutex_unlock(&cold_tier_lock);
+    return NULL;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LIFECYCLE                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE cold_tier_init(void)
+{
+    cold_tier_age_seconds = read_environment_long("PGM_COLD_TIER_AGE_SECONDS", 0, 0, 1L << 40);
+    cold_tier_interval_seconds = read_environment_long("PGM_COLD_TIER_INTERVAL_SECONDS", COLD_TIER_DEFAULT_INTERVAL_SECONDS, 1, 86400);
+    long cache_blocks = read_environment_long("PGM_COLD_CACHE_BLOCKS", COLD_CACHE_DEFAULT_BLOCKS, 0, COLD_CACHE_MAX_BLOCKS);
+    if (!storage_engine->persistent)
+    {
+        return NO_ERROR; // Nothing on disk to tier
+    }
+    if (cache_blocks > 0)
+    {
+        cold_cache = calloc((size_t)cache_blocks, sizeof(COLD_CACHED_BLOCK));
+        if (unlikely(cold_cache == NULL))
+        {
+            PSE("Failed to allocate the cold block cache");
+            return SYSCALL_ERROR;
+        }
+        cold_cache_capacity = (size_t)cache_blocks;
+    }
+    P("Cold tier: messages older than %lds, a pass every %lds (0 = disabled), %ld decompressed blocks cached", cold_tier_age_seconds,
+      cold_tier_interval_seconds, cache_blocks);
+    if (cold_tier_age_seconds == 0)
+    {
+        return NO_ERROR;
+    }
+    if (unlikely(mkdir(cold_store_directory, 0700) != 0 && errno != EEXIST))
+    {
+        PSE("Failed to create [%s]", cold_store_directory);
+        return SYSCALL_ERROR;
+    }
+
+    pthread_condattr_t attributes;
+    if (unlikely(pthread_condattr_init(&attributes) != 0 || pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC) != 0 ||
+                 pthread_cond_init(&cold_tier_cond, &attributes) != 0))
+    {
+        PSE("Failed to initialize the cold tier condition variable");
+        return SYSCALL_ERROR;
+    }
+    pthread_condattr_destroy(&attributes);
+    // Started before main() blocks SIGINT/SIGTERM: the thread must not inherit an open mask, signals belong to the signal thread
+    sigset_t all_signals, previous_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &previous_mask);
+    int create_result = pthread_create(&cold_tier_thread_id, NULL, cold_tier_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+    if (unlikely(create_result != 0))
+    {
+        PSE("Failed to start the cold tier thread");
+        return SYSCALL_ERROR;
+    }
+    cold_tier_thread_started = 1;
+    return NO_ERROR;
+}
+
+void cold_tier_shutdown(void)
+{
+    if (cold_tier_thread_started)
+    {
+        pthread_mutex_lock(&cold_tier_lock);
+        cold_tier_stop = 1;
+        pthread_cond_signal(&cold_tier_cond);
+        pthread_mutex_unlock(&cold_tier_lock);
+        pthread_join(cold_tier_thread_id, NULL);
+        cold_tier_thread_started = 0;
+    }
+
+    pthread_mutex_lock(&cold_cache_lock);
+    for (size_t i = 0; i < cold_cache_capacity; i++)
+    {
+        free(cold_cache[i].raw);
+    }
+    free(cold_cache);
+    cold_cache = NULL;
+    cold_cache_capacity = 0;
+    pthread_mutex_unlock(&cold_cache_lock);
+
+    COLD_TIER_STATISTICS statistics;
+    cold_tier_statistics(&statistics);
+    if (statistics.moved_messages > 0 || statistics.cold_reads > 0 || statistics.archives_removed > 0)
+    {
+        P("Cold tier: %llu messages moved (%llu body bytes stored in %llu), %llu archives written, %llu removed, %llu bodies read "
+          "from archives (%llu from the block cache)",
+          (unsigned long long)statistics.moved_messages, (unsigned long long)statistics.moved_body_bytes, (unsigned long long)statistics.stored_bytes,
+          (unsigned long long)statistics.archives_written, (unsigned long long)statistics.archives_removed,
+          (unsigned long long)statistics.cold_reads, (unsigned long long)statistics.cache_hits);
+    }
+}
+
+void cold_tier_statistics(COLD_TIER_STATISTICS *out)
+{
+    if (unlikely(out == NULL))
+    {
+        return;
+    }
+    out->hot_messages = atomic_load(&cold_hot_messages);
+    out->cold_messages = atomic_load(&cold_cold_messages);
+    out->moved_messages = atomic_load(&cold_moved_messages);
+    out->moved_body_bytes = atomic_load(&cold_moved_body_bytes);
+    out->stored_bytes = atomic_load(&cold_stored_bytes);
+    out->archives_written = atomic_load(&cold_archives_written);
+    out->archives_removed = atomic_load(&cold_archives_removed);
+    out->cold_reads = atomic_load(&cold_reads);
+    out->cache_hits = atomic_load(&cold_cache_hits);
+}
+
+ERROR_CODE cold_tier_for_each_archive(ERROR_CODE (*callback)(const char *path, void *context), void *context)
+{
+    if (unlikely(callback == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    DIR *store = opendir(cold_store_directory);
+    if (store == NULL)
+    {
+        return errno == ENOENT ? NO_ERROR : SYSCALL_ERROR;
+    }
+    ERROR_CODE result = NO_ERROR;
+    size_t suffix_length = strlen(cold_archive_suffix);
+    struct dirent *user_entry;
+    while (result == NO_ERROR && (user_entry = readdir(store)) != NULL)
+    {
+        if (user_entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        char user_directory[PATH_MAX];
+        snprintf(user_directory, sizeof(user_directory), "%s/%s", cold_store_directory, user_entry->d_name);
+        DIR *directory = opendir(user_directory);
+        if (directory == NULL)
+        {
+            continue; // Not a user folder
+        }
+        struct dirent *entry;
+        while (result == NO_ERROR && (entry = readdir(directory)) != NULL)
+        {
+            size_t length = strlen(entry->d_name);
+            char path[PATH_MAX];
+            if (entry->d_name[0] == '.' || length <= suffix_length || strcmp(entry->d_name + length - suffix_length, cold_archive_suffix) != 0 ||
+                (size_t)snprintf(path, sizeof(path), "%s/%s", user_directory, entry->d_name) >= sizeof(path))
+            {
+                continue; // Leftovers of a pass (.tmp, .swap)
+            }
+            result = callback(path, context);
+        }
+        closedir(directory);
+    }
+    closedir(store);
+    return result;
+}
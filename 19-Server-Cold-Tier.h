@@ -0,0 +1,119 @@
+/**
+ * @file 19-Server-Cold-Tier.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the cold tier: bodies of old messages packed into compressed per-user archives
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+/**
+ * Most messages are never read again a few days after they arrive, yet each one keeps a whole file (and its blocks) in the tree.
+ * A background pass moves the bodies of the messages older than PGM_COLD_TIER_AGE_SECONDS into one archive per user and pass:
+ *   <cold_store_directory>/<username>/<16 hex digits of the archive id>.pgmz
+ * An archive is a COLD_ARCHIVE_HEADER followed by blocks, each one a COLD_BLOCK_HEADER and the bodies of up to COLD_BLOCK_SIZE
+ * bytes of messages, compressed with 18-Compression.h (stored as they are when that does not make them smaller).
+ *
+ * The message file keeps its name, its header and its checksum, only its body becomes a COLD_REFERENCE (K = sizeof(COLD_REFERENCE),
+ * see 4-Server-Storage.h for the other shapes):
+ *  - S == H + K + C (trailer magic)      cold body, always checksummed. Bodies of K and K + C bytes never go cold
+ * So listing, searching and quotas never notice, and loading a cold message reads and decompresses one block, kept in a small
+ * cache of decompressed blocks for the next messages of the same block.
+ *
+ * The pass writes and syncs the archive first, then swaps every message file with its record with renameat2(RENAME_EXCHANGE):
+ * a message that was marked as read or deleted meanwhile is simply skipped, and a crash leaves either the old file or the record.
+ * Messages with a shared body (7-Server-Body-Store.h) stay where they are, their body is already stored once. Archives no
+ * record points to anymore are removed by the next pass.
+ *
+ * Configuration:
+ *  - PGM_COLD_TIER_AGE_SECONDS       messages older than this go cold (default 0: no pass, cold messages are still served)
+ *  - PGM_COLD_TIER_INTERVAL_SECONDS  time between two passes (default COLD_TIER_DEFAULT_INTERVAL_SECONDS)
+ *  - PGM_COLD_CACHE_BLOCKS           decompressed blocks kept in memory (default COLD_CACHE_DEFAULT_BLOCKS, 0 = no cache)
+ * Only the file storage engine has a cold tier.
+ */
+
+typedef struct COLD_REFERENCE {
+    uint32_t magic;
+    uint32_t offset_in_block;  // Where the body starts in the decompressed block
+    uint64_t archive_id;
+    uint64_t block_offset;     // Of the COLD_BLOCK_HEADER in the archive
+    uint64_t reserved;
+} COLD_REFERENCE; // Host byte order, like BODY_REFERENCE
+
+typedef struct COLD_ARCHIVE_HEADER {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t archive_id;
+    char username[USERNAME_SIZE_CHARS];
+} COLD_ARCHIVE_HEADER;
+
+typedef struct COLD_BLOCK_HEADER {
+    uint32_t magic;
+    uint32_t raw_length;       // Bodies in the block
+    uint32_t stored_length;    // Bytes that follow, == raw_length if the block is not compressed
+    uint32_t crc32c;           // Of the stored bytes
+} COLD_BLOCK_HEADER;
+
+enum cold_tier_constants {
+    COLD_REFERENCE_MAGIC = 0x50474D59,         // "PGMY"
+    COLD_ARCHIVE_MAGIC = 0x50474D5A,           // "PGMZ"
+    COLD_BLOCK_MAGIC = 0x50474D4B,             // "PGMK"
+    COLD_ARCHIVE_VERSION = 1,
+    COLD_BLOCK_SIZE = 64 * 1024,               // Bodies per block before compression: one load decompresses at most this much
+    COLD_ARCHIVE_MAX_MESSAGES = 4096,          // A user with more old messages gets several archives in the same pass
+    COLD_TIER_DEFAULT_INTERVAL_SECONDS = 3600,
+    COLD_CACHE_DEFAULT_BLOCKS = 64,
+    COLD_CACHE_MAX_BLOCKS = 4096,
+};
+
+extern const char *cold_store_directory; // In the server working directory
+
+typedef struct COLD_TIER_STATISTICS {
+    uint64_t hot_messages;         // Last pass: messages whose body is in their file or in the body store
+    uint64_t cold_messages;        // Last pass: messages whose body is in an archive
+    uint64_t moved_messages;       // Since start
+    uint64_t moved_body_bytes;     // Since start, bodies of the moved messages
+    uint64_t stored_bytes;         // Since start, what the archives written for them take on disk
+    uint64_t archives_written;
+    uint64_t archives_removed;     // No record pointed to them anymore
+    uint64_t cold_reads;           // Bodies read from an archive
+    uint64_t cache_hits;           // Of those, served by the block cache
+} COLD_TIER_STATISTICS;
+
+/**
+ * @brief Reads the PGM_COLD_* variables, allocates the block cache and starts the pass thread if PGM_COLD_TIER_AGE_SECONDS is set
+ * @note Must be called once after storage_engine_init(), before any worker thread starts
+ * @return NO_ERROR on success, SYSCALL_ERROR if the cache or the thread cannot be set up
+ */
+extern ERROR_CODE cold_tier_init(void);
+
+/**
+ * @brief Stops the pass (waiting for the archive in progress), frees the cache and logs the statistics
+ */
+extern void cold_tier_shutdown(void);
+
+/**
+ * @return 1 if a file of @p file_size bytes (checksum trailer excluded) with @p message_length is a record pointing to a cold archive
+ */
+extern int cold_tier_is_reference_record(uint64_t file_size, uint32_t message_length);
+
+/**
+ * @brief Reads the body @p reference points to from the archives of @p username, through the block cache
+ * @note Also works without cold_tier_init() (offline tools), every call decompresses its block then
+ * @return NO_ERROR, STRING_SIZE_INVALID if the reference, the archive or the block is bogus, SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE cold_tier_read_body(const char *username, const COLD_REFERENCE *reference, char *body, uint32_t body_length);
+
+/**
+ * @brief Calls @p callback with the path (from the working directory) of every archive, stops at the first error
+ */
+extern ERROR_CODE cold_tier_for_each_archive(ERROR_CODE (*callback)(const char *path, void *context), void *context);
+
+extern void cold_tier_statistics(COLD_TIER_STATISTICS *out);
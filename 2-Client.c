@@ -11,6 +11,8 @@
 
 #include "3-Global-Variables-and-Functions.h"
 #include "2-Client.h"
+#include "18-Compression.h"
+#include "24-Header-Encoding.h"
 
 #include <sys/stat.h> /* For mkdir */
 #include <error.h>    /* For error handling and printing (strerror)*/
@@ -18,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h> // to get the home environment name
 #include <string.h> // String concatenation
+#include <strings.h> // strcasecmp
 #include <unistd.h> // for read
 #include <sys/socket.h> // socket, bind, listen, accept
 #include <netinet/in.h> // struct sockaddr_in, INADDR_ANY
@@ -27,6 +30,8 @@
 #include <linux/if_link.h> // IFLA_ADDRESS
 #include <stdint.h>	// uint32_t
 #include <stddef.h>	// offsetof
+#include <time.h>	// localtime, strftime
+#include <fcntl.h>	// open
 
 // SIMPLE PRINT STATEMENT ON STDOUT
 #define P(fmt, ...) do{fprintf(stdout,"[CL]>>> " fmt "\n", ##__VA_ARGS__);}while(0);
@@ -95,6 +100,299 @@ inline ERROR_CODE create_message(LOGIN_SESSION_ENVIRONMENT* login_env, MESSAGE*
 }
 */
 
+/**
+ * @brief Prints one line of the inbox or of the search results, @p summary as received from the server (network byte order)
+ */
+static void print_message_summary(size_t index, MESSAGE_SUMMARY *summary)
+{
+	// Never trust the peer to null terminate
+	summary->sender[USERNAME_SIZE_CHARS - 1] = '\0';
+	summary->subject[SUBJECT_SIZE_CHARS - 1] = '\0';
+	summary->filename[MESSAGE_SUMMARY_FILENAME_SIZE_CHARS - 1] = '\0';
+
+	char received_at[32] = "unknown date";
+	time_t timestamp = (time_t)network_to_host_64(summary->timestamp);
+	struct tm *local_time = timestamp != 0 ? localtime(&timestamp) : NULL; // Single threaded client, localtime() is fine
+	if (local_time != NULL)
+	{
+		strftime(received_at, sizeof(received_at), "%Y-%m-%d %H:%M:%S", local_time);
+	}
+	printf("  [%zu] %s %s From: %s  Subject: %s  (%u bytes)\n", index, received_at,
+		   (ntohl(summary->flags) & MESSAGE_SUMMARY_UNREAD) ? "[NEW]" : "     ",
+		   summary->sender, summary->subject, ntohl(summary->message_length));
+}
+
+/**
+ * @brief Asks the server to compress the bodies and the lists of this session, see 18-Compression.h
+ * @return NO_ERROR (@p wire enabled or not), SYSCALL_ERROR if the connection failed
+ */
+static ERROR_CODE negotiate_compression(int sockfd, const char *sender, WIRE_COMPRESSION *wire)
+{
+	WIRE_COMPRESSION_OFFER offer = wire_compression_local_offer();
+	if (offer.codecs == WIRE_CODEC_NONE)
+	{
+		return NO_ERROR; // PGM_COMPRESSION=off: not even asked, the session is exactly the old protocol
+	}
+	MESSAGE_CODE request_code = REQUEST_NEGOTIATE_COMPRESSION;
+	ERROR_CODE server_code = ERROR;
+	if (unlikely(send_all(sockfd, &request_code, sizeof(request_code)) < 0 || recv_all(sockfd, &server_code, sizeof(server_code)) <= 0))
+	{
+		PSE("[%s] >>> Failed to negotiate compression", sender);
+		return SYSCALL_ERROR;
+	}
+	if (server_code != NO_ERROR)
+	{
+		P("[%s] >>> Server without compression, session uncompressed", sender); // Older server: MESSAGE_ERROR
+		return NO_ERROR;
+	}
+	WIRE_COMPRESSION_OFFER request = {.codecs = htonl(offer.codecs), .min_bytes = htonl(offer.min_bytes)};
+	WIRE_COMPRESSION_OFFER answer = {0};
+	if (unlikely(send_all(sockfd, &request, sizeof(request)) < 0 || recv_all(sockfd, &answer, sizeof(answer)) <= 0))
+	{
+		PSE("[%s] >>> Failed to negotiate compression", sender);
+		return SYSCALL_ERROR;
+	}
+	wire->enabled = (ntohl(answer.codecs) & WIRE_CODEC_LZ77) != 0;
+	wire->min_bytes = ntohl(answer.min_bytes);
+	P("[%s] >>> Wire compression %s (bodies and lists of at least %u bytes)", sender, wire->enabled ? "on" : "off", wire->min_bytes);
+	return NO_ERROR;
+}
+
+/**
+ * @brief Asks the server for compact MESSAGE headers in this session, see 24-Header-Encoding.h
+ * @return NO_ERROR (@p headers compact or not), SYSCALL_ERROR if the connection failed
+ */
+static ERROR_CODE negotiate_header_encoding(int sockfd, const char *sender, WIRE_HEADERS *headers)
+{
+	if (!header_encoding_local_compact())
+	{
+		return NO_ERROR; // PGM_COMPACT_HEADERS=off: not even asked
+	}
+	MESSAGE_CODE request_code = REQUEST_NEGOTIATE_HEADER_ENCODING;
+	ERROR_CODE server_code = ERROR;
+	if (unlikely(send_all(sockfd, &request_code, sizeof(request_code)) < 0 || recv_all(sockfd, &server_code, sizeof(server_code)) <= 0))
+	{
+		PSE("[%s] >>> Failed to negotiate the header encoding", sender);
+		return SYSCALL_ERROR;
+	}
+	if (server_code != NO_ERROR)
+	{
+		P("[%s] >>> Server without compact headers, session uses fixed ones", sender); // Older server: MESSAGE_ERROR
+		return NO_ERROR;
+	}
+	uint32_t encodings = htonl(WIRE_HEADER_COMPACT);
+	uint32_t answer = 0;
+	if (unlikely(send_all(sockfd, &encodings, sizeof(encodings)) < 0 || recv_all(sockfd, &answer, sizeof(answer)) <= 0))
+	{
+		PSE("[%s] >>> Failed to negotiate the header encoding", sender);
+		return SYSCALL_ERROR;
+	}
+	headers->compact = ntohl(answer) == WIRE_HEADER_COMPACT;
+	P("[%s] >>> %s headers", sender, headers->compact ? "Compact" : "Fixed");
+	return NO_ERROR;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                                 SESSION RESUME                                                */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * The last RESUME_TOKEN of a user is kept in <username>.pgmresume in the working directory (readable by the owner only), so a
+ * client started again after a dropped connection logs in without the password. Quitting deletes it, PGM_RESUME=off disables it.
+ */
+static const char *resume_file_suffix = ".pgmresume";
+
+static int resume_enabled(void)
+{
+	const char *mode = getenv("PGM_RESUME");
+	return mode == NULL || strcasecmp(mode, "off") != 0;
+}
+
+static void resume_file_path(const char *sender, char *path, size_t path_size)
+{
+	snprintf(path, path_size, "%s%s", sender, resume_file_suffix);
+}
+
+/**
+ * @return 1 if a token of @p sender was read into @p token, 0 otherwise
+ */
+static int load_resume_token(const char *sender, RESUME_TOKEN *token)
+{
+	char path[USERNAME_SIZE_CHARS + 16];
+	resume_file_path(sender, path, sizeof(path));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	ssize_t read_bytes = read(fd, token, sizeof(*token));
+	close(fd);
+	return read_bytes == (ssize_t)sizeof(*token);
+}
+
+static void save_resume_token(const char *sender, const RESUME_TOKEN *token)
+{
+	char path[USERNAME_SIZE_CHARS + 16];
+	resume_file_path(sender, path, sizeof(path));
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (unlikely(fd < 0 || write(fd, token, sizeof(*token)) != (ssize_t)sizeof(*token)))
+	{
+		PSE("[%s] >>> Failed to save the resume token, the next login asks for the password", sender);
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		unlink(path);
+		return;
+	}
+	close(fd);
+}
+
+static void forget_resume_token(const char *sender)
+{
+	char path[USERNAME_SIZE_CHARS + 16];
+	resume_file_path(sender, path, sizeof(path));
+	unlink(path);
+}
+
+/**
+ * @brief Asks the server for a resume token once logged in and saves it
+ * @return NO_ERROR (token saved or server without tokens), SYSCALL_ERROR if the connection failed
+ */
+static ERROR_CODE request_resume_token(int sockfd, const char *sender)
+{
+	MESSAGE_CODE request_code = REQUEST_RESUME_TOKEN;
+	ERROR_CODE server_code = ERROR;
+	if (unlikely(send_all(sockfd, &request_code, sizeof(request_code)) < 0 || recv_all(sockfd, &server_code, sizeof(server_code)) <= 0))
+	{
+		PSE("[%s] >>> Failed to request a resume token", sender);
+		return SYSCALL_ERROR;
+	}
+	if (server_code != NO_ERROR)
+	{
+		P("[%s] >>> Server without resume tokens", sender); // Older server: MESSAGE_ERROR, or PGM_RESUME_TOKEN_SECONDS=0: ERROR
+		return NO_ERROR;
+	}
+	RESUME_TOKEN token;
+	if (unlikely(recv_all(sockfd, &token, sizeof(token)) <= 0))
+	{
+		PSE("[%s] >>> Failed to receive the resume token", sender);
+		return SYSCALL_ERROR;
+	}
+	save_resume_token(sender, &token);
+	return NO_ERROR;
+}
+
+/**
+ * @brief Sends the resume frame (see RESUME_TOKEN) instead of the username
+ * @return NO_ERROR (logged in, the new token is saved), RESUME_REJECTED (log in with the password on this connection), ERROR if the
+ * connection is no longer usable (an older server takes the frame for an invalid username and closes it)
+ */
+static ERROR_CODE resume_session(int sockfd, const char *sender, const RESUME_TOKEN *token)
+{
+	unsigned char frame[USERNAME_SIZE_CHARS + sizeof(RESUME_TOKEN)] = {0};
+	frame[0] = RESUME_FRAME_MARKER;
+	memcpy(frame + USERNAME_SIZE_CHARS, token, sizeof(*token));
+	ERROR_CODE server_code = ERROR;
+	if (unlikely(send_all(sockfd, frame, sizeof(frame)) < 0 || recv_all(sockfd, &server_code, sizeof(server_code)) <= 0))
+	{
+		P("[%s] >>> Resume failed, logging in again", sender);
+		return ERROR;
+	}
+	if (server_code != NO_ERROR)
+	{
+		P("[%s] >>> Resume refused: %s", sender, convert_error_code_to_string(server_code));
+		forget_resume_token(sender);
+		return server_code == RESUME_REJECTED ? RESUME_REJECTED : ERROR;
+	}
+	RESUME_TOKEN next_token;
+	if (unlikely(recv_all(sockfd, &next_token, sizeof(next_token)) <= 0))
+	{
+		PSE("[%s] >>> Failed to receive the new resume token", sender);
+		return ERROR;
+	}
+	save_resume_token(sender, &next_token);
+	P("[%s] >>> Session resumed", sender);
+	return NO_ERROR;
+}
+
+/**
+ * @return a socket connected to @p srv, -1 on error
+ */
+static int connect_to_server(const struct sockaddr_in *srv, const char *sender)
+{
+	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (unlikely(sockfd < 0))
+	{
+		PSE("[%s] >>> socket()", sender);
+		return -1;
+	}
+	if (unlikely(connect(sockfd, (const struct sockaddr *)srv, sizeof(*srv)) < 0))
+	{
+		PSE("[%s] >>> connect()", sender);
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+/**
+ * @brief Sends the hello frame (see PROTOCOL_HELLO) and sets up @p wire and @p headers with what the server picked
+ * @param out_capabilities set to the capabilities of the session
+ * @return NO_ERROR, ERROR if the server does not know the hello (an older one closes the connection)
+ */
+static ERROR_CODE send_hello(int sockfd, const char *sender, WIRE_COMPRESSION *wire, WIRE_HEADERS *headers, uint32_t *out_capabilities)
+{
+	WIRE_COMPRESSION_OFFER offer = wire_compression_local_offer();
+	uint32_t capabilities = PROTOCOL_CAPABILITY_DELIVERY_ACK;
+	capabilities |= (offer.codecs & WIRE_CODEC_LZ77) != 0 ? (uint32_t)PROTOCOL_CAPABILITY_COMPRESSION : 0u;
+	capabilities |= header_encoding_local_compact() ? (uint32_t)PROTOCOL_CAPABILITY_COMPACT_HEADERS : 0u;
+	PROTOCOL_HELLO hello = {.magic = htonl(PROTOCOL_HELLO_MAGIC), .version = htonl(PROTOCOL_VERSION), .capabilities = htonl(capabilities),
+							.compression_min_bytes = htonl(offer.min_bytes)};
+	unsigned char frame[USERNAME_SIZE_CHARS + sizeof(PROTOCOL_HELLO)] = {0};
+	frame[0] = HELLO_FRAME_MARKER;
+	memcpy(frame + USERNAME_SIZE_CHARS, &hello, sizeof(hello));
+	ERROR_CODE server_code = ERROR;
+	PROTOCOL_HELLO answer = {0};
+	if (send_all(sockfd, frame, sizeof(frame)) < 0 || recv_all(sockfd, &server_code, sizeof(server_code)) <= 0 || server_code != NO_ERROR ||
+		recv_all(sockfd, &answer, sizeof(answer)) <= 0 || ntohl(answer.magic) != PROTOCOL_HELLO_MAGIC)
+	{
+		P("[%s] >>> Server without hello, connecting again with the old protocol", sender);
+		return ERROR;
+	}
+	*out_capabilities = ntohl(answer.capabilities);
+	wire->enabled = (*out_capabilities & PROTOCOL_CAPABILITY_COMPRESSION) != 0;
+	wire->min_bytes = ntohl(answer.compression_min_bytes);
+	headers->compact = (*out_capabilities & PROTOCOL_CAPABILITY_COMPACT_HEADERS) != 0;
+	P("[%s] >>> Protocol %u, capabilities 0x%x (compression %s, %s headers)", sender, ntohl(answer.version), *out_capabilities,
+	  wire->enabled ? "on" : "off", headers->compact ? "compact" : "fixed");
+	return NO_ERROR;
+}
+
+/**
+ * @brief connect_to_server(), then the hello unless PGM_HELLO=off. A server that refuses the hello gets a new connection without it
+ * @param out_greeted 1 if the hello went through: @p wire, @p headers and @p out_capabilities hold the session settings
+ * @return the socket, -1 on error
+ */
+static int connect_and_greet(const struct sockaddr_in *srv, const char *sender, WIRE_COMPRESSION *wire, WIRE_HEADERS *headers,
+							 uint32_t *out_capabilities, int *out_greeted)
+{
+	*out_greeted = 0;
+	*out_capabilities = 0;
+	int sockfd = connect_to_server(srv, sender);
+	const char *mode = getenv("PGM_HELLO");
+	if (sockfd < 0 || (mode != NULL && strcasecmp(mode, "off") == 0))
+	{
+		return sockfd;
+	}
+	if (send_hello(sockfd, sender, wire, headers, out_capabilities) == NO_ERROR)
+	{
+		*out_greeted = 1;
+		return sockfd;
+	}
+	close(sockfd);
+	return connect_to_server(srv, sender);
+}
+
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
 /*                                                   MAIN LOOP                                                   */
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
@@ -166,6 +464,13 @@ int main(int argc, char** argv)
 	
 		int sockfd = -1;
 		struct sockaddr_in srv = {0};
+		// Settled by the hello, or after the login when the server does not know it
+		WIRE_COMPRESSION wire = {0};
+		WIRE_HEADERS headers = {0};
+		int delivery_ack = 0; // The server sends a final ERROR_CODE for REQUEST_SEND_MESSAGE, only settled by the hello
+		uint32_t capabilities = 0;
+		int greeted = 0;
+		int resumed = 0;
 		char server_ip[INET_ADDRSTRLEN];
 
 		P("[%s] >>> Enter server IPv4 address (default is local 0.0.0.0) (e.g. 192.168.1.10):", env.sender);
@@ -233,13 +538,6 @@ int main(int argc, char** argv)
 		}
 		const uint16_t SERVER_PORT = (uint16_t)port_long;
 
-		sockfd = socket(AF_INET, SOCK_STREAM, 0);
-		if (unlikely(sockfd < 0))
-		{
-			PSE("[%s] >>> socket()", env.sender);
-			return(1);
-		}
-
 		// Create the socket with the given port and server IP given by the user.
 		srv.sin_family = AF_INET; // IPv4 socket.
 		// Port in sockaddr_in must be stored in network byte order, not host byte order.
@@ -247,17 +545,33 @@ int main(int argc, char** argv)
 		if (unlikely(inet_pton(AF_INET, server_ip, &srv.sin_addr) <= 0))
 		{
 			PSE("[%s] >>> Invalid IPv4 address", env.sender);
-			close(sockfd);
 			return(1);
 		}
 
 		P("[%s] >>> Connecting to %s:%u ...", env.sender, server_ip, SERVER_PORT);
-		if (unlikely(connect(sockfd, (struct sockaddr *)&srv, sizeof(srv)) < 0))
+		sockfd = connect_and_greet(&srv, env.sender, &wire, &headers, &capabilities, &greeted);
+		if (unlikely(sockfd < 0))
 		{
-			PSE("[%s] >>> connect()", env.sender);
-			close(sockfd);
 			return(1);
 		}
+
+		// A token saved by a previous run that lost its connection logs in without the password
+		RESUME_TOKEN saved_token;
+		if (resume_enabled() && (!greeted || (capabilities & PROTOCOL_CAPABILITY_RESUME_TOKENS) != 0) && load_resume_token(env.sender, &saved_token))
+		{
+			ERROR_CODE resume_code = resume_session(sockfd, env.sender, &saved_token);
+			resumed = resume_code == NO_ERROR;
+			if (resume_code != NO_ERROR && resume_code != RESUME_REJECTED) // The server closed the connection: log in on a new one
+			{
+				close(sockfd);
+				// A server that refused the hello will refuse it again
+				sockfd = greeted ? connect_and_greet(&srv, env.sender, &wire, &headers, &capabilities, &greeted) : connect_to_server(&srv, env.sender);
+				if (unlikely(sockfd < 0))
+				{
+					return(1);
+				}
+			}
+		}
 	
 
 
@@ -266,6 +580,7 @@ int main(int argc, char** argv)
 		/* -------------------------------------------------------------------------- */
 		/*                            SERVER AUTHENTICATION                           */
 		/* -------------------------------------------------------------------------- */
+	if (!resumed)
 	{
 		// PHASE 3:
 		// Login handshake with the server.
@@ -405,6 +720,20 @@ int main(int argc, char** argv)
 					P("[%s] >>> Authentication successful", env.sender);
 					authenticated = 1;
 				}
+				else if (unlikely(server_code == SERVER_BUSY))
+				{
+					// Not a wrong password: the server is overloaded and already closed the connection
+					P("[%s] >>> Server busy, try again later", env.sender);
+					close(sockfd);
+					return(1);
+				}
+				else if (unlikely(server_code == LOGIN_THROTTLED))
+				{
+					// Too many failures for this user or this address, more attempts now would only extend the ban
+					P("[%s] >>> Too many failed logins, try again later", env.sender);
+					close(sockfd);
+					return(1);
+				}
 				else
 				{
 					// Increase attempts only on failed authentication responses.
@@ -420,6 +749,12 @@ int main(int argc, char** argv)
 				}
 			}
 		}
+		else if (server_code == LOGIN_THROTTLED)
+		{
+			P("[%s] >>> Too many failed logins, try again later", env.sender);
+			close(sockfd);
+			return(1);
+		}
 		else
 		{
 			P("[%s] >>> Unexpected server response: %s", env.sender, convert_error_code_to_string(server_code));
@@ -434,7 +769,16 @@ int main(int argc, char** argv)
 	/* -------------------------------------------------------------------------- */
 	/*                         MESSAGE SENDING AND READING                        */
 	/* -------------------------------------------------------------------------- */
-	int running = 1;
+	if (!resumed && resume_enabled() && (!greeted || (capabilities & PROTOCOL_CAPABILITY_RESUME_TOKENS) != 0) &&
+		unlikely(request_resume_token(sockfd, env.sender) != NO_ERROR))
+	{
+		close(sockfd);
+		return(1);
+	}
+	// The hello already settled both, only a server that did not get it is asked after the login
+	delivery_ack = greeted && (capabilities & PROTOCOL_CAPABILITY_DELIVERY_ACK) != 0;
+	int running = greeted || (negotiate_compression(sockfd, env.sender, &wire) == NO_ERROR &&
+							  negotiate_header_encoding(sockfd, env.sender, &headers) == NO_ERROR);
 	while (running)
 	{
 		// PHASE 4A:
@@ -445,6 +789,9 @@ int main(int argc, char** argv)
 		printf("  [3] Load message\n");
 		printf("  [4] Load unread messages list\n");
 		printf("  [5] Delete message\n");
+		printf("  [6] Inbox (sender, subject, size)\n");
+		printf("  [7] Search messages\n");
+		printf("  [8] Filter messages by sender/subject\n");
 		printf("  [q] Quit\n> ");
 		// Menu prompt ends with '>' and no newline, so flush now to make it visible immediately.
 		fflush(stdout);
@@ -501,6 +848,21 @@ int main(int argc, char** argv)
 		case 'D':
 			request_code = REQUEST_DELETE_MESSAGE;
 			break;
+		case '6':
+		case 'i':
+		case 'I':
+			request_code = REQUEST_LIST_MESSAGE_SUMMARIES;
+			break;
+		case '7':
+		case 'f':
+		case 'F':
+			request_code = REQUEST_SEARCH_MESSAGES;
+			break;
+		case '8':
+		case 'g':
+		case 'G':
+			request_code = REQUEST_FILTER_MESSAGES;
+			break;
 		case 'q':
 		case 'Q':
 			request_code = LOGOUT;
@@ -585,7 +947,7 @@ int main(int argc, char** argv)
 				// message_length is part of network payload, so convert host byte order -> network byte order.
 				header->message_length = htonl((uint32_t)body_len); // Message lenght is multibyte (32 bytes) so we need to convert it to Big endian
 
-				if (unlikely(send_all(sockfd, header, header_size) < 0))
+				if (unlikely(wire_send_header(sockfd, &headers, header) < 0))
 				{
 					PSE("[%s] >>> Failed to send MESSAGE header", env.sender);
 					free(header);
@@ -613,7 +975,7 @@ int main(int argc, char** argv)
 				// Body is sent as raw bytes without '\0': receiver already knows exact length from header->message_length.
 				if (likely(body_len > 0))
 				{
-					if (unlikely(send_all(sockfd, message_buf, body_len) < 0))
+					if (unlikely(wire_send_payload(sockfd, &wire, message_buf, (uint32_t)body_len, NULL, 0) < 0))
 					{
 						PSE("[%s] >>> Failed to send message body", env.sender);
 						free(header);
@@ -623,6 +985,20 @@ int main(int argc, char** argv)
 				}
 
 				free(header);
+
+				// A server that negotiated it acknowledges only once the message is stored durably on its side, the others send nothing more
+				ERROR_CODE delivery_code = NO_ERROR;
+				if (delivery_ack && unlikely(recv_all(sockfd, &delivery_code, sizeof(delivery_code)) <= 0))
+				{
+					PSE("[%s] >>> Failed to receive delivery confirmation", env.sender);
+					running = 0;
+					break;
+				}
+				if (unlikely(delivery_code != NO_ERROR))
+				{
+					P("[%s] >>> Message not stored by the server: %s", env.sender, convert_error_code_to_string(delivery_code));
+					break;
+				}
 				P("[%s] >>> Message sent", env.sender);
 				break;
 			}
@@ -667,7 +1043,7 @@ int main(int argc, char** argv)
 			}
 			if (likely(list_len > 0))
 			{
-				if (unlikely(recv_all(sockfd, list, list_len) <= 0))
+				if (unlikely(wire_recv_payload(sockfd, &wire, list, (uint32_t)list_len) <= 0))
 				{
 					PSE("[%s] >>> Failed to receive users list", env.sender);
 					free(list);
@@ -718,7 +1094,7 @@ int main(int argc, char** argv)
 			}
 			if (likely(list_len > 0))
 			{
-				if (unlikely(recv_all(sockfd, list, list_len) <= 0))
+				if (unlikely(wire_recv_payload(sockfd, &wire, list, (uint32_t)list_len) <= 0))
 				{
 					PSE("[%s] >>> Failed to receive message list", env.sender);
 					free(list);
@@ -866,7 +1242,7 @@ int main(int argc, char** argv)
 					running = 0;
 					break;
 				}
-				if (unlikely(recv_all(sockfd, header, header_size) <= 0))
+				if (unlikely(wire_recv_header(sockfd, &headers, header) <= 0))
 				{
 					PSE("[%s] >>> Failed to receive MESSAGE header", env.sender);
 					free(header);
@@ -903,7 +1279,7 @@ int main(int argc, char** argv)
 					running = 0;
 					break;
 				}
-				if (unlikely(recv_all(sockfd, body, body_len) <= 0))
+				if (unlikely(wire_recv_payload(sockfd, &wire, body, (uint32_t)body_len) <= 0))
 				{
 					PSE("[%s] >>> Failed to receive message body", env.sender);
 					free(body);
@@ -966,7 +1342,7 @@ int main(int argc, char** argv)
 			}
 			if (likely(list_len > 0))
 			{
-				if (unlikely(recv_all(sockfd, list, list_len) <= 0))
+				if (unlikely(wire_recv_payload(sockfd, &wire, list, (uint32_t)list_len) <= 0))
 				{
 					PSE("[%s] >>> Failed to receive unread list", env.sender);
 					free(list);
@@ -979,6 +1355,256 @@ int main(int argc, char** argv)
 			free(list);
 			break;
 		}
+		case REQUEST_LIST_MESSAGE_SUMMARIES:
+		{
+			// PHASE 4G:
+			// Inbox view: same length-prefix + ack handshake, but the payload is an array of MESSAGE_SUMMARY instead of filenames,
+			// so sender and subject are shown without downloading any message.
+			if (unlikely(send_all(sockfd, &request_code, sizeof(request_code)) < 0))
+			{
+				PSE("[%s] >>> Failed to send MESSAGE_CODE", env.sender);
+				running = 0;
+				break;
+			}
+
+			uint32_t summaries_len_net = 0;
+			if (unlikely(recv_all(sockfd, &summaries_len_net, sizeof(summaries_len_net)) <= 0))
+			{
+				PSE("[%s] >>> Failed to receive inbox length", env.sender);
+				running = 0;
+				break;
+			}
+			uint32_t summaries_len = ntohl(summaries_len_net);
+
+			ERROR_CODE ack = NO_ERROR;
+			if (unlikely(send_all(sockfd, &ack, sizeof(ack)) < 0))
+			{
+				PSE("[%s] >>> Failed to send inbox ack", env.sender);
+				running = 0;
+				break;
+			}
+
+			MESSAGE_SUMMARY *summaries = calloc(summaries_len == 0 ? 1 : summaries_len, 1);
+			if (unlikely(summaries == NULL))
+			{
+				PSE("[%s] >>> Failed to allocate inbox buffer", env.sender);
+				running = 0;
+				break;
+			}
+			if (likely(summaries_len > 0))
+			{
+				if (unlikely(wire_recv_payload(sockfd, &wire, summaries, (uint32_t)summaries_len) <= 0))
+				{
+					PSE("[%s] >>> Failed to receive inbox", env.sender);
+					free(summaries);
+					running = 0;
+					break;
+				}
+			}
+
+			size_t summary_count = summaries_len / sizeof(MESSAGE_SUMMARY);
+			printf("\nInbox (%zu messages):\n", summary_count);
+			for (size_t i = 0; i < summary_count; i++)
+			{
+				print_message_summary(i, &summaries[i]);
+			}
+			free(summaries);
+			break;
+		}
+		case REQUEST_SEARCH_MESSAGES:
+		{
+			// PHASE 4H:
+			// Search flow: send the query and the page, the server answers with an ERROR_CODE and then
+			// the same length-prefix + ack handshake as the inbox, the payload starting with the number of matches.
+			SEARCH_REQUEST search_request;
+			memset(&search_request, 0, sizeof(search_request));
+			printf("Insert the words to search (all of them must appear in subject or body):\n>");
+			fflush(stdout);
+			if (unlikely(fgets(search_request.query, sizeof(search_request.query), stdin) == NULL))
+			{
+				PSE("[%s] >>> Failed to read search query", env.sender);
+				running = 0;
+				break;
+			}
+			search_request.query[strcspn(search_request.query, "\n")] = '\0';
+
+			char page_buf[16] = {0};
+			printf("Insert page number (empty for the first, %u results per page):\n>", SEARCH_MAX_RESULTS_PER_PAGE);
+			fflush(stdout);
+			if (unlikely(fgets(page_buf, sizeof(page_buf), stdin) == NULL))
+			{
+				PSE("[%s] >>> Failed to read search page", env.sender);
+				running = 0;
+				break;
+			}
+			long page = strtol(page_buf, NULL, 10);
+			if (page < 1 || page > 100000)
+			{
+				page = 1;
+			}
+			search_request.offset = htonl((uint32_t)((page - 1) * SEARCH_MAX_RESULTS_PER_PAGE));
+			search_request.limit = htonl(SEARCH_MAX_RESULTS_PER_PAGE);
+
+			if (unlikely(send_all(sockfd, &request_code, sizeof(request_code)) < 0 ||
+						 send_all(sockfd, &search_request, sizeof(search_request)) < 0))
+			{
+				PSE("[%s] >>> Failed to send search request", env.sender);
+				running = 0;
+				break;
+			}
+			ERROR_CODE search_result = ERROR;
+			if (unlikely(recv_all(sockfd, &search_result, sizeof(search_result)) <= 0))
+			{
+				PSE("[%s] >>> Failed to receive search result", env.sender);
+				running = 0;
+				break;
+			}
+			if (search_result != NO_ERROR)
+			{
+				printf("%s\n", search_result == STRING_SIZE_INVALID ? "Nothing to search: use words of at least two letters or digits"
+																   : "Search is not available right now");
+				break;
+			}
+
+			uint32_t results_len_net = 0;
+			if (unlikely(recv_all(sockfd, &results_len_net, sizeof(results_len_net)) <= 0))
+			{
+				PSE("[%s] >>> Failed to receive search results length", env.sender);
+				running = 0;
+				break;
+			}
+			uint32_t results_len = ntohl(results_len_net);
+
+			// Anything smaller than the results header cannot be a valid answer: refuse it, the server then skips the payload
+			ERROR_CODE ack = results_len >= sizeof(SEARCH_RESULTS_HEADER) ? NO_ERROR : ERROR;
+			if (unlikely(send_all(sockfd, &ack, sizeof(ack)) < 0))
+			{
+				PSE("[%s] >>> Failed to send search results ack", env.sender);
+				running = 0;
+				break;
+			}
+			if (ack != NO_ERROR)
+			{
+				PSE("[%s] >>> Bogus search results length %u", env.sender, results_len);
+				break;
+			}
+
+			char *results = calloc(results_len, 1);
+			if (unlikely(results == NULL))
+			{
+				PSE("[%s] >>> Failed to allocate search results buffer", env.sender);
+				running = 0;
+				break;
+			}
+			if (unlikely(wire_recv_payload(sockfd, &wire, results, (uint32_t)results_len) <= 0))
+			{
+				PSE("[%s] >>> Failed to receive search results", env.sender);
+				free(results);
+				running = 0;
+				break;
+			}
+
+			SEARCH_RESULTS_HEADER *results_header = (SEARCH_RESULTS_HEADER *)results;
+			size_t summary_count = (results_len - sizeof(SEARCH_RESULTS_HEADER)) / sizeof(MESSAGE_SUMMARY);
+			if (summary_count > ntohl(results_header->returned))
+			{
+				summary_count = ntohl(results_header->returned);
+			}
+			MESSAGE_SUMMARY *summaries = (MESSAGE_SUMMARY *)(results + sizeof(SEARCH_RESULTS_HEADER));
+			printf("\nSearch \"%s\": %u matches, page %ld:\n", search_request.query, ntohl(results_header->total_matches), page);
+			for (size_t i = 0; i < summary_count; i++)
+			{
+				print_message_summary((size_t)(page - 1) * SEARCH_MAX_RESULTS_PER_PAGE + i, &summaries[i]);
+			}
+			free(results);
+			break;
+		}
+		case REQUEST_FILTER_MESSAGES:
+		{
+			// PHASE 4I:
+			// Filter flow: send what sender and subject must contain, then the same ERROR_CODE + length-prefix + ack as the search,
+			// the payload being a plain MESSAGE_SUMMARY array like the inbox.
+			FILTER_REQUEST filter_request;
+			memset(&filter_request, 0, sizeof(filter_request));
+			printf("Sender contains (empty for any sender):\n>");
+			fflush(stdout);
+			if (unlikely(fgets(filter_request.sender_contains, sizeof(filter_request.sender_contains), stdin) == NULL))
+			{
+				PSE("[%s] >>> Failed to read sender filter", env.sender);
+				running = 0;
+				break;
+			}
+			filter_request.sender_contains[strcspn(filter_request.sender_contains, "\n")] = '\0';
+			printf("Subject contains (empty for any subject):\n>");
+			fflush(stdout);
+			if (unlikely(fgets(filter_request.subject_contains, sizeof(filter_request.subject_contains), stdin) == NULL))
+			{
+				PSE("[%s] >>> Failed to read subject filter", env.sender);
+				running = 0;
+				break;
+			}
+			filter_request.subject_contains[strcspn(filter_request.subject_contains, "\n")] = '\0';
+
+			if (unlikely(send_all(sockfd, &request_code, sizeof(request_code)) < 0 ||
+						 send_all(sockfd, &filter_request, sizeof(filter_request)) < 0))
+			{
+				PSE("[%s] >>> Failed to send filter request", env.sender);
+				running = 0;
+				break;
+			}
+			ERROR_CODE filter_result = ERROR;
+			if (unlikely(recv_all(sockfd, &filter_result, sizeof(filter_result)) <= 0))
+			{
+				PSE("[%s] >>> Failed to receive filter result", env.sender);
+				running = 0;
+				break;
+			}
+			if (filter_result != NO_ERROR)
+			{
+				printf("%s\n", filter_result == STRING_SIZE_INVALID ? "Nothing to filter: give a sender, a subject or both"
+																   : "Filter is not available right now");
+				break;
+			}
+
+			uint32_t summaries_len_net = 0;
+			if (unlikely(recv_all(sockfd, &summaries_len_net, sizeof(summaries_len_net)) <= 0))
+			{
+				PSE("[%s] >>> Failed to receive filtered messages length", env.sender);
+				running = 0;
+				break;
+			}
+			uint32_t summaries_len = ntohl(summaries_len_net);
+			ERROR_CODE ack = NO_ERROR;
+			if (unlikely(send_all(sockfd, &ack, sizeof(ack)) < 0))
+			{
+				PSE("[%s] >>> Failed to send filtered messages ack", env.sender);
+				running = 0;
+				break;
+			}
+			MESSAGE_SUMMARY *summaries = calloc(summaries_len == 0 ? 1 : summaries_len, 1);
+			if (unlikely(summaries == NULL))
+			{
+				PSE("[%s] >>> Failed to allocate filtered messages buffer", env.sender);
+				running = 0;
+				break;
+			}
+			if (summaries_len > 0 && unlikely(wire_recv_payload(sockfd, &wire, summaries, (uint32_t)summaries_len) <= 0))
+			{
+				PSE("[%s] >>> Failed to receive filtered messages", env.sender);
+				free(summaries);
+				running = 0;
+				break;
+			}
+
+			size_t summary_count = summaries_len / sizeof(MESSAGE_SUMMARY);
+			printf("\nFiltered (%zu messages):\n", summary_count);
+			for (size_t i = 0; i < summary_count; i++)
+			{
+				print_message_summary(i, &summaries[i]);
+			}
+			free(summaries);
+			break;
+		}
 		case REQUEST_DELETE_MESSAGE:
 		{
 			// PHASE 4F:
@@ -1018,7 +1644,7 @@ int main(int argc, char** argv)
 			}
 			if (likely(list_len > 0))
 			{
-				if (unlikely(recv_all(sockfd, list, list_len) <= 0))
+				if (unlikely(wire_recv_payload(sockfd, &wire, list, (uint32_t)list_len) <= 0))
 				{
 					PSE("[%s] >>> Failed to receive delete list", env.sender);
 					free(list);
@@ -1168,6 +1794,7 @@ int main(int argc, char** argv)
 			{
 				PSE("[%s] >>> Failed to send LOGOUT", env.sender);
 			}
+			forget_resume_token(env.sender); // Quitting is not a dropped connection, the next start asks for the password
 			running = 0;
 			break;
 		default:
@@ -1195,6 +1822,18 @@ int main(int argc, char** argv)
 	/* -------------------------------------------------------------------------- */
 	/*                             END OF CLIENT LOOP                             */
 	/* -------------------------------------------------------------------------- */
+	if (wire.payloads_sent + wire.payloads_received > 0)
+	{
+		P("Wire compression: sent %llu bytes as %llu, received %llu bytes as %llu (%llu us compressing, %llu us decompressing)",
+		  (unsigned long long)wire.raw_bytes_sent, (unsigned long long)wire.wire_bytes_sent, (unsigned long long)wire.raw_bytes_received,
+		  (unsigned long long)wire.wire_bytes_received, (unsigned long long)(wire.compress_nanoseconds / 1000),
+		  (unsigned long long)(wire.decompress_nanoseconds / 1000));
+	}
+	if (headers.headers_sent + headers.headers_received > 0)
+	{
+		P("Compact headers: sent %llu in %llu bytes, received %llu in %llu bytes", (unsigned long long)headers.headers_sent,
+		  (unsigned long long)headers.bytes_sent, (unsigned long long)headers.headers_received, (unsigned long long)headers.bytes_received);
+	}
 	close(sockfd);
 	P("Exiting program");
 	return(0);
@@ -0,0 +1,400 @@
+/**
+ * @file 20-Server-Auth.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for password verifiers: salted memory-hard KDF, computed on a bounded pool of authentication threads
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "14-Server-Storage-Engine.h"
+#include "20-Server-Auth.h"
+#include <crypt.h>      // crypt_r, crypt_gensalt_rn, struct crypt_data
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, free
+#include <string.h>     // memset, strlen, strnlen, strncmp
+#include <signal.h>     // sigfillset, pthread_sigmask
+#include <stdint.h>     // uint64_t
+#include <pthread.h>    // pthread_create, pthread_join, pthread_mutex_t, pthread_cond_t
+#include <time.h>       // clock_gettime
+
+static const char *auth_verifier_prefix = "$y$"; // yescrypt, see crypt(5)
+
+typedef enum AUTH_JOB_TYPE {
+    AUTH_JOB_MAKE_VERIFIER,
+    AUTH_JOB_CHECK_PASSWORD,
+} AUTH_JOB_TYPE;
+
+/**
+ * @brief One request, on the stack of the waiting session
+ */
+typedef struct AUTH_JOB {
+    AUTH_JOB_TYPE type;
+    const char *username;
+    const char *password;
+    const char *stored;
+    char *out;
+    size_t out_size;
+
+    ERROR_CODE result;
+    int match;
+    uint64_t submitted_nanoseconds;
+    struct AUTH_JOB *next;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int done;
+} AUTH_JOB;
+
+// CONFIGURATION, written once by auth_init()
+static unsigned long auth_kdf_cost = AUTH_DEFAULT_KDF_COST;
+static size_t auth_queue_depth = AUTH_DEFAULT_QUEUE_DEPTH;
+static size_t auth_thread_count = 0;
+static pthread_t *auth_threads = NULL;
+
+// QUEUE AND COUNTERS, under the lock
+static pthread_mutex_t auth_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t auth_queued = PTHREAD_COND_INITIALIZER;
+static AUTH_JOB *auth_head = NULL;
+static AUTH_JOB *auth_tail = NULL;
+static size_t auth_queue_length = 0;
+static int auth_stop = 0;
+static AUTH_STATISTICS auth_counters = {0};
+
+static uint64_t auth_now_nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+int auth_is_verifier(const char *stored)
+{
+    return stored != NULL && strncmp(stored, auth_verifier_prefix, strlen(auth_verifier_prefix)) == 0;
+}
+
+/**
+ * @brief strcmp() == 0 whose time does not depend on where the strings differ
+ */
+static int auth_equal_constant_time(const char *a, const char *b)
+{
+    size_t a_length = strnlen(a, PASSWORD_SIZE_CHARS);
+    size_t b_length = strnlen(b, PASSWORD_SIZE_CHARS);
+    unsigned int difference = a_length != b_length;
+    for (size_t i = 0; i < PASSWORD_SIZE_CHARS; i++)
+    {
+        unsigned char a_byte = i < a_length ? (unsigned char)a[i] : 0;
+        unsigned char b_byte = i < b_length ? (unsigned char)b[i] : 0;
+        difference |= (unsigned int)(a_byte ^ b_byte);
+    }
+    return difference == 0;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              KDF                                                              */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief Hashes @p password with a fresh salt into @p out
+ * @param data scratch of the calling thread (32 KiB, too big for every call to clear it on the stack)
+ */
+static ERROR_CODE auth_hash(struct crypt_data *data, const char *password, char *out, size_t out_size)
+{
+    char setting[CRYPT_GENSALT_OUTPUT_SIZE];
+    // No random bytes given: libcrypt takes the salt from the kernel (getrandom)
+    if (unlikely(crypt_gensalt_rn(auth_verifier_prefix, auth_kdf_cost, NULL, 0, setting, (int)sizeof(setting)) == NULL))
+    {
+        PSE("Failed to make a password salt");
+        return SYSCALL_ERROR;
+    }
+    memset(data, 0, sizeof(*data));
+    const char *hash = crypt_r(password, setting, data);
+    if (unlikely(hash == NULL || hash[0] == '*' || (size_t)snprintf(out, out_size, "%s", hash) >= out_size))
+    {
+        PSE("Failed to hash a password");
+        return SYSCALL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+static void auth_run_job(AUTH_JOB *job, struct crypt_data *data)
+{
+    if (job->type == AUTH_JOB_MAKE_VERIFIER)
+    {
+        job->result = auth_hash(data, job->password, job->out, job->out_size);
+        return;
+    }
+
+    job->result = NO_ERROR;
+    if (!auth_is_verifier(job->stored))
+    {
+        // Written before verifiers existed: the file holds the password itself
+        job->match = auth_equal_constant_time(job->password, job->stored);
+        char verifier[PASSWORD_SIZE_CHARS];
+        if (job->match && auth_hash(data, job->password, verifier, sizeof(verifier)) == NO_ERROR &&
+            storage_engine->write_password(job->username, verifier) == NO_ERROR)
+        {
+            P("Password of [%s] migrated to a verifier", job->username);
+            pthread_mutex_lock(&auth_lock);
+            auth_counters.legacy_migrated++;
+            pthread_mutex_unlock(&auth_lock);
+        }
+        else if (job->match)
+        {
+            P("Failed to migrate the password of [%s], retried at the next login", job->username);
+        }
+        return;
+    }
+    memset(data, 0, sizeof(*data));
+    const char *hash = crypt_r(job->password, job->stored, data); // The setting (cost and salt) is the verifier itself
+    if (unlikely(hash == NULL || hash[0] == '*'))
+    {
+        P("Unusable password verifier for [%s]", job->username);
+        job->result = SYSCALL_ERROR;
+        return;
+    }
+    job->match = auth_equal_constant_time(hash, job->stored);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              POOL                                                             */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static void auth_count_latency(uint64_t nanoseconds)
+{
+    uint64_t microseconds = nanoseconds / 1000;
+    size_t bucket = 0;
+    while (microseconds > 1 && bucket < AUTH_LATENCY_BUCKETS - 1)
+    {
+        microseconds >>= 1;
+        bucket++;
+    }
+    auth_counters.latency_count[bucket]++;
+}
+
+static void *auth_thread(void *argument)
+{
+    (void)argument;
+    struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+    pthread_mutex_lock(&auth_lock);
+    for (;;)
+    {
+        while (auth_head == NULL && !auth_stop)
+        {
+            pthread_cond_wait(&auth_queued, &auth_lock);
+        }
+        if (auth_head == NULL) // Stopping, and nothing left to run
+        {
+            break;
+        }
+        AUTH_JOB *job = auth_head;
+        auth_head = job->next;
+        if (auth_head == NULL)
+        {
+            auth_tail = NULL;
+        }
+        auth_queue_length--;
+        pthread_mutex_unlock(&auth_lock);
+
+        if (likely(data != NULL))
+        {
+            auth_run_job(job, data);
+        }
+        else
+        {
+            job->result = SYSCALL_ERROR;
+        }
+
+        pthread_mutex_lock(&auth_lock);
+        if (job->result == NO_ERROR && job->type == AUTH_JOB_MAKE_VERIFIER)
+        {
+            auth_counters.verifiers_made++;
+        }
+        if (job->result == NO_ERROR && job->type == AUTH_JOB_CHECK_PASSWORD)
+        {
+            auth_counters.checks++;
+            auth_counters.mismatches += job->match ? 0 : 1;
+        }
+        auth_count_latency(auth_now_nanoseconds() - job->submitted_nanoseconds);
+        pthread_mutex_unlock(&auth_lock);
+
+        pthread_mutex_lock(&job->lock);
+        job->done = 1;
+        pthread_cond_signal(&job->done_cond);
+        pthread_mutex_unlock(&job->lock);
+
+        pthread_mutex_lock(&auth_lock);
+    }
+    pthread_mutex_unlock(&auth_lock);
+    free(data);
+    return NULL;
+}
+
+/**
+ * @brief Queues @p job and waits for it, or refuses it if PGM_AUTH_QUEUE_DEPTH requests are already waiting
+ * @return job->result, SERVER_BUSY if refused
+ */
+static ERROR_CODE auth_run(AUTH_JOB *job)
+{
+    job->next = NULL;
+    job->done = 0;
+    job->submitted_nanoseconds = auth_now_nanoseconds();
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done_cond, NULL);
+
+    pthread_mutex_lock(&auth_lock);
+    if (auth_thread_count == 0 || auth_stop || auth_queue_length >= auth_queue_depth)
+    {
+        auth_counters.refused_busy++;
+        pthread_mutex_unlock(&auth_lock);
+        pthread_mutex_destroy(&job->lock);
+        pthread_cond_destroy(&job->done_cond);
+        return SERVER_BUSY;
+    }
+    if (auth_tail != NULL)
+    {
+        auth_tail->next = job;
+    }
+    else
+    {
+        auth_head = job;
+    }
+    auth_tail = job;
+    auth_queue_length++;
+    pthread_cond_signal(&auth_queued);
+    pthread_mutex_unlock(&auth_lock);
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->done)
+    {
+        pthread_cond_wait(&job->done_cond, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+    // The authentication thread signalled under the lock and no longer touches the job once it released it
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->done_cond);
+    return job->result;
+}
+
+ERROR_CODE auth_make_verifier(const char *password, char *out, size_t out_size)
+{
+    if (unlikely(password == NULL || out == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    AUTH_JOB job = {.type = AUTH_JOB_MAKE_VERIFIER, .password = password, .out = out, .out_size = out_size};
+    return auth_run(&job);
+}
+
+ERROR_CODE auth_check_password(const char *username, const char *password, const char *stored, int *out_match)
+{
+    if (unlikely(username == NULL || password == NULL || stored == NULL || out_match == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    AUTH_JOB job = {.type = AUTH_JOB_CHECK_PASSWORD, .username = username, .password = password, .stored = stored};
+    ERROR_CODE result = auth_run(&job);
+    *out_match = result == NO_ERROR && job.match;
+    return result;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LIFECYCLE                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE auth_init(void)
+{
+    auth_kdf_cost = (unsigned long)read_environment_long("PGM_AUTH_KDF_COST", AUTH_DEFAULT_KDF_COST, 1, AUTH_MAX_KDF_COST);
+    auth_queue_depth = (size_t)read_environment_long("PGM_AUTH_QUEUE_DEPTH", AUTH_DEFAULT_QUEUE_DEPTH, 1, AUTH_MAX_QUEUE_DEPTH);
+    size_t thread_count = (size_t)read_environment_long("PGM_AUTH_THREADS", AUTH_DEFAULT_THREADS, 1, AUTH_MAX_THREADS);
+    auth_threads = calloc(thread_count, sizeof(pthread_t));
+    if (unlikely(auth_threads == NULL))
+    {
+        PSE("Failed to allocate the authentication threads");
+        return SYSCALL_ERROR;
+    }
+    // Started before main() blocks SIGINT/SIGTERM: the threads must not inherit an open mask, signals belong to the signal thread
+    sigset_t all_signals, previous_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &previous_mask);
+    size_t started = 0;
+    while (started < thread_count && pthread_create(&auth_threads[started], NULL, auth_thread, NULL) == 0)
+    {
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+    pthread_mutex_lock(&auth_lock);
+    auth_thread_count = started;
+    pthread_mutex_unlock(&auth_lock);
+    if (unlikely(started < thread_count))
+    {
+        PSE("Failed to start the authentication threads (%zu of %zu started)", started, thread_count);
+        auth_shutdown();
+        return SYSCALL_ERROR;
+    }
+    P("Authentication: %zu threads, %zu requests queued at most, yescrypt cost %lu", auth_thread_count, auth_queue_depth, auth_kdf_cost);
+    return NO_ERROR;
+}
+
+/**
+ * @return the upper bound, in microseconds, of the bucket holding the @p percent percentile of the latencies
+ */
+static uint64_t auth_latency_percentile(const AUTH_STATISTICS *statistics, uint64_t total, unsigned int percent)
+{
+    uint64_t seen = 0;
+    for (size_t i = 0; i < AUTH_LATENCY_BUCKETS; i++)
+    {
+        seen += statistics->latency_count[i];
+        if (seen * 100 >= total * percent)
+        {
+            return 2ull << i;
+        }
+    }
+    return 2ull << (AUTH_LATENCY_BUCKETS - 1);
+}
+
+void auth_shutdown(void)
+{
+    pthread_mutex_lock(&auth_lock);
+    auth_stop = 1;
+    pthread_cond_broadcast(&auth_queued);
+    size_t thread_count = auth_thread_count;
+    pthread_mutex_unlock(&auth_lock);
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        pthread_join(auth_threads[i], NULL);
+    }
+    free(auth_threads);
+    auth_threads = NULL;
+    auth_thread_count = 0;
+
+    AUTH_STATISTICS statistics;
+    auth_statistics(&statistics);
+    uint64_t total = 0;
+    for (size_t i = 0; i < AUTH_LATENCY_BUCKETS; i++)
+    {
+        total += statistics.latency_count[i];
+    }
+    if (total > 0 || statistics.refused_busy > 0)
+    {
+        P("Authentication: %llu checks (%llu wrong passwords), %llu verifiers made, %llu legacy passwords migrated, %llu requests refused (queue full)",
+          (unsigned long long)statistics.checks, (unsigned long long)statistics.mismatches, (unsigned long long)statistics.verifiers_made,
+          (unsigned long long)statistics.legacy_migrated, (unsigned long long)statistics.refused_busy);
+    }
+    if (total > 0)
+    {
+        P("Authentication latency (queue and KDF): median < %llu us, 99th percentile < %llu us",
+          (unsigned long long)auth_latency_percentile(&statistics, total, 50), (unsigned long long)auth_latency_percentile(&statistics, total, 99));
+    }
+}
+
+void auth_statistics(AUTH_STATISTICS *out)
+{
+    pthread_mutex_lock(&auth_lock);
+    *out = auth_counters;
+    pthread_mutex_unlock(&auth_lock);
+}
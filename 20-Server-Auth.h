@@ -0,0 +1,91 @@
+/**
+ * @file 20-Server-Auth.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for password verifiers: salted memory-hard KDF, computed on a bounded pool of authentication threads
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+/**
+ * The password file of a user holds a verifier, never the password: a yescrypt hash (crypt(5), "$y$..." with its random salt and
+ * its cost) computed by libcrypt. Checking a password costs one KDF run, tens of milliseconds and a few MiB of memory by design, so
+ * it never runs on a session thread directly:
+ *  - auth_make_verifier() and auth_check_password() queue the work for one of the PGM_AUTH_THREADS threads and wait for it
+ *  - at most PGM_AUTH_QUEUE_DEPTH requests wait in the queue, the next ones are refused with SERVER_BUSY right away: during a
+ *    reconnect storm a login either starts within depth / threads KDF runs or fails fast, it never waits behind an unbounded queue
+ *
+ * Password files written before verifiers existed hold the password itself. They are still accepted (compared in constant time)
+ * and the first successful login replaces them with a verifier, through storage_engine->write_password().
+ *
+ * Configuration:
+ *  - PGM_AUTH_KDF_COST     yescrypt cost of new verifiers, 1 to 11 (default AUTH_DEFAULT_KDF_COST), each step doubles time and memory.
+ *                          Existing verifiers keep the cost they were made with
+ *  - PGM_AUTH_THREADS      KDF threads (default AUTH_DEFAULT_THREADS)
+ *  - PGM_AUTH_QUEUE_DEPTH  requests allowed to wait for a thread (default AUTH_DEFAULT_QUEUE_DEPTH)
+ *
+ * Requests, refusals, migrations and the latency of the requests (queue and KDF, median and 99th percentile) are logged by
+ * auth_shutdown().
+ */
+
+enum auth_constants {
+    AUTH_DEFAULT_KDF_COST = 5,      // About 20 ms and 8 MiB per run on a current x86 core
+    AUTH_MAX_KDF_COST = 11,
+    AUTH_DEFAULT_THREADS = 4,
+    AUTH_MAX_THREADS = 64,
+    AUTH_DEFAULT_QUEUE_DEPTH = 64,
+    AUTH_MAX_QUEUE_DEPTH = 4096,
+    AUTH_LATENCY_BUCKETS = 32,      // Powers of two of microseconds
+};
+
+typedef struct AUTH_STATISTICS {
+    uint64_t verifiers_made;        // Registrations
+    uint64_t checks;
+    uint64_t mismatches;
+    uint64_t legacy_migrated;       // Plaintext password files replaced by a verifier
+    uint64_t refused_busy;          // Queue full: SERVER_BUSY
+    uint64_t latency_count[AUTH_LATENCY_BUCKETS]; // Queue + KDF, bucket i: [2^i, 2^(i+1)) us
+} AUTH_STATISTICS;
+
+/**
+ * @brief Reads the PGM_AUTH_* variables and starts the authentication threads
+ * @note Must be called once before any worker thread starts
+ * @return NO_ERROR on success, SYSCALL_ERROR if a thread cannot be started
+ */
+extern ERROR_CODE auth_init(void);
+
+/**
+ * @brief Stops the authentication threads and logs the statistics, only to be called once every worker thread has been joined
+ */
+extern void auth_shutdown(void);
+
+/**
+ * @brief Makes a new verifier (fresh salt, PGM_AUTH_KDF_COST) for @p password on an authentication thread
+ * @param out room for PASSWORD_SIZE_CHARS bytes
+ * @return NO_ERROR, SERVER_BUSY if the queue is full, SYSCALL_ERROR if libcrypt fails
+ */
+extern ERROR_CODE auth_make_verifier(const char *password, char *out, size_t out_size);
+
+/**
+ * @brief Checks @p password against @p stored (a verifier, or a legacy plaintext password file) on an authentication thread
+ *
+ * A legacy password that matches is replaced by a verifier before returning, a failed migration is logged and retried at the
+ * next login.
+ * @param out_match set to 1 if the password is right, 0 otherwise
+ * @return NO_ERROR (@p out_match set), SERVER_BUSY if the queue is full, SYSCALL_ERROR if libcrypt fails
+ */
+extern ERROR_CODE auth_check_password(const char *username, const char *password, const char *stored, int *out_match);
+
+/**
+ * @return 1 if @p stored is a verifier, 0 if it is a legacy plaintext password
+ */
+extern int auth_is_verifier(const char *stored);
+
+extern void auth_statistics(AUTH_STATISTICS *out);
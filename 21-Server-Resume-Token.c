@@ -0,0 +1,250 @@
+/**
+ * @file 21-Server-Resume-Token.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for session resume tokens: signed, expiring proofs of a past login that skip the password on reconnect
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "21-Server-Resume-Token.h"
+#include <stdio.h>      // snprintf
+#include <string.h>     // memcpy, memset, strnlen
+#include <stdint.h>     // uint8_t, uint64_t
+#include <stddef.h>     // offsetof
+#include <pthread.h>    // pthread_mutex_t
+#include <time.h>       // clock_gettime
+#include <sys/random.h> // getrandom
+
+// CONFIGURATION, written once by resume_token_init()
+static uint64_t resume_token_seconds = RESUME_TOKEN_DEFAULT_SECONDS;
+static uint64_t resume_key[2] = {0};
+
+static pthread_mutex_t resume_lock = PTHREAD_MUTEX_INITIALIZER;
+static RESUME_TOKEN_STATISTICS resume_counters = {0};
+
+/**
+ * @brief Seconds of CLOCK_MONOTONIC: tokens never outlive the key, which never outlives the process, so wall clock jumps do not matter
+ */
+static uint64_t resume_now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              SIPHASH-2-4                                                      */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static uint64_t resume_rotate(uint64_t value, unsigned int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t resume_load64_little_endian(const uint8_t *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void resume_store64_little_endian(uint8_t *p, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        p[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void resume_sipround(uint64_t v[4])
+{
+    v[0] += v[1]; v[1] = resume_rotate(v[1], 13); v[1] ^= v[0]; v[0] = resume_rotate(v[0], 32);
+    v[2] += v[3]; v[3] = resume_rotate(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = resume_rotate(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = resume_rotate(v[1], 17); v[1] ^= v[2]; v[2] = resume_rotate(v[2], 32);
+}
+
+/**
+ * @brief SipHash-2-4 with a 128 bit output (the variant of the reference implementation), a keyed PRF used here as a MAC
+ */
+static void resume_siphash128(const uint64_t key[2], const uint8_t *data, size_t length, uint8_t out[RESUME_TOKEN_TAG_BYTES])
+{
+    uint64_t v[4] = {0x736f6d6570736575ull ^ key[0], 0x646f72616e646f6dull ^ key[1], 0x6c7967656e657261ull ^ key[0],
+                     0x7465646279746573ull ^ key[1]};
+    v[1] ^= 0xee;
+    const uint8_t *end = data + (length - length % 8);
+    for (; data != end; data += 8)
+    {
+        uint64_t word = resume_load64_little_endian(data);
+        v[3] ^= word;
+        resume_sipround(v);
+        resume_sipround(v);
+        v[0] ^= word;
+    }
+    uint64_t last = (uint64_t)length << 56;
+    for (size_t i = 0; i < length % 8; i++)
+    {
+        last |= (uint64_t)data[i] << (8 * i);
+    }
+    v[3] ^= last;
+    resume_sipround(v);
+    resume_sipround(v);
+    v[0] ^= last;
+
+    v[2] ^= 0xee;
+    for (int i = 0; i < 4; i++)
+    {
+        resume_sipround(v);
+    }
+    resume_store64_little_endian(out, v[0] ^ v[1] ^ v[2] ^ v[3]);
+    v[1] ^= 0xdd;
+    for (int i = 0; i < 4; i++)
+    {
+        resume_sipround(v);
+    }
+    resume_store64_little_endian(out + 8, v[0] ^ v[1] ^ v[2] ^ v[3]);
+}
+
+/**
+ * @brief The tag covers every byte before it, padding included (there is none, all fields are 8 byte multiples)
+ */
+static void resume_token_sign(const RESUME_TOKEN *token, uint8_t out[RESUME_TOKEN_TAG_BYTES])
+{
+    resume_siphash128(resume_key, (const uint8_t *)token, offsetof(RESUME_TOKEN, tag), out);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              TOKENS                                                           */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE resume_token_issue(const char *username, RESUME_TOKEN *out)
+{
+    if (unlikely(username == NULL || out == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    if (resume_token_seconds == 0)
+    {
+        return ERROR;
+    }
+    memset(out, 0, sizeof(*out));
+    snprintf(out->username, sizeof(out->username), "%s", username);
+    out->expires = host_to_network_64(resume_now_seconds() + resume_token_seconds);
+    uint64_t nonce = 0;
+    if (unlikely(getrandom(&nonce, sizeof(nonce), 0) != (ssize_t)sizeof(nonce)))
+    {
+        PSE("Failed to draw the nonce of a resume token");
+        return SYSCALL_ERROR;
+    }
+    out->nonce = nonce; // Random bytes, no byte order
+    resume_token_sign(out, out->tag);
+
+    pthread_mutex_lock(&resume_lock);
+    resume_counters.issued++;
+    pthread_mutex_unlock(&resume_lock);
+    return NO_ERROR;
+}
+
+int resume_token_enabled(void)
+{
+    return resume_token_seconds != 0;
+}
+
+ERROR_CODE resume_token_check(const RESUME_TOKEN *token, char *out_username)
+{
+    if (unlikely(token == NULL || out_username == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    out_username[0] = '\0';
+    if (resume_token_seconds == 0)
+    {
+        return RESUME_REJECTED;
+    }
+    uint8_t expected[RESUME_TOKEN_TAG_BYTES];
+    resume_token_sign(token, expected);
+    unsigned int difference = 0; // Constant time: the position of the first wrong byte must not leak
+    for (size_t i = 0; i < RESUME_TOKEN_TAG_BYTES; i++)
+    {
+        difference |= (unsigned int)(expected[i] ^ token->tag[i]);
+    }
+    int expired = network_to_host_64(token->expires) <= resume_now_seconds();
+
+    pthread_mutex_lock(&resume_lock);
+    if (difference != 0)
+    {
+        resume_counters.rejected_signature++;
+    }
+    else if (expired)
+    {
+        resume_counters.rejected_expired++;
+    }
+    pthread_mutex_unlock(&resume_lock);
+    if (difference != 0 || expired || strnlen(token->username, sizeof(token->username)) == sizeof(token->username))
+    {
+        return RESUME_REJECTED;
+    }
+    memcpy(out_username, token->username, sizeof(token->username));
+    return NO_ERROR;
+}
+
+void resume_token_count_resume(int took_over)
+{
+    pthread_mutex_lock(&resume_lock);
+    resume_counters.resumed++;
+    resume_counters.sessions_taken_over += took_over ? 1 : 0;
+    pthread_mutex_unlock(&resume_lock);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LIFECYCLE                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE resume_token_init(void)
+{
+    resume_token_seconds = (uint64_t)read_environment_long("PGM_RESUME_TOKEN_SECONDS", RESUME_TOKEN_DEFAULT_SECONDS, 0, RESUME_TOKEN_MAX_SECONDS);
+    if (unlikely(getrandom(resume_key, sizeof(resume_key), 0) != (ssize_t)sizeof(resume_key)))
+    {
+        PSE("Failed to draw the resume token key");
+        return SYSCALL_ERROR;
+    }
+    if (resume_token_seconds == 0)
+    {
+        P("Resume tokens: off");
+    }
+    else
+    {
+        P("Resume tokens: valid for %llu s", (unsigned long long)resume_token_seconds);
+    }
+    return NO_ERROR;
+}
+
+void resume_token_shutdown(void)
+{
+    RESUME_TOKEN_STATISTICS statistics;
+    resume_token_statistics(&statistics);
+    if (statistics.issued + statistics.rejected_signature + statistics.rejected_expired > 0)
+    {
+        P("Resume tokens: %llu issued, %llu sessions resumed (%llu took over a session still logged in), %llu rejected (%llu bad signature, %llu expired)",
+          (unsigned long long)statistics.issued, (unsigned long long)statistics.resumed, (unsigned long long)statistics.sessions_taken_over,
+          (unsigned long long)(statistics.rejected_signature + statistics.rejected_expired), (unsigned long long)statistics.rejected_signature,
+          (unsigned long long)statistics.rejected_expired);
+    }
+    memset(resume_key, 0, sizeof(resume_key));
+}
+
+void resume_token_statistics(RESUME_TOKEN_STATISTICS *out)
+{
+    pthread_mutex_lock(&resume_lock);
+    *out = resume_counters;
+    pthread_mutex_unlock(&resume_lock);
+}
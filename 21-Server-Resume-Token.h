@@ -0,0 +1,77 @@
+/**
+ * @file 21-Server-Resume-Token.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for session resume tokens: signed, expiring proofs of a past login that skip the password on reconnect
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stdint.h> // uint64_t
+
+/**
+ * A RESUME_TOKEN (see 3-Global-Variables-and-Functions.h) names a user and an expiry, signed with SipHash-2-4 (128 bit tag) under a
+ * key drawn from the kernel when the server starts. Checking one costs a hash of 80 bytes: no password file is read and no KDF
+ * runs, so a client that lost its connection is back in one round trip. The server keeps no table of tokens:
+ *  - a token is valid until it expires, every resume hands out a new one
+ *  - a restart draws a new key, every token handed out before is rejected and the clients log in with their password
+ * A resume takes over the logged in slot of the user when the server still holds the old session (the peer vanished without
+ * closing it): that session is shut down instead of the resume being refused as a double login.
+ *
+ * Configuration:
+ *  - PGM_RESUME_TOKEN_SECONDS  lifetime of a token (default RESUME_TOKEN_DEFAULT_SECONDS), 0 to hand out none and reject all
+ */
+
+enum resume_token_constants {
+    RESUME_TOKEN_DEFAULT_SECONDS = 600,
+    RESUME_TOKEN_MAX_SECONDS = 86400,
+};
+
+typedef struct RESUME_TOKEN_STATISTICS {
+    uint64_t issued;
+    uint64_t resumed;
+    uint64_t rejected_signature;   // Forged, damaged, or signed before the last restart
+    uint64_t rejected_expired;
+    uint64_t sessions_taken_over;  // Resumes that replaced a session still logged in
+} RESUME_TOKEN_STATISTICS;
+
+/**
+ * @brief Reads PGM_RESUME_TOKEN_SECONDS and draws the signing key
+ * @return NO_ERROR, SYSCALL_ERROR if the kernel gives no random bytes
+ */
+extern ERROR_CODE resume_token_init(void);
+
+/**
+ * @brief Logs the statistics, only to be called once every worker thread has been joined
+ */
+extern void resume_token_shutdown(void);
+
+/**
+ * @return 1 if tokens are issued (PGM_RESUME_TOKEN_SECONDS is not 0), what the server advertises in its PROTOCOL_HELLO
+ */
+extern int resume_token_enabled(void);
+
+/**
+ * @brief Signs a new token for @p username into @p out (network byte order, ready to send)
+ * @return NO_ERROR, ERROR if tokens are disabled
+ */
+extern ERROR_CODE resume_token_issue(const char *username, RESUME_TOKEN *out);
+
+/**
+ * @brief Checks the signature and the expiry of @p token, then copies its username into @p out_username
+ * @param out_username room for USERNAME_SIZE_CHARS bytes, always null terminated
+ * @return NO_ERROR, RESUME_REJECTED otherwise
+ * @note The caller still checks that the user exists
+ */
+extern ERROR_CODE resume_token_check(const RESUME_TOKEN *token, char *out_username);
+
+/**
+ * @brief Counts a resume that completed, @p took_over if it replaced a session still logged in
+ */
+extern void resume_token_count_resume(int took_over);
+
+extern void resume_token_statistics(RESUME_TOKEN_STATISTICS *out);
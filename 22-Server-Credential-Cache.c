@@ -0,0 +1,323 @@
+/**
+ * @file 22-Server-Credential-Cache.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the cache of password verifiers, what the file engine answers logins from before reading .PASSWORD
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "5-Server-User-Registry.h"
+#include "14-Server-Storage-Engine.h"
+#include "22-Server-Credential-Cache.h"
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, free, getenv
+#include <string.h>     // strcmp, memset, strchr
+#include <strings.h>    // strcasecmp
+#include <stdint.h>     // uint32_t, uint64_t
+#include <pthread.h>    // pthread_mutex_t
+
+typedef struct CREDENTIAL_ENTRY {
+    char username[USERNAME_SIZE_CHARS];       // Empty when the entry is free
+    char stored[PASSWORD_SIZE_CHARS];
+    struct CREDENTIAL_ENTRY *hash_next;       // Also the free list
+    struct CREDENTIAL_ENTRY *lru_previous;    // Most recently used first
+    struct CREDENTIAL_ENTRY *lru_next;
+} CREDENTIAL_ENTRY;
+
+// Written once by credential_cache_init(), the content under the lock
+static pthread_mutex_t credential_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t credential_cache_capacity = 0;
+static CREDENTIAL_ENTRY *credential_entries = NULL;
+static CREDENTIAL_ENTRY **credential_buckets = NULL;
+static size_t credential_bucket_mask = 0;      // Bucket count - 1, a power of two
+static CREDENTIAL_ENTRY *credential_free = NULL;
+static CREDENTIAL_ENTRY *credential_lru_head = NULL;
+static CREDENTIAL_ENTRY *credential_lru_tail = NULL;
+static uint64_t credential_generation = 0;     // Bumped by every invalidation
+static CREDENTIAL_CACHE_STATISTICS credential_counters = {0};
+
+static uint32_t credential_hash(const char *username)
+{
+    uint32_t hash = 2166136261u; // FNV-1a, like the user registry
+    for (const unsigned char *cursor = (const unsigned char *)username; *cursor != '\0'; cursor++)
+    {
+        hash = (hash ^ *cursor) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @return the link pointing to the entry of @p username (or the NULL ending its bucket), under the lock
+ */
+static CREDENTIAL_ENTRY **credential_find(const char *username)
+{
+    CREDENTIAL_ENTRY **link = &credential_buckets[credential_hash(username) & credential_bucket_mask];
+    while (*link != NULL && strcmp((*link)->username, username) != 0)
+    {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+static void credential_lru_unlink(CREDENTIAL_ENTRY *entry)
+{
+    if (entry->lru_previous != NULL)
+    {
+        entry->lru_previous->lru_next = entry->lru_next;
+    }
+    else
+    {
+        credential_lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL)
+    {
+        entry->lru_next->lru_previous = entry->lru_previous;
+    }
+    else
+    {
+        credential_lru_tail = entry->lru_previous;
+    }
+    entry->lru_previous = NULL;
+    entry->lru_next = NULL;
+}
+
+static void credential_lru_push_front(CREDENTIAL_ENTRY *entry)
+{
+    entry->lru_previous = NULL;
+    entry->lru_next = credential_lru_head;
+    if (credential_lru_head != NULL)
+    {
+        credential_lru_head->lru_previous = entry;
+    }
+    credential_lru_head = entry;
+    if (credential_lru_tail == NULL)
+    {
+        credential_lru_tail = entry;
+    }
+}
+
+/**
+ * @brief Takes @p entry (found through @p link) out of its bucket and of the LRU list, and gives it back to the free list
+ */
+static void credential_remove(CREDENTIAL_ENTRY **link, CREDENTIAL_ENTRY *entry)
+{
+    *link = entry->hash_next;
+    credential_lru_unlink(entry);
+    memset(entry->username, 0, sizeof(entry->username));
+    memset(entry->stored, 0, sizeof(entry->stored)); // Verifiers are not secrets, legacy passwords are
+    entry->hash_next = credential_free;
+    credential_free = entry;
+}
+
+int credential_cache_lookup(const char *username, char *out, size_t out_size, uint64_t *out_ticket)
+{
+    if (unlikely(username == NULL || out == NULL || out_ticket == NULL))
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&credential_cache_lock);
+    *out_ticket = credential_generation;
+    if (credential_cache_capacity == 0)
+    {
+        pthread_mutex_unlock(&credential_cache_lock);
+        return 0;
+    }
+    CREDENTIAL_ENTRY *entry = *credential_find(username);
+    if (entry == NULL)
+    {
+        credential_counters.misses++;
+        pthread_mutex_unlock(&credential_cache_lock);
+        return 0;
+    }
+    credential_counters.hits++;
+    credential_lru_unlink(entry);
+    credential_lru_push_front(entry);
+    snprintf(out, out_size, "%s", entry->stored);
+    pthread_mutex_unlock(&credential_cache_lock);
+    return 1;
+}
+
+void credential_cache_fill(const char *username, const char *stored, uint64_t ticket)
+{
+    if (unlikely(username == NULL || stored == NULL || username[0] == '\0'))
+    {
+        return;
+    }
+    pthread_mutex_lock(&credential_cache_lock);
+    if (credential_cache_capacity == 0)
+    {
+        pthread_mutex_unlock(&credential_cache_lock);
+        return;
+    }
+    if (ticket != credential_generation)
+    {
+        credential_counters.stale_fills_dropped++; // The file may have changed after it was read, the next login reads it again
+        pthread_mutex_unlock(&credential_cache_lock);
+        return;
+    }
+    CREDENTIAL_ENTRY **link = credential_find(username);
+    CREDENTIAL_ENTRY *entry = *link;
+    if (entry == NULL)
+    {
+        if (credential_free == NULL) // Full: the least recently used user goes
+        {
+            CREDENTIAL_ENTRY *victim = credential_lru_tail;
+            credential_remove(credential_find(victim->username), victim);
+            credential_counters.evictions++;
+            link = credential_find(username); // The victim may have been the end of this bucket
+        }
+        entry = credential_free;
+        credential_free = entry->hash_next;
+        snprintf(entry->username, sizeof(entry->username), "%s", username);
+        entry->hash_next = NULL;
+        *link = entry;
+    }
+    else
+    {
+        credential_lru_unlink(entry);
+    }
+    snprintf(entry->stored, sizeof(entry->stored), "%s", stored);
+    credential_lru_push_front(entry);
+    credential_counters.fills++;
+    pthread_mutex_unlock(&credential_cache_lock);
+}
+
+void credential_cache_invalidate(const char *username)
+{
+    if (unlikely(username == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&credential_cache_lock);
+    credential_generation++;
+    credential_counters.invalidations++;
+    if (credential_cache_capacity > 0)
+    {
+        CREDENTIAL_ENTRY **link = credential_find(username);
+        if (*link != NULL)
+        {
+            credential_remove(link, *link);
+        }
+    }
+    pthread_mutex_unlock(&credential_cache_lock);
+}
+
+void credential_cache_preload(void)
+{
+    const char *mode = getenv("PGM_CREDENTIAL_CACHE_PRELOAD");
+    pthread_mutex_lock(&credential_cache_lock);
+    size_t capacity = credential_cache_capacity;
+    pthread_mutex_unlock(&credential_cache_lock);
+    if (capacity == 0 || mode == NULL || strcasecmp(mode, "on") != 0)
+    {
+        return;
+    }
+    USER_LIST_SNAPSHOT *users = user_registry_acquire_list();
+    if (unlikely(users == NULL))
+    {
+        P("Credential cache: cannot list the users to preload");
+        return;
+    }
+    size_t loaded = 0;
+    char stored[PASSWORD_SIZE_CHARS];
+    // "name\nname\n...\0": each read goes through the engine, which fills the table on its miss
+    for (char *name = users->data; *name != '\0' && loaded < capacity;)
+    {
+        char *end = strchr(name, '\n');
+        char username[USERNAME_SIZE_CHARS] = {0};
+        size_t length = end != NULL ? (size_t)(end - name) : strlen(name);
+        if (length > 0 && length < sizeof(username))
+        {
+            memcpy(username, name, length);
+            loaded += storage_engine->read_password(username, stored, sizeof(stored)) == NO_ERROR;
+        }
+        if (end == NULL)
+        {
+            break;
+        }
+        name = end + 1;
+    }
+    memset(stored, 0, sizeof(stored));
+    user_registry_release_list(users);
+    P("Credential cache: %zu users preloaded", loaded);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LIFECYCLE                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE credential_cache_init(void)
+{
+    size_t capacity = (size_t)read_environment_long("PGM_CREDENTIAL_CACHE_SIZE", CREDENTIAL_CACHE_DEFAULT_SIZE, 0, CREDENTIAL_CACHE_MAX_SIZE);
+    if (capacity == 0)
+    {
+        P("Credential cache: off, every login reads its password file");
+        return NO_ERROR;
+    }
+    size_t bucket_count = 1;
+    while (bucket_count < capacity)
+    {
+        bucket_count <<= 1;
+    }
+    credential_entries = calloc(capacity, sizeof(CREDENTIAL_ENTRY));
+    credential_buckets = calloc(bucket_count, sizeof(CREDENTIAL_ENTRY *));
+    if (unlikely(credential_entries == NULL || credential_buckets == NULL))
+    {
+        PSE("Failed to allocate the credential cache");
+        free(credential_entries);
+        free(credential_buckets);
+        credential_entries = NULL;
+        credential_buckets = NULL;
+        return SYSCALL_ERROR;
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        credential_entries[i].hash_next = i + 1 < capacity ? &credential_entries[i + 1] : NULL;
+    }
+    pthread_mutex_lock(&credential_cache_lock);
+    credential_free = &credential_entries[0];
+    credential_bucket_mask = bucket_count - 1;
+    credential_cache_capacity = capacity;
+    pthread_mutex_unlock(&credential_cache_lock);
+    P("Credential cache: up to %zu users", capacity);
+    return NO_ERROR;
+}
+
+void credential_cache_shutdown(void)
+{
+    CREDENTIAL_CACHE_STATISTICS statistics;
+    credential_cache_statistics(&statistics);
+    if (statistics.hits + statistics.misses > 0)
+    {
+        P("Credential cache: %llu hits, %llu misses, %llu fills (%llu dropped after an invalidation), %llu evictions, %llu invalidations",
+          (unsigned long long)statistics.hits, (unsigned long long)statistics.misses, (unsigned long long)statistics.fills,
+          (unsigned long long)statistics.stale_fills_dropped, (unsigned long long)statistics.evictions, (unsigned long long)statistics.invalidations);
+    }
+    pthread_mutex_lock(&credential_cache_lock);
+    if (credential_entries != NULL)
+    {
+        memset(credential_entries, 0, credential_cache_capacity * sizeof(CREDENTIAL_ENTRY));
+    }
+    free(credential_entries);
+    free(credential_buckets);
+    credential_entries = NULL;
+    credential_buckets = NULL;
+    credential_free = NULL;
+    credential_lru_head = NULL;
+    credential_lru_tail = NULL;
+    credential_cache_capacity = 0;
+    pthread_mutex_unlock(&credential_cache_lock);
+}
+
+void credential_cache_statistics(CREDENTIAL_CACHE_STATISTICS *out)
+{
+    pthread_mutex_lock(&credential_cache_lock);
+    *out = credential_counters;
+    pthread_mutex_unlock(&credential_cache_lock);
+}
@@ -0,0 +1,80 @@
+/**
+ * @file 22-Server-Credential-Cache.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the cache of password verifiers, what the file engine answers logins from before reading .PASSWORD
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+/**
+ * Every login used to open the user folder and read .PASSWORD. The file engine now keeps the content of the password files it read
+ * (the verifier: algorithm, cost, salt and hash in one string, see 20-Server-Auth.h) in a bounded table, least recently used out:
+ *  - filled by the first login of a user, or at startup for every registered user with PGM_CREDENTIAL_CACHE_PRELOAD=on
+ *  - invalidated by every write of a password file (registration, password change, migration of a legacy password)
+ * A read that raced with an invalidation is not cached: credential_cache_lookup() hands out a ticket and credential_cache_fill()
+ * drops the value if any invalidation happened since, so the table never holds a password older than the file.
+ *
+ * Configuration:
+ *  - PGM_CREDENTIAL_CACHE_SIZE     users kept (default CREDENTIAL_CACHE_DEFAULT_SIZE), 0 to read .PASSWORD on every login
+ *  - PGM_CREDENTIAL_CACHE_PRELOAD  on / off (default off)
+ *
+ * Password files changed by hand while the server runs are not seen until the user is evicted or the server restarts.
+ */
+
+enum credential_cache_constants {
+    CREDENTIAL_CACHE_DEFAULT_SIZE = 4096, // About 1.5 MiB
+    CREDENTIAL_CACHE_MAX_SIZE = 1 << 20,
+};
+
+typedef struct CREDENTIAL_CACHE_STATISTICS {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t fills;
+    uint64_t stale_fills_dropped; // Raced with an invalidation
+    uint64_t evictions;
+    uint64_t invalidations;
+} CREDENTIAL_CACHE_STATISTICS;
+
+/**
+ * @brief Reads PGM_CREDENTIAL_CACHE_SIZE and allocates the table, must be called once before any worker thread starts
+ * @return NO_ERROR, SYSCALL_ERROR if memory runs out
+ */
+extern ERROR_CODE credential_cache_init(void);
+
+/**
+ * @brief Clears the table and logs the statistics, only to be called once every worker thread has been joined
+ */
+extern void credential_cache_shutdown(void);
+
+/**
+ * @brief Reads the password file of every registered user into the table (PGM_CREDENTIAL_CACHE_PRELOAD=on), until it is full
+ * @note Called by main() once the user registry is loaded, does nothing if the storage engine has no cache
+ */
+extern void credential_cache_preload(void);
+
+/**
+ * @brief Copies the cached password file of @p username into @p out
+ * @param out_ticket set on a miss, to give to credential_cache_fill() once the file is read
+ * @return 1 on a hit, 0 on a miss
+ */
+extern int credential_cache_lookup(const char *username, char *out, size_t out_size, uint64_t *out_ticket);
+
+/**
+ * @brief Caches @p stored, read from the password file of @p username after the miss that returned @p ticket
+ */
+extern void credential_cache_fill(const char *username, const char *stored, uint64_t ticket);
+
+/**
+ * @brief Forgets @p username, to be called once its password file was written
+ */
+extern void credential_cache_invalidate(const char *username);
+
+extern void credential_cache_statistics(CREDENTIAL_CACHE_STATISTICS *out);
@@ -0,0 +1,343 @@
+/**
+ * @file 23-Server-Login-Throttle.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for login throttling: failed attempts per client address and per username, with exponential backoff and decay
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "23-Server-Login-Throttle.h"
+#include <stdlib.h>     // calloc, free, getenv
+#include <string.h>     // memset
+#include <strings.h>    // strcasecmp
+#include <stdint.h>     // uint32_t, uint64_t
+#include <stdatomic.h>  // atomic_uint_fast64_t
+#include <pthread.h>    // pthread_mutex_t
+#include <time.h>       // clock_gettime
+#include <sys/random.h> // getrandom
+
+typedef struct THROTTLE_ENTRY {
+    uint64_t key;              // 0 when free
+    uint64_t decayed_at_ms;    // failures is the count as of this time
+    uint64_t banned_until_ms;
+    uint32_t failures;
+} THROTTLE_ENTRY;
+
+typedef enum THROTTLE_KEY_KIND {
+    THROTTLE_KEY_ADDRESS = 1,
+    THROTTLE_KEY_USERNAME = 2,
+} THROTTLE_KEY_KIND;
+
+// CONFIGURATION, written once by login_throttle_init()
+static int throttle_enabled = 0;
+static uint32_t throttle_free_failures = THROTTLE_DEFAULT_FREE_FAILURES;
+static uint64_t throttle_base_ms = THROTTLE_DEFAULT_BASE_MS;
+static uint64_t throttle_max_ms = (uint64_t)THROTTLE_DEFAULT_MAX_SECONDS * 1000;
+static uint64_t throttle_half_life_ms = (uint64_t)THROTTLE_DEFAULT_HALF_LIFE_SECONDS * 1000;
+static uint64_t throttle_seed = 0;          // Keys an attacker cannot aim at the set of someone else
+static THROTTLE_ENTRY *throttle_entries = NULL;
+static size_t throttle_set_mask = 0;        // Set count - 1, a power of two
+static pthread_mutex_t throttle_stripes[THROTTLE_STRIPES];
+
+// Counted outside the stripe locks
+static atomic_uint_fast64_t throttle_failures = 0;
+static atomic_uint_fast64_t throttle_bans = 0;
+static atomic_uint_fast64_t throttle_connections_refused = 0;
+static atomic_uint_fast64_t throttle_logins_refused = 0;
+static atomic_uint_fast64_t throttle_entries_replaced = 0;
+
+static uint64_t throttle_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Final mix of splitmix64: every input bit moves every output bit
+ */
+static uint64_t throttle_mix(uint64_t value)
+{
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ull;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebull;
+    value ^= value >> 31;
+    return value;
+}
+
+static uint64_t throttle_key_of_address(uint32_t address)
+{
+    uint64_t key = throttle_mix(throttle_seed ^ ((uint64_t)THROTTLE_KEY_ADDRESS << 56) ^ address);
+    return key != 0 ? key : 1;
+}
+
+static uint64_t throttle_key_of_username(const char *username)
+{
+    uint64_t hash = 14695981039346656037ull ^ throttle_seed; // FNV-1a 64, seeded
+    for (const unsigned char *cursor = (const unsigned char *)username; *cursor != '\0'; cursor++)
+    {
+        hash = (hash ^ *cursor) * 1099511628211ull;
+    }
+    uint64_t key = throttle_mix(hash ^ ((uint64_t)THROTTLE_KEY_USERNAME << 56));
+    return key != 0 ? key : 1;
+}
+
+static THROTTLE_ENTRY *throttle_set_of(uint64_t key)
+{
+    return &throttle_entries[(key & throttle_set_mask) * THROTTLE_WAYS];
+}
+
+static pthread_mutex_t *throttle_stripe_of(uint64_t key)
+{
+    return &throttle_stripes[(key & throttle_set_mask) % THROTTLE_STRIPES];
+}
+
+/**
+ * @return the entry of @p key in @p set, NULL if it has none. Under the stripe lock
+ */
+static THROTTLE_ENTRY *throttle_find(THROTTLE_ENTRY *set, uint64_t key)
+{
+    for (size_t way = 0; way < THROTTLE_WAYS; way++)
+    {
+        if (set[way].key == key)
+        {
+            return &set[way];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Halves the failures of @p entry once per half life gone by since they were last decayed. Under the stripe lock
+ */
+static void throttle_decay(THROTTLE_ENTRY *entry, uint64_t now)
+{
+    if (entry->failures == 0 || now <= entry->decayed_at_ms)
+    {
+        entry->decayed_at_ms = entry->failures == 0 ? now : entry->decayed_at_ms;
+        return;
+    }
+    uint64_t halvings = (now - entry->decayed_at_ms) / throttle_half_life_ms;
+    entry->failures = halvings >= 32 ? 0 : entry->failures >> halvings;
+    entry->decayed_at_ms = entry->failures == 0 ? now : entry->decayed_at_ms + halvings * throttle_half_life_ms;
+}
+
+/**
+ * @brief The entry a new key takes in a full @p set: a free one, else the least failed one not banned, else the one banned the shortest
+ */
+static THROTTLE_ENTRY *throttle_victim(THROTTLE_ENTRY *set, uint64_t now)
+{
+    THROTTLE_ENTRY *victim = NULL;
+    for (size_t way = 0; way < THROTTLE_WAYS; way++)
+    {
+        THROTTLE_ENTRY *entry = &set[way];
+        if (entry->key == 0)
+        {
+            return entry;
+        }
+        throttle_decay(entry, now);
+        int banned = entry->banned_until_ms > now;
+        int victim_banned = victim != NULL && victim->banned_until_ms > now;
+        if (victim == NULL || (!banned && victim_banned) ||
+            (banned == victim_banned && (banned ? entry->banned_until_ms < victim->banned_until_ms : entry->failures < victim->failures)))
+        {
+            victim = entry;
+        }
+    }
+    atomic_fetch_add_explicit(&throttle_entries_replaced, 1, memory_order_relaxed);
+    return victim;
+}
+
+/**
+ * @return milliseconds left on the ban of @p key, 0 if it has none
+ */
+static uint64_t throttle_wait(uint64_t key)
+{
+    pthread_mutex_t *stripe = throttle_stripe_of(key);
+    uint64_t now = throttle_now_ms();
+    pthread_mutex_lock(stripe);
+    THROTTLE_ENTRY *entry = throttle_find(throttle_set_of(key), key);
+    uint64_t wait = entry != NULL && entry->banned_until_ms > now ? entry->banned_until_ms - now : 0;
+    pthread_mutex_unlock(stripe);
+    return wait;
+}
+
+/**
+ * @return 1 if @p key is banned after this failure
+ */
+static int throttle_fail(uint64_t key)
+{
+    pthread_mutex_t *stripe = throttle_stripe_of(key);
+    uint64_t now = throttle_now_ms();
+    pthread_mutex_lock(stripe);
+    THROTTLE_ENTRY *set = throttle_set_of(key);
+    THROTTLE_ENTRY *entry = throttle_find(set, key);
+    if (entry == NULL)
+    {
+        entry = throttle_victim(set, now);
+        *entry = (THROTTLE_ENTRY){.key = key, .decayed_at_ms = now};
+    }
+    throttle_decay(entry, now);
+    entry->failures += entry->failures < UINT32_MAX ? 1 : 0;
+    int banned = 0;
+    if (entry->failures > throttle_free_failures)
+    {
+        // Doubled at each failure past the free ones: 1x, 2x, 4x... the base, up to the longest ban
+        uint32_t doublings = entry->failures - throttle_free_failures - 1;
+        uint64_t ban = doublings >= 40 ? throttle_max_ms : throttle_base_ms << doublings;
+        ban = ban < throttle_max_ms ? ban : throttle_max_ms;
+        entry->banned_until_ms = entry->banned_until_ms > now + ban ? entry->banned_until_ms : now + ban;
+        banned = 1;
+    }
+    pthread_mutex_unlock(stripe);
+    if (banned)
+    {
+        atomic_fetch_add_explicit(&throttle_bans, 1, memory_order_relaxed);
+    }
+    return banned;
+}
+
+uint64_t login_throttle_address_wait(uint32_t address)
+{
+    if (!throttle_enabled)
+    {
+        return 0;
+    }
+    uint64_t wait = throttle_wait(throttle_key_of_address(address));
+    if (wait > 0)
+    {
+        atomic_fetch_add_explicit(&throttle_connections_refused, 1, memory_order_relaxed);
+    }
+    return wait;
+}
+
+uint64_t login_throttle_user_wait(const char *username)
+{
+    if (!throttle_enabled || username == NULL)
+    {
+        return 0;
+    }
+    uint64_t wait = throttle_wait(throttle_key_of_username(username));
+    if (wait > 0)
+    {
+        atomic_fetch_add_explicit(&throttle_logins_refused, 1, memory_order_relaxed);
+    }
+    return wait;
+}
+
+int login_throttle_failure(uint32_t address, const char *username)
+{
+    if (!throttle_enabled)
+    {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&throttle_failures, 1, memory_order_relaxed);
+    int banned = throttle_fail(throttle_key_of_address(address));
+    if (username != NULL)
+    {
+        banned = throttle_fail(throttle_key_of_username(username)) || banned;
+    }
+    return banned;
+}
+
+void login_throttle_success(const char *username)
+{
+    if (!throttle_enabled || username == NULL)
+    {
+        return;
+    }
+    uint64_t key = throttle_key_of_username(username);
+    pthread_mutex_t *stripe = throttle_stripe_of(key);
+    pthread_mutex_lock(stripe);
+    THROTTLE_ENTRY *entry = throttle_find(throttle_set_of(key), key);
+    if (entry != NULL)
+    {
+        memset(entry, 0, sizeof(*entry));
+    }
+    pthread_mutex_unlock(stripe);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LIFECYCLE                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE login_throttle_init(void)
+{
+    const char *mode = getenv("PGM_THROTTLE");
+    if (mode != NULL && strcasecmp(mode, "off") == 0)
+    {
+        P("Login throttling: off");
+        return NO_ERROR;
+    }
+    size_t slots = (size_t)read_environment_long("PGM_THROTTLE_SLOTS", THROTTLE_DEFAULT_SLOTS, THROTTLE_MIN_SLOTS, THROTTLE_MAX_SLOTS);
+    throttle_free_failures = (uint32_t)read_environment_long("PGM_THROTTLE_FREE_FAILURES", THROTTLE_DEFAULT_FREE_FAILURES, 0, 1000);
+    throttle_base_ms = (uint64_t)read_environment_long("PGM_THROTTLE_BASE_MS", THROTTLE_DEFAULT_BASE_MS, 1, 3600000);
+    throttle_max_ms = (uint64_t)read_environment_long("PGM_THROTTLE_MAX_SECONDS", THROTTLE_DEFAULT_MAX_SECONDS, 1, 86400) * 1000;
+    throttle_half_life_ms = (uint64_t)read_environment_long("PGM_THROTTLE_HALF_LIFE_SECONDS", THROTTLE_DEFAULT_HALF_LIFE_SECONDS, 1, 86400) * 1000;
+
+    size_t set_count = 1;
+    while (set_count * THROTTLE_WAYS < slots)
+    {
+        set_count <<= 1;
+    }
+    if (unlikely(getrandom(&throttle_seed, sizeof(throttle_seed), 0) != (ssize_t)sizeof(throttle_seed)))
+    {
+        PSE("Failed to draw the login throttling seed");
+        return SYSCALL_ERROR;
+    }
+    throttle_entries = calloc(set_count * THROTTLE_WAYS, sizeof(THROTTLE_ENTRY));
+    if (unlikely(throttle_entries == NULL))
+    {
+        PSE("Failed to allocate the login throttling table");
+        return SYSCALL_ERROR;
+    }
+    for (size_t i = 0; i < THROTTLE_STRIPES; i++)
+    {
+        pthread_mutex_init(&throttle_stripes[i], NULL);
+    }
+    throttle_set_mask = set_count - 1;
+    throttle_enabled = 1;
+    P("Login throttling: %zu entries, banned after %u failures for %llu ms doubling up to %llu s, failures halve every %llu s",
+      set_count * THROTTLE_WAYS, throttle_free_failures, (unsigned long long)throttle_base_ms, (unsigned long long)(throttle_max_ms / 1000),
+      (unsigned long long)(throttle_half_life_ms / 1000));
+    return NO_ERROR;
+}
+
+void login_throttle_shutdown(void)
+{
+    if (!throttle_enabled)
+    {
+        return;
+    }
+    LOGIN_THROTTLE_STATISTICS statistics;
+    login_throttle_statistics(&statistics);
+    if (statistics.failures > 0)
+    {
+        P("Login throttling: %llu failed attempts, %llu bans, %llu connections and %llu logins refused, %llu entries replaced",
+          (unsigned long long)statistics.failures, (unsigned long long)statistics.bans, (unsigned long long)statistics.connections_refused,
+          (unsigned long long)statistics.logins_refused, (unsigned long long)statistics.entries_replaced);
+    }
+    throttle_enabled = 0;
+    for (size_t i = 0; i < THROTTLE_STRIPES; i++)
+    {
+        pthread_mutex_destroy(&throttle_stripes[i]);
+    }
+    free(throttle_entries);
+    throttle_entries = NULL;
+}
+
+void login_throttle_statistics(LOGIN_THROTTLE_STATISTICS *out)
+{
+    out->failures = atomic_load_explicit(&throttle_failures, memory_order_relaxed);
+    out->bans = atomic_load_explicit(&throttle_bans, memory_order_relaxed);
+    out->connections_refused = atomic_load_explicit(&throttle_connections_refused, memory_order_relaxed);
+    out->logins_refused = atomic_load_explicit(&throttle_logins_refused, memory_order_relaxed);
+    out->entries_replaced = atomic_load_explicit(&throttle_entries_replaced, memory_order_relaxed);
+}
@@ -0,0 +1,92 @@
+/**
+ * @file 23-Server-Login-Throttle.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for login throttling: failed attempts per client address and per username, with exponential backoff and decay
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stdint.h> // uint32_t, uint64_t
+
+/**
+ * MAX_PASSWORD_ATTEMPTS only bounds one connection, a client that reconnects gets three more. Failed logins are now counted per
+ * client address and per username in a table of fixed size:
+ *  - a wrong password counts for both, an invalid username or a rejected resume token for the address only
+ *  - past PGM_THROTTLE_FREE_FAILURES failures a key is banned for PGM_THROTTLE_BASE_MS, doubled at each further failure up to
+ *    PGM_THROTTLE_MAX_SECONDS
+ *  - the count halves every PGM_THROTTLE_HALF_LIFE_SECONDS without failures, a successful login forgets the username
+ * A banned address is dropped by the accept loop before any worker thread exists: it costs an accept() and a close(). A banned
+ * username gets LOGIN_THROTTLED before its password file is read or any KDF runs.
+ *
+ * The table is set associative: THROTTLE_WAYS entries per set, a key lives in the set its (seeded) hash picks and takes the place of
+ * the least failed entry of a full set, so memory never grows with the number of attackers. Sets are spread over THROTTLE_STRIPES
+ * locks, the accept loop and the workers rarely wait on each other.
+ *
+ * Configuration:
+ *  - PGM_THROTTLE                    on / off (default on)
+ *  - PGM_THROTTLE_SLOTS              entries (default THROTTLE_DEFAULT_SLOTS, rounded up to a power of two)
+ *  - PGM_THROTTLE_FREE_FAILURES      failures before the first ban (default THROTTLE_DEFAULT_FREE_FAILURES)
+ *  - PGM_THROTTLE_BASE_MS            first ban (default THROTTLE_DEFAULT_BASE_MS)
+ *  - PGM_THROTTLE_MAX_SECONDS        longest ban (default THROTTLE_DEFAULT_MAX_SECONDS)
+ *  - PGM_THROTTLE_HALF_LIFE_SECONDS  decay of the failure counts (default THROTTLE_DEFAULT_HALF_LIFE_SECONDS)
+ */
+
+enum login_throttle_constants {
+    THROTTLE_WAYS = 4,
+    THROTTLE_STRIPES = 64,
+    THROTTLE_DEFAULT_SLOTS = 8192,          // 256 KiB
+    THROTTLE_MIN_SLOTS = THROTTLE_WAYS * THROTTLE_STRIPES,
+    THROTTLE_MAX_SLOTS = 1 << 22,
+    THROTTLE_DEFAULT_FREE_FAILURES = 5,
+    THROTTLE_DEFAULT_BASE_MS = 1000,
+    THROTTLE_DEFAULT_MAX_SECONDS = 900,
+    THROTTLE_DEFAULT_HALF_LIFE_SECONDS = 300,
+};
+
+typedef struct LOGIN_THROTTLE_STATISTICS {
+    uint64_t failures;
+    uint64_t bans;                  // Failures that started or extended a ban
+    uint64_t connections_refused;   // By the accept loop
+    uint64_t logins_refused;        // Username banned
+    uint64_t entries_replaced;      // Keys pushed out of a full set
+} LOGIN_THROTTLE_STATISTICS;
+
+/**
+ * @brief Reads the PGM_THROTTLE_* variables and allocates the table, must be called once before any worker thread starts
+ * @return NO_ERROR, SYSCALL_ERROR if memory or random bytes run out
+ */
+extern ERROR_CODE login_throttle_init(void);
+
+/**
+ * @brief Logs the statistics and frees the table, only to be called once every worker thread has been joined
+ */
+extern void login_throttle_shutdown(void);
+
+/**
+ * @param address IPv4 address of the client, network byte order
+ * @return milliseconds until @p address may connect again, 0 if it may now (counted as a refused connection otherwise)
+ */
+extern uint64_t login_throttle_address_wait(uint32_t address);
+
+/**
+ * @return milliseconds until @p username may log in again, 0 if it may now (counted as a refused login otherwise)
+ */
+extern uint64_t login_throttle_user_wait(const char *username);
+
+/**
+ * @brief Counts a failed attempt of @p address and, if not NULL, of @p username
+ * @return 1 if one of them is banned now, the connection should be closed
+ */
+extern int login_throttle_failure(uint32_t address, const char *username);
+
+/**
+ * @brief Forgets the failures of @p username once it logged in, the ones of its address only decay
+ */
+extern void login_throttle_success(const char *username);
+
+extern void login_throttle_statistics(LOGIN_THROTTLE_STATISTICS *out);
@@ -0,0 +1,229 @@
+/**
+ * @file 24-Header-Encoding.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the compact encoding of MESSAGE headers, on the wire and in message files, shared by the server and the client
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "24-Header-Encoding.h"
+#include <stdlib.h>     // getenv
+#include <string.h>     // memcpy, memset, memchr, strnlen
+#include <strings.h>    // strcasecmp
+#include <stdint.h>     // uint8_t, uint32_t
+#include <stddef.h>     // offsetof
+#include <arpa/inet.h>  // htonl, ntohl
+
+static uint8_t *header_put_varint(uint8_t *out, const uint8_t *end, uint32_t value)
+{
+    while (out != NULL && out < end)
+    {
+        if (value < 0x80)
+        {
+            *out++ = (uint8_t)value;
+            return out;
+        }
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    return NULL;
+}
+
+/**
+ * @return the position after the varint, NULL if it is truncated or does not fit 32 bits
+ */
+static const uint8_t *header_get_varint(const uint8_t *in, const uint8_t *end, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (unsigned int shift = 0; in < end && shift < 7 * COMPACT_HEADER_VARINT_MAX_BYTES; shift += 7)
+    {
+        uint8_t byte = *in++;
+        if (shift == 28 && byte > 0x0f)
+        {
+            return NULL;
+        }
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static uint8_t *header_put_string(uint8_t *out, const uint8_t *end, const char *field, size_t field_size)
+{
+    size_t length = strnlen(field, field_size - 1);
+    out = header_put_varint(out, end, (uint32_t)length);
+    if (out == NULL || (size_t)(end - out) < length)
+    {
+        return NULL;
+    }
+    memcpy(out, field, length);
+    return out + length;
+}
+
+/**
+ * @brief Fills @p field (already zeroed) with the next string, which must leave room for the terminator and hold none
+ */
+static const uint8_t *header_get_string(const uint8_t *in, const uint8_t *end, char *field, size_t field_size)
+{
+    uint32_t length = 0;
+    in = in == NULL ? NULL : header_get_varint(in, end, &length);
+    if (in == NULL || length >= field_size || (size_t)(end - in) < length || memchr(in, '\0', length) != NULL)
+    {
+        return NULL;
+    }
+    memcpy(field, in, length);
+    return in + length;
+}
+
+void header_canonicalize(MESSAGE *header)
+{
+    if (header == NULL)
+    {
+        return;
+    }
+    char *fields[] = {header->sender, header->recipient, header->subject};
+    size_t sizes[] = {sizeof(header->sender), sizeof(header->recipient), sizeof(header->subject)};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        size_t length = strnlen(fields[i], sizes[i] - 1);
+        memset(fields[i] + length, 0, sizes[i] - length);
+    }
+}
+
+size_t header_encode(const MESSAGE *header, void *out, size_t capacity)
+{
+    if (header == NULL || out == NULL || capacity < 2)
+    {
+        return 0;
+    }
+    uint8_t *cursor = (uint8_t *)out;
+    const uint8_t *end = cursor + capacity;
+    *cursor++ = COMPACT_HEADER_MARKER;
+    *cursor++ = COMPACT_HEADER_VERSION;
+    cursor = header_put_string(cursor, end, header->sender, sizeof(header->sender));
+    cursor = cursor == NULL ? NULL : header_put_string(cursor, end, header->recipient, sizeof(header->recipient));
+    cursor = cursor == NULL ? NULL : header_put_string(cursor, end, header->subject, sizeof(header->subject));
+    cursor = header_put_varint(cursor, end, ntohl(header->message_length));
+    return cursor == NULL ? 0 : (size_t)(cursor - (uint8_t *)out);
+}
+
+ERROR_CODE header_decode(const void *in, size_t length, MESSAGE *out, size_t *out_consumed)
+{
+    if (in == NULL || out == NULL || out_consumed == NULL)
+    {
+        return NULL_PARAMETERS;
+    }
+    const uint8_t *cursor = (const uint8_t *)in;
+    const uint8_t *end = cursor + length;
+    if (length < 2 || cursor[0] != COMPACT_HEADER_MARKER || cursor[1] != COMPACT_HEADER_VERSION)
+    {
+        return STRING_SIZE_INVALID;
+    }
+    memset(out, 0, offsetof(MESSAGE, message));
+    cursor = header_get_string(cursor + 2, end, out->sender, sizeof(out->sender));
+    cursor = header_get_string(cursor, end, out->recipient, sizeof(out->recipient));
+    cursor = header_get_string(cursor, end, out->subject, sizeof(out->subject));
+    uint32_t message_length = 0;
+    cursor = cursor == NULL ? NULL : header_get_varint(cursor, end, &message_length);
+    if (cursor == NULL)
+    {
+        return STRING_SIZE_INVALID;
+    }
+    out->message_length = htonl(message_length);
+    *out_consumed = (size_t)(cursor - (const uint8_t *)in);
+    return NO_ERROR;
+}
+
+int header_encoding_local_compact(void)
+{
+    const char *mode = getenv("PGM_COMPACT_HEADERS");
+    return mode == NULL || strcasecmp(mode, "off") != 0;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              WIRE HEADERS                                                     */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+int wire_send_header(int fd, WIRE_HEADERS *wire, const MESSAGE *header)
+{
+    if (wire == NULL || !wire->compact)
+    {
+        return send_all(fd, header, offsetof(MESSAGE, message));
+    }
+    // Prefix and header in one send, like the payloads of 18-Compression.c
+    uint8_t packet[WIRE_HEADER_PREFIX_MAX_BYTES + COMPACT_HEADER_MAX_BYTES];
+    uint8_t encoded[COMPACT_HEADER_MAX_BYTES];
+    size_t encoded_length = header_encode(header, encoded, sizeof(encoded));
+    uint8_t *cursor = header_put_varint(packet, packet + WIRE_HEADER_PREFIX_MAX_BYTES, (uint32_t)encoded_length);
+    if (encoded_length == 0 || cursor == NULL)
+    {
+        return -1;
+    }
+    memcpy(cursor, encoded, encoded_length);
+    size_t packet_length = (size_t)(cursor - packet) + encoded_length;
+    int result = send_all(fd, packet, packet_length);
+    if (result == 0)
+    {
+        wire->headers_sent++;
+        wire->bytes_sent += packet_length;
+    }
+    return result;
+}
+
+int wire_recv_header(int fd, WIRE_HEADERS *wire, MESSAGE *header)
+{
+    if (wire == NULL || !wire->compact)
+    {
+        return recv_all(fd, header, offsetof(MESSAGE, message));
+    }
+    uint8_t prefix[WIRE_HEADER_PREFIX_MAX_BYTES] = {0};
+    size_t prefix_length = 0;
+    uint32_t encoded_length = 0;
+    const uint8_t *prefix_end = NULL;
+    while (prefix_end == NULL)
+    {
+        if (prefix_length == sizeof(prefix))
+        {
+            return -1;
+        }
+        int result = recv_all(fd, &prefix[prefix_length++], 1);
+        if (result <= 0)
+        {
+            return result;
+        }
+        if ((prefix[prefix_length - 1] & 0x80) == 0)
+        {
+            prefix_end = header_get_varint(prefix, prefix + prefix_length, &encoded_length);
+            if (prefix_end == NULL)
+            {
+                return -1;
+            }
+        }
+    }
+    if (encoded_length == 0 || encoded_length > COMPACT_HEADER_MAX_BYTES)
+    {
+        return -1; // Never read more than the largest compact header
+    }
+    uint8_t encoded[COMPACT_HEADER_MAX_BYTES];
+    int result = recv_all(fd, encoded, encoded_length);
+    if (result <= 0)
+    {
+        return result;
+    }
+    size_t consumed = 0;
+    if (header_decode(encoded, encoded_length, header, &consumed) != NO_ERROR || consumed != encoded_length)
+    {
+        return -1;
+    }
+    wire->headers_received++;
+    wire->bytes_received += prefix_length + encoded_length;
+    return 1;
+}
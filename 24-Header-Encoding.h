@@ -0,0 +1,107 @@
+/**
+ * @file 24-Header-Encoding.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the compact encoding of MESSAGE headers, on the wire and in message files, shared by the server and the client
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+/**
+ * A MESSAGE header is offsetof(MESSAGE, message) = 260 bytes, mostly zero padding: "bob" to "al" about "hi" uses 9 of them.
+ * The compact encoding keeps the used bytes only:
+ *  - COMPACT_HEADER_MARKER, COMPACT_HEADER_VERSION
+ *  - sender, recipient, subject: each a varint length then the bytes, no terminator
+ *  - message_length as a varint
+ * Varints are LEB128: 7 bits per byte, low bits first, high bit set on every byte but the last.
+ *
+ * Both sides of the codec work on caller buffers of fixed size and never allocate. The decoder checks every length against the
+ * field it fills and against the bytes it was given, and writes a header whose padding is zero. The encoder writes the same
+ * canonical header back, see header_canonicalize().
+ *
+ * Message files: a legacy header starts with its sender, never empty, so a file starting with COMPACT_HEADER_MARKER has a compact
+ * header, followed by the body exactly as before (see MESSAGE_FILE_SHAPE in 4-Server-Storage.h). The server writes compact headers
+ * when they are smaller and reads both.
+ */
+
+enum header_encoding_constants {
+    COMPACT_HEADER_MARKER = 0x00,
+    COMPACT_HEADER_VERSION = 0x01,
+    COMPACT_HEADER_VARINT_MAX_BYTES = 5,     // A uint32_t
+    // Marker, version, three 1 byte lengths (fields are below 128 bytes), the longest strings and message_length
+    COMPACT_HEADER_MAX_BYTES = 2 + 3 + (USERNAME_SIZE_CHARS - 1) * 2 + (SUBJECT_SIZE_CHARS - 1) + COMPACT_HEADER_VARINT_MAX_BYTES,
+    WIRE_HEADER_PREFIX_MAX_BYTES = 2,        // Varint of COMPACT_HEADER_MAX_BYTES
+};
+
+/**
+ * @brief Terminates every string of @p header within its field and zeroes what follows the terminator
+ * @note Checksums cover the canonical header, the one a compact header decodes to
+ */
+extern void header_canonicalize(MESSAGE *header);
+
+/**
+ * @brief Encodes @p header (read as if canonical: a string without terminator stops one byte before the end of its field)
+ * @return the encoded size, 0 if it does not fit @p capacity (COMPACT_HEADER_MAX_BYTES always fits)
+ */
+extern size_t header_encode(const MESSAGE *header, void *out, size_t capacity);
+
+/**
+ * @brief Decodes a compact header from the first @p length bytes of @p in into @p out (offsetof(MESSAGE, message) bytes)
+ * @param out_consumed bytes the header took, the body follows them
+ * @return NO_ERROR, STRING_SIZE_INVALID if the bytes are not a complete compact header
+ */
+extern ERROR_CODE header_decode(const void *in, size_t length, MESSAGE *out, size_t *out_consumed);
+
+/**
+ * @brief Reads PGM_COMPACT_HEADERS (on / off, default on)
+ */
+extern int header_encoding_local_compact(void);
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              WIRE HEADERS                                                     */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * Negotiated once per session, like the compression: by the hello (PROTOCOL_CAPABILITY_COMPACT_HEADERS) or, with a server that
+ * does not know it, with REQUEST_NEGOTIATE_HEADER_ENCODING right after the login:
+ *  - the client sends the code, the server answers NO_ERROR (an older server MESSAGE_ERROR, the session keeps fixed headers)
+ *  - the client sends the encodings it can read (uint32, network byte order, WIRE_HEADER_* bits), the server answers the one picked
+ * From then on every MESSAGE header (REQUEST_SEND_MESSAGE, REQUEST_LOAD_MESSAGE) is its compact size as a varint, then the compact
+ * header, in a single send. The receiver refuses sizes above COMPACT_HEADER_MAX_BYTES before reading them.
+ */
+
+enum wire_header_constants {
+    WIRE_HEADER_FIXED = 0,
+    WIRE_HEADER_COMPACT = 1,
+};
+
+/**
+ * @brief Header encoding of one connection, on both sides, zero initialized = fixed headers
+ */
+typedef struct WIRE_HEADERS {
+    int compact;
+
+    // Measured by wire_send_header() / wire_recv_header(), prefixes included
+    uint64_t headers_sent;
+    uint64_t bytes_sent;
+    uint64_t headers_received;
+    uint64_t bytes_received;
+} WIRE_HEADERS;
+
+/**
+ * @brief Sends @p header, compact if the session negotiated it, the offsetof(MESSAGE, message) bytes as they are otherwise
+ * @return 0 on success, -1 on error (like send_all())
+ */
+extern int wire_send_header(int fd, WIRE_HEADERS *wire, const MESSAGE *header);
+
+/**
+ * @brief Receives a header sent by wire_send_header() into @p header (offsetof(MESSAGE, message) bytes)
+ * @return 1 on success, 0 on peer close, -1 on error or on a corrupt header (like recv_all())
+ */
+extern int wire_recv_header(int fd, WIRE_HEADERS *wire, MESSAGE *header);
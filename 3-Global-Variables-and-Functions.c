@@ -12,6 +12,7 @@
 #include "3-Global-Variables-and-Functions.h" 
 #include <unistd.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>  // htonl, ntohl
 
 // ierror, an internal debug substitute to errno
 //ERROR_CODE ierrno = NO_ERROR;
@@ -52,6 +53,16 @@ const char *convert_error_code_to_string(const ERROR_CODE code)
         return "START_REGISTRATION";
     case WRONG_PASSWORD:
         return "WRONG_PASSWORD";
+    case USER_NOT_FOUND:
+        return "USER_NOT_FOUND";
+    case QUOTA_EXCEEDED:
+        return "QUOTA_EXCEEDED";
+    case SERVER_BUSY:
+        return "SERVER_BUSY";
+    case RESUME_REJECTED:
+        return "RESUME_REJECTED";
+    case LOGIN_THROTTLED:
+        return "LOGIN_THROTTLED";
     default:
         return "UNKNOWN_ERROR_CODE";
     }
@@ -132,6 +143,20 @@ int recv_all(int fd, void *buffer, size_t length)
     return 1;
 }
 
+uint64_t host_to_network_64(uint64_t value)
+{
+    if (htonl(1) == 1)
+    {
+        return value; // Big endian host, already in network order
+    }
+    return ((uint64_t)htonl((uint32_t)value) << 32) | htonl((uint32_t)(value >> 32));
+}
+
+uint64_t network_to_host_64(uint64_t value)
+{
+    return host_to_network_64(value); // Swapping twice gives back the original, on either endianness
+}
+
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
 /*                                              MESSAGE STRUCT CREATION                                          */
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
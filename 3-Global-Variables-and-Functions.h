@@ -69,10 +69,20 @@ typedef enum ERROR_CODE
     START_REGISTRATION = -100, // Used to indicate that the user wants to start the registration process
     WRONG_PASSWORD = -101, // Used to indicate that the password provided is wrong
     USER_NOT_FOUND = -102, // Used to indicate that the user was not found in the most general sense, that means both during login and message sending
+    QUOTA_EXCEEDED = -103, // The recipient mailbox is full (message count or bytes quota), the message is not accepted
+    SERVER_BUSY = -104,    // Too many logins waiting for a password check, the connection is closed: try again later
+    RESUME_REJECTED = -105, // The resume token is forged, expired or for an unknown user: log in with the password on the same connection
+    LOGIN_THROTTLED = -106, // Too many failed logins for this user or address, the connection is closed: try again later
 } ERROR_CODE;
 
 typedef enum MESSAGE_CODE
 {
+    REQUEST_NEGOTIATE_HEADER_ENCODING = 13,
+    REQUEST_RESUME_TOKEN = 12,
+    REQUEST_NEGOTIATE_COMPRESSION = 11,
+    REQUEST_FILTER_MESSAGES = 10,
+    REQUEST_SEARCH_MESSAGES = 9,
+    REQUEST_LIST_MESSAGE_SUMMARIES = 8,
     REQUEST_LOAD_UNREAD_MESSAGES = 7,
     REQUEST_DELETE_MESSAGE = 6,
     REQUEST_LOAD_SPECIFIC_MESSAGE = 5,
@@ -94,6 +104,10 @@ extern const char *convert_error_code_to_string(const ERROR_CODE code);
 extern int send_all(int fd, const void *buffer, size_t length);
 extern int recv_all(int fd, void *buffer, size_t length);
 
+/* 64 bit counterparts of htonl/ntohl, the libc ones (htobe64) are not part of C11 */
+extern uint64_t host_to_network_64(uint64_t value);
+extern uint64_t network_to_host_64(uint64_t value);
+
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
 /*                                              SIZES, CONSTANTS, VARIABLES                                      */
 /* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
@@ -105,6 +119,12 @@ enum sizes_and_constants{
     SUBJECT_SIZE_CHARS = 128,
     PASSWORD_SIZE_CHARS = 256,
     MAX_PASSWORD_ATTEMPTS = 3,
+    MESSAGE_SUMMARY_FILENAME_SIZE_CHARS = 64, // Same as MESSAGE_FILENAME_SIZE_CHARS of the server
+    SEARCH_QUERY_SIZE_CHARS = 128,
+    SEARCH_MAX_RESULTS_PER_PAGE = 100,
+    RESUME_FRAME_MARKER = 0x01, // First byte of a username buffer that carries a RESUME_TOKEN instead
+    HELLO_FRAME_MARKER = 0x02,  // First byte of a username buffer that carries a PROTOCOL_HELLO instead
+    RESUME_TOKEN_TAG_BYTES = 16,
 };
 
 extern const char *password_filename;
@@ -126,6 +146,7 @@ extern const char *file_suffix_user_data;
  *
  * @note write/send offsetof(MESSAGE, message) + message_length bytes.
  * @note read/recv offsetof(MESSAGE, message) first to get message_length, then read/recv message_length bytes to get the actual message.
+ * @note Sessions that negotiated compact headers send them encoded instead, see 24-Header-Encoding.h
  */
 typedef struct MESSAGE {
     char sender[USERNAME_SIZE_CHARS];
@@ -150,6 +171,103 @@ memcpy(msg->message, body, message_length);
 // write/send total_size bytes
 */
 
+/**
+ * @brief One line of the inbox as sent for REQUEST_LIST_MESSAGE_SUMMARIES: everything but the body
+ *
+ * The reply uses the same length prefix + ack handshake as the filename lists, the payload is an array of MESSAGE_SUMMARY
+ * (length / sizeof(MESSAGE_SUMMARY) entries), newest message first. Multibyte fields are in network byte order.
+ * @note The server builds it from cached headers, so listing an inbox never opens a message body
+ */
+typedef struct MESSAGE_SUMMARY {
+    uint64_t message_id;
+    uint64_t timestamp;      // Seconds since the epoch the message was received at
+    uint32_t message_length; // Body bytes
+    uint32_t flags;          // MESSAGE_SUMMARY_FLAGS
+    char sender[USERNAME_SIZE_CHARS];
+    char subject[SUBJECT_SIZE_CHARS];
+    char filename[MESSAGE_SUMMARY_FILENAME_SIZE_CHARS]; // What REQUEST_LOAD_SPECIFIC_MESSAGE and REQUEST_DELETE_MESSAGE expect
+} MESSAGE_SUMMARY;
+
+typedef enum MESSAGE_SUMMARY_FLAGS
+{
+    MESSAGE_SUMMARY_UNREAD = 1,
+} MESSAGE_SUMMARY_FLAGS;
+
+/**
+ * @brief Sent right after REQUEST_SEARCH_MESSAGES: words that must all appear in the subject or the body of a message
+ *
+ * The server replies with an ERROR_CODE (STRING_SIZE_INVALID if the query has no searchable word), then if NO_ERROR with the usual
+ * length prefix + ack handshake. The payload is a SEARCH_RESULTS_HEADER followed by `returned` MESSAGE_SUMMARY, best match first.
+ * Multibyte fields are in network byte order.
+ */
+typedef struct SEARCH_REQUEST {
+    char query[SEARCH_QUERY_SIZE_CHARS];
+    uint32_t offset; // Pagination: matches to skip
+    uint32_t limit;  // Pagination: matches to return, capped at SEARCH_MAX_RESULTS_PER_PAGE
+} SEARCH_REQUEST;
+
+typedef struct SEARCH_RESULTS_HEADER {
+    uint32_t total_matches; // All the matches, not only this page
+    uint32_t returned;      // MESSAGE_SUMMARY that follow
+} SEARCH_RESULTS_HEADER;
+
+/**
+ * @brief Sent right after REQUEST_FILTER_MESSAGES: substrings the sender and the subject must contain (ASCII case insensitive), empty for any
+ *
+ * The server replies with an ERROR_CODE (STRING_SIZE_INVALID if both are empty), then if NO_ERROR with the usual
+ * length prefix + ack handshake. The payload is an array of MESSAGE_SUMMARY, newest first.
+ */
+typedef struct FILTER_REQUEST {
+    char sender_contains[USERNAME_SIZE_CHARS];
+    char subject_contains[SUBJECT_SIZE_CHARS];
+} FILTER_REQUEST;
+
+/**
+ * @brief Lets a client that lost its connection log in again without its password, see 21-Server-Resume-Token.h
+ *
+ * Got with REQUEST_RESUME_TOKEN once logged in: the server replies with an ERROR_CODE then, if NO_ERROR, the token. An older server
+ * replies MESSAGE_ERROR. To resume, the client sends a username buffer (USERNAME_SIZE_CHARS) starting with RESUME_FRAME_MARKER,
+ * which is never a valid username, and the token in the same write. The server replies NO_ERROR followed by a new token, or
+ * RESUME_REJECTED and then waits for the username as usual. Multibyte fields are in network byte order.
+ */
+typedef struct RESUME_TOKEN {
+    char username[USERNAME_SIZE_CHARS];
+    uint64_t expires;                     // Server clock, only the server reads it
+    uint64_t nonce;                       // Random, two tokens never look alike
+    uint8_t tag[RESUME_TOKEN_TAG_BYTES];  // Keyed by the server over the fields above
+} RESUME_TOKEN;
+
+/**
+ * @brief What a client and a server can do, exchanged once before the login
+ *
+ * The client may send, as its very first bytes, a username buffer (USERNAME_SIZE_CHARS) starting with HELLO_FRAME_MARKER, never a
+ * valid username, and its PROTOCOL_HELLO in the same write. The server replies NO_ERROR followed by its own PROTOCOL_HELLO: the
+ * lower version and the capabilities both sides have, then waits for the username (or a resume frame) as usual. Everything the
+ * hello settles is in force from the login on, no REQUEST_NEGOTIATE_* round trip is needed:
+ *  - PROTOCOL_CAPABILITY_COMPRESSION       wire compression (18-Compression.h), with the larger compression_min_bytes
+ *  - PROTOCOL_CAPABILITY_COMPACT_HEADERS   compact MESSAGE headers (24-Header-Encoding.h)
+ *  - PROTOCOL_CAPABILITY_RESUME_TOKENS     the server issues resume tokens (REQUEST_RESUME_TOKEN), only answered by the server
+ *  - PROTOCOL_CAPABILITY_DELIVERY_ACK      REQUEST_SEND_MESSAGE ends with an ERROR_CODE sent once the message is durable
+ * A server older than the hello takes the frame for an invalid username and closes the connection: the client connects again and
+ * uses the old flow. An older client never sends it. Without a hello the session is the original protocol, byte for byte, until
+ * a REQUEST_NEGOTIATE_* turns something on. Every field is in network byte order.
+ */
+typedef struct PROTOCOL_HELLO {
+    uint32_t magic;                       // PROTOCOL_HELLO_MAGIC
+    uint32_t version;                     // PROTOCOL_VERSION of the sender, then the one picked by the server
+    uint32_t capabilities;                // PROTOCOL_CAPABILITY_* bits
+    uint32_t compression_min_bytes;       // Payloads below this are always sent raw
+} PROTOCOL_HELLO;
+
+enum protocol_constants {
+    PROTOCOL_HELLO_MAGIC = 0x50474D48,    // "PGMH"
+    PROTOCOL_VERSION = 1,
+    PROTOCOL_CAPABILITY_COMPRESSION = 1 << 0,
+    PROTOCOL_CAPABILITY_COMPACT_HEADERS = 1 << 1,
+    PROTOCOL_CAPABILITY_RESUME_TOKENS = 1 << 2,
+    PROTOCOL_CAPABILITY_DELIVERY_ACK = 1 << 3,
+};
+
 /*
  * @note: initialize MESSAGE structure on stack before function call
 */ // TODO: DELETE SINCE I MOVED IT TO THE 2-CLIENT.C FILE
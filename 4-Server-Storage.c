@@ -0,0 +1,2317 @@
+/**
+ * @file 4-Server-Storage.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the server storage layer (message ids, message files and everything that touches the disk on behalf of the worker threads)
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "7-Server-Body-Store.h"
+#include "13-Server-Snapshot.h"
+#include "15-Server-Checksum.h"
+#include "18-Compression.h"
+#include "19-Server-Cold-Tier.h"
+#include "24-Header-Encoding.h"
+#include <stdio.h>      // snprintf, rename, renameat
+#include <stdlib.h>     // getenv, strtol, malloc, calloc, free
+#include <stddef.h>     // offsetof
+#include <unistd.h>     // close, write, read, pread, fsync, fdatasync, syncfs, unlink, unlinkat, ftruncate, access
+#include <fcntl.h>      // open, openat, AT_FDCWD
+#include <pthread.h>    // pthread_mutex_t, pthread_cond_t
+#include <sys/stat.h>   // fstat, fstatat, stat, mkdir, mkdirat
+#include <arpa/inet.h>  // ntohl
+#include <semaphore.h>  // sem_t, sem_init, sem_wait, sem_post
+#include <stdatomic.h>  // _Atomic, atomic_load, atomic_compare_exchange_weak
+#include <time.h>       // time, gmtime_r, timegm, mktime, strftime
+#include <string.h>     // strlen, strncmp, strcmp, strcpy, memcpy
+#include <errno.h>      // errno, EINTR, ENOENT
+#include <dirent.h>     // opendir, fdopendir, readdir, closedir
+#include <sys/file.h>   // flock
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              MESSAGE IDS                                                      */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+const char *message_id_filename = ".MSGID";
+static const char *message_id_temp_filename = ".MSGID.tmp";
+
+static _Atomic message_id_t last_allocated_message_id = 0; // Last id handed out to a worker
+static _Atomic message_id_t reserved_message_id = 0;       // Every id <= this value is covered by the high-water mark on disk
+static sem_t message_id_reserve_semaphore;                  // Serializes the (rare) writes of the high-water mark file
+
+/**
+ * @brief Converts the current time into the smallest id that can be allocated in this second
+ */
+static message_id_t message_id_time_floor(void)
+{
+    time_t now = time(NULL);
+    if (unlikely(now < 0))
+    {
+        return 0;
+    }
+    return ((message_id_t)now) << MESSAGE_ID_SEQUENCE_BITS;
+}
+
+/**
+ * @brief Writes @p high_water_mark in the high-water mark file: temp file + fsync + rename, so a crash leaves either the old or the new value, never half of it
+ * @return NO_ERROR on success, SYSCALL_ERROR on failure
+ */
+static ERROR_CODE message_id_persist_high_water_mark(message_id_t high_water_mark)
+{
+    char line[32] = {0};
+    int line_length = snprintf(line, sizeof(line), "%llu\n", (unsigned long long)high_water_mark);
+    if (unlikely(line_length <= 0))
+    {
+        return SYSCALL_ERROR;
+    }
+
+    int fd = open(message_id_temp_filename, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (unlikely(fd < 0))
+    {
+        PSE("Failed to open message id high-water mark temp file");
+        return SYSCALL_ERROR;
+    }
+    if (unlikely(write(fd, line, (size_t)line_length) != (ssize_t)line_length || fsync(fd) != 0))
+    {
+        PSE("Failed to write message id high-water mark");
+        close(fd);
+        return SYSCALL_ERROR;
+    }
+    close(fd);
+
+    if (unlikely(rename(message_id_temp_filename, message_id_filename) != 0))
+    {
+        PSE("Failed to rename message id high-water mark file");
+        return SYSCALL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+ERROR_CODE message_id_allocator_init(void)
+{
+    if (unlikely(sem_init(&message_id_reserve_semaphore, 0, 1) == -1))
+    {
+        PSE("sem_init() failed for message_id_reserve_semaphore");
+        return SYSCALL_ERROR;
+    }
+
+    message_id_t high_water_mark = 0;
+    FILE *file = fopen(message_id_filename, "r");
+    if (file != NULL)
+    {
+        unsigned long long stored = 0;
+        if (fscanf(file, "%llu", &stored) == 1)
+        {
+            high_water_mark = (message_id_t)stored;
+        }
+        else
+        {
+            P("Message id high-water mark file is unreadable, falling back to the clock");
+        }
+        fclose(file);
+    }
+    else if (errno != ENOENT)
+    {
+        PSE("Failed to open message id high-water mark file");
+        return SYSCALL_ERROR;
+    }
+
+    // Any id up to the high-water mark may have been handed out before a crash, so we restart right after it
+    atomic_store(&last_allocated_message_id, high_water_mark);
+    atomic_store(&reserved_message_id, high_water_mark);
+    P("Message id allocator ready, high-water mark: %llu", (unsigned long long)high_water_mark);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Makes sure that @p wanted is covered by the high-water mark on disk before it gets handed out
+ * @return NO_ERROR on success, SYSCALL_ERROR on failure
+ */
+static ERROR_CODE message_id_reserve_up_to(message_id_t wanted)
+{
+    while (unlikely(sem_wait(&message_id_reserve_semaphore) < 0))
+    {
+        if (errno != EINTR)
+        {
+            PSE("sem_wait() failed for message_id_reserve_semaphore");
+            return SYSCALL_ERROR;
+        }
+    }
+
+    ERROR_CODE result = NO_ERROR;
+    if (wanted > atomic_load(&reserved_message_id)) // Another thread may have reserved while we were waiting
+    {
+        // The clock moves the floor by a whole second of ids at a time, so the reservation runs ahead of the clock, not of the id
+        message_id_t new_reservation = wanted + MESSAGE_ID_RESERVE_BLOCK;
+        message_id_t clock_reservation = message_id_time_floor() + ((message_id_t)MESSAGE_ID_RESERVE_SECONDS << MESSAGE_ID_SEQUENCE_BITS);
+        if (clock_reservation > new_reservation)
+        {
+            new_reservation = clock_reservation;
+        }
+        result = message_id_persist_high_water_mark(new_reservation);
+        if (likely(result == NO_ERROR))
+        {
+            atomic_store(&reserved_message_id, new_reservation);
+        }
+    }
+
+    sem_post(&message_id_reserve_semaphore);
+    return result;
+}
+
+message_id_t message_id_next(void)
+{
+    message_id_t previous = atomic_load(&last_allocated_message_id);
+    for (;;)
+    {
+        // Monotonic: at least previous + 1, but jump forward to the clock so the id keeps following time
+        message_id_t floor = message_id_time_floor();
+        message_id_t next = (previous + 1 > floor) ? previous + 1 : floor;
+
+        if (unlikely(next > atomic_load(&reserved_message_id)))
+        {
+            if (unlikely(message_id_reserve_up_to(next) != NO_ERROR))
+            {
+                return 0;
+            }
+        }
+
+        // On failure previous gets reloaded with the current value and we try again
+        if (likely(atomic_compare_exchange_weak(&last_allocated_message_id, &previous, next)))
+        {
+            return next;
+        }
+    }
+}
+
+message_id_t message_id_watermark(void)
+{
+    // message_id_next() never goes below the clock: at least the floor of this second from now on
+    message_id_t last = atomic_load(&last_allocated_message_id);
+    message_id_t floor = message_id_time_floor();
+    return floor > last + 1 ? floor - 1 : last;
+}
+
+ERROR_CODE message_id_advance_past(message_id_t id)
+{
+    message_id_t previous = atomic_load(&last_allocated_message_id);
+    while (previous < id && !atomic_compare_exchange_weak(&last_allocated_message_id, &previous, id))
+    {
+        // previous reloaded, try again
+    }
+    if (id > atomic_load(&reserved_message_id))
+    {
+        return message_id_reserve_up_to(id);
+    }
+    return NO_ERROR;
+}
+
+ERROR_CODE message_id_format_filename(message_id_t id, int unread, char *out, size_t out_size)
+{
+    if (unlikely(out == NULL || out_size == 0))
+    {
+        return NULL_PARAMETERS;
+    }
+
+    time_t seconds = (time_t)(id >> MESSAGE_ID_SEQUENCE_BITS);
+    unsigned int sequence = (unsigned int)(id & ((1u << MESSAGE_ID_SEQUENCE_BITS) - 1u));
+
+    // UTC: a local timestamp repeats in the daylight saving fall-back hour, two ids an hour apart would get the same name
+    struct tm id_tm = {0};
+    if (unlikely(gmtime_r(&seconds, &id_tm) == NULL))
+    {
+        PSE("Failed to convert message id time");
+        return SYSCALL_ERROR;
+    }
+    char timestamp[16] = {0};
+    if (unlikely(strftime(timestamp, sizeof(timestamp), "%Y%m%d%H%M%S", &id_tm) == 0))
+    {
+        PSE("Failed to format message id timestamp");
+        return SYSCALL_ERROR;
+    }
+
+    int written = snprintf(out, out_size, "%s%s%0*u%s", unread ? UNREAD_PREFIX : "", timestamp, MESSAGE_ID_SEQUENCE_DIGITS, sequence, file_suffix_user_data);
+    if (unlikely(written < 0 || (size_t)written >= out_size))
+    {
+        return STRING_SIZE_EXCEEDING_MAXIMUM;
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief Converts exactly @p count decimal digits starting at @p digits (the caller already checked that they are digits)
+ */
+static unsigned long long parse_decimal_digits(const char *digits, size_t count)
+{
+    unsigned long long value = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        value = value * 10u + (unsigned long long)(digits[i] - '0');
+    }
+    return value;
+}
+
+message_id_t message_id_from_filename(const char *filename)
+{
+    if (unlikely(filename == NULL))
+    {
+        return 0;
+    }
+    size_t prefix_length = strlen(UNREAD_PREFIX);
+    if (strncmp(filename, UNREAD_PREFIX, prefix_length) == 0)
+    {
+        filename += prefix_length;
+    }
+
+    // <YYYYMMDDHHMMSS> is mandatory, both for the old and the new names
+    size_t digits = 0;
+    while (filename[digits] >= '0' && filename[digits] <= '9')
+    {
+        digits++;
+    }
+    if (digits < 14 || strcmp(filename + digits, file_suffix_user_data) != 0)
+    {
+        return 0;
+    }
+
+    struct tm id_tm = {0};
+    id_tm.tm_year = (int)parse_decimal_digits(filename, 4) - 1900;
+    id_tm.tm_mon = (int)parse_decimal_digits(filename + 4, 2) - 1;
+    id_tm.tm_mday = (int)parse_decimal_digits(filename + 6, 2);
+    id_tm.tm_hour = (int)parse_decimal_digits(filename + 8, 2);
+    id_tm.tm_min = (int)parse_decimal_digits(filename + 10, 2);
+    id_tm.tm_sec = (int)parse_decimal_digits(filename + 12, 2);
+    // Names of ids have exactly MESSAGE_ID_SEQUENCE_DIGITS after the UTC timestamp. Old names (at most 3 counter digits) were in
+    // local time: mktime() guesses daylight saving for them, which is off by an hour at worst in the fall-back hour
+    time_t seconds = -1;
+    if (digits == 14 + MESSAGE_ID_SEQUENCE_DIGITS)
+    {
+        seconds = timegm(&id_tm);
+    }
+    else
+    {
+        id_tm.tm_isdst = -1;
+        seconds = mktime(&id_tm);
+    }
+    if (unlikely(seconds < 0))
+    {
+        return 0;
+    }
+
+    // Whatever follows the timestamp is the sequence (new names) or the clash counter (old names)
+    if (digits - 14 > MESSAGE_ID_SEQUENCE_DIGITS)
+    {
+        return 0;
+    }
+    unsigned long long sequence = parse_decimal_digits(filename + 14, digits - 14);
+    if (sequence >= (1ull << MESSAGE_ID_SEQUENCE_BITS))
+    {
+        return 0;
+    }
+    return (((message_id_t)seconds) << MESSAGE_ID_SEQUENCE_BITS) | (message_id_t)sequence;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              DURABILITY                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static const char *durability_env = "PGM_DURABILITY";
+static const char *group_commit_window_env = "PGM_GROUP_COMMIT_WINDOW_US";
+static const char *group_commit_max_batch_env = "PGM_GROUP_COMMIT_MAX_BATCH";
+
+static DURABILITY_MODE durability_mode = DURABILITY_GROUP_COMMIT;
+static long group_commit_window_microseconds = GROUP_COMMIT_DEFAULT_WINDOW_MICROSECONDS;
+static size_t group_commit_max_batch = GROUP_COMMIT_DEFAULT_MAX_BATCH;
+
+/**
+ * One waiter per delivering worker, lives on the worker stack for the duration of storage_make_durable().
+ * The batch is a singly linked list of waiters, whoever syncs the batch fills in the result of every waiter.
+ */
+typedef struct group_commit_waiter {
+    struct group_commit_waiter *next;
+    ERROR_CODE result;
+    int done;
+} group_commit_waiter;
+
+// GROUP COMMIT STATE, every field is protected by group_commit_lock
+static pthread_mutex_t group_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_commit_cond;                  // Initialized with CLOCK_MONOTONIC in storage_durability_init()
+static group_commit_waiter *group_commit_open_batch = NULL; // Batch that is still accepting deliveries
+static size_t group_commit_open_batch_size = 0;
+static int group_commit_leader_present = 0;                 // The first waiter of the open batch is its leader: it waits the window and then syncs
+static int group_commit_sync_in_progress = 0;               // Only one syncfs() at a time, the next leader keeps collecting meanwhile
+
+/**
+ * @brief Reads a numeric environment variable, returns @p fallback if the variable is missing or out of [@p min, @p max]
+ */
+long read_environment_long(const char *name, long fallback, long min, long max)
+{
+    const char *value = getenv(name);
+    if (value == NULL || value[0] == '\0')
+    {
+        return fallback;
+    }
+    char *endptr = NULL;
+    errno = 0;
+    long parsed = strtol(value, &endptr, 10);
+    if (unlikely(endptr == value || *endptr != '\0' || errno != 0 || parsed < min || parsed > max))
+    {
+        P("Invalid value [%s] for %s, using fallback: %ld", value, name, fallback);
+        return fallback;
+    }
+    return parsed;
+}
+
+const char *convert_durability_mode_to_string(DURABILITY_MODE mode)
+{
+    switch (mode)
+    {
+    case DURABILITY_NONE:
+        return "none";
+    case DURABILITY_GROUP_COMMIT:
+        return "group";
+    case DURABILITY_STRICT:
+        return "strict";
+    default:
+        return "unknown";
+    }
+}
+
+DURABILITY_MODE storage_durability_mode(void)
+{
+    return durability_mode;
+}
+
+ERROR_CODE storage_durability_init(void)
+{
+    const char *mode = getenv(durability_env);
+    if (mode != NULL)
+    {
+        if (strcmp(mode, "none") == 0)
+            durability_mode = DURABILITY_NONE;
+        else if (strcmp(mode, "group") == 0)
+            durability_mode = DURABILITY_GROUP_COMMIT;
+        else if (strcmp(mode, "strict") == 0)
+            durability_mode = DURABILITY_STRICT;
+        else
+            P("Invalid value [%s] for %s, using fallback: %s", mode, durability_env, convert_durability_mode_to_string(durability_mode));
+    }
+    group_commit_window_microseconds = read_environment_long(group_commit_window_env, GROUP_COMMIT_DEFAULT_WINDOW_MICROSECONDS, 0, 1000000);
+    group_commit_max_batch = (size_t)read_environment_long(group_commit_max_batch_env, GROUP_COMMIT_DEFAULT_MAX_BATCH, 1, 100000);
+
+    // The batch window is a relative timeout, the monotonic clock keeps it immune to wall clock jumps
+    pthread_condattr_t condition_attributes;
+    if (unlikely(pthread_condattr_init(&condition_attributes) != 0 ||
+                 pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC) != 0 ||
+                 pthread_cond_init(&group_commit_cond, &condition_attributes) != 0))
+    {
+        PSE("Failed to initialize the group commit condition variable");
+        return SYSCALL_ERROR;
+    }
+    pthread_condattr_destroy(&condition_attributes);
+
+    P("Durability mode: %s (group commit window: %ldus, max batch: %zu)", convert_durability_mode_to_string(durability_mode), group_commit_window_microseconds, group_commit_max_batch);
+    return NO_ERROR;
+}
+
+/**
+ * @brief fsync() of a directory, needed to make a newly created (or renamed) directory entry durable
+ * @param relative_path directory relative to @p directory_fd (AT_FDCWD: the working directory), NULL for @p directory_fd itself
+ */
+static ERROR_CODE sync_directory_at(int directory_fd, const char *relative_path)
+{
+    if (relative_path == NULL)
+    {
+        if (unlikely(fsync(directory_fd) != 0))
+        {
+            PSE("fsync() failed for directory fd %d", directory_fd);
+            return SYSCALL_ERROR;
+        }
+        return NO_ERROR;
+    }
+    int fd = openat(directory_fd, relative_path, O_RDONLY | O_DIRECTORY);
+    if (unlikely(fd < 0))
+    {
+        PSE("Failed to open directory [%s] for fsync", relative_path);
+        return SYSCALL_ERROR;
+    }
+    int rc = fsync(fd);
+    if (unlikely(rc != 0))
+    {
+        PSE("fsync() failed for directory [%s]", relative_path);
+    }
+    close(fd);
+    return rc == 0 ? NO_ERROR : SYSCALL_ERROR;
+}
+
+static ERROR_CODE sync_directory(const char *directory_path)
+{
+    return sync_directory_at(AT_FDCWD, directory_path);
+}
+
+/**
+ * @brief Group commit: joins the open batch, the first waiter of a batch (leader) waits for the window to expire or the batch to fill up,
+ * then a single syncfs() makes every file of the batch (data + directory entries) durable and the whole batch is woken up
+ */
+static ERROR_CODE group_commit_wait(int fd)
+{
+    group_commit_waiter self = {0};
+
+    pthread_mutex_lock(&group_commit_lock);
+    self.next = group_commit_open_batch;
+    group_commit_open_batch = &self;
+    group_commit_open_batch_size++;
+
+    if (group_commit_leader_present) // FOLLOWER: somebody else will sync for us
+    {
+        if (group_commit_open_batch_size >= group_commit_max_batch)
+        {
+            pthread_cond_broadcast(&group_commit_cond); // Batch is full, wake the leader before its window expires
+        }
+        while (!self.done)
+        {
+            pthread_cond_wait(&group_commit_cond, &group_commit_lock);
+        }
+        pthread_mutex_unlock(&group_commit_lock);
+        return self.result;
+    }
+
+    // LEADER: collect followers until the window expires or the batch is full
+    group_commit_leader_present = 1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += group_commit_window_microseconds * 1000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (group_commit_open_batch_size < group_commit_max_batch)
+    {
+        if (pthread_cond_timedwait(&group_commit_cond, &group_commit_lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    while (group_commit_sync_in_progress) // The previous batch is still syncing, keep the batch open meanwhile
+    {
+        pthread_cond_wait(&group_commit_cond, &group_commit_lock);
+    }
+
+    // Close the batch: new deliveries start a new one with a new leader
+    group_commit_waiter *batch = group_commit_open_batch;
+    size_t batch_size = group_commit_open_batch_size;
+    group_commit_open_batch = NULL;
+    group_commit_open_batch_size = 0;
+    group_commit_leader_present = 0;
+    group_commit_sync_in_progress = 1;
+    pthread_mutex_unlock(&group_commit_lock);
+
+    // LINUX MAN: syncfs() is like sync(), but synchronizes just the filesystem containing the file referred to by the open file descriptor fd.
+    ERROR_CODE result = NO_ERROR;
+    if (unlikely(syncfs(fd) != 0))
+    {
+        PSE("syncfs() failed for a group commit batch of %zu messages", batch_size);
+        result = SYSCALL_ERROR;
+    }
+
+    pthread_mutex_lock(&group_commit_lock);
+    for (group_commit_waiter *waiter = batch; waiter != NULL; waiter = waiter->next)
+    {
+        waiter->result = result;
+        waiter->done = 1;
+    }
+    group_commit_sync_in_progress = 0;
+    pthread_cond_broadcast(&group_commit_cond);
+    pthread_mutex_unlock(&group_commit_lock);
+
+    return result;
+}
+
+ERROR_CODE storage_make_durable(int fd, const char *directory_path)
+{
+    if (unlikely(directory_path == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    return storage_make_durable_at(fd, AT_FDCWD, directory_path);
+}
+
+ERROR_CODE storage_make_durable_at(int fd, int directory_fd, const char *relative_directory)
+{
+    if (unlikely(fd < 0))
+    {
+        return NULL_PARAMETERS;
+    }
+
+    switch (durability_mode)
+    {
+    case DURABILITY_NONE:
+        return NO_ERROR;
+    case DURABILITY_GROUP_COMMIT:
+        return group_commit_wait(fd);
+    case DURABILITY_STRICT:
+        if (unlikely(fdatasync(fd) != 0))
+        {
+            PSE("fdatasync() failed");
+            return SYSCALL_ERROR;
+        }
+        return sync_directory_at(directory_fd, relative_directory); // The file is useless if its directory entry is lost
+    default:
+        return ERROR;
+    }
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              STORAGE LAYOUT                                                   */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+const char *storage_layout_filename = ".LAYOUT";
+const char *storage_layout_migration_filename = ".LAYOUT.migrating";
+static const char *storage_layout_temp_filename = ".LAYOUT.tmp";
+static const char *storage_lock_filename = ".LOCK";         // flock()ed by the server and the offline tools, only one of them may touch the tree
+static const char *storage_layout_env = "PGM_STORAGE_LAYOUT";
+
+static STORAGE_LAYOUT storage_layout = {0, 0}; // Written once at startup (or by the migration tool), read-only afterwards
+static int storage_lock_fd = -1;
+
+static int write_all(int fd, const void *buffer, size_t length);
+
+/**
+ * @brief FNV-1a 32 bit, used for the fan-out directories and to tell a torn log record from a good one
+ */
+static uint32_t fnv1a_32(const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+STORAGE_LAYOUT storage_layout_current(void)
+{
+    return storage_layout;
+}
+
+static int storage_layout_equals(STORAGE_LAYOUT a, STORAGE_LAYOUT b)
+{
+    return a.user_levels == b.user_levels && a.message_levels == b.message_levels;
+}
+
+ERROR_CODE storage_layout_parse(const char *text, STORAGE_LAYOUT *out_layout)
+{
+    if (unlikely(text == NULL || out_layout == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    if (strcmp(text, "flat") == 0)
+    {
+        *out_layout = (STORAGE_LAYOUT){0, 0};
+        return NO_ERROR;
+    }
+    if (strcmp(text, "sharded") == 0)
+    {
+        *out_layout = (STORAGE_LAYOUT){2, 1};
+        return NO_ERROR;
+    }
+    unsigned int user_levels = 0;
+    unsigned int message_levels = 0;
+    char trailing = '\0';
+    if (sscanf(text, "%u:%u%c", &user_levels, &message_levels, &trailing) != 2 ||
+        user_levels > STORAGE_LAYOUT_MAX_LEVELS || message_levels > STORAGE_LAYOUT_MAX_LEVELS)
+    {
+        return ERROR;
+    }
+    *out_layout = (STORAGE_LAYOUT){user_levels, message_levels};
+    return NO_ERROR;
+}
+
+/**
+ * @brief Writes "<hh>/" for every level, taking one byte of the hash of @p key per level
+ * @param out at least STORAGE_LAYOUT_MAX_LEVELS * (STORAGE_SHARD_NAME_CHARS + 1) + 1 bytes
+ */
+static void storage_shard_prefix(const char *key, unsigned int levels, char *out)
+{
+    uint32_t hash = fnv1a_32(key, strlen(key));
+    size_t offset = 0;
+    for (unsigned int level = 0; level < levels; level++)
+    {
+        offset += (size_t)sprintf(&out[offset], "%02x/", (unsigned int)((hash >> (8 * level)) & 0xFFu));
+    }
+    out[offset] = '\0';
+}
+
+static int is_shard_name(const char *name)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    return strlen(name) == STORAGE_SHARD_NAME_CHARS && strchr(hex_digits, name[0]) != NULL && strchr(hex_digits, name[1]) != NULL;
+}
+
+static char *storage_user_directory_path_with(STORAGE_LAYOUT layout, const char *username)
+{
+    char prefix[STORAGE_LAYOUT_MAX_LEVELS * (STORAGE_SHARD_NAME_CHARS + 1) + 1] = {0};
+    storage_shard_prefix(username, layout.user_levels, prefix);
+    size_t path_length = strlen(prefix) + strlen(username) + strlen(folder_suffix_user) + 1;
+    char *path = calloc(path_length, sizeof(char));
+    if (unlikely(path == NULL))
+    {
+        PSE("Failed to allocate user directory path for [%s]", username);
+        return NULL;
+    }
+    snprintf(path, path_length, "%s%s%s", prefix, username, folder_suffix_user);
+    return path;
+}
+
+static char *storage_message_path_with(unsigned int message_levels, const char *user_directory_path, const char *filename)
+{
+    // The UNREAD prefix is not hashed: marking a message as read renames it inside the same bucket
+    const char *key = strncmp(filename, UNREAD_PREFIX, strlen(UNREAD_PREFIX)) == 0 ? filename + strlen(UNREAD_PREFIX) : filename;
+    char prefix[STORAGE_LAYOUT_MAX_LEVELS * (STORAGE_SHARD_NAME_CHARS + 1) + 1] = {0};
+    storage_shard_prefix(key, message_levels, prefix);
+    size_t path_length = strlen(user_directory_path) + 1 + strlen(prefix) + strlen(filename) + 1;
+    char *path = calloc(path_length, sizeof(char));
+    if (unlikely(path == NULL))
+    {
+        PSE("Failed to allocate message path for [%s]", filename);
+        return NULL;
+    }
+    snprintf(path, path_length, "%s/%s%s", user_directory_path, prefix, filename);
+    return path;
+}
+
+char *storage_user_directory_path(const char *username)
+{
+    if (unlikely(username == NULL))
+    {
+        return NULL;
+    }
+    return storage_user_directory_path_with(storage_layout, username);
+}
+
+char *storage_message_path(const char *user_directory_path, const char *filename)
+{
+    if (unlikely(user_directory_path == NULL || filename == NULL))
+    {
+        return NULL;
+    }
+    return storage_message_path_with(storage_layout.message_levels, user_directory_path, filename);
+}
+
+ERROR_CODE storage_message_relative_path(const char *filename, char *out, size_t out_size)
+{
+    if (unlikely(filename == NULL || out == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    const char *key = strncmp(filename, UNREAD_PREFIX, strlen(UNREAD_PREFIX)) == 0 ? filename + strlen(UNREAD_PREFIX) : filename;
+    char prefix[STORAGE_LAYOUT_MAX_LEVELS * (STORAGE_SHARD_NAME_CHARS + 1) + 1] = {0};
+    storage_shard_prefix(key, storage_layout.message_levels, prefix);
+    int length = snprintf(out, out_size, "%s%s", prefix, filename);
+    return length < 0 || (size_t)length >= out_size ? STRING_SIZE_EXCEEDING_MAXIMUM : NO_ERROR;
+}
+
+/**
+ * @brief mkdir -p of every directory in @p path before the last '/' (the last component is left alone)
+ * @param sync_created if set, the parent of every directory actually created is fsync()ed, so the new entry survives a crash
+ */
+static ERROR_CODE make_parent_directories(const char *path, int sync_created)
+{
+    char *copy = strdup(path);
+    if (unlikely(copy == NULL))
+    {
+        PSE("Failed to allocate path copy");
+        return SYSCALL_ERROR;
+    }
+    ERROR_CODE result = NO_ERROR;
+    for (char *slash = strchr(copy, '/'); slash != NULL && result == NO_ERROR; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdir(copy, 0700) == 0)
+        {
+            if (sync_created)
+            {
+                char *parent_end = strrchr(copy, '/');
+                if (parent_end == NULL)
+                {
+                    result = sync_directory(".");
+                }
+                else
+                {
+                    *parent_end = '\0';
+                    result = sync_directory(copy);
+                    *parent_end = '/';
+                }
+            }
+        }
+        else if (errno != EEXIST)
+        {
+            PSE("Failed to create directory [%s]", copy);
+            result = SYSCALL_ERROR;
+        }
+        *slash = '/';
+    }
+    free(copy);
+    return result;
+}
+
+/**
+ * @brief make_parent_directories() of @p relative_path inside @p directory_fd, for the message buckets of a user folder
+ */
+static ERROR_CODE make_parent_directories_at(int directory_fd, const char *relative_path, int sync_created)
+{
+    char copy[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    if (unlikely((size_t)snprintf(copy, sizeof(copy), "%s", relative_path) >= sizeof(copy)))
+    {
+        return STRING_SIZE_EXCEEDING_MAXIMUM;
+    }
+    ERROR_CODE result = NO_ERROR;
+    for (char *slash = strchr(copy, '/'); slash != NULL && result == NO_ERROR; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdirat(directory_fd, copy, 0700) == 0)
+        {
+            if (sync_created)
+            {
+                char *parent_end = strrchr(copy, '/');
+                if (parent_end == NULL)
+                {
+                    result = sync_directory_at(directory_fd, NULL);
+                }
+                else
+                {
+                    *parent_end = '\0';
+                    result = sync_directory_at(directory_fd, copy);
+                    *parent_end = '/';
+                }
+            }
+        }
+        else if (errno != EEXIST)
+        {
+            PSE("Failed to create directory [%s]", copy);
+            result = SYSCALL_ERROR;
+        }
+        *slash = '/';
+    }
+    return result;
+}
+
+ERROR_CODE storage_create_user_directory(const char *username)
+{
+    char *path = storage_user_directory_path(username);
+    if (unlikely(path == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+    ERROR_CODE result = make_parent_directories(path, 0);
+    if (likely(result == NO_ERROR) && unlikely(mkdir(path, 0700) == -1 && errno != EEXIST))
+    {
+        PSE("Failed to create user folder [%s]", path);
+        result = SYSCALL_ERROR;
+    }
+    free(path);
+    return result;
+}
+
+/**
+ * @brief Joins @p directory and @p name, "." is dropped so user folders of a flat tree keep their short relative path
+ */
+static char *join_path(const char *directory, const char *name)
+{
+    if (strcmp(directory, ".") == 0)
+    {
+        return strdup(name);
+    }
+    size_t path_length = strlen(directory) + 1 + strlen(name) + 1;
+    char *path = calloc(path_length, sizeof(char));
+    if (likely(path != NULL))
+    {
+        snprintf(path, path_length, "%s/%s", directory, name);
+    }
+    return path;
+}
+
+/**
+ * @brief d_type when the filesystem fills it, stat() otherwise
+ */
+static int entry_is_directory(const char *directory, const struct dirent *entry)
+{
+    if (entry->d_type != DT_UNKNOWN)
+    {
+        return entry->d_type == DT_DIR;
+    }
+    char *path = join_path(directory, entry->d_name);
+    struct stat entry_stat = {0};
+    int is_directory = path != NULL && stat(path, &entry_stat) == 0 && S_ISDIR(entry_stat.st_mode);
+    free(path);
+    return is_directory;
+}
+
+static ERROR_CODE walk_users(const char *directory, unsigned int levels_left, ERROR_CODE (*callback)(const char *, void *), void *context)
+{
+    DIR *directory_stream = opendir(directory);
+    if (unlikely(directory_stream == NULL))
+    {
+        PSE("opendir() failed for [%s]", directory);
+        return SYSCALL_ERROR;
+    }
+
+    size_t folder_suffix_length = strlen(folder_suffix_user);
+    char username[USERNAME_SIZE_CHARS] = {0};
+    ERROR_CODE result = NO_ERROR;
+    struct dirent *directory_entry = NULL;
+    while (result == NO_ERROR && (directory_entry = readdir(directory_stream)) != NULL)
+    {
+        if (levels_left > 0) // Fan-out level: only descend into shard directories
+        {
+            if (is_shard_name(directory_entry->d_name) && entry_is_directory(directory, directory_entry))
+            {
+                char *child = join_path(directory, directory_entry->d_name);
+                result = child == NULL ? SYSCALL_ERROR : walk_users(child, levels_left - 1, callback, context);
+                free(child);
+            }
+            continue;
+        }
+
+        size_t name_length = strlen(directory_entry->d_name);
+        if (name_length <= folder_suffix_length || strcmp(directory_entry->d_name + name_length - folder_suffix_length, folder_suffix_user) != 0)
+        {
+            continue; // Not a user folder
+        }
+        size_t username_length = name_length - folder_suffix_length;
+        if (username_length >= sizeof(username) || !entry_is_directory(directory, directory_entry))
+        {
+            continue; // Could never have been registered through the protocol, or just a file with the user suffix
+        }
+        memcpy(username, directory_entry->d_name, username_length);
+        username[username_length] = '\0';
+        result = callback(username, context);
+    }
+    closedir(directory_stream);
+    return result;
+}
+
+/**
+ * @brief d_type when the filesystem fills it, fstatat() otherwise
+ */
+static int entry_is_directory_at(int directory_fd, const struct dirent *entry)
+{
+    if (entry->d_type != DT_UNKNOWN)
+    {
+        return entry->d_type == DT_DIR;
+    }
+    struct stat entry_stat = {0};
+    return fstatat(directory_fd, entry->d_name, &entry_stat, 0) == 0 && S_ISDIR(entry_stat.st_mode);
+}
+
+/**
+ * @brief Walks the directory @p name of @p parent_fd: every level is opened relative to the previous one, no path is ever built
+ */
+static ERROR_CODE walk_messages_at(int parent_fd, const char *name, unsigned int levels_left, ERROR_CODE (*callback)(const char *, void *), void *context)
+{
+    // A new open file description even for ".": readdir() must not move the offset of a cached directory fd, closedir() closes this one
+    int directory_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *directory_stream = directory_fd < 0 ? NULL : fdopendir(directory_fd);
+    if (unlikely(directory_stream == NULL))
+    {
+        PSE("Failed to open user directory: %s", name);
+        if (directory_fd >= 0)
+        {
+            close(directory_fd);
+        }
+        return SYSCALL_ERROR;
+    }
+
+    size_t file_suffix_length = strlen(file_suffix_user_data);
+    ERROR_CODE result = NO_ERROR;
+    struct dirent *directory_entry = NULL;
+    while (result == NO_ERROR && (directory_entry = readdir(directory_stream)) != NULL)
+    {
+        if (levels_left > 0)
+        {
+            if (is_shard_name(directory_entry->d_name) && entry_is_directory_at(directory_fd, directory_entry))
+            {
+                result = walk_messages_at(directory_fd, directory_entry->d_name, levels_left - 1, callback, context);
+            }
+            continue;
+        }
+
+        size_t name_length = strlen(directory_entry->d_name);
+        if (name_length <= file_suffix_length || strcmp(directory_entry->d_name + name_length - file_suffix_length, file_suffix_user_data) != 0)
+        {
+            continue; // Not a message (password/data files, partial deliveries, shard directories)
+        }
+        result = callback(directory_entry->d_name, context);
+    }
+    closedir(directory_stream);
+    return result;
+}
+
+ERROR_CODE storage_for_each_user(ERROR_CODE (*callback)(const char *username, void *context), void *context)
+{
+    if (unlikely(callback == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    return walk_users(".", storage_layout.user_levels, callback, context);
+}
+
+ERROR_CODE storage_for_each_message(const char *user_directory_path, ERROR_CODE (*callback)(const char *filename, void *context), void *context)
+{
+    if (unlikely(user_directory_path == NULL || callback == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    return walk_messages_at(AT_FDCWD, user_directory_path, storage_layout.message_levels, callback, context);
+}
+
+ERROR_CODE storage_for_each_message_at(int user_directory_fd, ERROR_CODE (*callback)(const char *filename, void *context), void *context)
+{
+    if (unlikely(user_directory_fd < 0 || callback == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    return walk_messages_at(user_directory_fd, ".", storage_layout.message_levels, callback, context);
+}
+
+/**
+ * @brief Takes the working directory lock, held until the process exits
+ */
+static ERROR_CODE storage_lock_working_directory(void)
+{
+    if (storage_lock_fd >= 0)
+    {
+        return NO_ERROR;
+    }
+    int fd = open(storage_lock_filename, O_CREAT | O_RDWR, 0600);
+    if (unlikely(fd < 0))
+    {
+        PSE("Failed to open the lock file [%s]", storage_lock_filename);
+        return SYSCALL_ERROR;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        P("Another server (or tool) is already using this directory");
+        close(fd);
+        return ERROR;
+    }
+    storage_lock_fd = fd;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Temp file + fsync + rename, a crash leaves the old or the new content
+ */
+static ERROR_CODE write_small_file_atomically(const char *path, const char *content)
+{
+    int fd = open(storage_layout_temp_filename, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (unlikely(fd < 0))
+    {
+        PSE("Failed to open [%s]", storage_layout_temp_filename);
+        return SYSCALL_ERROR;
+    }
+    if (unlikely(write_all(fd, content, strlen(content)) < 0 || fsync(fd) != 0))
+    {
+        PSE("Failed to write [%s]", storage_layout_temp_filename);
+        close(fd);
+        return SYSCALL_ERROR;
+    }
+    close(fd);
+    if (unlikely(rename(storage_layout_temp_filename, path) != 0))
+    {
+        PSE("Failed to rename [%s] to [%s]", storage_layout_temp_filename, path);
+        return SYSCALL_ERROR;
+    }
+    return sync_directory(".");
+}
+
+static ERROR_CODE storage_layout_write(STORAGE_LAYOUT layout)
+{
+    char line[32] = {0};
+    snprintf(line, sizeof(line), "%u:%u\n", layout.user_levels, layout.message_levels);
+    return write_small_file_atomically(storage_layout_filename, line);
+}
+
+/**
+ * @brief Reads the layout file, a missing file means a flat tree (@p out_recorded set to 0)
+ * @return NO_ERROR with @p out_layout filled, ERROR if the file is malformed, SYSCALL_ERROR if it cannot be read
+ */
+static ERROR_CODE storage_layout_read(STORAGE_LAYOUT *out_layout, int *out_recorded)
+{
+    *out_recorded = 0;
+    FILE *layout_file = fopen(storage_layout_filename, "r");
+    if (layout_file == NULL)
+    {
+        if (errno == ENOENT)
+        {
+            *out_layout = (STORAGE_LAYOUT){0, 0};
+            return NO_ERROR;
+        }
+        PSE("Failed to open [%s]", storage_layout_filename);
+        return SYSCALL_ERROR;
+    }
+    char line[32] = {0};
+    ERROR_CODE result = ERROR;
+    if (fgets(line, sizeof(line), layout_file) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        result = storage_layout_parse(line, out_layout);
+    }
+    fclose(layout_file);
+    if (unlikely(result != NO_ERROR))
+    {
+        P("Malformed layout file [%s]", storage_layout_filename);
+    }
+    *out_recorded = result == NO_ERROR;
+    return result;
+}
+
+static ERROR_CODE stop_at_first_user(const char *username, void *context)
+{
+    (void)username;
+    *(int *)context = 1;
+    return ERROR; // Stops the walk, one is enough
+}
+
+ERROR_CODE storage_layout_init(void)
+{
+    ERROR_CODE lock_result = storage_lock_working_directory();
+    if (unlikely(lock_result != NO_ERROR))
+    {
+        return lock_result;
+    }
+    if (unlikely(access(storage_layout_migration_filename, F_OK) == 0))
+    {
+        P("A layout migration was interrupted, run the server with --migrate-layout <layout> again to complete it");
+        return ERROR;
+    }
+
+    STORAGE_LAYOUT recorded = {0, 0};
+    int layout_recorded = 0;
+    ERROR_CODE read_result = storage_layout_read(&recorded, &layout_recorded);
+    if (unlikely(read_result != NO_ERROR))
+    {
+        return read_result;
+    }
+    storage_layout = recorded;
+
+    const char *env_layout = getenv(storage_layout_env);
+    if (env_layout != NULL)
+    {
+        STORAGE_LAYOUT wanted = {0, 0};
+        if (unlikely(storage_layout_parse(env_layout, &wanted) != NO_ERROR))
+        {
+            P("Invalid %s [%s], expected flat, sharded or <user levels>:<message levels> (max %d)", storage_layout_env, env_layout, STORAGE_LAYOUT_MAX_LEVELS);
+            return ERROR;
+        }
+        if (!storage_layout_equals(wanted, recorded))
+        {
+            // A layout can only be chosen for a new tree, converting the existing one is the job of the migration tool
+            int has_users = 0;
+            storage_for_each_user(stop_at_first_user, &has_users);
+            if (layout_recorded || has_users)
+            {
+                P("The tree uses layout %u:%u but %s asks for %u:%u, run the server with --migrate-layout %s first",
+                  recorded.user_levels, recorded.message_levels, storage_layout_env, wanted.user_levels, wanted.message_levels, env_layout);
+                return ERROR;
+            }
+            if (unlikely(storage_layout_write(wanted) != NO_ERROR))
+            {
+                return SYSCALL_ERROR;
+            }
+            storage_layout = wanted;
+        }
+    }
+    P("Storage layout: %u user fan-out levels, %u message fan-out levels", storage_layout.user_levels, storage_layout.message_levels);
+    return NO_ERROR;
+}
+
+/* ---------------------------------------------- LAYOUT MIGRATION ---------------------------------------------- */
+
+typedef struct NAME_LIST {
+    char **names;
+    size_t count;
+    size_t capacity;
+} NAME_LIST;
+
+static ERROR_CODE name_list_append(const char *name, void *context)
+{
+    NAME_LIST *list = (NAME_LIST *)context;
+    if (list->count + 1 > list->capacity)
+    {
+        size_t next_capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        char **reallocated = realloc(list->names, next_capacity * sizeof(char *));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Failed to allocate the migration name list");
+            return SYSCALL_ERROR;
+        }
+        list->names = reallocated;
+        list->capacity = next_capacity;
+    }
+    list->names[list->count] = strdup(name);
+    if (unlikely(list->names[list->count] == NULL))
+    {
+        PSE("Failed to allocate the migration name list");
+        return SYSCALL_ERROR;
+    }
+    list->count++;
+    return NO_ERROR;
+}
+
+static void name_list_free(NAME_LIST *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->names[i]);
+    }
+    free(list->names);
+    *list = (NAME_LIST){0};
+}
+
+/**
+ * @brief rename() of @p old_path to @p new_path, creating the fan-out directories of the destination
+ */
+static ERROR_CODE migrate_entry(const char *old_path, const char *new_path)
+{
+    if (strcmp(old_path, new_path) == 0)
+    {
+        return NO_ERROR;
+    }
+    if (unlikely(make_parent_directories(new_path, 0) != NO_ERROR))
+    {
+        return SYSCALL_ERROR;
+    }
+    if (unlikely(rename(old_path, new_path) != 0))
+    {
+        PSE("Failed to move [%s] to [%s]", old_path, new_path);
+        return SYSCALL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+/**
+ * @brief Removes the fan-out directories left empty by the migration, non empty ones (new layout, leftovers) simply fail rmdir() and stay
+ */
+static void remove_empty_shard_directories(const char *directory, unsigned int levels)
+{
+    if (levels == 0)
+    {
+        return;
+    }
+    DIR *directory_stream = opendir(directory);
+    if (directory_stream == NULL)
+    {
+        return;
+    }
+    NAME_LIST shards = {0};
+    struct dirent *directory_entry = NULL;
+    while ((directory_entry = readdir(directory_stream)) != NULL)
+    {
+        if (is_shard_name(directory_entry->d_name) && entry_is_directory(directory, directory_entry))
+        {
+            name_list_append(directory_entry->d_name, &shards);
+        }
+    }
+    closedir(directory_stream);
+    for (size_t i = 0; i < shards.count; i++)
+    {
+        char *child = join_path(directory, shards.names[i]);
+        if (child != NULL)
+        {
+            remove_empty_shard_directories(child, levels - 1);
+            rmdir(child);
+            free(child);
+        }
+    }
+    name_list_free(&shards);
+}
+
+ERROR_CODE storage_migrate_layout(const char *target_layout)
+{
+    STORAGE_LAYOUT to = {0, 0};
+    if (unlikely(target_layout == NULL || storage_layout_parse(target_layout, &to) != NO_ERROR))
+    {
+        P("Invalid target layout, expected flat, sharded or <user levels>:<message levels> (max %d)", STORAGE_LAYOUT_MAX_LEVELS);
+        return ERROR;
+    }
+    ERROR_CODE result = storage_lock_working_directory();
+    if (unlikely(result != NO_ERROR))
+    {
+        return result;
+    }
+
+    // The migration file records "<from> <to>": if it exists we are resuming an interrupted run
+    STORAGE_LAYOUT from = {0, 0};
+    FILE *migration_file = fopen(storage_layout_migration_filename, "r");
+    if (migration_file != NULL)
+    {
+        STORAGE_LAYOUT resumed_to = {0, 0};
+        int fields = fscanf(migration_file, "%u:%u %u:%u", &from.user_levels, &from.message_levels, &resumed_to.user_levels, &resumed_to.message_levels);
+        fclose(migration_file);
+        if (unlikely(fields != 4 || from.user_levels > STORAGE_LAYOUT_MAX_LEVELS || from.message_levels > STORAGE_LAYOUT_MAX_LEVELS))
+        {
+            P("Malformed migration file [%s]", storage_layout_migration_filename);
+            return ERROR;
+        }
+        if (unlikely(!storage_layout_equals(resumed_to, to)))
+        {
+            P("An interrupted migration to %u:%u must be completed first", resumed_to.user_levels, resumed_to.message_levels);
+            return ERROR;
+        }
+        P("Resuming the migration from %u:%u to %u:%u", from.user_levels, from.message_levels, to.user_levels, to.message_levels);
+    }
+    else
+    {
+        int layout_recorded = 0;
+        result = storage_layout_read(&from, &layout_recorded);
+        if (unlikely(result != NO_ERROR))
+        {
+            return result;
+        }
+        if (storage_layout_equals(from, to))
+        {
+            P("The tree already uses layout %u:%u, nothing to do", to.user_levels, to.message_levels);
+            return NO_ERROR;
+        }
+        char line[64] = {0};
+        snprintf(line, sizeof(line), "%u:%u %u:%u\n", from.user_levels, from.message_levels, to.user_levels, to.message_levels);
+        if (unlikely(write_small_file_atomically(storage_layout_migration_filename, line) != NO_ERROR))
+        {
+            return SYSCALL_ERROR;
+        }
+        P("Migrating from %u:%u to %u:%u", from.user_levels, from.message_levels, to.user_levels, to.message_levels);
+    }
+
+    // Deliveries interrupted by a crash are resolved with the paths of the old layout (replayed records may point to shared bodies)
+    storage_layout = from;
+    if (unlikely(body_store_init() != NO_ERROR || delivery_log_recover_and_open() != NO_ERROR))
+    {
+        return SYSCALL_ERROR;
+    }
+
+    // 1) User folders still in the old position. A rerun does not see the ones already moved: they are not at the old depth
+    NAME_LIST users = {0};
+    size_t moved_users = 0;
+    size_t moved_messages = 0;
+    result = walk_users(".", from.user_levels, name_list_append, &users);
+    for (size_t i = 0; i < users.count && result == NO_ERROR; i++)
+    {
+        char *old_path = storage_user_directory_path_with(from, users.names[i]);
+        char *new_path = storage_user_directory_path_with(to, users.names[i]);
+        result = (old_path == NULL || new_path == NULL) ? SYSCALL_ERROR : migrate_entry(old_path, new_path);
+        moved_users += result == NO_ERROR && strcmp(old_path, new_path) != 0;
+        free(old_path);
+        free(new_path);
+    }
+    name_list_free(&users);
+
+    // 2) Messages of every user (now all in the new position), same idea: the ones already moved are not at the old depth
+    if (result == NO_ERROR)
+    {
+        result = walk_users(".", to.user_levels, name_list_append, &users);
+    }
+    for (size_t i = 0; i < users.count && result == NO_ERROR; i++)
+    {
+        char *user_directory = storage_user_directory_path_with(to, users.names[i]);
+        if (unlikely(user_directory == NULL))
+        {
+            result = SYSCALL_ERROR;
+            break;
+        }
+        NAME_LIST messages = {0};
+        if (from.message_levels != to.message_levels)
+        {
+            result = walk_messages_at(AT_FDCWD, user_directory, from.message_levels, name_list_append, &messages);
+        }
+        for (size_t j = 0; j < messages.count && result == NO_ERROR; j++)
+        {
+            char *old_path = storage_message_path_with(from.message_levels, user_directory, messages.names[j]);
+            char *new_path = storage_message_path_with(to.message_levels, user_directory, messages.names[j]);
+            result = (old_path == NULL || new_path == NULL) ? SYSCALL_ERROR : migrate_entry(old_path, new_path);
+            moved_messages += result == NO_ERROR;
+            free(old_path);
+            free(new_path);
+        }
+        name_list_free(&messages);
+        if (from.message_levels > 0 && to.message_levels != from.message_levels)
+        {
+            remove_empty_shard_directories(user_directory, from.message_levels);
+        }
+        free(user_directory);
+    }
+    name_list_free(&users);
+    if (from.user_levels > 0 && to.user_levels != from.user_levels)
+    {
+        remove_empty_shard_directories(".", from.user_levels);
+    }
+
+    if (unlikely(result != NO_ERROR))
+    {
+        P("Migration interrupted, the server will not start until it is completed: fix the error and run it again");
+        return result;
+    }
+
+    // 3) Every rename on disk before the tree is declared migrated
+    sync();
+    if (unlikely(storage_layout_write(to) != NO_ERROR || unlink(storage_layout_migration_filename) != 0 || sync_directory(".") != NO_ERROR))
+    {
+        PSE("Failed to record the new layout");
+        return SYSCALL_ERROR;
+    }
+    storage_layout = to;
+    P("Migration completed: %zu user folders and %zu messages moved", moved_users, moved_messages);
+    return NO_ERROR;
+}
+
+ERROR_CODE storage_open_offline(void)
+{
+    ERROR_CODE result = storage_layout_init();
+    if (likely(result == NO_ERROR))
+    {
+        result = message_id_allocator_init();
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = storage_durability_init();
+    }
+    if (likely(result == NO_ERROR))
+    {
+        storage_body_compression_init(); // Imports store their bodies like deliveries
+        storage_header_encoding_init();
+        result = body_store_init(); // Before the recovery: replayed records may point to shared bodies
+    }
+    if (likely(result == NO_ERROR))
+    {
+        result = delivery_log_recover_and_open();
+    }
+    if (unlikely(result != NO_ERROR))
+    {
+        P("Unable to open the tree in the working directory (is the server running?)");
+    }
+    return result;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                          DELIVERY WRITE-AHEAD LOG                                             */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+const char *delivery_log_filename = ".DELIVERY.wal";
+const char *partial_message_suffix = ".part"; // Appended to the final name while the message is being written, does not end with file_suffix_user_data so it is never listed
+
+// DELIVERY LOG STATE, protected by delivery_log_lock
+static pthread_mutex_t delivery_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int delivery_log_fd = -1;
+static size_t delivery_log_in_flight = 0;  // Intents appended whose commit/abort is not written yet
+static off_t delivery_log_size = 0;
+
+static void delivery_log_fill_record(DELIVERY_LOG_RECORD *record, DELIVERY_LOG_RECORD_TYPE type, message_id_t id, uint32_t message_length, const char *recipient, const char *filename)
+{
+    memset(record, 0, sizeof(*record)); // Padding included, the checksum covers raw bytes
+    record->magic = DELIVERY_LOG_MAGIC;
+    record->type = (uint32_t)type;
+    record->message_id = id;
+    record->message_length = message_length;
+    snprintf(record->recipient, sizeof(record->recipient), "%s", recipient);
+    snprintf(record->filename, sizeof(record->filename), "%s", filename);
+    record->checksum = fnv1a_32(record, offsetof(DELIVERY_LOG_RECORD, checksum));
+}
+
+static int delivery_log_record_is_valid(const DELIVERY_LOG_RECORD *record)
+{
+    return record->magic == DELIVERY_LOG_MAGIC &&
+           record->type >= DELIVERY_LOG_INTENT && record->type <= DELIVERY_LOG_ABORT &&
+           record->checksum == fnv1a_32(record, offsetof(DELIVERY_LOG_RECORD, checksum));
+}
+
+/**
+ * @brief Appends one record, @p sync forces it on disk before returning (used by the strict durability mode for intents)
+ */
+static ERROR_CODE delivery_log_append(DELIVERY_LOG_RECORD_TYPE type, message_id_t id, uint32_t message_length, const char *recipient, const char *filename, int sync)
+{
+    DELIVERY_LOG_RECORD record;
+    delivery_log_fill_record(&record, type, id, message_length, recipient, filename);
+
+    ERROR_CODE result = NO_ERROR;
+    pthread_mutex_lock(&delivery_log_lock);
+    if (unlikely(delivery_log_fd < 0))
+    {
+        result = ERROR;
+    }
+    else if (unlikely(write_all(delivery_log_fd, &record, sizeof(record)) < 0 || (sync && fdatasync(delivery_log_fd) != 0)))
+    {
+        PSE("Failed to append to the delivery log");
+        result = SYSCALL_ERROR;
+        if (unlikely(ftruncate(delivery_log_fd, delivery_log_size) != 0)) // Drop a torn record, the next ones stay aligned (O_APPEND)
+        {
+            PSE("Failed to cut a torn record off the delivery log");
+        }
+    }
+    else
+    {
+        delivery_log_size += (off_t)sizeof(record);
+        if (type == DELIVERY_LOG_INTENT)
+        {
+            delivery_log_in_flight++;
+        }
+    }
+    // A commit or abort ends its delivery even when it could not be appended: recovery checks an intent without one against the
+    // tree anyway, and the log must not stay in flight (never checkpointed) until the next restart
+    if (type != DELIVERY_LOG_INTENT && delivery_log_in_flight > 0)
+    {
+        delivery_log_in_flight--;
+    }
+
+    // Checkpoint: nothing in flight means no record is needed anymore, so the whole log can go
+    if (delivery_log_fd >= 0 && delivery_log_in_flight == 0 && delivery_log_size > DELIVERY_LOG_CHECKPOINT_BYTES)
+    {
+        if (likely(ftruncate(delivery_log_fd, 0) == 0))
+        {
+            delivery_log_size = 0;
+        }
+        else
+        {
+            PSE("Failed to checkpoint the delivery log");
+        }
+    }
+    pthread_mutex_unlock(&delivery_log_lock);
+    return result;
+}
+
+static uint32_t body_compression_min_bytes = 0; // 0: bodies are stored as they are
+
+void storage_body_compression_init(void)
+{
+    WIRE_COMPRESSION_OFFER offer = wire_compression_local_offer();
+    body_compression_min_bytes = (offer.codecs & WIRE_CODEC_LZ77) == 0 ? 0 : offer.min_bytes > 0 ? offer.min_bytes : 1;
+    if (body_compression_min_bytes == 0)
+    {
+        P("Body compression: off");
+        return;
+    }
+    P("Body compression: bodies of at least %u bytes", body_compression_min_bytes);
+}
+
+/**
+ * @brief Compresses a body that is about to be stored inline, see MESSAGE_FILE_SHAPE for the sizes a compressed body may have
+ * @param compressed room for @p body_length bytes
+ * @return the size of the block, 0 if the body is stored as it is
+ */
+static size_t storage_compress_body(const char *body, uint32_t body_length, char *compressed)
+{
+    if (body_compression_min_bytes == 0 || body_length < body_compression_min_bytes || body_length <= sizeof(MESSAGE_CHECKSUM))
+    {
+        return 0;
+    }
+    size_t compressed_length = compress_block(body, body_length, compressed, body_length - sizeof(MESSAGE_CHECKSUM));
+    return compressed_length > sizeof(COLD_REFERENCE) ? compressed_length : 0; // compress_block() already keeps Z + C < L
+}
+
+int storage_message_file_shape(uint64_t file_size, uint32_t message_length, uint32_t tail_magic, MESSAGE_FILE_SHAPE *out_shape)
+{
+    uint64_t header_size = offsetof(MESSAGE, message);
+    int tail_is_checksum = tail_magic == MESSAGE_CHECKSUM_MAGIC;
+    MESSAGE_FILE_SHAPE shape = {0};
+    if (message_length == 0 || message_length > MESSAGE_SIZE_CHARS)
+    {
+        return 0;
+    }
+    if (file_size == header_size + message_length)
+    {
+        // Inline, written before checksums existed
+    }
+    else if (file_size == header_size + message_length + sizeof(MESSAGE_CHECKSUM) && tail_is_checksum)
+    {
+        shape.checksummed = 1;
+    }
+    else if (body_store_is_reference_record(file_size, message_length))
+    {
+        shape.shared_body = 1;
+    }
+    else if (body_store_is_reference_record(file_size - sizeof(MESSAGE_CHECKSUM), message_length) &&
+             message_length != sizeof(BODY_REFERENCE) + sizeof(MESSAGE_CHECKSUM) && tail_is_checksum)
+    {
+        shape.shared_body = 1;
+        shape.checksummed = 1;
+    }
+    else if (cold_tier_is_reference_record(file_size - sizeof(MESSAGE_CHECKSUM), message_length) && tail_is_checksum)
+    {
+        shape.cold_body = 1;
+        shape.checksummed = 1;
+    }
+    else if (file_size > header_size + sizeof(COLD_REFERENCE) + sizeof(MESSAGE_CHECKSUM) && file_size < header_size + message_length && tail_is_checksum)
+    {
+        shape.compressed_body = 1; // Z = S - H - C: K < Z and Z + C < L
+        shape.checksummed = 1;
+    }
+    else
+    {
+        return 0;
+    }
+    if (out_shape != NULL)
+    {
+        *out_shape = shape;
+    }
+    return 1;
+}
+
+static int storage_compact_headers = 0;
+
+void storage_header_encoding_init(void)
+{
+    storage_compact_headers = header_encoding_local_compact();
+    P("Message headers: %s", storage_compact_headers ? "compact" : "fixed");
+}
+
+size_t storage_encode_file_header(const MESSAGE *header, void *out)
+{
+    size_t header_size = offsetof(MESSAGE, message);
+    size_t encoded_size = storage_compact_headers ? header_encode(header, out, header_size - 1) : 0;
+    if (encoded_size == 0)
+    {
+        memcpy(out, header, header_size); // Off, or nothing to save
+        return header_size;
+    }
+    return encoded_size;
+}
+
+/**
+ * @brief Decodes the header at the start of a message file, compact or fixed, from the first @p available bytes of @p bytes
+ * @return 1 with @p out_header and @p out_header_size filled, 0 if the header is truncated or corrupt
+ */
+static int storage_decode_file_header(const char *bytes, size_t available, MESSAGE *out_header, size_t *out_header_size)
+{
+    size_t header_size = offsetof(MESSAGE, message);
+    if (available > 0 && (unsigned char)bytes[0] == COMPACT_HEADER_MARKER) // A fixed header starts with its sender, never empty
+    {
+        return header_decode(bytes, available < header_size ? available : header_size, out_header, out_header_size) == NO_ERROR;
+    }
+    if (available < header_size)
+    {
+        return 0;
+    }
+    memcpy(out_header, bytes, header_size);
+    *out_header_size = header_size;
+    return 1;
+}
+
+int storage_expand_file_header(char *file, size_t *file_size, size_t capacity)
+{
+    size_t header_size = offsetof(MESSAGE, message);
+    if (*file_size == 0 || (unsigned char)file[0] != COMPACT_HEADER_MARKER)
+    {
+        return 1;
+    }
+    MESSAGE header;
+    size_t compact_size = 0;
+    if (!storage_decode_file_header(file, *file_size, &header, &compact_size) || *file_size - compact_size + header_size > capacity)
+    {
+        return 0;
+    }
+    memmove(file + header_size, file + compact_size, *file_size - compact_size);
+    memcpy(file, &header, header_size);
+    *file_size = *file_size - compact_size + header_size;
+    return 1;
+}
+
+int storage_message_file_shape_of(int fd, uint32_t *out_message_length, size_t *out_header_size, MESSAGE_FILE_SHAPE *out_shape)
+{
+    char bytes[offsetof(MESSAGE, message)];
+    MESSAGE header;
+    size_t header_size = 0;
+    MESSAGE_CHECKSUM tail = {0};
+    struct stat file_stat = {0};
+    ssize_t n = fstat(fd, &file_stat) != 0 ? -1 : pread(fd, bytes, sizeof(bytes), 0);
+    if (n <= 0 || !storage_decode_file_header(bytes, (size_t)n, &header, &header_size))
+    {
+        return 0;
+    }
+    if (file_stat.st_size >= (off_t)(header_size + sizeof(tail)) &&
+        pread(fd, &tail, sizeof(tail), file_stat.st_size - (off_t)sizeof(tail)) != (ssize_t)sizeof(tail))
+    {
+        return 0;
+    }
+    *out_message_length = ntohl(header.message_length);
+    if (out_header_size != NULL)
+    {
+        *out_header_size = header_size;
+    }
+    // Counted with a fixed header, see MESSAGE_FILE_SHAPE
+    uint64_t file_size = (uint64_t)file_stat.st_size - header_size + sizeof(bytes);
+    return storage_message_file_shape(file_size, *out_message_length, tail.magic, out_shape);
+}
+
+/**
+ * @brief Tells a record pointing to the body store from an inline message, by size (see 7-Server-Body-Store.h)
+ * @return 1 if the message file open in @p fd is a record (@p out_reference filled), 0 if its body is inline or the file is bogus
+ */
+static int storage_message_body_reference(int fd, BODY_REFERENCE *out_reference)
+{
+    uint32_t message_length = 0;
+    size_t header_size = 0;
+    MESSAGE_FILE_SHAPE shape;
+    if (!storage_message_file_shape_of(fd, &message_length, &header_size, &shape) || !shape.shared_body)
+    {
+        return 0;
+    }
+    return pread(fd, out_reference, sizeof(*out_reference), (off_t)header_size) == (ssize_t)sizeof(*out_reference) &&
+           out_reference->magic == BODY_REFERENCE_MAGIC;
+}
+
+int storage_message_file_is_complete(const char *path, uint32_t expected_message_length)
+{
+    if (unlikely(path == NULL))
+    {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    int complete = 0;
+    uint32_t message_length = 0;
+    MESSAGE_FILE_SHAPE shape;
+    if (storage_message_file_shape_of(fd, &message_length, NULL, &shape) &&
+        (expected_message_length == 0 || message_length == expected_message_length))
+    {
+        complete = 1;
+        if (shape.shared_body)
+        {
+            // Only complete if the record points to a body that made it to the body store entirely
+            BODY_REFERENCE reference;
+            complete = storage_message_body_reference(fd, &reference) && body_store_contains(&reference, message_length);
+        }
+        if (complete && shape.checksummed)
+        {
+            // The right size is not enough: pages written before the crash may never have reached the disk
+            MESSAGE *message = malloc(sizeof(MESSAGE) + MESSAGE_SIZE_CHARS);
+            complete = message != NULL && storage_read_message(fd, message, 1) == NO_ERROR;
+            free(message);
+        }
+    }
+    close(fd);
+    return complete;
+}
+
+/**
+ * @brief A kept record may point to a body whose reference increment did not reach the disk before the crash: take it again.
+ * If it did reach the disk the body just keeps one reference too many (leaked, never lost)
+ */
+static void delivery_log_retain_body(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    BODY_REFERENCE reference;
+    if (storage_message_body_reference(fd, &reference))
+    {
+        body_store_retain(&reference);
+    }
+    close(fd);
+}
+
+/**
+ * @brief Resolves one intent that has no commit/abort: replay it if the message made it to the disk entirely, discard it otherwise
+ */
+static void delivery_log_resolve_intent(const DELIVERY_LOG_RECORD *intent)
+{
+    char *user_directory = storage_user_directory_path(intent->recipient);
+    char *final_path = user_directory == NULL ? NULL : storage_message_path(user_directory, intent->filename);
+    size_t path_length = final_path == NULL ? 0 : strlen(final_path) + strlen(partial_message_suffix) + 1;
+    char *partial_path = final_path == NULL ? NULL : calloc(path_length, sizeof(char));
+    free(user_directory);
+    if (unlikely(final_path == NULL || partial_path == NULL))
+    {
+        PSE("Failed to allocate recovery paths for message %llu", (unsigned long long)intent->message_id);
+        free(final_path);
+        free(partial_path);
+        return;
+    }
+    snprintf(partial_path, path_length, "%s%s", final_path, partial_message_suffix);
+
+    if (access(final_path, F_OK) == 0) // Renamed already, only the sync (or the commit record) was missing
+    {
+        if (storage_message_file_is_complete(final_path, intent->message_length))
+        {
+            P("Recovery: message [%s] for [%s] is complete, kept", intent->filename, intent->recipient);
+            delivery_log_retain_body(final_path);
+        }
+        else
+        {
+            P("Recovery: message [%s] for [%s] is truncated, discarded", intent->filename, intent->recipient);
+            unlink(final_path);
+        }
+    }
+    else if (access(partial_path, F_OK) == 0) // Crash while writing or right before the rename
+    {
+        if (storage_message_file_is_complete(partial_path, intent->message_length) && rename(partial_path, final_path) == 0)
+        {
+            P("Recovery: message [%s] for [%s] replayed", intent->filename, intent->recipient);
+            delivery_log_retain_body(final_path);
+        }
+        else
+        {
+            P("Recovery: partial message [%s] for [%s] discarded", intent->filename, intent->recipient);
+            unlink(partial_path);
+        }
+    }
+    else
+    {
+        P("Recovery: message [%s] for [%s] never reached the disk, nothing to do", intent->filename, intent->recipient);
+    }
+
+    free(final_path);
+    free(partial_path);
+}
+
+ERROR_CODE delivery_log_recover_and_open(void)
+{
+    int fd = open(delivery_log_filename, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (unlikely(fd < 0))
+    {
+        PSE("Failed to open the delivery log [%s]", delivery_log_filename);
+        return SYSCALL_ERROR;
+    }
+
+    // Pending intents are at most the deliveries that were in flight at crash time, a small array with linear search is enough
+    DELIVERY_LOG_RECORD *pending = NULL;
+    size_t pending_count = 0;
+    size_t pending_capacity = 0;
+    size_t records_read = 0;
+
+    DELIVERY_LOG_RECORD record;
+    ssize_t got;
+    while ((got = read(fd, &record, sizeof(record))) == (ssize_t)sizeof(record))
+    {
+        if (unlikely(!delivery_log_record_is_valid(&record)))
+        {
+            P("Recovery: torn record in the delivery log after %zu records, ignoring the tail", records_read);
+            break;
+        }
+        records_read++;
+
+        if (record.type == DELIVERY_LOG_INTENT)
+        {
+            if (pending_count + 1 > pending_capacity)
+            {
+                size_t next_capacity = pending_capacity == 0 ? 16 : pending_capacity * 2;
+                DELIVERY_LOG_RECORD *reallocated = realloc(pending, next_capacity * sizeof(*pending));
+                if (unlikely(reallocated == NULL))
+                {
+                    PSE("Failed to allocate the pending intents array");
+                    free(pending);
+                    close(fd);
+                    return SYSCALL_ERROR;
+                }
+                pending = reallocated;
+                pending_capacity = next_capacity;
+            }
+            pending[pending_count++] = record;
+            continue;
+        }
+
+        // Commit or abort: the matching intent is resolved, swap-remove it
+        for (size_t i = 0; i < pending_count; i++)
+        {
+            if (pending[i].message_id == record.message_id)
+            {
+                pending[i] = pending[--pending_count];
+                break;
+            }
+        }
+    }
+    if (unlikely(got < 0))
+    {
+        PSE("Failed to read the delivery log");
+        free(pending);
+        close(fd);
+        return SYSCALL_ERROR;
+    }
+
+    for (size_t i = 0; i < pending_count; i++)
+    {
+        delivery_log_resolve_intent(&pending[i]);
+    }
+    if (pending_count > 0)
+    {
+        sync(); // Make the recovery decisions durable before forgetting about them
+    }
+    P("Delivery log recovery: %zu records read, %zu incomplete deliveries resolved", records_read, pending_count);
+    free(pending);
+
+    if (unlikely(ftruncate(fd, 0) != 0 || fsync(fd) != 0))
+    {
+        PSE("Failed to truncate the delivery log");
+        close(fd);
+        return SYSCALL_ERROR;
+    }
+
+    pthread_mutex_lock(&delivery_log_lock);
+    delivery_log_fd = fd;
+    delivery_log_size = 0;
+    delivery_log_in_flight = 0;
+    pthread_mutex_unlock(&delivery_log_lock);
+    return NO_ERROR;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              MESSAGE DELIVERY                                                 */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief write that loops until all EXPECTED! data is written (same idea as send_all)
+ * @return 0 on success, -1 on error
+ */
+static int write_all(int fd, const void *buffer, size_t length)
+{
+    const char *p = (const char *)buffer;
+    size_t left = length;
+    while (left)
+    {
+        ssize_t n = write(fd, p, left);
+        if (likely(n > 0))
+        {
+            p += n;
+            left -= (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+ERROR_CODE storage_deliver_message(int recipient_fd, const char *recipient_directory, const MESSAGE *header, const char *body, uint32_t body_length, char *out_filename)
+{
+    if (unlikely(recipient_fd < 0 || recipient_directory == NULL || header == NULL || body == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+
+    // The filename is derived from a server-wide monotonic id, so there is no name clash to retry on
+    message_id_t message_id = message_id_next();
+    char message_filename[MESSAGE_FILENAME_SIZE_CHARS] = {0};
+    if (unlikely(message_id == 0 || message_id_format_filename(message_id, 1, message_filename, sizeof(message_filename)) != NO_ERROR))
+    {
+        PSE("Failed to allocate message id for [%s]", recipient_directory);
+        return SYSCALL_ERROR;
+    }
+
+    // Everything below is relative to the recipient folder, only the snapshot hooks need the path from the working directory
+    char message_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    char partial_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    char snapshot_path[STORAGE_MESSAGE_PATH_SIZE_CHARS];
+    if (unlikely(storage_message_relative_path(message_filename, message_path, sizeof(message_path)) != NO_ERROR ||
+                 (size_t)snprintf(partial_path, sizeof(partial_path), "%s%s", message_path, partial_message_suffix) >= sizeof(partial_path) ||
+                 (size_t)snprintf(snapshot_path, sizeof(snapshot_path), "%s/%s", recipient_directory, message_path) >= sizeof(snapshot_path)))
+    {
+        P("Message path too long for [%s]", recipient_directory);
+        return SYSCALL_ERROR;
+    }
+    char message_directory[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS]; // The message bucket with a sharded layout
+    char *bucket_end = strrchr(strcpy(message_directory, message_path), '/');
+    if (bucket_end != NULL)
+    {
+        *bucket_end = '\0';
+    }
+
+    // 1) Intent first: from now on a crash is resolved by the recovery pass. Strict mode wants it on disk before the message file exists
+    if (unlikely(delivery_log_append(DELIVERY_LOG_INTENT, message_id, body_length, header->recipient, message_filename, durability_mode == DURABILITY_STRICT) != NO_ERROR))
+    {
+        return SYSCALL_ERROR;
+    }
+
+    // Shared bodies are stored (or referenced once more) before the record, the record then only holds the reference.
+    // If the body store fails the message is simply stored inline, compressed if that makes it smaller
+    BODY_REFERENCE body_reference;
+    int shared_body = body_store_should_share(body_length) && body_store_acquire(body, body_length, &body_reference) == NO_ERROR;
+    char compressed_body[MESSAGE_SIZE_CHARS];
+    size_t compressed_length = shared_body ? 0 : storage_compress_body(body, body_length, compressed_body);
+    const void *stored_body = shared_body ? (const void *)&body_reference : compressed_length > 0 ? (const void *)compressed_body : (const void *)body;
+    size_t stored_body_length = shared_body ? sizeof(body_reference) : compressed_length > 0 ? compressed_length : body_length;
+    MESSAGE canonical; // What a compact header decodes to, the checksum covers it
+    memcpy(&canonical, header, offsetof(MESSAGE, message));
+    header_canonicalize(&canonical);
+    char file_header[offsetof(MESSAGE, message)];
+    size_t file_header_size = storage_encode_file_header(&canonical, file_header);
+    MESSAGE_CHECKSUM checksum = {.magic = MESSAGE_CHECKSUM_MAGIC, .crc32c = checksum_message(&canonical, body, body_length)}; // Of the real body
+
+    // 2) Write the partial file and move it to its final name, readers never see a half written message
+    ERROR_CODE result = NO_ERROR;
+    if (storage_layout.message_levels > 0)
+    {
+        result = make_parent_directories_at(recipient_fd, message_path, durability_mode == DURABILITY_STRICT); // Buckets are created on first use
+    }
+    int msg_fd = result != NO_ERROR ? -1 : openat(recipient_fd, partial_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600); // Still exclusive: an existing file here means the high-water mark was lost, and we never overwrite mail
+    if (unlikely(result != NO_ERROR))
+    {
+        PSE("Failed to create the message bucket for [%s/%s]", recipient_directory, partial_path);
+    }
+    else if (unlikely(msg_fd < 0))
+    {
+        PSE("Failed to create message file [%s/%s]", recipient_directory, partial_path);
+        result = SYSCALL_ERROR;
+    }
+    else if (unlikely(write_all(msg_fd, file_header, file_header_size) < 0 || write_all(msg_fd, stored_body, stored_body_length) < 0 ||
+                      write_all(msg_fd, &checksum, sizeof(checksum)) < 0))
+    {
+        PSE("Failed to write message file [%s/%s]", recipient_directory, partial_path);
+        result = SYSCALL_ERROR;
+    }
+    else
+    {
+        snapshot_create_begin(snapshot_path); // A snapshot started while this id was being delivered leaves it out
+        int renamed = renameat(recipient_fd, partial_path, recipient_fd, message_path) == 0;
+        snapshot_change_end();
+        if (unlikely(!renamed))
+        {
+            PSE("Failed to rename message file [%s/%s]", recipient_directory, partial_path);
+            result = SYSCALL_ERROR;
+        }
+    }
+    if (likely(result == NO_ERROR))
+    {
+        // 3) Data + directory entry (+ log, since it lives on the same filesystem for group commit) on disk
+        result = storage_make_durable_at(msg_fd, recipient_fd, bucket_end != NULL ? message_directory : NULL);
+    }
+    if (msg_fd >= 0)
+    {
+        close(msg_fd);
+    }
+
+    // 4) Commit or abort, this record does not need to be synced: a missing commit just makes recovery re-check a complete file
+    if (unlikely(result != NO_ERROR))
+    {
+        unlinkat(recipient_fd, partial_path, 0); // Never leave a truncated (or not durable) message behind
+        snapshot_change_begin(snapshot_path);
+        unlinkat(recipient_fd, message_path, 0);
+        snapshot_change_end();
+        if (shared_body)
+        {
+            body_store_release(&body_reference);
+        }
+        delivery_log_append(DELIVERY_LOG_ABORT, message_id, body_length, header->recipient, message_filename, 0);
+    }
+    else
+    {
+        delivery_log_append(DELIVERY_LOG_COMMIT, message_id, body_length, header->recipient, message_filename, 0);
+        if (out_filename != NULL)
+        {
+            memcpy(out_filename, message_filename, sizeof(message_filename));
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Final and partial path of an imported message
+ * @return NO_ERROR with both heap allocated (to be freed by the caller), SYSCALL_ERROR if memory runs out
+ */
+static ERROR_CODE storage_import_paths(const char *user_directory_path, const char *filename, char **out_message_path, char **out_partial_path)
+{
+    char *message_path = storage_message_path(user_directory_path, filename);
+    size_t path_length = message_path == NULL ? 0 : strlen(message_path) + strlen(partial_message_suffix) + 1;
+    char *partial_path = message_path == NULL ? NULL : calloc(path_length, sizeof(char));
+    if (unlikely(partial_path == NULL))
+    {
+        PSE("Failed to allocate message path");
+        free(message_path);
+        return SYSCALL_ERROR;
+    }
+    snprintf(partial_path, path_length, "%s%s", message_path, partial_message_suffix);
+    *out_message_path = message_path;
+    *out_partial_path = partial_path;
+    return NO_ERROR;
+}
+
+ERROR_CODE storage_import_message_write(const char *user_directory_path, const char *filename, const MESSAGE *header, const char *body, uint32_t body_length)
+{
+    if (unlikely(user_directory_path == NULL || filename == NULL || header == NULL || body == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    char *message_path = NULL;
+    char *partial_path = NULL;
+    if (unlikely(storage_import_paths(user_directory_path, filename, &message_path, &partial_path) != NO_ERROR))
+    {
+        return SYSCALL_ERROR;
+    }
+    // The message keeps its name (and so its id and read state), the same name in the same folder is the same message
+    struct stat existing = {0};
+    if (stat(message_path, &existing) == 0)
+    {
+        free(message_path);
+        free(partial_path);
+        return OPERATION_ABORTED;
+    }
+
+    BODY_REFERENCE body_reference;
+    int shared_body = body_store_should_share(body_length) && body_store_acquire(body, body_length, &body_reference) == NO_ERROR;
+    char compressed_body[MESSAGE_SIZE_CHARS];
+    size_t compressed_length = shared_body ? 0 : storage_compress_body(body, body_length, compressed_body);
+    const void *stored_body = shared_body ? (const void *)&body_reference : compressed_length > 0 ? (const void *)compressed_body : (const void *)body;
+    size_t stored_body_length = shared_body ? sizeof(body_reference) : compressed_length > 0 ? compressed_length : body_length;
+    MESSAGE canonical; // What a compact header decodes to, the checksum covers it
+    memcpy(&canonical, header, offsetof(MESSAGE, message));
+    header_canonicalize(&canonical);
+    char file_header[offsetof(MESSAGE, message)];
+    size_t file_header_size = storage_encode_file_header(&canonical, file_header);
+    MESSAGE_CHECKSUM checksum = {.magic = MESSAGE_CHECKSUM_MAGIC, .crc32c = checksum_message(&canonical, body, body_length)}; // Of the real body
+
+    ERROR_CODE result = NO_ERROR;
+    if (storage_layout.message_levels > 0)
+    {
+        result = make_parent_directories(message_path, 0); // The caller syncs the whole batch
+    }
+    int msg_fd = result != NO_ERROR ? -1 : open(partial_path, O_CREAT | O_TRUNC | O_WRONLY, 0600); // A leftover of an interrupted import is simply rewritten
+    if (unlikely(result != NO_ERROR))
+    {
+        PSE("Failed to create the message bucket for [%s]", partial_path);
+    }
+    else if (unlikely(msg_fd < 0))
+    {
+        PSE("Failed to create message file [%s]", partial_path);
+        result = SYSCALL_ERROR;
+    }
+    else if (unlikely(write_all(msg_fd, file_header, file_header_size) < 0 || write_all(msg_fd, stored_body, stored_body_length) < 0 ||
+                      write_all(msg_fd, &checksum, sizeof(checksum)) < 0))
+    {
+        PSE("Failed to write message file [%s]", partial_path);
+        result = SYSCALL_ERROR;
+    }
+    if (msg_fd >= 0)
+    {
+        close(msg_fd);
+    }
+    if (unlikely(result != NO_ERROR))
+    {
+        unlink(partial_path);
+        if (shared_body)
+        {
+            body_store_release(&body_reference);
+        }
+    }
+    free(message_path);
+    free(partial_path);
+    return result;
+}
+
+ERROR_CODE storage_import_message_publish(const char *user_directory_path, const char *filename)
+{
+    if (unlikely(user_directory_path == NULL || filename == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    char *message_path = NULL;
+    char *partial_path = NULL;
+    if (unlikely(storage_import_paths(user_directory_path, filename, &message_path, &partial_path) != NO_ERROR))
+    {
+        return SYSCALL_ERROR;
+    }
+    ERROR_CODE result = NO_ERROR;
+    if (unlikely(rename(partial_path, message_path) != 0))
+    {
+        PSE("Failed to rename message file [%s]", partial_path);
+        result = SYSCALL_ERROR;
+    }
+    free(message_path);
+    free(partial_path);
+    return result;
+}
+
+/**
+ * @brief storage_read_message(), plus the stored block of a compressed body in @p compressed if not NULL
+ */
+static ERROR_CODE storage_read_message_stored(int fd, MESSAGE *message, int with_body, char *compressed, uint32_t *out_compressed_length)
+{
+    if (unlikely(message == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    size_t header_size = offsetof(MESSAGE, message);
+    if (!with_body)
+    {
+        char bytes[offsetof(MESSAGE, message)]; // A compact header is shorter, and so may be the whole file
+        size_t stored_header_size = 0;
+        ssize_t n = pread(fd, bytes, sizeof(bytes), 0);
+        if (n <= 0 || !storage_decode_file_header(bytes, (size_t)n, message, &stored_header_size))
+        {
+            return STRING_SIZE_INVALID;
+        }
+        uint32_t message_length = ntohl(message->message_length);
+        return message_length == 0 || message_length > MESSAGE_SIZE_CHARS ? STRING_SIZE_INVALID : NO_ERROR;
+    }
+
+    // The whole file in one read: header, inline body (or reference) and checksum
+    char file[offsetof(MESSAGE, message) + MESSAGE_SIZE_CHARS + sizeof(MESSAGE_CHECKSUM)];
+    struct stat file_stat = {0};
+    if (unlikely(fstat(fd, &file_stat) != 0))
+    {
+        return SYSCALL_ERROR;
+    }
+    if (file_stat.st_size == 0 || file_stat.st_size > (off_t)sizeof(file))
+    {
+        return STRING_SIZE_INVALID;
+    }
+    size_t file_size = (size_t)file_stat.st_size;
+    ssize_t n = pread(fd, file, file_size, 0);
+    if (unlikely(n < 0))
+    {
+        return SYSCALL_ERROR;
+    }
+    if ((size_t)n != file_size)
+    {
+        return STRING_SIZE_INVALID; // Truncated while we were reading it
+    }
+    if (!storage_expand_file_header(file, &file_size, sizeof(file)) || file_size < header_size)
+    {
+        return STRING_SIZE_INVALID;
+    }
+    memcpy(message, file, header_size);
+    uint32_t message_length = ntohl(message->message_length);
+    MESSAGE_CHECKSUM tail = {0};
+    if (file_size >= header_size + sizeof(tail))
+    {
+        memcpy(&tail, file + file_size - sizeof(tail), sizeof(tail));
+    }
+    MESSAGE_FILE_SHAPE shape;
+    if (!storage_message_file_shape(file_size, message_length, tail.magic, &shape))
+    {
+        return STRING_SIZE_INVALID;
+    }
+
+    if (shape.shared_body)
+    {
+        BODY_REFERENCE reference;
+        memcpy(&reference, file + header_size, sizeof(reference));
+        if (reference.magic != BODY_REFERENCE_MAGIC)
+        {
+            return STRING_SIZE_INVALID;
+        }
+        ERROR_CODE result = body_store_read(&reference, message->message, message_length);
+        if (result != NO_ERROR)
+        {
+            return result;
+        }
+    }
+    else if (shape.cold_body)
+    {
+        COLD_REFERENCE reference;
+        memcpy(&reference, file + header_size, sizeof(reference));
+        ERROR_CODE result = cold_tier_read_body(message->recipient, &reference, message->message, message_length);
+        if (result != NO_ERROR)
+        {
+            return result;
+        }
+    }
+    else if (shape.compressed_body)
+    {
+        size_t compressed_length = file_size - header_size - sizeof(MESSAGE_CHECKSUM);
+        if (decompress_block(file + header_size, compressed_length, message->message, message_length) != NO_ERROR)
+        {
+            return STRING_SIZE_INVALID;
+        }
+        if (compressed != NULL)
+        {
+            memcpy(compressed, file + header_size, compressed_length);
+            *out_compressed_length = (uint32_t)compressed_length;
+        }
+    }
+    else
+    {
+        memcpy(message->message, file + header_size, message_length);
+    }
+
+    if (!shape.checksummed)
+    {
+        checksum_count_unchecked();
+        return NO_ERROR;
+    }
+    return checksum_verify_message(message, message->message, message_length, tail.crc32c) ? NO_ERROR : STRING_SIZE_INVALID;
+}
+
+ERROR_CODE storage_read_message(int fd, MESSAGE *message, int with_body)
+{
+    return storage_read_message_stored(fd, message, with_body, NULL, NULL);
+}
+
+ERROR_CODE storage_read_message_compressed(int fd, MESSAGE *message, char *compressed, uint32_t *out_compressed_length)
+{
+    if (unlikely(compressed == NULL || out_compressed_length == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    *out_compressed_length = 0;
+    return storage_read_message_stored(fd, message, 1, compressed, out_compressed_length);
+}
+
+ERROR_CODE storage_remove_message_at(int user_directory_fd, const char *user_directory, const char *filename)
+{
+    if (unlikely(user_directory_fd < 0 || user_directory == NULL || filename == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    char message_path[STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS];
+    char snapshot_path[STORAGE_MESSAGE_PATH_SIZE_CHARS];
+    if (unlikely(storage_message_relative_path(filename, message_path, sizeof(message_path)) != NO_ERROR ||
+                 (size_t)snprintf(snapshot_path, sizeof(snapshot_path), "%s/%s", user_directory, message_path) >= sizeof(snapshot_path)))
+    {
+        errno = ENAMETOOLONG;
+        return SYSCALL_ERROR;
+    }
+    int fd = openat(user_directory_fd, message_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return SYSCALL_ERROR; // errno kept, ENOENT = no such message
+    }
+    BODY_REFERENCE reference;
+    int shared_body = storage_message_body_reference(fd, &reference);
+    close(fd);
+    snapshot_change_begin(snapshot_path);
+    int removed = unlinkat(user_directory_fd, message_path, 0) == 0;
+    snapshot_change_end();
+    if (!removed)
+    {
+        return SYSCALL_ERROR; // Another session deleted it first, that session also drops the body reference
+    }
+    if (shared_body)
+    {
+        // The unlink must be durable before the reference goes, otherwise a crash could bring back a record pointing to a freed body
+        char *bucket_end = strrchr(message_path, '/');
+        if (bucket_end != NULL)
+        {
+            *bucket_end = '\0';
+        }
+        if (durability_mode == DURABILITY_NONE || sync_directory_at(user_directory_fd, bucket_end != NULL ? message_path : NULL) == NO_ERROR)
+        {
+            body_store_release(&reference);
+        }
+    }
+    return NO_ERROR;
+}
+
+uint64_t storage_message_bytes(int fd)
+{
+    // The quota counts header + body, so every shape but the inline one without checksum needs the message_length of the header
+    uint32_t message_length = 0;
+    MESSAGE_FILE_SHAPE shape;
+    if (storage_message_file_shape_of(fd, &message_length, NULL, &shape))
+    {
+        return offsetof(MESSAGE, message) + message_length;
+    }
+    struct stat file_stat = {0};
+    return fstat(fd, &file_stat) == 0 ? (uint64_t)file_stat.st_size : 0;
+}
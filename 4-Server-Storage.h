@@ -0,0 +1,427 @@
+/**
+ * @file 4-Server-Storage.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the server storage layer (message ids, message files and everything that touches the disk on behalf of the worker threads)
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              MESSAGE IDS                                                      */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * Every stored message is identified by a 64 bit server-wide monotonic id.
+ * Layout of the id (most significant bits first):
+ *  - [63 .. MESSAGE_ID_SEQUENCE_BITS] seconds since the epoch at allocation time
+ *  - [MESSAGE_ID_SEQUENCE_BITS-1 .. 0] sequence number inside that second
+ * So sorting ids numerically also sorts them by time, and two messages delivered in the same second never clash.
+ *
+ * The message filename is derived from the id: [UNREAD]<YYYYMMDDHHMMSS><sequence, MESSAGE_ID_SEQUENCE_DIGITS digits><file_suffix_user_data>
+ * The timestamp is in UTC, so the name maps back to exactly one id (a local timestamp repeats when daylight saving ends). The old
+ * naming scheme used local time with a counter of at most 3 digits, the digit count tells the two apart.
+ */
+typedef uint64_t message_id_t;
+
+enum message_id_constants {
+    MESSAGE_ID_SEQUENCE_BITS = 20,       // Up to ~1M messages per second before the id "borrows" the next second
+    MESSAGE_ID_SEQUENCE_DIGITS = 7,      // 2^20 - 1 = 1048575 -> 7 decimal digits
+    MESSAGE_ID_RESERVE_SECONDS = 60,     // How far ahead of the clock the high-water mark file is written, about once per this many seconds
+    MESSAGE_ID_RESERVE_BLOCK = 4096,     // At least this many ids past the wanted one, for bursts that run ahead of the clock
+    MESSAGE_FILENAME_SIZE_CHARS = 64,    // Enough for "UNREAD" + 14 + 7 digits + suffix + null terminator
+};
+
+#define UNREAD_PREFIX "UNREAD"
+
+extern const char *message_id_filename; // High-water mark file in the server working directory
+
+/**
+ * @brief Loads the persisted high-water mark and initializes the allocator, must be called once before any worker thread starts
+ * @return NO_ERROR on success, SYSCALL_ERROR if the high-water mark file cannot be read or written
+ */
+extern ERROR_CODE message_id_allocator_init(void);
+
+/**
+ * @brief Allocates the next message id, thread safe and lock free unless the reservation on disk must move ahead
+ * @return the new id, 0 if the high-water mark could not be persisted (the id must not be used in that case)
+ */
+extern message_id_t message_id_next(void);
+
+/**
+ * @brief An id that every id handed out from now on is greater than: the last one handed out, or the clock if it is ahead
+ * (trees written by older versions or imported have ids the allocator never handed out)
+ */
+extern message_id_t message_id_watermark(void);
+
+/**
+ * @brief Makes sure @p id and every id before it are never handed out, for messages that keep the id they were given elsewhere (archive import)
+ * @return NO_ERROR on success, SYSCALL_ERROR if the high-water mark could not be persisted
+ */
+extern ERROR_CODE message_id_advance_past(message_id_t id);
+
+/**
+ * @brief Writes the message filename (without directory) derived from @p id into @p out
+ * @return NO_ERROR on success, STRING_SIZE_EXCEEDING_MAXIMUM if @p out is too small, SYSCALL_ERROR if the time conversion fails
+ */
+extern ERROR_CODE message_id_format_filename(message_id_t id, int unread, char *out, size_t out_size);
+
+/**
+ * @brief Rebuilds the id from a message filename, also accepts the old "<timestamp><counter>" names
+ * @return the id, 0 if @p filename is not a message filename
+ */
+extern message_id_t message_id_from_filename(const char *filename);
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              DURABILITY                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * How hard the server tries to get a delivered message on stable storage before acknowledging the sender.
+ * Selected at startup with the PGM_DURABILITY environment variable ("none", "group", "strict").
+ */
+typedef enum DURABILITY_MODE
+{
+    DURABILITY_NONE = 0,         // write() + close(), the page cache flushes whenever it wants (old behaviour, mail can be lost on a crash)
+    DURABILITY_GROUP_COMMIT = 1, // Concurrent deliveries share one syncfs() per batch (time window / batch size), default
+    DURABILITY_STRICT = 2,       // fdatasync() of the message + fsync() of the directory for every single message
+} DURABILITY_MODE;
+
+enum durability_constants {
+    GROUP_COMMIT_DEFAULT_WINDOW_MICROSECONDS = 2000, // How long the batch leader waits for other deliveries to join (PGM_GROUP_COMMIT_WINDOW_US)
+    GROUP_COMMIT_DEFAULT_MAX_BATCH = 64,             // A batch that reaches this many messages is synced right away (PGM_GROUP_COMMIT_MAX_BATCH)
+};
+
+/**
+ * @brief Reads PGM_DURABILITY, PGM_GROUP_COMMIT_WINDOW_US and PGM_GROUP_COMMIT_MAX_BATCH, must be called once before any worker thread starts
+ * @return NO_ERROR on success, SYSCALL_ERROR if the group commit synchronization primitives cannot be created
+ */
+extern ERROR_CODE storage_durability_init(void);
+
+/**
+ * @brief Reads the integer environment variable @p name, @p fallback if it is missing or outside [@p min, @p max] (shared by every PGM_* numeric setting)
+ */
+extern long read_environment_long(const char *name, long fallback, long min, long max);
+
+extern DURABILITY_MODE storage_durability_mode(void);
+extern const char *convert_durability_mode_to_string(DURABILITY_MODE mode);
+
+/**
+ * @brief Blocks until the data written to @p fd (a file inside @p directory_path) is durable according to the configured mode
+ * @return NO_ERROR once durable, SYSCALL_ERROR if the sync failed (the message must not be acknowledged)
+ */
+extern ERROR_CODE storage_make_durable(int fd, const char *directory_path);
+
+/**
+ * @brief storage_make_durable() for a file inside @p relative_directory of the directory open in @p directory_fd (NULL: that directory itself)
+ */
+extern ERROR_CODE storage_make_durable_at(int fd, int directory_fd, const char *relative_directory);
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              STORAGE LAYOUT                                                   */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * Where user folders and message files live on disk. With a flat tree every user folder sits in the server working directory
+ * and every message directly in its user folder, so huge trees end up with huge directories (slow lookups, slow readdir).
+ * The sharded layouts add levels of fan-out directories named after the bytes of a FNV-1a hash, two hex digits per level:
+ *  - user folders:  [<h0>/[<h1>/]]<username><folder_suffix_user>          hash of the username
+ *  - message files: <user folder>/[<h0>/[<h1>/]]<filename>                hash of the filename without the UNREAD prefix,
+ *                                                                         so marking a message as read never moves it to another bucket
+ * The layout of a tree is recorded in the layout file (a missing file means flat, the layout of the older versions).
+ * PGM_STORAGE_LAYOUT selects the layout of a new tree: "flat" (0:0), "sharded" (2:1) or "<user levels>:<message levels>".
+ * An existing tree is converted with: ./bin/server --migrate-layout <layout>   (server stopped)
+ */
+typedef struct STORAGE_LAYOUT {
+    unsigned int user_levels;
+    unsigned int message_levels;
+} STORAGE_LAYOUT;
+
+enum storage_layout_constants {
+    STORAGE_LAYOUT_MAX_LEVELS = 2,   // Up to 65536 fan-out directories, plenty for any tree this server can handle
+    STORAGE_SHARD_NAME_CHARS = 2,    // Each level is one byte of the hash in hex
+    // Buffers for the paths the request handlers build on the stack: "<buckets>/<filename>[.part]" inside a user folder, and the same
+    // path from the working directory ("<user buckets>/<username>.pgmusr/<buckets>/<filename>", only for logs and snapshot hooks)
+    STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS = STORAGE_LAYOUT_MAX_LEVELS * (STORAGE_SHARD_NAME_CHARS + 1) + MESSAGE_FILENAME_SIZE_CHARS + 8,
+    STORAGE_USER_DIRECTORY_PATH_SIZE_CHARS = STORAGE_LAYOUT_MAX_LEVELS * (STORAGE_SHARD_NAME_CHARS + 1) + USERNAME_SIZE_CHARS + 16,
+    STORAGE_MESSAGE_PATH_SIZE_CHARS = STORAGE_USER_DIRECTORY_PATH_SIZE_CHARS + STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS,
+};
+
+extern const char *storage_layout_filename;          // Layout of the tree, in the server working directory
+extern const char *storage_layout_migration_filename; // Present while a migration is running (or was interrupted)
+
+/**
+ * @brief Loads the layout of the tree, must be called once before any other storage function that builds a path
+ * @return NO_ERROR on success, ERROR if PGM_STORAGE_LAYOUT disagrees with the tree or a migration was interrupted, SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE storage_layout_init(void);
+
+extern STORAGE_LAYOUT storage_layout_current(void);
+
+/**
+ * @brief Parses "flat", "sharded" or "<user levels>:<message levels>"
+ * @return NO_ERROR on success, ERROR if @p text is not a valid layout
+ */
+extern ERROR_CODE storage_layout_parse(const char *text, STORAGE_LAYOUT *out_layout);
+
+/**
+ * @brief Path of the folder of @p username according to the current layout
+ * @return heap allocated path (to be freed by the caller), NULL if memory runs out
+ */
+extern char *storage_user_directory_path(const char *username);
+
+/**
+ * @brief Creates the folder of @p username, fan-out directories included (already existing directories are fine)
+ * @return NO_ERROR on success, SYSCALL_ERROR otherwise
+ */
+extern ERROR_CODE storage_create_user_directory(const char *username);
+
+/**
+ * @brief Path of the message @p filename inside @p user_directory_path according to the current layout
+ * @return heap allocated path (to be freed by the caller), NULL if memory runs out
+ */
+extern char *storage_message_path(const char *user_directory_path, const char *filename);
+
+/**
+ * @brief Path of the message @p filename relative to its user folder ("[<bucket>/]<filename>"), for the *at() calls on a user folder fd
+ * @param out at least STORAGE_MESSAGE_RELATIVE_PATH_SIZE_CHARS bytes
+ * @return NO_ERROR, STRING_SIZE_EXCEEDING_MAXIMUM if it does not fit in @p out_size bytes
+ */
+extern ERROR_CODE storage_message_relative_path(const char *filename, char *out, size_t out_size);
+
+/**
+ * @brief Calls @p callback with the name of every registered user (folder suffix stripped), in directory order
+ * @return NO_ERROR if the whole tree was walked, the first non NO_ERROR value returned by @p callback, or SYSCALL_ERROR
+ */
+extern ERROR_CODE storage_for_each_user(ERROR_CODE (*callback)(const char *username, void *context), void *context);
+
+/**
+ * @brief Calls @p callback with the filename of every message (file ending with file_suffix_user_data) of a user folder, in directory order
+ * @return NO_ERROR if the whole folder was walked, the first non NO_ERROR value returned by @p callback, or SYSCALL_ERROR
+ */
+extern ERROR_CODE storage_for_each_message(const char *user_directory_path, ERROR_CODE (*callback)(const char *filename, void *context), void *context);
+
+/**
+ * @brief storage_for_each_message() of the user folder open in @p user_directory_fd, the fd itself is left untouched
+ */
+extern ERROR_CODE storage_for_each_message_at(int user_directory_fd, ERROR_CODE (*callback)(const char *filename, void *context), void *context);
+
+/**
+ * @brief Offline tool: converts the tree in the working directory to @p target_layout in place, with rename() only (no copies)
+ *
+ * Pending deliveries are recovered first. The migration is restartable: if it gets interrupted the server refuses to start
+ * and running the tool again (same target) completes it.
+ * @return NO_ERROR on success, ERROR on invalid arguments, SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE storage_migrate_layout(const char *target_layout);
+
+/**
+ * @brief Startup sequence of the offline tools that read or write messages: lock, layout, ids, durability, body store and
+ * recovery of the pending deliveries (the server does the same steps one by one in main())
+ * @return NO_ERROR on success, ERROR if the tree is in use or cannot be opened as it is, SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE storage_open_offline(void);
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                          DELIVERY WRITE-AHEAD LOG                                             */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * A delivery is a multi step operation (create file, write header, write body, sync), a crash in the middle used to leave a truncated .pgm file
+ * that was then served with a bogus message_length. Now every delivery is bracketed by two records in the delivery log:
+ *  1. DELIVERY_LOG_INTENT  before anything touches the recipient folder
+ *  2. the message is written in "<filename><partial_message_suffix>" (never listed) and then renamed to its final name
+ *  3. DELIVERY_LOG_COMMIT  once the message is durable (DELIVERY_LOG_ABORT if the delivery failed and was cleaned up)
+ * At startup only the intents without a commit/abort are looked at, so recovery never scans the user folders.
+ */
+typedef enum DELIVERY_LOG_RECORD_TYPE
+{
+    DELIVERY_LOG_INTENT = 1,
+    DELIVERY_LOG_COMMIT = 2,
+    DELIVERY_LOG_ABORT = 3,
+} DELIVERY_LOG_RECORD_TYPE;
+
+/**
+ * @brief Fixed size record, written with a single append so a torn tail is detected by the magic/checksum and simply ignored
+ * @note Stored in host byte order: the log never leaves the server machine
+ */
+typedef struct DELIVERY_LOG_RECORD {
+    uint32_t magic;
+    uint32_t type;                                 // DELIVERY_LOG_RECORD_TYPE
+    uint64_t message_id;
+    uint32_t message_length;                       // Body length, used to tell a complete message file from a truncated one
+    char recipient[USERNAME_SIZE_CHARS];
+    char filename[MESSAGE_FILENAME_SIZE_CHARS];
+    uint32_t checksum;                             // FNV-1a of every byte before this field
+} DELIVERY_LOG_RECORD;
+
+enum delivery_log_constants {
+    DELIVERY_LOG_MAGIC = 0x50474D57,               // "PGMW"
+    DELIVERY_LOG_CHECKPOINT_BYTES = 1 << 20,       // When nothing is in flight and the log is bigger than this it gets truncated
+};
+
+extern const char *delivery_log_filename;
+extern const char *partial_message_suffix;
+
+/**
+ * @brief Recovery pass + opening of the delivery log, must be called once at startup before any worker thread starts
+ *
+ * Every intent without commit/abort is resolved: a complete message file (final or partial) is kept/renamed in place (replay),
+ * a truncated one is removed (discard). The log is then truncated.
+ * @return NO_ERROR on success, SYSCALL_ERROR if the log cannot be read or opened
+ */
+extern ERROR_CODE delivery_log_recover_and_open(void);
+
+/**
+ * @brief Checks that @p path is a complete message file: header present, sane message_length and a file size that matches it (see MESSAGE_FILE_SHAPE)
+ * @param expected_message_length if not 0 the header message_length must also match it
+ * @return 1 if complete, 0 otherwise (missing, truncated or bogus)
+ */
+extern int storage_message_file_is_complete(const char *path, uint32_t expected_message_length);
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              MESSAGE DELIVERY                                                 */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * Every message file written by the server ends with a MESSAGE_CHECKSUM: the CRC32C of the header and of the body (the real
+ * body, also when the file only holds a BODY_REFERENCE to it), see 15-Server-Checksum.h. Files written before checksums existed
+ * have no trailer and are still served, without verification.
+ *
+ * The shape of a file is told by its size S and message_length L (H = offsetof(MESSAGE, message), R = sizeof(BODY_REFERENCE),
+ * C = sizeof(MESSAGE_CHECKSUM)). A file that starts with a compact header of h bytes (see 24-Header-Encoding.h) counts as
+ * S - h + H: what follows the header is the same either way.
+ *  - S == H + L                          inline body, no checksum
+ *  - S == H + L + C (trailer magic)      inline body, checksum
+ *  - S == H + R, L != R                  shared body, no checksum
+ *  - S == H + R + C (trailer magic)      shared body, checksum. Bodies of R and R + C bytes are never shared, so L != R and L != R + C
+ *  - S == H + K + C (trailer magic)      cold body (K = sizeof(COLD_REFERENCE), see 19-Server-Cold-Tier.h)
+ *  - S == H + Z + C (trailer magic)      body compressed to Z bytes (18-Compression.h), K < Z and Z + C < L so no other shape matches
+ */
+typedef struct MESSAGE_CHECKSUM {
+    uint32_t magic;
+    uint32_t crc32c;
+} MESSAGE_CHECKSUM; // Host byte order, like BODY_REFERENCE
+
+enum message_checksum_constants {
+    MESSAGE_CHECKSUM_MAGIC = 0x50474D43,           // "PGMC"
+};
+
+typedef struct MESSAGE_FILE_SHAPE {
+    int shared_body;                               // The file holds a BODY_REFERENCE instead of the body
+    int checksummed;                               // The file ends with a MESSAGE_CHECKSUM
+    int cold_body;                                 // The file holds a COLD_REFERENCE instead of the body
+    int compressed_body;                           // The file holds the body compressed with compress_block()
+} MESSAGE_FILE_SHAPE;
+
+/**
+ * @brief Tells the shape of a message file from its size, its message_length (host byte order) and the magic of its last C bytes
+ * @param tail_magic magic field of the MESSAGE_CHECKSUM the file would end with, 0 if it is shorter than H + C
+ * @return 1 with @p out_shape filled, 0 if the file is bogus (truncated, or a message_length that does not match its size)
+ */
+extern int storage_message_file_shape(uint64_t file_size, uint32_t message_length, uint32_t tail_magic, MESSAGE_FILE_SHAPE *out_shape);
+
+/**
+ * @brief Shape of the message file open in @p fd, from its size, its header and its last bytes
+ * @param out_header_size optional, size of the header on disk: the body (or the reference) starts there
+ * @return 1 with @p out_message_length (host byte order) and @p out_shape filled, 0 if the file is bogus or cannot be read
+ */
+extern int storage_message_file_shape_of(int fd, uint32_t *out_message_length, size_t *out_header_size, MESSAGE_FILE_SHAPE *out_shape);
+
+/**
+ * Headers are written compact (24-Header-Encoding.h) when that is smaller, unless PGM_COMPACT_HEADERS=off (same variable as the
+ * wire headers). Files are read whatever their header: turning it off only changes the files written from then on.
+ */
+
+/**
+ * @brief Reads PGM_COMPACT_HEADERS for the messages delivered or imported from now on
+ * @note Called by storage_open_offline(), and by the server before any worker thread starts
+ */
+extern void storage_header_encoding_init(void);
+
+/**
+ * @brief Encodes the header a message file starts with: compact if enabled and smaller, the H bytes of @p header otherwise
+ * @param header canonical (see header_canonicalize()), the checksum of the file covers it
+ * @param out room for offsetof(MESSAGE, message) bytes
+ * @return the size of the encoded header
+ */
+extern size_t storage_encode_file_header(const MESSAGE *header, void *out);
+
+/**
+ * @brief Rewrites the @p file_size bytes of a message file read into @p file with a header of H bytes, in place
+ * @param capacity size of @p file, a file that would not fit is bogus
+ * @return 1 with @p file_size updated (nothing to do for a fixed header), 0 if the compact header is corrupt or the file too large
+ */
+extern int storage_expand_file_header(char *file, size_t *file_size, size_t capacity);
+
+/**
+ * Bodies of at least PGM_COMPRESSION_MIN_BYTES bytes are stored compressed when that saves more than the shape needs (see above),
+ * unless PGM_COMPRESSION=off (same variables as the wire compression, see 18-Compression.h). The block is the one a compressed
+ * session downloads, so a body is compressed once at delivery and never again. Shared and cold bodies are stored as before.
+ */
+
+/**
+ * @brief Reads PGM_COMPRESSION and PGM_COMPRESSION_MIN_BYTES for the bodies delivered or imported from now on
+ * @note Called by storage_open_offline(), and by the server before any worker thread starts
+ */
+extern void storage_body_compression_init(void);
+
+
+/**
+ * @brief Stores a message in the recipient folder: allocates the id, logs the intent, writes header + body, waits for durability, logs the commit
+ *
+ * @param recipient_fd the recipient user folder, open: every file operation is relative to it
+ * @param recipient_directory path of the same folder, for the logs and the snapshot hooks
+ * @param header MESSAGE header as it will be stored once canonical (message_length already in network byte order)
+ * @param body message body, @p body_length bytes
+ * @param out_filename optional, receives the name of the created file (at least MESSAGE_FILENAME_SIZE_CHARS bytes)
+ * @return NO_ERROR when the message is stored (and durable), SYSCALL_ERROR otherwise. On failure no partial file is left behind.
+ */
+extern ERROR_CODE storage_deliver_message(int recipient_fd, const char *recipient_directory, const MESSAGE *header, const char *body, uint32_t body_length, char *out_filename);
+
+/**
+ * @brief Offline import, first half: writes a message that keeps its original @p filename as "<filename><partial_message_suffix>"
+ *
+ * Bodies go to the body store like a delivery would put them. Nothing is synced: the caller syncs a whole batch of partial files
+ * and then publishes them, so a crash never leaves a listed message (or a shared body reference) that did not reach the disk.
+ * @return NO_ERROR once written, OPERATION_ABORTED if @p filename already exists (mail is never overwritten), SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE storage_import_message_write(const char *user_directory_path, const char *filename, const MESSAGE *header, const char *body, uint32_t body_length);
+
+/**
+ * @brief Offline import, second half: moves a partial file written by storage_import_message_write() to its final name
+ * @return NO_ERROR on success, SYSCALL_ERROR otherwise
+ */
+extern ERROR_CODE storage_import_message_publish(const char *user_directory_path, const char *filename);
+
+/**
+ * @brief Reads the message file open in @p fd into @p message, the body inline or from the body store (see 7-Server-Body-Store.h)
+ *
+ * With @p with_body the whole file is read with a single pread and its checksum, if it has one, is verified (counted in the
+ * statistics of 15-Server-Checksum.h). Without, only the header is read and nothing is verified.
+ * @param message room for offsetof(MESSAGE, message) bytes, plus MESSAGE_SIZE_CHARS with @p with_body
+ * @return NO_ERROR, STRING_SIZE_INVALID if the file is bogus (size, message_length or checksum), SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE storage_read_message(int fd, MESSAGE *message, int with_body);
+
+/**
+ * @brief storage_read_message() with the body, that also returns the block the body is stored compressed as, if it is
+ * @param compressed room for MESSAGE_SIZE_CHARS bytes
+ * @param out_compressed_length set to the size of the block, 0 if the body is not stored compressed
+ */
+extern ERROR_CODE storage_read_message_compressed(int fd, MESSAGE *message, char *compressed, uint32_t *out_compressed_length);
+
+/**
+ * @brief Deletes the message @p filename of the user folder open in @p user_directory_fd and drops the reference to its shared body, if it has one
+ * @param user_directory path of the same folder, for the snapshot hooks
+ * @return NO_ERROR on success, SYSCALL_ERROR if the file could not be removed (errno set, ENOENT if there is no such message)
+ */
+extern ERROR_CODE storage_remove_message_at(int user_directory_fd, const char *user_directory, const char *filename);
+
+/**
+ * @brief Bytes the message file open in @p fd accounts for (header + body), also for records whose body is shared
+ * and for files that end with a checksum
+ */
+extern uint64_t storage_message_bytes(int fd);
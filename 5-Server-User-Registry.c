@@ -0,0 +1,288 @@
+/**
+ * @file 5-Server-User-Registry.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the in-memory directory of registered users (existence checks and the pre-serialized user list)
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "5-Server-User-Registry.h"
+#include "14-Server-Storage-Engine.h"
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, malloc, free, qsort
+#include <string.h>     // strlen, strcmp, memcpy, strndup
+#include <pthread.h>    // pthread_rwlock_t
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              HASH SET                                                         */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+// REGISTRY STATE, protected by user_registry_lock (read lock for lookups, write lock for additions and list rebuilds)
+static pthread_rwlock_t user_registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char **user_registry_slots = NULL;  // Open addressing, linear probing, NULL = empty slot (users are never removed, so no tombstones)
+static size_t user_registry_capacity = 0;
+static size_t user_registry_count = 0;
+static uint64_t user_registry_generation = 0;              // Bumped on every addition
+static USER_LIST_SNAPSHOT *user_registry_cached_list = NULL; // The registry holds one reference to it
+
+/**
+ * @brief FNV-1a 64 bit of a null terminated string
+ */
+static uint64_t user_registry_hash(const char *username)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char *c = (const unsigned char *)username; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * @brief Returns the slot holding @p username or the empty slot where it would go, the table is never full (see USER_REGISTRY_MAX_LOAD_PERCENT)
+ */
+static size_t user_registry_find_slot(char **slots, size_t capacity, const char *username)
+{
+    size_t mask = capacity - 1;
+    size_t index = (size_t)user_registry_hash(username) & mask;
+    while (slots[index] != NULL && strcmp(slots[index], username) != 0)
+    {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+/**
+ * @brief Doubles the table and rehashes every name, the strings themselves are moved not copied
+ * @note Caller holds the write lock
+ */
+static ERROR_CODE user_registry_grow(void)
+{
+    size_t next_capacity = user_registry_capacity == 0 ? USER_REGISTRY_INITIAL_CAPACITY : user_registry_capacity * 2;
+    char **next_slots = calloc(next_capacity, sizeof(char *));
+    if (unlikely(next_slots == NULL))
+    {
+        PSE("Failed to allocate the user registry table");
+        return SYSCALL_ERROR;
+    }
+    for (size_t i = 0; i < user_registry_capacity; i++)
+    {
+        if (user_registry_slots[i] != NULL)
+        {
+            next_slots[user_registry_find_slot(next_slots, next_capacity, user_registry_slots[i])] = user_registry_slots[i];
+        }
+    }
+    free(user_registry_slots);
+    user_registry_slots = next_slots;
+    user_registry_capacity = next_capacity;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Inserts a copy of @p username if missing
+ * @note Caller holds the write lock
+ */
+static ERROR_CODE user_registry_insert_locked(const char *username)
+{
+    if ((user_registry_count + 1) * 100 > user_registry_capacity * USER_REGISTRY_MAX_LOAD_PERCENT)
+    {
+        if (unlikely(user_registry_grow() != NO_ERROR))
+        {
+            return SYSCALL_ERROR;
+        }
+    }
+    size_t slot = user_registry_find_slot(user_registry_slots, user_registry_capacity, username);
+    if (user_registry_slots[slot] != NULL)
+    {
+        return NO_ERROR; // Already registered
+    }
+    user_registry_slots[slot] = strndup(username, USERNAME_SIZE_CHARS - 1);
+    if (unlikely(user_registry_slots[slot] == NULL))
+    {
+        PSE("Failed to allocate the user registry entry for [%s]", username);
+        return SYSCALL_ERROR;
+    }
+    user_registry_count++;
+    user_registry_generation++;
+    return NO_ERROR;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              PUBLIC API                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+static ERROR_CODE user_registry_load_user(const char *username, void *context)
+{
+    (void)context;
+    return user_registry_insert_locked(username);
+}
+
+ERROR_CODE user_registry_init(void)
+{
+    // With the file engine the walk follows the storage layout (flat or sharded user folders), see 4-Server-Storage.h
+    pthread_rwlock_wrlock(&user_registry_lock);
+    ERROR_CODE result = storage_engine->for_each_user(user_registry_load_user, NULL);
+    size_t loaded = user_registry_count;
+    pthread_rwlock_unlock(&user_registry_lock);
+
+    if (likely(result == NO_ERROR))
+    {
+        P("User registry loaded: %zu registered users", loaded);
+    }
+    else
+    {
+        P("Failed to load the user registry");
+    }
+    return result;
+}
+
+void user_registry_destroy(void)
+{
+    pthread_rwlock_wrlock(&user_registry_lock);
+    for (size_t i = 0; i < user_registry_capacity; i++)
+    {
+        free(user_registry_slots[i]);
+    }
+    free(user_registry_slots);
+    user_registry_slots = NULL;
+    user_registry_capacity = 0;
+    user_registry_count = 0;
+    USER_LIST_SNAPSHOT *cached = user_registry_cached_list;
+    user_registry_cached_list = NULL;
+    pthread_rwlock_unlock(&user_registry_lock);
+    user_registry_release_list(cached);
+}
+
+int user_registry_contains(const char *username)
+{
+    if (unlikely(username == NULL))
+    {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&user_registry_lock);
+    int found = user_registry_capacity != 0 &&
+                user_registry_slots[user_registry_find_slot(user_registry_slots, user_registry_capacity, username)] != NULL;
+    pthread_rwlock_unlock(&user_registry_lock);
+    return found;
+}
+
+ERROR_CODE user_registry_add(const char *username)
+{
+    if (unlikely(username == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    pthread_rwlock_wrlock(&user_registry_lock);
+    ERROR_CODE result = user_registry_insert_locked(username);
+    pthread_rwlock_unlock(&user_registry_lock);
+    return result;
+}
+
+static int compare_usernames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Serializes the registry in alphabetical order
+ * @note Caller holds the write lock
+ */
+static USER_LIST_SNAPSHOT *user_registry_build_list_locked(void)
+{
+    char **names = NULL;
+    size_t bytes_needed = 1; // Null terminator, also the whole payload when there are no users
+    if (user_registry_count > 0)
+    {
+        names = malloc(user_registry_count * sizeof(char *));
+        if (unlikely(names == NULL))
+        {
+            PSE("Failed to allocate the user list");
+            return NULL;
+        }
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < user_registry_capacity; i++)
+    {
+        if (user_registry_slots[i] != NULL)
+        {
+            names[used++] = user_registry_slots[i];
+            bytes_needed += strlen(user_registry_slots[i]) + 1; // Name + newline
+        }
+    }
+    if (used > 1)
+    {
+        qsort(names, used, sizeof(char *), compare_usernames);
+    }
+
+    USER_LIST_SNAPSHOT *snapshot = malloc(sizeof(USER_LIST_SNAPSHOT) + bytes_needed);
+    if (unlikely(snapshot == NULL))
+    {
+        PSE("Failed to allocate the user list");
+        free(names);
+        return NULL;
+    }
+    atomic_init(&snapshot->references, 1); // The reference held by the registry
+    snapshot->generation = user_registry_generation;
+    size_t offset = 0;
+    for (size_t i = 0; i < used; i++)
+    {
+        size_t name_length = strlen(names[i]);
+        memcpy(&snapshot->data[offset], names[i], name_length);
+        offset += name_length;
+        snapshot->data[offset++] = '\n';
+    }
+    snapshot->data[offset++] = '\0';
+    snapshot->length = offset;
+    free(names);
+    return snapshot;
+}
+
+USER_LIST_SNAPSHOT *user_registry_acquire_list(void)
+{
+    // Fast path: nobody registered since the last build, just take a reference
+    pthread_rwlock_rdlock(&user_registry_lock);
+    USER_LIST_SNAPSHOT *snapshot = user_registry_cached_list;
+    if (likely(snapshot != NULL && snapshot->generation == user_registry_generation))
+    {
+        atomic_fetch_add(&snapshot->references, 1);
+        pthread_rwlock_unlock(&user_registry_lock);
+        return snapshot;
+    }
+    pthread_rwlock_unlock(&user_registry_lock);
+
+    // Slow path: rebuild, checking again since another worker may have done it in the meantime
+    USER_LIST_SNAPSHOT *stale = NULL;
+    pthread_rwlock_wrlock(&user_registry_lock);
+    snapshot = user_registry_cached_list;
+    if (snapshot == NULL || snapshot->generation != user_registry_generation)
+    {
+        snapshot = user_registry_build_list_locked();
+        if (unlikely(snapshot == NULL))
+        {
+            pthread_rwlock_unlock(&user_registry_lock);
+            return NULL;
+        }
+        stale = user_registry_cached_list;
+        user_registry_cached_list = snapshot;
+    }
+    atomic_fetch_add(&snapshot->references, 1);
+    pthread_rwlock_unlock(&user_registry_lock);
+
+    user_registry_release_list(stale); // Workers still sending the old list keep it alive until they are done
+    return snapshot;
+}
+
+void user_registry_release_list(USER_LIST_SNAPSHOT *snapshot)
+{
+    if (snapshot != NULL && atomic_fetch_sub(&snapshot->references, 1) == 1)
+    {
+        free(snapshot);
+    }
+}
@@ -0,0 +1,70 @@
+/**
+ * @file 5-Server-User-Registry.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the in-memory directory of registered users (existence checks and the pre-serialized user list)
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include <stdatomic.h>  // atomic_uint
+
+/**
+ * The user folders are the source of truth, the registry is just a cache of their names:
+ *  - filled once at startup with a single scan of the server working directory
+ *  - updated by the registration flow, the only place where a user folder is created
+ * Lookups are a hash set probe (no syscalls), the list sent for REQUEST_LIST_REGISTERED_USERS is serialized only when
+ * the registry generation changed since the last time it was built.
+ */
+
+enum user_registry_constants {
+    USER_REGISTRY_INITIAL_CAPACITY = 64, // Slots of the hash set, always a power of two
+    USER_REGISTRY_MAX_LOAD_PERCENT = 70, // The hash set doubles when it gets fuller than this
+};
+
+/**
+ * @brief Serialized list of registered users: "name\nname\n...\0", exactly the payload of REQUEST_LIST_REGISTERED_USERS
+ * @note Shared between threads and reference counted, so a worker can send it without holding any lock while a registration builds the next one
+ */
+typedef struct USER_LIST_SNAPSHOT {
+    atomic_uint references;
+    uint64_t generation; // Registry generation it was built from
+    size_t length;       // Bytes in data, null terminator included
+    char data[];
+} USER_LIST_SNAPSHOT;
+
+/**
+ * @brief Walks the user folders once (following the storage layout) and loads every user, must be called once after storage_layout_init() and before any worker thread starts
+ * @return NO_ERROR on success, SYSCALL_ERROR if the directory cannot be read or memory runs out
+ */
+extern ERROR_CODE user_registry_init(void);
+
+/**
+ * @brief Releases the registry, only to be called once every worker thread has been joined
+ */
+extern void user_registry_destroy(void);
+
+/**
+ * @brief O(1) check for a registered user, replaces stat() on the user folder
+ * @return 1 if @p username is registered, 0 otherwise
+ */
+extern int user_registry_contains(const char *username);
+
+/**
+ * @brief Adds @p username to the registry and bumps the generation, to be called once the user folder is fully initialized
+ * @return NO_ERROR on success (also if it was already present), SYSCALL_ERROR if memory runs out
+ */
+extern ERROR_CODE user_registry_add(const char *username);
+
+/**
+ * @brief Returns the current serialized user list, rebuilt only if a user was added since the last call
+ * @return the snapshot (to be released with user_registry_release_list()), NULL if memory runs out
+ */
+extern USER_LIST_SNAPSHOT *user_registry_acquire_list(void);
+extern void user_registry_release_list(USER_LIST_SNAPSHOT *snapshot);
@@ -0,0 +1,651 @@
+/**
+ * @file 6-Server-Mailbox.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the mailbox accounting: per-user quotas enforced at delivery time and the background retention (expiry) engine
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "6-Server-Mailbox.h"
+#include "8-Server-Header-Cache.h"
+#include "9-Server-Search-Index.h"
+#include "14-Server-Storage-Engine.h"
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, realloc, free, qsort
+#include <string.h>     // strlen, strcmp, strncmp, memmove
+#include <pthread.h>    // pthread_mutex_t, pthread_cond_t, pthread_create
+#include <time.h>       // time, clock_gettime
+#include <errno.h>      // ETIMEDOUT
+#include <stdatomic.h>  // atomic_int
+#include <signal.h>     // sigfillset, pthread_sigmask
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              MAILBOXES                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct MAILBOX_ENTRY {
+    message_id_t id; // Sort key (time order), 0 for names that do not follow any naming scheme: those are never expired
+    uint64_t bytes;
+    int live;        // 0 once deleted/expired, dead entries are compacted lazily
+    char filename[MESSAGE_FILENAME_SIZE_CHARS];
+} MAILBOX_ENTRY;
+
+typedef struct MAILBOX {
+    pthread_mutex_t lock;             // Protects everything below
+    char username[USERNAME_SIZE_CHARS];
+    int loaded;                       // Entries and usage built from the user folder (one walk, the first time the mailbox is needed)
+    uint64_t message_count;           // Stored + reserved messages
+    uint64_t bytes;                   // Stored + reserved bytes
+    MAILBOX_ENTRY *entries;           // Ordered by id
+    size_t entries_used;
+    size_t entries_capacity;
+    size_t dead_entries;
+} MAILBOX;
+
+// CONFIGURATION, written once by mailbox_init()
+static long quota_max_messages = 0;
+static long quota_max_bytes = 0;
+static long retention_max_age_seconds = 0;
+static long retention_read_max_age_seconds = 0;
+static long retention_interval_seconds = MAILBOX_DEFAULT_RETENTION_INTERVAL_SECONDS;
+static int mailbox_tracking_enabled = 0; // Nothing configured = no tracking at all, the workers pay nothing
+
+// USERNAME -> MAILBOX TABLE, protected by mailbox_table_lock. Mailboxes are never removed before mailbox_shutdown()
+static pthread_mutex_t mailbox_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static MAILBOX **mailbox_table = NULL;
+static size_t mailbox_table_capacity = 0;
+static size_t mailbox_table_count = 0;
+
+// RETENTION THREAD
+static pthread_t retention_thread_id;
+static int retention_thread_started = 0;
+static pthread_mutex_t retention_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retention_cond; // Initialized with CLOCK_MONOTONIC in mailbox_init()
+static atomic_int retention_stop = 0; // Also read without the lock by the preload walk
+
+static uint64_t hash_username(const char *username)
+{
+    uint64_t hash = 14695981039346656037ull; // FNV-1a 64 bit
+    for (const unsigned char *c = (const unsigned char *)username; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static size_t mailbox_table_find_slot(MAILBOX **table, size_t capacity, const char *username)
+{
+    size_t mask = capacity - 1;
+    size_t index = (size_t)hash_username(username) & mask;
+    while (table[index] != NULL && strcmp(table[index]->username, username) != 0)
+    {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+/**
+ * @brief Returns the mailbox of @p username, creating it (not loaded yet) if needed
+ * @return the mailbox, NULL if memory runs out
+ */
+static MAILBOX *mailbox_get(const char *username)
+{
+    pthread_mutex_lock(&mailbox_table_lock);
+    if ((mailbox_table_count + 1) * 10 > mailbox_table_capacity * 7) // Keep the load under 70%
+    {
+        size_t next_capacity = mailbox_table_capacity == 0 ? MAILBOX_TABLE_INITIAL_CAPACITY : mailbox_table_capacity * 2;
+        MAILBOX **next_table = calloc(next_capacity, sizeof(MAILBOX *));
+        if (unlikely(next_table == NULL))
+        {
+            PSE("Failed to allocate the mailbox table");
+            pthread_mutex_unlock(&mailbox_table_lock);
+            return NULL;
+        }
+        for (size_t i = 0; i < mailbox_table_capacity; i++)
+        {
+            if (mailbox_table[i] != NULL)
+            {
+                next_table[mailbox_table_find_slot(next_table, next_capacity, mailbox_table[i]->username)] = mailbox_table[i];
+            }
+        }
+        free(mailbox_table);
+        mailbox_table = next_table;
+        mailbox_table_capacity = next_capacity;
+    }
+
+    size_t slot = mailbox_table_find_slot(mailbox_table, mailbox_table_capacity, username);
+    MAILBOX *mailbox = mailbox_table[slot];
+    if (mailbox == NULL)
+    {
+        mailbox = calloc(1, sizeof(MAILBOX));
+        if (unlikely(mailbox == NULL))
+        {
+            PSE("Failed to allocate the mailbox of [%s]", username);
+            pthread_mutex_unlock(&mailbox_table_lock);
+            return NULL;
+        }
+        pthread_mutex_init(&mailbox->lock, NULL);
+        snprintf(mailbox->username, sizeof(mailbox->username), "%s", username);
+        mailbox_table[slot] = mailbox;
+        mailbox_table_count++;
+    }
+    pthread_mutex_unlock(&mailbox_table_lock);
+    return mailbox;
+}
+
+static int compare_entries_by_id(const void *a, const void *b)
+{
+    const MAILBOX_ENTRY *entry_a = (const MAILBOX_ENTRY *)a;
+    const MAILBOX_ENTRY *entry_b = (const MAILBOX_ENTRY *)b;
+    return (entry_a->id > entry_b->id) - (entry_a->id < entry_b->id);
+}
+
+/**
+ * @brief Inserts an entry keeping the id order, new deliveries have the highest id so this is an append in practice
+ * @note Caller holds the mailbox lock
+ */
+static ERROR_CODE mailbox_insert_entry(MAILBOX *mailbox, const char *filename, uint64_t bytes)
+{
+    if (mailbox->entries_used + 1 > mailbox->entries_capacity)
+    {
+        size_t next_capacity = mailbox->entries_capacity == 0 ? 16 : mailbox->entries_capacity * 2;
+        MAILBOX_ENTRY *reallocated = realloc(mailbox->entries, next_capacity * sizeof(MAILBOX_ENTRY));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Failed to grow the mailbox of [%s]", mailbox->username);
+            return SYSCALL_ERROR;
+        }
+        mailbox->entries = reallocated;
+        mailbox->entries_capacity = next_capacity;
+    }
+
+    message_id_t id = message_id_from_filename(filename);
+    size_t position = mailbox->entries_used;
+    while (position > 0 && mailbox->entries[position - 1].id > id)
+    {
+        position--;
+    }
+    memmove(&mailbox->entries[position + 1], &mailbox->entries[position], (mailbox->entries_used - position) * sizeof(MAILBOX_ENTRY));
+    MAILBOX_ENTRY *entry = &mailbox->entries[position];
+    entry->id = id;
+    entry->bytes = bytes;
+    entry->live = 1;
+    snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+    mailbox->entries_used++;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Binary search on the id, then the exact name among the (rare) entries sharing it
+ * @note Caller holds the mailbox lock
+ */
+static MAILBOX_ENTRY *mailbox_find_entry(MAILBOX *mailbox, const char *filename)
+{
+    message_id_t id = message_id_from_filename(filename);
+    size_t low = 0;
+    size_t high = mailbox->entries_used;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (mailbox->entries[middle].id < id)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    for (size_t i = low; i < mailbox->entries_used && mailbox->entries[i].id == id; i++)
+    {
+        if (mailbox->entries[i].live && strcmp(mailbox->entries[i].filename, filename) == 0)
+        {
+            return &mailbox->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Drops the dead entries once they are the majority, so the array does not keep growing with deleted messages
+ * @note Caller holds the mailbox lock
+ */
+static void mailbox_compact(MAILBOX *mailbox)
+{
+    if (mailbox->dead_entries * 2 < mailbox->entries_used)
+    {
+        return;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < mailbox->entries_used; i++)
+    {
+        if (mailbox->entries[i].live)
+        {
+            mailbox->entries[kept++] = mailbox->entries[i];
+        }
+    }
+    mailbox->entries_used = kept;
+    mailbox->dead_entries = 0;
+}
+
+/**
+ * @brief The message of @p entry is gone from the disk: give back its room, mailbox_compact() is up to the caller
+ * @note Caller holds the mailbox lock
+ */
+static void mailbox_forget_entry(MAILBOX *mailbox, MAILBOX_ENTRY *entry)
+{
+    entry->live = 0;
+    mailbox->dead_entries++;
+    mailbox->message_count -= mailbox->message_count > 0;
+    mailbox->bytes -= entry->bytes <= mailbox->bytes ? entry->bytes : mailbox->bytes;
+}
+
+static ERROR_CODE mailbox_load_message(const char *filename, void *context)
+{
+    MAILBOX *mailbox = (MAILBOX *)context;
+    uint64_t message_bytes = 0; // Same bytes as the delivery reserved, also for shared bodies
+    ERROR_CODE result = storage_engine->message_bytes(mailbox->username, filename, &message_bytes);
+    if (result != NO_ERROR)
+    {
+        return result == ERROR ? NO_ERROR : result; // ERROR: deleted in the meantime
+    }
+
+    // Appended unordered and sorted once at the end of the walk
+    if (mailbox->entries_used + 1 > mailbox->entries_capacity)
+    {
+        size_t next_capacity = mailbox->entries_capacity == 0 ? 16 : mailbox->entries_capacity * 2;
+        MAILBOX_ENTRY *reallocated = realloc(mailbox->entries, next_capacity * sizeof(MAILBOX_ENTRY));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Failed to grow the mailbox of [%s]", mailbox->username);
+            return SYSCALL_ERROR;
+        }
+        mailbox->entries = reallocated;
+        mailbox->entries_capacity = next_capacity;
+    }
+    MAILBOX_ENTRY *entry = &mailbox->entries[mailbox->entries_used++];
+    entry->id = message_id_from_filename(filename);
+    entry->bytes = message_bytes;
+    entry->live = 1;
+    snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+    mailbox->message_count++;
+    mailbox->bytes += entry->bytes;
+    return NO_ERROR;
+}
+
+/**
+ * @brief The only listing of a mailbox: builds entries and usage from the messages of the storage engine
+ * @note Caller holds the mailbox lock
+ */
+static ERROR_CODE mailbox_ensure_loaded(MAILBOX *mailbox)
+{
+    if (likely(mailbox->loaded))
+    {
+        return NO_ERROR;
+    }
+    ERROR_CODE result = storage_engine->list(mailbox->username, mailbox_load_message, mailbox);
+    if (unlikely(result != NO_ERROR))
+    {
+        // Start again from scratch next time, the partial state would be wrong
+        mailbox->entries_used = 0;
+        mailbox->message_count = 0;
+        mailbox->bytes = 0;
+        return result;
+    }
+    if (mailbox->entries_used > 1)
+    {
+        qsort(mailbox->entries, mailbox->entries_used, sizeof(MAILBOX_ENTRY), compare_entries_by_id);
+    }
+    mailbox->loaded = 1;
+    return NO_ERROR;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              QUOTAS                                                           */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE mailbox_reserve(const char *username, uint64_t message_bytes)
+{
+    if (!mailbox_tracking_enabled)
+    {
+        return NO_ERROR;
+    }
+    if (unlikely(username == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    MAILBOX *mailbox = mailbox_get(username);
+    if (unlikely(mailbox == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+
+    pthread_mutex_lock(&mailbox->lock);
+    ERROR_CODE result = mailbox_ensure_loaded(mailbox);
+    if (likely(result == NO_ERROR))
+    {
+        if ((quota_max_messages > 0 && mailbox->message_count + 1 > (uint64_t)quota_max_messages) ||
+            (quota_max_bytes > 0 && mailbox->bytes + message_bytes > (uint64_t)quota_max_bytes))
+        {
+            result = QUOTA_EXCEEDED;
+        }
+        else
+        {
+            mailbox->message_count++;
+            mailbox->bytes += message_bytes;
+        }
+    }
+    pthread_mutex_unlock(&mailbox->lock);
+    return result;
+}
+
+void mailbox_commit_delivery(const char *username, const char *filename, uint64_t message_bytes)
+{
+    if (!mailbox_tracking_enabled || username == NULL || filename == NULL)
+    {
+        return;
+    }
+    MAILBOX *mailbox = mailbox_get(username);
+    if (unlikely(mailbox == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&mailbox->lock);
+    // Usage was already counted by the reservation, if the entry cannot be tracked the message is just never expired
+    mailbox_insert_entry(mailbox, filename, message_bytes);
+    pthread_mutex_unlock(&mailbox->lock);
+}
+
+void mailbox_cancel_reservation(const char *username, uint64_t message_bytes)
+{
+    if (!mailbox_tracking_enabled || username == NULL)
+    {
+        return;
+    }
+    MAILBOX *mailbox = mailbox_get(username);
+    if (unlikely(mailbox == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&mailbox->lock);
+    mailbox->message_count -= mailbox->message_count > 0;
+    mailbox->bytes -= message_bytes <= mailbox->bytes ? message_bytes : mailbox->bytes;
+    pthread_mutex_unlock(&mailbox->lock);
+}
+
+void mailbox_message_renamed(const char *username, const char *old_filename, const char *new_filename)
+{
+    if (!mailbox_tracking_enabled || username == NULL || old_filename == NULL || new_filename == NULL)
+    {
+        return;
+    }
+    MAILBOX *mailbox = mailbox_get(username);
+    if (unlikely(mailbox == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&mailbox->lock);
+    MAILBOX_ENTRY *entry = mailbox->loaded ? mailbox_find_entry(mailbox, old_filename) : NULL;
+    if (entry != NULL)
+    {
+        snprintf(entry->filename, sizeof(entry->filename), "%s", new_filename); // Same id: the order does not change
+    }
+    pthread_mutex_unlock(&mailbox->lock);
+}
+
+void mailbox_message_removed(const char *username, const char *filename)
+{
+    if (!mailbox_tracking_enabled || username == NULL || filename == NULL)
+    {
+        return;
+    }
+    MAILBOX *mailbox = mailbox_get(username);
+    if (unlikely(mailbox == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&mailbox->lock);
+    MAILBOX_ENTRY *entry = mailbox->loaded ? mailbox_find_entry(mailbox, filename) : NULL;
+    if (entry != NULL)
+    {
+        mailbox_forget_entry(mailbox, entry);
+        mailbox_compact(mailbox);
+    }
+    pthread_mutex_unlock(&mailbox->lock);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              RETENTION                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief Expires the messages of one mailbox, entries are in time order so only the old prefix is looked at
+ * @note The victims are picked under the mailbox lock but removed without it: a removal may be an unlink, a WAL write and a sync,
+ *       and deliveries to this user (mailbox_reserve()) must not wait for a whole pass
+ * @return number of expired messages
+ */
+static size_t mailbox_expire(MAILBOX *mailbox, time_t now)
+{
+    // The youngest age that can still expire something: anything younger ends the scan
+    long min_age = retention_max_age_seconds;
+    if (retention_read_max_age_seconds > 0 && (min_age == 0 || retention_read_max_age_seconds < min_age))
+    {
+        min_age = retention_read_max_age_seconds;
+    }
+
+    char (*victims)[MESSAGE_FILENAME_SIZE_CHARS] = NULL;
+    size_t victims_used = 0;
+    size_t victims_capacity = 0;
+    pthread_mutex_lock(&mailbox->lock);
+    if (unlikely(mailbox_ensure_loaded(mailbox) != NO_ERROR))
+    {
+        pthread_mutex_unlock(&mailbox->lock);
+        return 0;
+    }
+    for (size_t i = 0; i < mailbox->entries_used; i++)
+    {
+        MAILBOX_ENTRY *entry = &mailbox->entries[i];
+        if (entry->id == 0 || !entry->live)
+        {
+            continue;
+        }
+        long age = (long)(now - (time_t)(entry->id >> MESSAGE_ID_SEQUENCE_BITS));
+        if (age <= min_age)
+        {
+            break;
+        }
+        int read = strncmp(entry->filename, UNREAD_PREFIX, strlen(UNREAD_PREFIX)) != 0;
+        if (!((retention_max_age_seconds > 0 && age > retention_max_age_seconds) ||
+              (read && retention_read_max_age_seconds > 0 && age > retention_read_max_age_seconds)))
+        {
+            continue;
+        }
+        if (victims_used == victims_capacity)
+        {
+            size_t next_capacity = victims_capacity == 0 ? 16 : victims_capacity * 2;
+            char (*reallocated)[MESSAGE_FILENAME_SIZE_CHARS] = realloc(victims, next_capacity * sizeof(*victims));
+            if (unlikely(reallocated == NULL))
+            {
+                PSE("Failed to grow the expiry list of [%s], the rest waits for the next pass", mailbox->username);
+                break;
+            }
+            victims = reallocated;
+            victims_capacity = next_capacity;
+        }
+        snprintf(victims[victims_used++], sizeof(*victims), "%s", entry->filename);
+    }
+    pthread_mutex_unlock(&mailbox->lock);
+
+    size_t expired = 0;
+    for (size_t i = 0; i < victims_used; i++)
+    {
+        // Anything but NO_ERROR: a session deleted it first, or marked it as read and it has another name now (maybe before its
+        // mailbox_message_renamed()). Either way that session updates the mailbox itself, a read message is looked at again next pass
+        ERROR_CODE removed = storage_engine->remove(mailbox->username, victims[i]);
+        if (removed != NO_ERROR)
+        {
+            continue;
+        }
+        header_cache_message_removed(mailbox->username, victims[i]);
+        search_index_message_removed(mailbox->username, victims[i]);
+        pthread_mutex_lock(&mailbox->lock);
+        MAILBOX_ENTRY *entry = mailbox_find_entry(mailbox, victims[i]);
+        if (entry != NULL)
+        {
+            P("Retention: expired [%s] of [%s]", victims[i], mailbox->username);
+            mailbox_forget_entry(mailbox, entry);
+            expired++;
+        }
+        pthread_mutex_unlock(&mailbox->lock);
+    }
+    if (victims_used > 0)
+    {
+        pthread_mutex_lock(&mailbox->lock);
+        mailbox_compact(mailbox);
+        pthread_mutex_unlock(&mailbox->lock);
+    }
+    free(victims);
+    return expired;
+}
+
+static ERROR_CODE preload_mailbox(const char *username, void *context)
+{
+    (void)context;
+    MAILBOX *mailbox = mailbox_get(username);
+    if (mailbox != NULL)
+    {
+        pthread_mutex_lock(&mailbox->lock);
+        mailbox_ensure_loaded(mailbox);
+        pthread_mutex_unlock(&mailbox->lock);
+    }
+    return retention_stop ? OPERATION_ABORTED : NO_ERROR; // Unlocked read is fine: worst case one more mailbox is loaded
+}
+
+static void *retention_thread(void *arg)
+{
+    (void)arg;
+    // First pass: load every mailbox once, in the background, so the next passes only look at memory
+    storage_engine->for_each_user(preload_mailbox, NULL);
+
+    pthread_mutex_lock(&retention_lock);
+    while (!retention_stop)
+    {
+        pthread_mutex_unlock(&retention_lock);
+
+        // Snapshot of the mailboxes, they are never freed while this thread runs
+        pthread_mutex_lock(&mailbox_table_lock);
+        size_t count = 0;
+        MAILBOX **mailboxes = mailbox_table_count == 0 ? NULL : calloc(mailbox_table_count, sizeof(MAILBOX *));
+        for (size_t i = 0; mailboxes != NULL && i < mailbox_table_capacity; i++)
+        {
+            if (mailbox_table[i] != NULL)
+            {
+                mailboxes[count++] = mailbox_table[i];
+            }
+        }
+        pthread_mutex_unlock(&mailbox_table_lock);
+
+        time_t now = time(NULL);
+        size_t expired = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            expired += mailbox_expire(mailboxes[i], now);
+        }
+        free(mailboxes);
+        if (expired > 0)
+        {
+            P("Retention pass: %zu messages expired", expired);
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += retention_interval_seconds;
+        pthread_mutex_lock(&retention_lock);
+        while (!retention_stop && pthread_cond_timedwait(&retention_cond, &retention_lock, &deadline) != ETIMEDOUT)
+        {
+            // Spurious wakeup, keep waiting
+        }
+    }
+    pthread_mutex_unlock(&retention_lock);
+    return NULL;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LIFECYCLE                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE mailbox_init(void)
+{
+    quota_max_messages = read_environment_long("PGM_QUOTA_MAX_MESSAGES", 0, 0, 1L << 40);
+    quota_max_bytes = read_environment_long("PGM_QUOTA_MAX_BYTES", 0, 0, 1L << 50);
+    retention_max_age_seconds = read_environment_long("PGM_RETENTION_MAX_AGE_SECONDS", 0, 0, 1L << 40);
+    retention_read_max_age_seconds = read_environment_long("PGM_RETENTION_READ_MAX_AGE_SECONDS", 0, 0, 1L << 40);
+    retention_interval_seconds = read_environment_long("PGM_RETENTION_INTERVAL_SECONDS", MAILBOX_DEFAULT_RETENTION_INTERVAL_SECONDS, 1, 86400);
+
+    int retention_enabled = retention_max_age_seconds > 0 || retention_read_max_age_seconds > 0;
+    mailbox_tracking_enabled = retention_enabled || quota_max_messages > 0 || quota_max_bytes > 0;
+    P("Mailbox quota: %ld messages, %ld bytes. Retention: %lds, read %lds, every %lds (0 = disabled)",
+      quota_max_messages, quota_max_bytes, retention_max_age_seconds, retention_read_max_age_seconds, retention_interval_seconds);
+    if (!retention_enabled)
+    {
+        return NO_ERROR;
+    }
+
+    pthread_condattr_t attributes;
+    if (unlikely(pthread_condattr_init(&attributes) != 0 || pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC) != 0 ||
+                 pthread_cond_init(&retention_cond, &attributes) != 0))
+    {
+        PSE("Failed to initialize the retention condition variable");
+        return SYSCALL_ERROR;
+    }
+    pthread_condattr_destroy(&attributes);
+    // Started before main() blocks SIGINT/SIGTERM: the thread must not inherit an open mask, signals belong to the signal thread
+    sigset_t all_signals, previous_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &previous_mask);
+    int create_result = pthread_create(&retention_thread_id, NULL, retention_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+    if (unlikely(create_result != 0))
+    {
+        PSE("Failed to start the retention thread");
+        return SYSCALL_ERROR;
+    }
+    retention_thread_started = 1;
+    return NO_ERROR;
+}
+
+void mailbox_shutdown(void)
+{
+    if (retention_thread_started)
+    {
+        pthread_mutex_lock(&retention_lock);
+        retention_stop = 1;
+        pthread_cond_signal(&retention_cond);
+        pthread_mutex_unlock(&retention_lock);
+        pthread_join(retention_thread_id, NULL);
+        retention_thread_started = 0;
+    }
+
+    pthread_mutex_lock(&mailbox_table_lock);
+    for (size_t i = 0; i < mailbox_table_capacity; i++)
+    {
+        if (mailbox_table[i] != NULL)
+        {
+            pthread_mutex_destroy(&mailbox_table[i]->lock);
+            free(mailbox_table[i]->entries);
+            free(mailbox_table[i]);
+        }
+    }
+    free(mailbox_table);
+    mailbox_table = NULL;
+    mailbox_table_capacity = 0;
+    mailbox_table_count = 0;
+    pthread_mutex_unlock(&mailbox_table_lock);
+}
@@ -0,0 +1,73 @@
+/**
+ * @file 6-Server-Mailbox.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the mailbox accounting: per-user quotas enforced at delivery time and the background retention (expiry) engine
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+/**
+ * Every mailbox keeps in memory its usage (message count, bytes) and the list of its messages ordered by id, that is by time.
+ * The list is built with a single walk of the user folder the first time the mailbox is touched (first delivery, or the first
+ * retention pass which loads every mailbox in the background), afterwards it is only updated incrementally by the workers:
+ * deliveries, reads (UNREAD rename) and deletes. So neither the quota check nor the retention pass walks a directory.
+ *
+ * Configuration (environment variables, 0 = disabled):
+ *  - PGM_QUOTA_MAX_MESSAGES               max messages in a mailbox
+ *  - PGM_QUOTA_MAX_BYTES                  max bytes (header + body of every message) in a mailbox
+ *  - PGM_RETENTION_MAX_AGE_SECONDS        messages older than this are expired, read or not
+ *  - PGM_RETENTION_READ_MAX_AGE_SECONDS   read messages older than this are expired
+ *  - PGM_RETENTION_INTERVAL_SECONDS       how often the retention thread runs (default MAILBOX_DEFAULT_RETENTION_INTERVAL_SECONDS)
+ */
+
+enum mailbox_constants {
+    MAILBOX_DEFAULT_RETENTION_INTERVAL_SECONDS = 60,
+    MAILBOX_TABLE_INITIAL_CAPACITY = 64, // Slots of the username -> mailbox table, always a power of two
+};
+
+/**
+ * @brief Reads the quota/retention configuration and starts the retention thread if a retention policy is set
+ * @note Must be called once after user_registry_init() and before any worker thread starts
+ * @return NO_ERROR on success, SYSCALL_ERROR if the retention thread cannot be started
+ */
+extern ERROR_CODE mailbox_init(void);
+
+/**
+ * @brief Stops the retention thread and frees every mailbox, only to be called once every worker thread has been joined
+ */
+extern void mailbox_shutdown(void);
+
+/**
+ * @brief Reserves room for one message of @p message_bytes in the mailbox of @p username, to be called before receiving the body
+ * @return NO_ERROR if the message fits (the room is now reserved), QUOTA_EXCEEDED if it does not, SYSCALL_ERROR on allocation or I/O errors
+ * @note Every successful reservation must be followed by exactly one mailbox_commit_delivery() or mailbox_cancel_reservation()
+ */
+extern ERROR_CODE mailbox_reserve(const char *username, uint64_t message_bytes);
+
+/**
+ * @brief The reserved message was stored as @p filename, it starts being tracked for retention
+ */
+extern void mailbox_commit_delivery(const char *username, const char *filename, uint64_t message_bytes);
+
+/**
+ * @brief The reserved message was not stored, its room is given back
+ */
+extern void mailbox_cancel_reservation(const char *username, uint64_t message_bytes);
+
+/**
+ * @brief Message @p old_filename was renamed @p new_filename (marked as read)
+ */
+extern void mailbox_message_renamed(const char *username, const char *old_filename, const char *new_filename);
+
+/**
+ * @brief Message @p filename was deleted by its owner
+ */
+extern void mailbox_message_removed(const char *username, const char *filename);
@@ -0,0 +1,513 @@
+/**
+ * @file 7-Server-Body-Store.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the content addressed body store: message bodies shared by every recipient of the same content
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "7-Server-Body-Store.h"
+#include "13-Server-Snapshot.h"
+#include <stdio.h>      // snprintf, sscanf
+#include <stdlib.h>     // getenv, malloc, free
+#include <string.h>     // strcmp, memcmp, memset, strlen
+#include <unistd.h>     // pread, pwrite, close, unlink, fdatasync, sync
+#include <fcntl.h>      // open
+#include <errno.h>      // errno, ENOENT, EEXIST, EINTR
+#include <sys/stat.h>   // mkdir, fstat
+#include <pthread.h>    // pthread_mutex_t
+#include <dirent.h>     // opendir, readdir, closedir
+
+const char *body_store_directory = ".BODIES";
+static const char *body_store_env = "PGM_BODY_STORE";
+static const char *body_store_min_bytes_env = "PGM_BODY_STORE_MIN_BYTES";
+
+// BODY STORE STATE, written once by body_store_init() and read-only afterwards
+static int body_store_dedup_enabled = 0;
+static long body_store_min_bytes = BODY_STORE_DEFAULT_MIN_BYTES;
+static pthread_mutex_t body_store_locks[BODY_STORE_LOCK_STRIPES]; // Serialize find-or-create and reference count updates of the bodies of a stripe
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              HELPERS                                                          */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+/**
+ * @brief FNV-1a 64 bit, same function as the user registry but over a sized buffer
+ */
+static uint64_t fnv1a_64(const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static pthread_mutex_t *body_store_lock_for(uint64_t hash)
+{
+    return &body_store_locks[hash % BODY_STORE_LOCK_STRIPES];
+}
+
+static void body_store_bucket_path(uint64_t hash, char *out, size_t out_size)
+{
+    snprintf(out, out_size, "%s/%02x", body_store_directory, (unsigned int)(hash >> 56));
+}
+
+static void body_store_path(uint64_t hash, uint32_t probe, char *out, size_t out_size)
+{
+    snprintf(out, out_size, "%s/%02x/%016llx-%u", body_store_directory, (unsigned int)(hash >> 56), (unsigned long long)hash, probe);
+}
+
+/**
+ * @brief pread/pwrite that loop until all EXPECTED! data is transferred (same idea as send_all)
+ * @return 0 on success, -1 on error or end of file
+ */
+static int pread_all(int fd, void *buffer, size_t length, off_t offset)
+{
+    char *p = (char *)buffer;
+    while (length)
+    {
+        ssize_t n = pread(fd, p, length, offset);
+        if (likely(n > 0))
+        {
+            p += n;
+            length -= (size_t)n;
+            offset += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buffer, size_t length, off_t offset)
+{
+    const char *p = (const char *)buffer;
+    while (length)
+    {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (likely(n > 0))
+        {
+            p += n;
+            length -= (size_t)n;
+            offset += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads and checks the header of an open body file
+ * @return 1 if the header is valid, 0 otherwise
+ */
+static int body_store_read_header(int fd, BODY_STORE_HEADER *out_header)
+{
+    return pread_all(fd, out_header, sizeof(*out_header), 0) == 0 && out_header->magic == BODY_STORE_MAGIC &&
+           out_header->body_length != 0 && out_header->body_length <= MESSAGE_SIZE_CHARS;
+}
+
+/**
+ * @brief Adds @p delta to the reference count of the body file @p reference points to, removing it when no reference is left
+ * @note Caller holds the stripe lock
+ */
+static ERROR_CODE body_store_update_references(const BODY_REFERENCE *reference, int delta)
+{
+    char path[BODY_STORE_PATH_SIZE_CHARS];
+    body_store_path(reference->hash, reference->probe, path, sizeof(path));
+    int fd = open(path, O_RDWR);
+    if (unlikely(fd < 0))
+    {
+        PSE("Body store: missing body [%s]", path);
+        return SYSCALL_ERROR;
+    }
+
+    ERROR_CODE result = NO_ERROR;
+    BODY_STORE_HEADER header;
+    if (unlikely(!body_store_read_header(fd, &header)))
+    {
+        P("Body store: corrupted body [%s]", path);
+        result = ERROR;
+    }
+    else if (delta < 0 && header.references <= 1)
+    {
+        snapshot_change_begin(path); // A running snapshot may still have records pointing to it
+        int removed = unlink(path) == 0;
+        snapshot_change_end();
+        if (unlikely(!removed))
+        {
+            PSE("Body store: failed to remove body [%s]", path);
+            result = SYSCALL_ERROR;
+        }
+    }
+    else
+    {
+        header.references = delta < 0 ? header.references - 1 : header.references + 1;
+        if (unlikely(pwrite_all(fd, &header.references, sizeof(header.references), (off_t)offsetof(BODY_STORE_HEADER, references)) != 0 ||
+                     (delta > 0 && storage_durability_mode() == DURABILITY_STRICT && fdatasync(fd) != 0)))
+        {
+            PSE("Body store: failed to update the references of [%s]", path);
+            result = SYSCALL_ERROR;
+        }
+    }
+    close(fd);
+    return result;
+}
+
+/**
+ * @brief Writes a new body file with one reference: partial file first, then rename, like the message files
+ * @note Caller holds the stripe lock
+ */
+static ERROR_CODE body_store_create(const char *path, uint64_t hash, const char *body, uint32_t body_length)
+{
+    char partial_path[BODY_STORE_PATH_SIZE_CHARS + 8];
+    snprintf(partial_path, sizeof(partial_path), "%s%s", path, partial_message_suffix);
+    int fd = open(partial_path, O_CREAT | O_TRUNC | O_WRONLY, 0600); // Only a crash leaves one behind, we hold the lock of its name
+    if (unlikely(fd < 0))
+    {
+        PSE("Body store: failed to create [%s]", partial_path);
+        return SYSCALL_ERROR;
+    }
+
+    BODY_STORE_HEADER header = {
+        .magic = BODY_STORE_MAGIC,
+        .body_length = body_length,
+        .references = 1,
+        .hash = hash,
+    };
+    ERROR_CODE result = NO_ERROR;
+    if (unlikely(pwrite_all(fd, &header, sizeof(header), 0) != 0 || pwrite_all(fd, body, body_length, (off_t)sizeof(header)) != 0))
+    {
+        PSE("Body store: failed to write [%s]", partial_path);
+        result = SYSCALL_ERROR;
+    }
+    else if (unlikely(rename(partial_path, path) != 0))
+    {
+        PSE("Body store: failed to rename [%s]", partial_path);
+        result = SYSCALL_ERROR;
+    }
+    else if (storage_durability_mode() == DURABILITY_STRICT)
+    {
+        // The record written next must never reach the disk before the body it points to
+        char bucket_path[BODY_STORE_PATH_SIZE_CHARS];
+        body_store_bucket_path(hash, bucket_path, sizeof(bucket_path));
+        result = storage_make_durable(fd, bucket_path);
+    }
+    close(fd);
+    if (unlikely(result != NO_ERROR))
+    {
+        unlink(partial_path);
+        unlink(path);
+    }
+    return result;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              PUBLIC API                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE body_store_init(void)
+{
+    // The locks are needed even with dedup off: records written while it was on still get released
+    for (size_t i = 0; i < BODY_STORE_LOCK_STRIPES; i++)
+    {
+        if (unlikely(pthread_mutex_init(&body_store_locks[i], NULL) != 0))
+        {
+            PSE("Failed to initialize the body store locks");
+            return SYSCALL_ERROR;
+        }
+    }
+
+    const char *mode = getenv(body_store_env);
+    if (mode != NULL)
+    {
+        if (strcmp(mode, "dedup") == 0)
+            body_store_dedup_enabled = 1;
+        else if (strcmp(mode, "inline") != 0)
+            P("Invalid value [%s] for %s, using fallback: inline", mode, body_store_env);
+    }
+    body_store_min_bytes = read_environment_long(body_store_min_bytes_env, BODY_STORE_DEFAULT_MIN_BYTES, 1, MESSAGE_SIZE_CHARS);
+    P("Body store: %s (min shared body: %ld bytes)", body_store_dedup_enabled ? "dedup" : "inline", body_store_min_bytes);
+    if (!body_store_dedup_enabled)
+    {
+        return NO_ERROR;
+    }
+
+    // Every bucket is created once here, so acquiring a body never has to create (and sync) a directory
+    int created = 0;
+    char path[BODY_STORE_PATH_SIZE_CHARS];
+    for (unsigned int bucket = 0; bucket <= BODY_STORE_BUCKETS; bucket++)
+    {
+        if (bucket == 0)
+            snprintf(path, sizeof(path), "%s", body_store_directory);
+        else
+            body_store_bucket_path((uint64_t)(bucket - 1) << 56, path, sizeof(path));
+        if (mkdir(path, 0700) == 0)
+        {
+            created = 1;
+        }
+        else if (unlikely(errno != EEXIST))
+        {
+            PSE("Failed to create the body store directory [%s]", path);
+            return SYSCALL_ERROR;
+        }
+    }
+    if (created)
+    {
+        sync(); // First start with dedup on, make the directories durable before any record can point inside them
+    }
+    return NO_ERROR;
+}
+
+int body_store_should_share(uint32_t body_length)
+{
+    return body_store_dedup_enabled && body_length >= (uint32_t)body_store_min_bytes && body_length != sizeof(BODY_REFERENCE) &&
+           body_length != sizeof(BODY_REFERENCE) + sizeof(MESSAGE_CHECKSUM);
+}
+
+ERROR_CODE body_store_acquire(const char *body, uint32_t body_length, BODY_REFERENCE *out_reference)
+{
+    if (unlikely(body == NULL || out_reference == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    if (unlikely(body_length == 0 || body_length > MESSAGE_SIZE_CHARS))
+    {
+        return STRING_SIZE_INVALID;
+    }
+
+    uint64_t hash = fnv1a_64(body, body_length);
+    char stored[MESSAGE_SIZE_CHARS];
+    char path[BODY_STORE_PATH_SIZE_CHARS];
+    ERROR_CODE result = SYSCALL_ERROR;
+    pthread_mutex_t *lock = body_store_lock_for(hash);
+    pthread_mutex_lock(lock);
+    for (uint32_t probe = 0; probe < BODY_STORE_MAX_PROBES; probe++)
+    {
+        body_store_path(hash, probe, path, sizeof(path));
+        int fd = open(path, O_RDWR);
+        if (fd < 0)
+        {
+            if (unlikely(errno != ENOENT))
+            {
+                PSE("Body store: failed to open [%s]", path);
+                break;
+            }
+            // First free probe: nobody stored this body yet (a freed earlier probe only costs a duplicate, never a wrong body)
+            result = body_store_create(path, hash, body, body_length);
+            if (likely(result == NO_ERROR))
+            {
+                *out_reference = (BODY_REFERENCE){.magic = BODY_REFERENCE_MAGIC, .probe = probe, .hash = hash};
+            }
+            break;
+        }
+
+        // Same hash, the content decides: a collision moves on to the next probe
+        BODY_STORE_HEADER header;
+        int same = body_store_read_header(fd, &header) && header.hash == hash && header.body_length == body_length &&
+                   pread_all(fd, stored, body_length, (off_t)sizeof(header)) == 0 && memcmp(stored, body, body_length) == 0;
+        close(fd);
+        if (same)
+        {
+            *out_reference = (BODY_REFERENCE){.magic = BODY_REFERENCE_MAGIC, .probe = probe, .hash = hash};
+            result = body_store_update_references(out_reference, +1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    if (unlikely(result == SYSCALL_ERROR))
+    {
+        P("Body store: no room for body %016llx (%u bytes)", (unsigned long long)hash, body_length);
+    }
+    return result;
+}
+
+ERROR_CODE body_store_retain(const BODY_REFERENCE *reference)
+{
+    if (unlikely(reference == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    pthread_mutex_t *lock = body_store_lock_for(reference->hash);
+    pthread_mutex_lock(lock);
+    ERROR_CODE result = body_store_update_references(reference, +1);
+    pthread_mutex_unlock(lock);
+    return result;
+}
+
+void body_store_release(const BODY_REFERENCE *reference)
+{
+    if (unlikely(reference == NULL))
+    {
+        return;
+    }
+    pthread_mutex_t *lock = body_store_lock_for(reference->hash);
+    pthread_mutex_lock(lock);
+    body_store_update_references(reference, -1);
+    pthread_mutex_unlock(lock);
+}
+
+ERROR_CODE body_store_read(const BODY_REFERENCE *reference, char *body, uint32_t body_length)
+{
+    if (unlikely(reference == NULL || body == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    // No lock: the content of a body file never changes and it cannot go away while the record we came from exists
+    char path[BODY_STORE_PATH_SIZE_CHARS];
+    body_store_path(reference->hash, reference->probe, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (unlikely(fd < 0))
+    {
+        PSE("Body store: missing body [%s]", path);
+        return SYSCALL_ERROR;
+    }
+    BODY_STORE_HEADER header;
+    int ok = body_store_read_header(fd, &header) && header.body_length == body_length &&
+             pread_all(fd, body, body_length, (off_t)sizeof(header)) == 0;
+    close(fd);
+    if (unlikely(!ok))
+    {
+        P("Body store: body [%s] is not %u bytes long", path, body_length);
+        return SYSCALL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+int body_store_contains(const BODY_REFERENCE *reference, uint32_t body_length)
+{
+    if (reference == NULL || reference->magic != BODY_REFERENCE_MAGIC || body_length == 0 || body_length > MESSAGE_SIZE_CHARS)
+    {
+        return 0;
+    }
+    char path[BODY_STORE_PATH_SIZE_CHARS];
+    body_store_path(reference->hash, reference->probe, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    char stored[MESSAGE_SIZE_CHARS];
+    BODY_STORE_HEADER header;
+    struct stat file_stat = {0};
+    int complete = body_store_read_header(fd, &header) && header.body_length == body_length && header.hash == reference->hash &&
+                   fstat(fd, &file_stat) == 0 && file_stat.st_size == (off_t)(sizeof(header) + body_length) &&
+                   pread_all(fd, stored, body_length, (off_t)sizeof(header)) == 0 && fnv1a_64(stored, body_length) == reference->hash;
+    close(fd);
+    return complete;
+}
+
+int body_store_is_reference_record(uint64_t file_size, uint32_t message_length)
+{
+    return message_length != sizeof(BODY_REFERENCE) && file_size == offsetof(MESSAGE, message) + sizeof(BODY_REFERENCE);
+}
+
+ERROR_CODE body_store_for_each(ERROR_CODE (*callback)(const char *path, const BODY_REFERENCE *reference, const BODY_STORE_HEADER *header, int intact, void *context), void *context)
+{
+    if (unlikely(callback == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    char *stored = malloc(MESSAGE_SIZE_CHARS);
+    if (unlikely(stored == NULL))
+    {
+        PSE("Body store: failed to allocate the walk buffer");
+        return SYSCALL_ERROR;
+    }
+    ERROR_CODE result = NO_ERROR;
+    char bucket_path[BODY_STORE_PATH_SIZE_CHARS];
+    for (unsigned int bucket = 0; bucket < BODY_STORE_BUCKETS && result == NO_ERROR; bucket++)
+    {
+        body_store_bucket_path((uint64_t)bucket << 56, bucket_path, sizeof(bucket_path));
+        DIR *directory = opendir(bucket_path);
+        if (directory == NULL)
+        {
+            if (unlikely(errno != ENOENT))
+            {
+                PSE("Body store: failed to open [%s]", bucket_path);
+                result = SYSCALL_ERROR;
+            }
+            continue;
+        }
+        struct dirent *entry = NULL;
+        while (result == NO_ERROR && (entry = readdir(directory)) != NULL)
+        {
+            // Only "<16 hex>-<probe>", leftovers of an interrupted create end with partial_message_suffix and are not bodies yet
+            unsigned long long hash = 0;
+            unsigned int probe = 0;
+            int consumed = 0;
+            if (sscanf(entry->d_name, "%16llx-%u%n", &hash, &probe, &consumed) != 2 || entry->d_name[consumed] != '\0' ||
+                strlen(entry->d_name) < 18 || probe >= BODY_STORE_MAX_PROBES)
+            {
+                continue;
+            }
+            BODY_REFERENCE reference = {BODY_REFERENCE_MAGIC, probe, (uint64_t)hash};
+            char path[BODY_STORE_PATH_SIZE_CHARS];
+            body_store_path(reference.hash, reference.probe, path, sizeof(path));
+            BODY_STORE_HEADER header;
+            memset(&header, 0, sizeof(header));
+            struct stat file_stat = {0};
+            int fd = open(path, O_RDONLY);
+            int intact = fd >= 0 && body_store_read_header(fd, &header) && header.hash == reference.hash &&
+                         fstat(fd, &file_stat) == 0 && file_stat.st_size == (off_t)(sizeof(header) + header.body_length) &&
+                         pread_all(fd, stored, header.body_length, (off_t)sizeof(header)) == 0 && fnv1a_64(stored, header.body_length) == reference.hash;
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            result = callback(path, &reference, &header, intact, context);
+        }
+        closedir(directory);
+    }
+    free(stored);
+    return result;
+}
+
+ERROR_CODE body_store_set_references(const BODY_REFERENCE *reference, uint64_t references)
+{
+    if (unlikely(reference == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    char path[BODY_STORE_PATH_SIZE_CHARS];
+    body_store_path(reference->hash, reference->probe, path, sizeof(path));
+    if (references == 0)
+    {
+        if (unlikely(unlink(path) != 0 && errno != ENOENT))
+        {
+            PSE("Body store: failed to remove body [%s]", path);
+            return SYSCALL_ERROR;
+        }
+        return NO_ERROR;
+    }
+    int fd = open(path, O_WRONLY);
+    ERROR_CODE result = NO_ERROR;
+    if (unlikely(fd < 0 || pwrite_all(fd, &references, sizeof(references), (off_t)offsetof(BODY_STORE_HEADER, references)) != 0))
+    {
+        PSE("Body store: failed to update the references of [%s]", path);
+        result = SYSCALL_ERROR;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return result;
+}
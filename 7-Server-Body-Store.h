@@ -0,0 +1,122 @@
+/**
+ * @file 7-Server-Body-Store.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the content addressed body store: message bodies shared by every recipient of the same content
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+/**
+ * The same announcement sent to N users used to be written N times. With PGM_BODY_STORE=dedup a body of at least
+ * PGM_BODY_STORE_MIN_BYTES bytes is stored once in the body store and every recipient gets a small record instead:
+ *  - body file:      <body_store_directory>/<h0>/<16 hex digits of the hash>-<probe>   BODY_STORE_HEADER + body
+ *  - message record: <user folder>/.../<message filename>                           MESSAGE header + BODY_REFERENCE
+ * The header of the record keeps the real message_length, so a record is told apart from an inline message by its size
+ * (header + sizeof(BODY_REFERENCE) instead of header + message_length). Bodies exactly sizeof(BODY_REFERENCE) bytes long
+ * are never shared, so the two shapes never collide. Neither are bodies sizeof(BODY_REFERENCE) + sizeof(MESSAGE_CHECKSUM)
+ * bytes long, for the same reason once the checksum trailer is counted (see MESSAGE_FILE_SHAPE in 4-Server-Storage.h).
+ *
+ * Every body file counts its references. The count may be too high after a crash (the body is leaked, never lost) but never
+ * too low: increments reach the disk before the record that needs them, decrements only after the record is gone.
+ * Reading references works whatever PGM_BODY_STORE says, so turning dedup off keeps every stored message readable.
+ */
+
+/**
+ * @brief Tail of a message record whose body lives in the body store
+ * @note Stored in host byte order: records never leave the server machine, only the body they point to is sent
+ */
+typedef struct BODY_REFERENCE {
+    uint32_t magic;  // BODY_REFERENCE_MAGIC
+    uint32_t probe;  // Collision counter, last part of the body file name
+    uint64_t hash;   // FNV-1a 64 of the body
+} BODY_REFERENCE;
+
+/**
+ * @brief First bytes of a body file, followed by body_length bytes of body
+ */
+typedef struct BODY_STORE_HEADER {
+    uint32_t magic;       // BODY_STORE_MAGIC
+    uint32_t body_length;
+    uint64_t references;  // Records pointing to this body, the file is removed when it drops to 0
+    uint64_t hash;
+} BODY_STORE_HEADER;
+
+enum body_store_constants {
+    BODY_REFERENCE_MAGIC = 0x50474D52,     // "PGMR"
+    BODY_STORE_MAGIC = 0x50474D42,         // "PGMB"
+    BODY_STORE_DEFAULT_MIN_BYTES = 256,    // Smaller bodies stay inline, sharing them saves less than the reference count update costs (PGM_BODY_STORE_MIN_BYTES)
+    BODY_STORE_MAX_PROBES = 16,            // Different bodies with the same hash (and length) get the next probe, up to this many
+    BODY_STORE_BUCKETS = 256,              // One fan-out directory per first byte of the hash, all created by body_store_init()
+    BODY_STORE_LOCK_STRIPES = 64,          // Acquire/release of bodies with different hashes rarely wait on each other
+    BODY_STORE_PATH_SIZE_CHARS = 64,       // "<directory>/<h0>/<16 hex>-<probe>" + null terminator
+};
+
+extern const char *body_store_directory; // In the server working directory
+
+/**
+ * @brief Reads PGM_BODY_STORE ("inline" default, "dedup") and PGM_BODY_STORE_MIN_BYTES, creates the store when dedup is on
+ * @note Must be called once after storage_durability_init() and before delivery_log_recover_and_open()
+ * @return NO_ERROR on success, SYSCALL_ERROR if the store directories cannot be created
+ */
+extern ERROR_CODE body_store_init(void);
+
+/**
+ * @brief 1 if a body of @p body_length bytes is to be stored in the body store, 0 if it stays inline in the message file
+ */
+extern int body_store_should_share(uint32_t body_length);
+
+/**
+ * @brief Finds the stored copy of @p body (or stores it) and takes one reference to it
+ * @note With the strict durability mode the reference is on disk when this returns, with the group commit mode the syncfs() of the delivery covers it
+ * @return NO_ERROR on success (@p out_reference filled), SYSCALL_ERROR on I/O errors or when every probe is taken by other bodies
+ */
+extern ERROR_CODE body_store_acquire(const char *body, uint32_t body_length, BODY_REFERENCE *out_reference);
+
+/**
+ * @brief Takes one more reference to an already stored body, used by the recovery of records whose increment may have been lost
+ */
+extern ERROR_CODE body_store_retain(const BODY_REFERENCE *reference);
+
+/**
+ * @brief Drops one reference, the body file is removed with the last one
+ * @note Only call it once the record holding @p reference is gone (and durable, see storage_remove_message())
+ */
+extern void body_store_release(const BODY_REFERENCE *reference);
+
+/**
+ * @brief Reads the body @p reference points to
+ * @return NO_ERROR on success, SYSCALL_ERROR if the body is missing, truncated or not @p body_length bytes long
+ */
+extern ERROR_CODE body_store_read(const BODY_REFERENCE *reference, char *body, uint32_t body_length);
+
+/**
+ * @brief 1 if the body @p reference points to is stored entirely and is @p body_length bytes long, 0 otherwise
+ */
+extern int body_store_contains(const BODY_REFERENCE *reference, uint32_t body_length);
+
+/**
+ * @brief 1 if a message file of @p file_size bytes whose header says @p message_length is a record pointing to the body store
+ */
+extern int body_store_is_reference_record(uint64_t file_size, uint32_t message_length);
+
+/**
+ * @brief Offline tools (fsck): calls @p callback with every body file of the store, in directory order
+ * @param callback receives the path of the body file, the reference that points to it, its header as stored and 1 if the file is intact (header, size
+ *                 and content hash), 0 if it is corrupted (the header may then be garbage)
+ * @return NO_ERROR if the whole store was walked (also when it does not exist), the first non NO_ERROR value returned by @p callback, or SYSCALL_ERROR
+ */
+extern ERROR_CODE body_store_for_each(ERROR_CODE (*callback)(const char *path, const BODY_REFERENCE *reference, const BODY_STORE_HEADER *header, int intact, void *context), void *context);
+
+/**
+ * @brief Offline tools (fsck): overwrites the reference count of a body, 0 removes the body file
+ * @return NO_ERROR on success, SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE body_store_set_references(const BODY_REFERENCE *reference, uint64_t references);
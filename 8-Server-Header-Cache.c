@@ -0,0 +1,605 @@
+/**
+ * @file 8-Server-Header-Cache.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the in-memory cache of message headers that serves REQUEST_LIST_MESSAGE_SUMMARIES
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "8-Server-Header-Cache.h"
+#include "10-Server-Substring-Filter.h"
+#include "14-Server-Storage-Engine.h"
+#include <stdio.h>      // snprintf
+#include <stdlib.h>     // calloc, realloc, malloc, free, qsort
+#include <string.h>     // strcmp, strncmp, strlen, memmove, memcpy, memset
+#include <stddef.h>     // offsetof
+#include <arpa/inet.h>  // htonl, ntohl
+#include <pthread.h>    // pthread_mutex_t
+#include <stdatomic.h>  // atomic_size_t, atomic_uint_fast64_t
+
+_Static_assert((int)MESSAGE_SUMMARY_FILENAME_SIZE_CHARS == (int)MESSAGE_FILENAME_SIZE_CHARS, "MESSAGE_SUMMARY must carry any message filename");
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              CACHED MAILBOXES                                                 */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct HEADER_CACHE_ENTRY {
+    message_id_t id;          // Sort key (time order)
+    uint32_t message_length;  // Body bytes, host byte order
+    uint8_t sender_length;    // strlen() of the fields, so the filter scans never look for the terminator
+    uint8_t subject_length;
+    char sender[USERNAME_SIZE_CHARS];
+    char subject[SUBJECT_SIZE_CHARS];
+    char filename[MESSAGE_FILENAME_SIZE_CHARS];
+} HEADER_CACHE_ENTRY;
+
+typedef struct USER_HEADER_CACHE {
+    pthread_mutex_t lock;                 // Protects loaded and the entries
+    char username[USERNAME_SIZE_CHARS];
+    int loaded;                           // 0 until the first listing and again after an eviction
+    atomic_uint_fast64_t last_listed;     // header_cache_clock at the last listing, 0 when not loaded. Read by the eviction without the lock
+    HEADER_CACHE_ENTRY *entries;          // Ordered by id
+    size_t entries_used;
+    size_t entries_capacity;
+} USER_HEADER_CACHE;
+
+// CONFIGURATION, written once by header_cache_init()
+static long header_cache_max_entries = HEADER_CACHE_DEFAULT_MAX_ENTRIES;
+
+// USERNAME -> CACHE TABLE, protected by header_cache_table_lock. Caches are never removed before header_cache_shutdown(), only emptied
+static pthread_mutex_t header_cache_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static USER_HEADER_CACHE **header_cache_table = NULL;
+static size_t header_cache_table_capacity = 0;
+static size_t header_cache_table_count = 0;
+
+static atomic_size_t header_cache_cached_entries = 0; // All users together, checked against header_cache_max_entries
+static atomic_uint_fast64_t header_cache_clock = 0;   // Ticks at every listing, orders the caches for the eviction
+
+static uint64_t hash_username(const char *username)
+{
+    uint64_t hash = 14695981039346656037ull; // FNV-1a 64 bit
+    for (const unsigned char *c = (const unsigned char *)username; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static size_t header_cache_find_slot(USER_HEADER_CACHE **table, size_t capacity, const char *username)
+{
+    size_t mask = capacity - 1;
+    size_t index = (size_t)hash_username(username) & mask;
+    while (table[index] != NULL && strcmp(table[index]->username, username) != 0)
+    {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+/**
+ * @brief Returns the cache of @p username, creating it (not loaded yet) only if @p create is set
+ * @return the cache, NULL if it does not exist (and @p create is 0) or memory runs out
+ */
+static USER_HEADER_CACHE *header_cache_get(const char *username, int create)
+{
+    pthread_mutex_lock(&header_cache_table_lock);
+    if (header_cache_table_capacity == 0 && !create)
+    {
+        pthread_mutex_unlock(&header_cache_table_lock);
+        return NULL;
+    }
+    if (create && (header_cache_table_count + 1) * 10 > header_cache_table_capacity * 7) // Keep the load under 70%
+    {
+        size_t next_capacity = header_cache_table_capacity == 0 ? HEADER_CACHE_TABLE_INITIAL_CAPACITY : header_cache_table_capacity * 2;
+        USER_HEADER_CACHE **next_table = calloc(next_capacity, sizeof(USER_HEADER_CACHE *));
+        if (unlikely(next_table == NULL))
+        {
+            PSE("Failed to allocate the header cache table");
+            pthread_mutex_unlock(&header_cache_table_lock);
+            return NULL;
+        }
+        for (size_t i = 0; i < header_cache_table_capacity; i++)
+        {
+            if (header_cache_table[i] != NULL)
+            {
+                next_table[header_cache_find_slot(next_table, next_capacity, header_cache_table[i]->username)] = header_cache_table[i];
+            }
+        }
+        free(header_cache_table);
+        header_cache_table = next_table;
+        header_cache_table_capacity = next_capacity;
+    }
+
+    size_t slot = header_cache_find_slot(header_cache_table, header_cache_table_capacity, username);
+    USER_HEADER_CACHE *cache = header_cache_table[slot];
+    if (cache == NULL && create)
+    {
+        cache = calloc(1, sizeof(USER_HEADER_CACHE));
+        if (unlikely(cache == NULL))
+        {
+            PSE("Failed to allocate the header cache of [%s]", username);
+            pthread_mutex_unlock(&header_cache_table_lock);
+            return NULL;
+        }
+        pthread_mutex_init(&cache->lock, NULL);
+        snprintf(cache->username, sizeof(cache->username), "%s", username);
+        header_cache_table[slot] = cache;
+        header_cache_table_count++;
+    }
+    pthread_mutex_unlock(&header_cache_table_lock);
+    return cache;
+}
+
+static int compare_entries_by_id(const void *a, const void *b)
+{
+    const HEADER_CACHE_ENTRY *entry_a = (const HEADER_CACHE_ENTRY *)a;
+    const HEADER_CACHE_ENTRY *entry_b = (const HEADER_CACHE_ENTRY *)b;
+    return (entry_a->id > entry_b->id) - (entry_a->id < entry_b->id);
+}
+
+/**
+ * @return index of the first entry with an id >= @p id
+ * @note Caller holds the cache lock
+ */
+static size_t header_cache_lower_bound(const USER_HEADER_CACHE *cache, message_id_t id)
+{
+    size_t low = 0;
+    size_t high = cache->entries_used;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (cache->entries[middle].id < id)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Binary search on the id, then the exact name among the (rare) entries sharing it
+ * @return index of the entry, entries_used if there is none
+ * @note Caller holds the cache lock
+ */
+static size_t header_cache_find_entry(const USER_HEADER_CACHE *cache, const char *filename)
+{
+    message_id_t id = message_id_from_filename(filename);
+    for (size_t i = header_cache_lower_bound(cache, id); i < cache->entries_used && cache->entries[i].id == id; i++)
+    {
+        if (strcmp(cache->entries[i].filename, filename) == 0)
+        {
+            return i;
+        }
+    }
+    return cache->entries_used;
+}
+
+static void header_cache_fill_entry(HEADER_CACHE_ENTRY *entry, const char *filename, const MESSAGE *header)
+{
+    memset(entry, 0, sizeof(*entry)); // The fields are copied whole into the summaries, no stale heap bytes after the terminators
+    entry->id = message_id_from_filename(filename);
+    entry->message_length = ntohl(header->message_length);
+    snprintf(entry->sender, sizeof(entry->sender), "%.*s", (int)sizeof(header->sender) - 1, header->sender);
+    snprintf(entry->subject, sizeof(entry->subject), "%.*s", (int)sizeof(header->subject) - 1, header->subject);
+    entry->sender_length = (uint8_t)strlen(entry->sender);
+    entry->subject_length = (uint8_t)strlen(entry->subject);
+    snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+}
+
+static int header_cache_entry_is_unread(const HEADER_CACHE_ENTRY *entry)
+{
+    return strncmp(entry->filename, UNREAD_PREFIX, strlen(UNREAD_PREFIX)) == 0;
+}
+
+/**
+ * @brief Wire form of a cached header, network byte order
+ */
+static void header_cache_fill_summary(MESSAGE_SUMMARY *summary, const HEADER_CACHE_ENTRY *entry)
+{
+    summary->message_id = host_to_network_64(entry->id);
+    summary->timestamp = host_to_network_64(entry->id >> MESSAGE_ID_SEQUENCE_BITS);
+    summary->message_length = htonl(entry->message_length);
+    summary->flags = htonl(header_cache_entry_is_unread(entry) ? MESSAGE_SUMMARY_UNREAD : 0);
+    memcpy(summary->sender, entry->sender, sizeof(summary->sender));
+    memcpy(summary->subject, entry->subject, sizeof(summary->subject));
+    memcpy(summary->filename, entry->filename, sizeof(summary->filename));
+}
+
+/**
+ * @brief Makes room for one more entry
+ * @note Caller holds the cache lock
+ */
+static ERROR_CODE header_cache_reserve_entry(USER_HEADER_CACHE *cache)
+{
+    if (cache->entries_used + 1 <= cache->entries_capacity)
+    {
+        return NO_ERROR;
+    }
+    size_t next_capacity = cache->entries_capacity == 0 ? 16 : cache->entries_capacity * 2;
+    HEADER_CACHE_ENTRY *reallocated = realloc(cache->entries, next_capacity * sizeof(HEADER_CACHE_ENTRY));
+    if (unlikely(reallocated == NULL))
+    {
+        PSE("Failed to grow the header cache of [%s]", cache->username);
+        return SYSCALL_ERROR;
+    }
+    cache->entries = reallocated;
+    cache->entries_capacity = next_capacity;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Drops every entry of a loaded cache, the next listing reads the headers again
+ * @note Caller holds the cache lock
+ */
+static void header_cache_unload(USER_HEADER_CACHE *cache)
+{
+    atomic_fetch_sub(&header_cache_cached_entries, cache->entries_used);
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->entries_used = 0;
+    cache->entries_capacity = 0;
+    cache->loaded = 0;
+    atomic_store(&cache->last_listed, 0);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LOADING AND EVICTION                                             */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct HEADER_CACHE_LOAD_CONTEXT {
+    USER_HEADER_CACHE *cache;
+    MESSAGE *header; // Scratch buffer, offsetof(MESSAGE, message) bytes
+} HEADER_CACHE_LOAD_CONTEXT;
+
+static ERROR_CODE header_cache_load_message(const char *filename, void *context)
+{
+    HEADER_CACHE_LOAD_CONTEXT *load = (HEADER_CACHE_LOAD_CONTEXT *)context;
+    // Only the header: the body (inline or shared) is never read for a listing
+    ERROR_CODE fetched = storage_engine->fetch(load->cache->username, filename, load->header, 0);
+    if (fetched == ERROR)
+    {
+        return NO_ERROR; // Deleted in the meantime
+    }
+    if (fetched != NO_ERROR)
+    {
+        P("Header cache: skipping bogus message file [%s] of [%s]", filename, load->cache->username);
+        return NO_ERROR;
+    }
+
+    // Appended unordered and sorted once at the end of the walk
+    if (unlikely(header_cache_reserve_entry(load->cache) != NO_ERROR))
+    {
+        return SYSCALL_ERROR;
+    }
+    header_cache_fill_entry(&load->cache->entries[load->cache->entries_used++], filename, load->header);
+    return NO_ERROR;
+}
+
+/**
+ * @brief The only listing of a cached mailbox
+ * @note Caller holds the cache lock
+ */
+static ERROR_CODE header_cache_ensure_loaded(USER_HEADER_CACHE *cache)
+{
+    if (likely(cache->loaded))
+    {
+        return NO_ERROR;
+    }
+    MESSAGE *header = malloc(offsetof(MESSAGE, message));
+    if (unlikely(header == NULL))
+    {
+        PSE("Failed to allocate the header cache load of [%s]", cache->username);
+        return SYSCALL_ERROR;
+    }
+    HEADER_CACHE_LOAD_CONTEXT load = {.cache = cache, .header = header};
+    ERROR_CODE result = storage_engine->list(cache->username, header_cache_load_message, &load);
+    free(header);
+    atomic_fetch_add(&header_cache_cached_entries, cache->entries_used);
+    if (unlikely(result != NO_ERROR))
+    {
+        header_cache_unload(cache); // Start again from scratch next time, the partial state would be wrong
+        return result;
+    }
+    if (cache->entries_used > 1)
+    {
+        qsort(cache->entries, cache->entries_used, sizeof(HEADER_CACHE_ENTRY), compare_entries_by_id);
+    }
+    cache->loaded = 1;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Drops the least recently listed mailboxes (never @p keep) until the cache fits in PGM_HEADER_CACHE_MAX_ENTRIES
+ * @note Caller holds no cache lock: the victim is picked under the table lock and emptied under its own lock, never both at once
+ */
+static void header_cache_evict(const USER_HEADER_CACHE *keep)
+{
+    while (atomic_load(&header_cache_cached_entries) > (size_t)header_cache_max_entries)
+    {
+        USER_HEADER_CACHE *victim = NULL;
+        uint_fast64_t victim_listed = 0;
+        pthread_mutex_lock(&header_cache_table_lock);
+        for (size_t i = 0; i < header_cache_table_capacity; i++)
+        {
+            USER_HEADER_CACHE *cache = header_cache_table[i];
+            uint_fast64_t listed = cache == NULL ? 0 : atomic_load(&cache->last_listed);
+            if (cache != NULL && cache != keep && listed != 0 && (victim == NULL || listed < victim_listed))
+            {
+                victim = cache;
+                victim_listed = listed;
+            }
+        }
+        pthread_mutex_unlock(&header_cache_table_lock);
+        if (victim == NULL)
+        {
+            return; // Only the mailbox just listed is left, it stays even if it alone is over the limit
+        }
+        pthread_mutex_lock(&victim->lock);
+        if (victim->loaded)
+        {
+            header_cache_unload(victim);
+        }
+        atomic_store(&victim->last_listed, 0);
+        pthread_mutex_unlock(&victim->lock);
+    }
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              PUBLIC API                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE header_cache_init(void)
+{
+    header_cache_max_entries = read_environment_long("PGM_HEADER_CACHE_MAX_ENTRIES", HEADER_CACHE_DEFAULT_MAX_ENTRIES, 1, 1L << 32);
+    P("Header cache: up to %ld headers in memory", header_cache_max_entries);
+    return NO_ERROR;
+}
+
+void header_cache_shutdown(void)
+{
+    pthread_mutex_lock(&header_cache_table_lock);
+    for (size_t i = 0; i < header_cache_table_capacity; i++)
+    {
+        USER_HEADER_CACHE *cache = header_cache_table[i];
+        if (cache != NULL)
+        {
+            pthread_mutex_destroy(&cache->lock);
+            free(cache->entries);
+            free(cache);
+        }
+    }
+    free(header_cache_table);
+    header_cache_table = NULL;
+    header_cache_table_capacity = 0;
+    header_cache_table_count = 0;
+    atomic_store(&header_cache_cached_entries, 0);
+    pthread_mutex_unlock(&header_cache_table_lock);
+}
+
+ERROR_CODE header_cache_list(const char *username, int only_unread, MESSAGE_SUMMARY **out_summaries, size_t *out_count)
+{
+    if (unlikely(username == NULL || out_summaries == NULL || out_count == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    *out_summaries = NULL;
+    *out_count = 0;
+    USER_HEADER_CACHE *cache = header_cache_get(username, 1);
+    if (unlikely(cache == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int was_loaded = cache->loaded;
+    ERROR_CODE result = header_cache_ensure_loaded(cache);
+    if (unlikely(result != NO_ERROR))
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return result;
+    }
+    atomic_store(&cache->last_listed, atomic_fetch_add(&header_cache_clock, 1) + 1);
+
+    MESSAGE_SUMMARY *summaries = cache->entries_used == 0 ? NULL : calloc(cache->entries_used, sizeof(MESSAGE_SUMMARY));
+    if (unlikely(cache->entries_used != 0 && summaries == NULL))
+    {
+        PSE("Failed to allocate the summaries of [%s]", username);
+        pthread_mutex_unlock(&cache->lock);
+        return SYSCALL_ERROR;
+    }
+    size_t count = 0;
+    for (size_t i = cache->entries_used; i > 0; i--) // Newest first
+    {
+        const HEADER_CACHE_ENTRY *entry = &cache->entries[i - 1];
+        if (only_unread && !header_cache_entry_is_unread(entry))
+        {
+            continue;
+        }
+        header_cache_fill_summary(&summaries[count++], entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!was_loaded)
+    {
+        header_cache_evict(cache);
+    }
+    *out_summaries = summaries;
+    *out_count = count;
+    return NO_ERROR;
+}
+
+ERROR_CODE header_cache_filter(const char *username, const SUBSTRING_NEEDLE *sender_needle, const SUBSTRING_NEEDLE *subject_needle, MESSAGE_SUMMARY **out_summaries, size_t *out_count)
+{
+    if (unlikely(username == NULL || out_summaries == NULL || out_count == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    *out_summaries = NULL;
+    *out_count = 0;
+    USER_HEADER_CACHE *cache = header_cache_get(username, 1);
+    if (unlikely(cache == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int was_loaded = cache->loaded;
+    ERROR_CODE result = header_cache_ensure_loaded(cache);
+    if (unlikely(result != NO_ERROR))
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return result;
+    }
+    atomic_store(&cache->last_listed, atomic_fetch_add(&header_cache_clock, 1) + 1);
+
+    MESSAGE_SUMMARY *summaries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    for (size_t i = cache->entries_used; i > 0; i--) // Newest first
+    {
+        const HEADER_CACHE_ENTRY *entry = &cache->entries[i - 1];
+        // The fields are scanned in place: their width is what the kernels may read
+        if ((sender_needle != NULL && !substring_contains(entry->sender, entry->sender_length, sizeof(entry->sender), sender_needle)) ||
+            (subject_needle != NULL && !substring_contains(entry->subject, entry->subject_length, sizeof(entry->subject), subject_needle)))
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            size_t next_capacity = capacity == 0 ? 16 : capacity * 2;
+            MESSAGE_SUMMARY *reallocated = realloc(summaries, next_capacity * sizeof(MESSAGE_SUMMARY));
+            if (unlikely(reallocated == NULL))
+            {
+                PSE("Failed to allocate the filtered summaries of [%s]", username);
+                pthread_mutex_unlock(&cache->lock);
+                free(summaries);
+                return SYSCALL_ERROR;
+            }
+            summaries = reallocated;
+            capacity = next_capacity;
+        }
+        memset(&summaries[count], 0, sizeof(MESSAGE_SUMMARY)); // Sent as is, padding included
+        header_cache_fill_summary(&summaries[count++], entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!was_loaded)
+    {
+        header_cache_evict(cache);
+    }
+    *out_summaries = summaries;
+    *out_count = count;
+    return NO_ERROR;
+}
+
+ERROR_CODE header_cache_summaries_for_ids(const char *username, const message_id_t *ids, size_t id_count, MESSAGE_SUMMARY *out_summaries, size_t *out_count)
+{
+    if (unlikely(username == NULL || (id_count != 0 && (ids == NULL || out_summaries == NULL)) || out_count == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    *out_count = 0;
+    USER_HEADER_CACHE *cache = header_cache_get(username, 1);
+    if (unlikely(cache == NULL))
+    {
+        return SYSCALL_ERROR;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int was_loaded = cache->loaded;
+    ERROR_CODE result = header_cache_ensure_loaded(cache);
+    if (unlikely(result != NO_ERROR))
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return result;
+    }
+    atomic_store(&cache->last_listed, atomic_fetch_add(&header_cache_clock, 1) + 1);
+    size_t count = 0;
+    for (size_t i = 0; i < id_count; i++)
+    {
+        size_t low = header_cache_lower_bound(cache, ids[i]);
+        if (low < cache->entries_used && cache->entries[low].id == ids[i])
+        {
+            header_cache_fill_summary(&out_summaries[count++], &cache->entries[low]);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!was_loaded)
+    {
+        header_cache_evict(cache);
+    }
+    *out_count = count;
+    return NO_ERROR;
+}
+
+void header_cache_message_added(const char *username, const char *filename, const MESSAGE *header)
+{
+    USER_HEADER_CACHE *cache = username == NULL || filename == NULL || header == NULL ? NULL : header_cache_get(username, 0);
+    if (cache == NULL)
+    {
+        return; // Never listed, nothing to keep up to date
+    }
+    pthread_mutex_lock(&cache->lock);
+    // A listing that loaded the cache after the file was renamed in already has it
+    if (cache->loaded && header_cache_find_entry(cache, filename) == cache->entries_used && header_cache_reserve_entry(cache) == NO_ERROR)
+    {
+        // New deliveries have the highest id so this is an append in practice
+        message_id_t id = message_id_from_filename(filename);
+        size_t position = cache->entries_used;
+        while (position > 0 && cache->entries[position - 1].id > id)
+        {
+            position--;
+        }
+        memmove(&cache->entries[position + 1], &cache->entries[position], (cache->entries_used - position) * sizeof(HEADER_CACHE_ENTRY));
+        header_cache_fill_entry(&cache->entries[position], filename, header);
+        cache->entries_used++;
+        atomic_fetch_add(&header_cache_cached_entries, 1);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void header_cache_message_renamed(const char *username, const char *old_filename, const char *new_filename)
+{
+    USER_HEADER_CACHE *cache = username == NULL || old_filename == NULL || new_filename == NULL ? NULL : header_cache_get(username, 0);
+    if (cache == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    size_t index = cache->loaded ? header_cache_find_entry(cache, old_filename) : cache->entries_used;
+    if (index < cache->entries_used)
+    {
+        snprintf(cache->entries[index].filename, sizeof(cache->entries[index].filename), "%s", new_filename); // Same id, the order holds
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void header_cache_message_removed(const char *username, const char *filename)
+{
+    USER_HEADER_CACHE *cache = username == NULL || filename == NULL ? NULL : header_cache_get(username, 0);
+    if (cache == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    size_t index = cache->loaded ? header_cache_find_entry(cache, filename) : cache->entries_used;
+    if (index < cache->entries_used)
+    {
+        memmove(&cache->entries[index], &cache->entries[index + 1], (cache->entries_used - index - 1) * sizeof(HEADER_CACHE_ENTRY));
+        cache->entries_used--;
+        atomic_fetch_sub(&header_cache_cached_entries, 1);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,82 @@
+/**
+ * @file 8-Server-Header-Cache.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the in-memory cache of message headers that serves REQUEST_LIST_MESSAGE_SUMMARIES
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include "4-Server-Storage.h"
+#include "10-Server-Substring-Filter.h"
+#include <stddef.h> // size_t
+
+/**
+ * The headers of a mailbox (sender, subject, body length) are read the first time its owner asks for the summaries:
+ * one walk of the user folder and one read of offsetof(MESSAGE, message) bytes per file, bodies are never touched.
+ * From then on the workers keep the cache up to date (deliveries, reads, deletes, expiry), so the next listings are served
+ * from memory only. Mailboxes nobody listed are not cached at all and their hooks cost a table lookup.
+ *
+ * Configuration (environment variable):
+ *  - PGM_HEADER_CACHE_MAX_ENTRIES   headers kept in memory for all users together (default HEADER_CACHE_DEFAULT_MAX_ENTRIES),
+ *                                   past it the least recently listed mailboxes are dropped and read again when needed
+ */
+
+enum header_cache_constants {
+    HEADER_CACHE_DEFAULT_MAX_ENTRIES = 100000, // ~300 bytes each
+    HEADER_CACHE_TABLE_INITIAL_CAPACITY = 64,  // Slots of the username -> cache table, always a power of two
+};
+
+/**
+ * @brief Reads the configuration, must be called once before any worker thread starts
+ */
+extern ERROR_CODE header_cache_init(void);
+
+/**
+ * @brief Frees every cached mailbox, only to be called once every worker thread has been joined
+ */
+extern void header_cache_shutdown(void);
+
+/**
+ * @brief Builds the summaries of the mailbox of @p username, newest first, ready to be sent (network byte order)
+ * @param only_unread 1 to skip the messages already read
+ * @param out_summaries receives a heap allocated array (to be freed by the caller), NULL if the mailbox is empty
+ * @return NO_ERROR on success, SYSCALL_ERROR if the user folder cannot be read or memory runs out
+ */
+extern ERROR_CODE header_cache_list(const char *username, int only_unread, MESSAGE_SUMMARY **out_summaries, size_t *out_count);
+
+/**
+ * @brief Builds the summaries of the messages of @p username whose sender and subject contain the needles, newest first (network byte order)
+ * @param sender_needle NULL to accept any sender
+ * @param subject_needle NULL to accept any subject
+ * @param out_summaries receives a heap allocated array (to be freed by the caller), NULL if nothing matches
+ * @return NO_ERROR on success, SYSCALL_ERROR if the user folder cannot be read or memory runs out
+ */
+extern ERROR_CODE header_cache_filter(const char *username, const SUBSTRING_NEEDLE *sender_needle, const SUBSTRING_NEEDLE *subject_needle, MESSAGE_SUMMARY **out_summaries, size_t *out_count);
+
+/**
+ * @brief Builds the summaries of the messages @p ids of @p username, in the same order, ready to be sent (network byte order)
+ * @param out_summaries room for @p id_count summaries, ids that are not in the mailbox anymore are skipped
+ * @param out_count receives the summaries written
+ * @return NO_ERROR on success, SYSCALL_ERROR if the user folder cannot be read or memory runs out
+ */
+extern ERROR_CODE header_cache_summaries_for_ids(const char *username, const message_id_t *ids, size_t id_count, MESSAGE_SUMMARY *out_summaries, size_t *out_count);
+
+/**
+ * @brief A message was stored as @p filename with @p header (message_length in network byte order)
+ */
+extern void header_cache_message_added(const char *username, const char *filename, const MESSAGE *header);
+
+/**
+ * @brief Message @p old_filename was renamed @p new_filename (marked as read)
+ */
+extern void header_cache_message_renamed(const char *username, const char *old_filename, const char *new_filename);
+
+/**
+ * @brief Message @p filename is gone (deleted by its owner or expired)
+ */
+extern void header_cache_message_removed(const char *username, const char *filename);
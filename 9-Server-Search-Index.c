@@ -0,0 +1,1488 @@
+/**
+ * @file 9-Server-Search-Index.c
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .c file for the per-user full-text search index (inverted index over subject and body) that serves REQUEST_SEARCH_MESSAGES
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#define _GNU_SOURCE     // Same as 1-Server.c, must be defined before any other inclusion
+#include "1-Server.h"
+#include "4-Server-Storage.h"
+#include "9-Server-Search-Index.h"
+#include "14-Server-Storage-Engine.h"
+#include "16-Server-Directory-Cache.h"
+#include <stdio.h>      // snprintf, fopen, fdopen, fread, fclose, renameat
+#include <stdlib.h>     // calloc, realloc, malloc, free, qsort, getenv
+#include <string.h>     // strcmp, strcasecmp, strlen, memmove, memcpy, memset
+#include <stddef.h>     // offsetof
+#include <unistd.h>     // write, close, unlink, unlinkat, fsync
+#include <fcntl.h>      // open, openat
+#include <math.h>       // log
+#include <arpa/inet.h>  // ntohl
+#include <pthread.h>    // pthread_mutex_t
+#include <stdatomic.h>  // atomic_size_t, atomic_uint_fast64_t
+
+const char *search_index_filename = ".SEARCH.idx";
+static const char *search_index_temp_filename = ".SEARCH.idx.tmp";
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              TOKENIZER                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct SEARCH_TOKEN {
+    char term[SEARCH_MAX_TERM_CHARS + 1];
+    uint32_t frequency;
+} SEARCH_TOKEN;
+
+typedef struct SEARCH_TOKEN_LIST {
+    SEARCH_TOKEN *tokens;
+    size_t used;
+    size_t capacity;
+} SEARCH_TOKEN_LIST;
+
+static int is_term_byte(unsigned char c)
+{
+    // Not isalnum(): the locale must not change what a word is, and UTF-8 letters are kept as they are
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/**
+ * @brief Appends the words of @p length bytes of @p text to @p list, each with frequency @p weight (duplicates are merged later)
+ */
+static ERROR_CODE search_tokenize(const char *text, size_t length, uint32_t weight, SEARCH_TOKEN_LIST *list)
+{
+    size_t i = 0;
+    while (i < length && text[i] != '\0')
+    {
+        if (!is_term_byte((unsigned char)text[i]))
+        {
+            i++;
+            continue;
+        }
+        size_t term_length = 0;
+        char term[SEARCH_MAX_TERM_CHARS + 1];
+        for (; i < length && text[i] != '\0' && is_term_byte((unsigned char)text[i]); i++)
+        {
+            if (term_length < SEARCH_MAX_TERM_CHARS)
+            {
+                char c = text[i];
+                term[term_length++] = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+            }
+        }
+        if (term_length < SEARCH_MIN_TERM_CHARS)
+        {
+            continue;
+        }
+        term[term_length] = '\0';
+        if (list->used == list->capacity)
+        {
+            size_t next_capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+            SEARCH_TOKEN *reallocated = realloc(list->tokens, next_capacity * sizeof(SEARCH_TOKEN));
+            if (unlikely(reallocated == NULL))
+            {
+                PSE("Failed to grow the search token list");
+                return SYSCALL_ERROR;
+            }
+            list->tokens = reallocated;
+            list->capacity = next_capacity;
+        }
+        memcpy(list->tokens[list->used].term, term, term_length + 1);
+        list->tokens[list->used].frequency = weight;
+        list->used++;
+    }
+    return NO_ERROR;
+}
+
+static int compare_tokens_by_term(const void *a, const void *b)
+{
+    return strcmp(((const SEARCH_TOKEN *)a)->term, ((const SEARCH_TOKEN *)b)->term);
+}
+
+/**
+ * @brief Sorts the tokens and merges the duplicates, summing their frequencies
+ */
+static void search_merge_tokens(SEARCH_TOKEN_LIST *list)
+{
+    if (list->used < 2)
+    {
+        return;
+    }
+    qsort(list->tokens, list->used, sizeof(SEARCH_TOKEN), compare_tokens_by_term);
+    size_t unique = 0;
+    for (size_t i = 1; i < list->used; i++)
+    {
+        if (strcmp(list->tokens[unique].term, list->tokens[i].term) == 0)
+        {
+            list->tokens[unique].frequency += list->tokens[i].frequency;
+        }
+        else
+        {
+            list->tokens[++unique] = list->tokens[i];
+        }
+    }
+    list->used = unique + 1;
+}
+
+/**
+ * @brief Builds the payload of the SEARCH_INDEX_ADD record of a message: [uint8_t length][term][uint16_t frequency]...
+ * @param out_payload receives a heap allocated buffer (to be freed by the caller), NULL if the message has no word
+ */
+static ERROR_CODE search_build_payload(const MESSAGE *header, const char *body, uint32_t body_length, char **out_payload, uint32_t *out_payload_bytes)
+{
+    *out_payload = NULL;
+    *out_payload_bytes = 0;
+    SEARCH_TOKEN_LIST list = {0};
+    // The subject describes the whole message: its words weigh twice as much as the ones of the body
+    if (unlikely(search_tokenize(header->subject, sizeof(header->subject), 2, &list) != NO_ERROR ||
+                 search_tokenize(body, body_length, 1, &list) != NO_ERROR))
+    {
+        free(list.tokens);
+        return SYSCALL_ERROR;
+    }
+    search_merge_tokens(&list);
+    if (list.used == 0)
+    {
+        free(list.tokens);
+        return NO_ERROR;
+    }
+
+    char *payload = malloc(SEARCH_INDEX_MAX_PAYLOAD_BYTES);
+    if (unlikely(payload == NULL))
+    {
+        PSE("Failed to allocate a search index record");
+        free(list.tokens);
+        return SYSCALL_ERROR;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < list.used; i++)
+    {
+        uint8_t term_length = (uint8_t)strlen(list.tokens[i].term);
+        uint16_t frequency = list.tokens[i].frequency > UINT16_MAX ? UINT16_MAX : (uint16_t)list.tokens[i].frequency;
+        if (used + 1 + term_length + sizeof(frequency) > SEARCH_INDEX_MAX_PAYLOAD_BYTES)
+        {
+            break; // Never with MESSAGE_SIZE_CHARS bodies, the words past the limit are simply not searchable
+        }
+        payload[used++] = (char)term_length;
+        memcpy(payload + used, list.tokens[i].term, term_length);
+        used += term_length;
+        memcpy(payload + used, &frequency, sizeof(frequency));
+        used += sizeof(frequency);
+    }
+    free(list.tokens);
+    *out_payload = payload;
+    *out_payload_bytes = (uint32_t)used;
+    return NO_ERROR;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              USER INDEXES                                                     */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct SEARCH_POSTING {
+    message_id_t id;
+    uint32_t frequency;
+} SEARCH_POSTING;
+
+typedef struct SEARCH_TERM {
+    char term[SEARCH_MAX_TERM_CHARS + 1]; // Empty slot when term[0] == '\0'
+    SEARCH_POSTING *postings;             // Ordered by id, may still hold dead documents until the next purge
+    size_t postings_used;
+    size_t postings_capacity;
+} SEARCH_TERM;
+
+typedef struct SEARCH_DOCUMENT {
+    message_id_t id;
+    uint32_t length;  // Sum of the frequencies of its words, for the BM25 length normalization
+    uint8_t live;     // 0 once removed, the postings are purged later
+    uint8_t seen;     // Scratch flag of the reconciliation with the user folder
+} SEARCH_DOCUMENT;
+
+typedef struct USER_SEARCH_INDEX {
+    pthread_mutex_t lock;                 // Protects everything below and the appends to the index log of the user
+    char username[USERNAME_SIZE_CHARS];
+    int loaded;                           // 0 until the first search and again after an eviction
+    atomic_uint_fast64_t last_searched;   // search_index_clock at the last search, 0 when not loaded. Read by the eviction without the lock
+    SEARCH_TERM *terms;                   // Open addressing table, word -> postings
+    size_t terms_capacity;
+    size_t terms_used;
+    SEARCH_DOCUMENT *documents;           // Ordered by id up to documents_sorted, the rest are appends of a load in progress
+    size_t documents_used;
+    size_t documents_sorted;
+    size_t documents_capacity;
+    size_t live_documents;
+    uint64_t live_length;                 // Sum of the lengths of the live documents
+    size_t postings;                      // All terms together, dead documents included
+} USER_SEARCH_INDEX;
+
+// CONFIGURATION, written once by search_index_init()
+static int search_index_on = 1;
+static long search_index_max_postings = SEARCH_INDEX_DEFAULT_MAX_POSTINGS;
+
+// USERNAME -> INDEX TABLE, protected by search_index_table_lock. Indexes are never removed before search_index_shutdown(), only emptied
+static pthread_mutex_t search_index_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static USER_SEARCH_INDEX **search_index_table = NULL;
+static size_t search_index_table_capacity = 0;
+static size_t search_index_table_count = 0;
+
+static atomic_size_t search_index_loaded_postings = 0; // All users together, checked against search_index_max_postings
+static atomic_uint_fast64_t search_index_clock = 0;    // Ticks at every search, orders the indexes for the eviction
+
+static uint64_t fnv1a_64(const char *text)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint32_t fnv1a_32(const void *data, size_t length, uint32_t hash)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t search_record_checksum(const SEARCH_INDEX_RECORD_HEADER *record, const char *payload)
+{
+    uint32_t hash = fnv1a_32(record, offsetof(SEARCH_INDEX_RECORD_HEADER, checksum), 2166136261u);
+    return fnv1a_32(payload, record->payload_bytes, hash);
+}
+
+static size_t search_index_find_slot(USER_SEARCH_INDEX **table, size_t capacity, const char *username)
+{
+    size_t mask = capacity - 1;
+    size_t index = (size_t)fnv1a_64(username) & mask;
+    while (table[index] != NULL && strcmp(table[index]->username, username) != 0)
+    {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+/**
+ * @brief Returns the index of @p username, creating it (not loaded yet) if needed
+ * @return the index, NULL if memory runs out
+ */
+static USER_SEARCH_INDEX *search_index_get(const char *username)
+{
+    pthread_mutex_lock(&search_index_table_lock);
+    if ((search_index_table_count + 1) * 10 > search_index_table_capacity * 7) // Keep the load under 70%
+    {
+        size_t next_capacity = search_index_table_capacity == 0 ? SEARCH_INDEX_TABLE_INITIAL_CAPACITY : search_index_table_capacity * 2;
+        USER_SEARCH_INDEX **next_table = calloc(next_capacity, sizeof(USER_SEARCH_INDEX *));
+        if (unlikely(next_table == NULL))
+        {
+            PSE("Failed to allocate the search index table");
+            pthread_mutex_unlock(&search_index_table_lock);
+            return NULL;
+        }
+        for (size_t i = 0; i < search_index_table_capacity; i++)
+        {
+            if (search_index_table[i] != NULL)
+            {
+                next_table[search_index_find_slot(next_table, next_capacity, search_index_table[i]->username)] = search_index_table[i];
+            }
+        }
+        free(search_index_table);
+        search_index_table = next_table;
+        search_index_table_capacity = next_capacity;
+    }
+
+    size_t slot = search_index_find_slot(search_index_table, search_index_table_capacity, username);
+    USER_SEARCH_INDEX *index = search_index_table[slot];
+    if (index == NULL)
+    {
+        index = calloc(1, sizeof(USER_SEARCH_INDEX));
+        if (unlikely(index == NULL))
+        {
+            PSE("Failed to allocate the search index of [%s]", username);
+            pthread_mutex_unlock(&search_index_table_lock);
+            return NULL;
+        }
+        pthread_mutex_init(&index->lock, NULL);
+        snprintf(index->username, sizeof(index->username), "%s", username);
+        search_index_table[slot] = index;
+        search_index_table_count++;
+    }
+    pthread_mutex_unlock(&search_index_table_lock);
+    return index;
+}
+
+/**
+ * @brief Slot of @p term in a terms table (the empty slot where it would go if it is missing)
+ */
+static size_t search_find_term_slot(const SEARCH_TERM *terms, size_t capacity, const char *term)
+{
+    size_t mask = capacity - 1;
+    size_t slot = (size_t)fnv1a_64(term) & mask;
+    while (terms[slot].term[0] != '\0' && strcmp(terms[slot].term, term) != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * @return the postings of @p term, NULL if no document ever had it
+ * @note Caller holds the index lock
+ */
+static SEARCH_TERM *search_lookup_term(const USER_SEARCH_INDEX *index, const char *term)
+{
+    if (index->terms_capacity == 0)
+    {
+        return NULL;
+    }
+    SEARCH_TERM *found = &index->terms[search_find_term_slot(index->terms, index->terms_capacity, term)];
+    return found->term[0] == '\0' ? NULL : found;
+}
+
+/**
+ * @return the postings of @p term, created empty if needed. NULL if memory runs out
+ * @note Caller holds the index lock
+ */
+static SEARCH_TERM *search_intern_term(USER_SEARCH_INDEX *index, const char *term)
+{
+    if ((index->terms_used + 1) * 10 > index->terms_capacity * 7)
+    {
+        size_t next_capacity = index->terms_capacity == 0 ? SEARCH_INDEX_TERMS_INITIAL_CAPACITY : index->terms_capacity * 2;
+        SEARCH_TERM *next_terms = calloc(next_capacity, sizeof(SEARCH_TERM));
+        if (unlikely(next_terms == NULL))
+        {
+            PSE("Failed to grow the search index of [%s]", index->username);
+            return NULL;
+        }
+        for (size_t i = 0; i < index->terms_capacity; i++)
+        {
+            if (index->terms[i].term[0] != '\0')
+            {
+                next_terms[search_find_term_slot(next_terms, next_capacity, index->terms[i].term)] = index->terms[i];
+            }
+        }
+        free(index->terms);
+        index->terms = next_terms;
+        index->terms_capacity = next_capacity;
+    }
+    SEARCH_TERM *found = &index->terms[search_find_term_slot(index->terms, index->terms_capacity, term)];
+    if (found->term[0] == '\0')
+    {
+        snprintf(found->term, sizeof(found->term), "%s", term);
+        index->terms_used++;
+    }
+    return found;
+}
+
+/**
+ * @brief Binary search of @p id in the postings from @p low on
+ * @return index of the first posting with an id >= @p id
+ */
+static size_t search_lower_bound(const SEARCH_POSTING *postings, size_t low, size_t high, message_id_t id)
+{
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (postings[middle].id < id)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @return the document @p id (live or not), NULL if it is not indexed
+ * @note Caller holds the index lock. Documents appended by a load in progress are not found until search_sort_documents()
+ */
+static SEARCH_DOCUMENT *search_lookup_document(const USER_SEARCH_INDEX *index, message_id_t id)
+{
+    size_t low = 0;
+    size_t high = index->documents_sorted;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (index->documents[middle].id < id)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low < index->documents_sorted && index->documents[low].id == id ? &index->documents[low] : NULL;
+}
+
+static int search_payload_next(const char *payload, uint32_t payload_bytes, size_t *offset, char *term, uint16_t *frequency)
+{
+    if (*offset + 1 > payload_bytes)
+    {
+        return 0;
+    }
+    size_t term_length = (unsigned char)payload[*offset];
+    if (term_length == 0 || term_length > SEARCH_MAX_TERM_CHARS || *offset + 1 + term_length + sizeof(*frequency) > payload_bytes)
+    {
+        return 0;
+    }
+    memcpy(term, payload + *offset + 1, term_length);
+    term[term_length] = '\0';
+    memcpy(frequency, payload + *offset + 1 + term_length, sizeof(*frequency));
+    *offset += 1 + term_length + sizeof(*frequency);
+    return 1;
+}
+
+/**
+ * @brief Adds the document @p id with the words of an ADD record payload, nothing happens if it is already indexed
+ *
+ * Once loaded the document and its postings are inserted in order (new deliveries have the highest id, so in practice it is an append).
+ * While loading, the log and the folder come in any order: everything is appended and search_sort_documents() sorts it once at the end,
+ * inserting in order there would cost a memmove per document.
+ * @note Caller holds the index lock
+ */
+static ERROR_CODE search_add_document(USER_SEARCH_INDEX *index, message_id_t id, const char *payload, uint32_t payload_bytes)
+{
+    SEARCH_DOCUMENT *existing = search_lookup_document(index, id);
+    if (existing != NULL)
+    {
+        existing->seen = 1;
+        return NO_ERROR; // Indexed twice (log replay racing with a delivery), the first copy wins
+    }
+    if (index->documents_used == index->documents_capacity)
+    {
+        size_t next_capacity = index->documents_capacity == 0 ? 64 : index->documents_capacity * 2;
+        SEARCH_DOCUMENT *reallocated = realloc(index->documents, next_capacity * sizeof(SEARCH_DOCUMENT));
+        if (unlikely(reallocated == NULL))
+        {
+            PSE("Failed to grow the search documents of [%s]", index->username);
+            return SYSCALL_ERROR;
+        }
+        index->documents = reallocated;
+        index->documents_capacity = next_capacity;
+    }
+
+    uint32_t length = 0;
+    size_t added = 0;
+    size_t offset = 0;
+    char term[SEARCH_MAX_TERM_CHARS + 1];
+    uint16_t frequency = 0;
+    while (search_payload_next(payload, payload_bytes, &offset, term, &frequency))
+    {
+        SEARCH_TERM *entry = search_intern_term(index, term);
+        if (unlikely(entry == NULL))
+        {
+            return SYSCALL_ERROR; // The postings already added point to a document that does not exist, queries skip them
+        }
+        if (entry->postings_used == entry->postings_capacity)
+        {
+            size_t next_capacity = entry->postings_capacity == 0 ? 4 : entry->postings_capacity * 2;
+            SEARCH_POSTING *reallocated = realloc(entry->postings, next_capacity * sizeof(SEARCH_POSTING));
+            if (unlikely(reallocated == NULL))
+            {
+                PSE("Failed to grow the postings of [%s]", index->username);
+                return SYSCALL_ERROR;
+            }
+            entry->postings = reallocated;
+            entry->postings_capacity = next_capacity;
+        }
+        size_t slot = entry->postings_used;
+        while (index->loaded && slot > 0 && entry->postings[slot - 1].id > id)
+        {
+            slot--;
+        }
+        memmove(&entry->postings[slot + 1], &entry->postings[slot], (entry->postings_used - slot) * sizeof(SEARCH_POSTING));
+        entry->postings[slot].id = id;
+        entry->postings[slot].frequency = frequency;
+        entry->postings_used++;
+        index->postings++;
+        added++;
+        length += frequency;
+    }
+    if (index->loaded)
+    {
+        atomic_fetch_add(&search_index_loaded_postings, added);
+    }
+
+    size_t position = index->documents_used;
+    while (index->loaded && position > 0 && index->documents[position - 1].id > id)
+    {
+        position--;
+    }
+    memmove(&index->documents[position + 1], &index->documents[position], (index->documents_used - position) * sizeof(SEARCH_DOCUMENT));
+    index->documents[position] = (SEARCH_DOCUMENT){.id = id, .length = length, .live = 1, .seen = 1};
+    index->documents_used++;
+    if (index->loaded)
+    {
+        index->documents_sorted = index->documents_used;
+    }
+    index->live_documents++;
+    index->live_length += length;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Marks the document @p id as removed
+ * @return 1 if it was live
+ * @note Caller holds the index lock
+ */
+static int search_remove_document(USER_SEARCH_INDEX *index, message_id_t id)
+{
+    SEARCH_DOCUMENT *document = search_lookup_document(index, id);
+    if (document == NULL || !document->live)
+    {
+        return 0;
+    }
+    document->live = 0;
+    index->live_documents--;
+    index->live_length -= document->length;
+    return 1;
+}
+
+static int compare_documents_by_id(const void *a, const void *b)
+{
+    const SEARCH_DOCUMENT *document_a = (const SEARCH_DOCUMENT *)a;
+    const SEARCH_DOCUMENT *document_b = (const SEARCH_DOCUMENT *)b;
+    return (document_a->id > document_b->id) - (document_a->id < document_b->id);
+}
+
+static int compare_postings_by_id(const void *a, const void *b)
+{
+    const SEARCH_POSTING *posting_a = (const SEARCH_POSTING *)a;
+    const SEARCH_POSTING *posting_b = (const SEARCH_POSTING *)b;
+    return (posting_a->id > posting_b->id) - (posting_a->id < posting_b->id);
+}
+
+/**
+ * @brief Sorts what a load appended (documents and postings) and drops the duplicates a replay may hold
+ * @note Caller holds the index lock
+ */
+static void search_sort_documents(USER_SEARCH_INDEX *index)
+{
+    if (index->documents_sorted == index->documents_used)
+    {
+        return;
+    }
+    qsort(index->documents, index->documents_used, sizeof(SEARCH_DOCUMENT), compare_documents_by_id);
+    size_t kept = 0;
+    for (size_t i = 0; i < index->documents_used; i++)
+    {
+        if (kept > 0 && index->documents[kept - 1].id == index->documents[i].id)
+        {
+            index->documents[kept - 1].seen |= index->documents[i].seen;
+            if (index->documents[i].live)
+            {
+                index->live_documents--;
+                index->live_length -= index->documents[i].length;
+            }
+            continue;
+        }
+        index->documents[kept++] = index->documents[i];
+    }
+    index->documents_used = kept;
+    index->documents_sorted = kept;
+
+    for (size_t i = 0; i < index->terms_capacity; i++)
+    {
+        SEARCH_TERM *entry = &index->terms[i];
+        int ordered = 1;
+        for (size_t j = 1; ordered && j < entry->postings_used; j++)
+        {
+            ordered = entry->postings[j - 1].id < entry->postings[j].id;
+        }
+        if (ordered)
+        {
+            continue;
+        }
+        qsort(entry->postings, entry->postings_used, sizeof(SEARCH_POSTING), compare_postings_by_id);
+        size_t unique = 0;
+        for (size_t j = 0; j < entry->postings_used; j++)
+        {
+            if (unique == 0 || entry->postings[unique - 1].id != entry->postings[j].id)
+            {
+                entry->postings[unique++] = entry->postings[j];
+            }
+        }
+        index->postings -= entry->postings_used - unique;
+        entry->postings_used = unique;
+    }
+}
+
+/**
+ * @brief Drops the postings and documents of removed messages once they are as many as the live ones
+ * @note Caller holds the index lock
+ */
+static void search_purge_dead_documents(USER_SEARCH_INDEX *index)
+{
+    size_t dead = index->documents_used - index->live_documents;
+    if (dead < 1024 || dead < index->live_documents)
+    {
+        return;
+    }
+    size_t postings_before = index->postings;
+    for (size_t i = 0; i < index->terms_capacity; i++)
+    {
+        SEARCH_TERM *entry = &index->terms[i];
+        size_t kept = 0;
+        for (size_t j = 0; j < entry->postings_used; j++)
+        {
+            const SEARCH_DOCUMENT *document = search_lookup_document(index, entry->postings[j].id);
+            if (document != NULL && document->live)
+            {
+                entry->postings[kept++] = entry->postings[j];
+            }
+        }
+        index->postings -= entry->postings_used - kept;
+        entry->postings_used = kept; // Empty terms keep their slot, the open addressing table has no tombstones
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < index->documents_used; i++)
+    {
+        if (index->documents[i].live)
+        {
+            index->documents[kept++] = index->documents[i];
+        }
+    }
+    index->documents_used = kept;
+    index->documents_sorted = kept;
+    if (index->loaded)
+    {
+        atomic_fetch_sub(&search_index_loaded_postings, postings_before - index->postings);
+    }
+}
+
+/**
+ * @brief Drops everything of a loaded index, the next search replays the log again
+ * @note Caller holds the index lock
+ */
+static void search_index_unload(USER_SEARCH_INDEX *index)
+{
+    if (index->loaded)
+    {
+        atomic_fetch_sub(&search_index_loaded_postings, index->postings);
+    }
+    for (size_t i = 0; i < index->terms_capacity; i++)
+    {
+        free(index->terms[i].postings);
+    }
+    free(index->terms);
+    free(index->documents);
+    index->terms = NULL;
+    index->terms_capacity = 0;
+    index->terms_used = 0;
+    index->documents = NULL;
+    index->documents_used = 0;
+    index->documents_sorted = 0;
+    index->documents_capacity = 0;
+    index->live_documents = 0;
+    index->live_length = 0;
+    index->postings = 0;
+    index->loaded = 0;
+    atomic_store(&index->last_searched, 0);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              INDEX LOG                                                        */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/**
+ * The log is derived data: it is never synced, a record lost in a crash is put back by the reconciliation of the next load.
+ */
+
+/**
+ * @return heap allocated "<user folder>/<name>" (to be freed by the caller), NULL if memory runs out
+ * @note For the offline rebuild, which runs without the directory cache. The server resolves the log against the cached folder fd
+ */
+static char *search_index_path(const char *username, const char *name)
+{
+    char *user_directory = storage_user_directory_path(username);
+    if (unlikely(user_directory == NULL))
+    {
+        return NULL;
+    }
+    size_t size = strlen(user_directory) + 1 + strlen(name) + 1;
+    char *path = malloc(size);
+    if (likely(path != NULL))
+    {
+        snprintf(path, size, "%s/%s", user_directory, name);
+    }
+    free(user_directory);
+    return path;
+}
+
+/**
+ * @brief fdopen() of the file @p name of an acquired user folder, opened with openat() (@p flags, mode 0600 when created)
+ * @return NULL with errno set on failure
+ */
+static FILE *search_log_open_at(const USER_DIRECTORY *directory, const char *name, int flags, const char *mode)
+{
+    int fd = openat(directory->fd, name, flags | O_CLOEXEC, 0600);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, mode);
+    if (file == NULL && fd >= 0)
+    {
+        close(fd);
+    }
+    return file;
+}
+
+/**
+ * @brief search_log_open_at() for @p username, the folder is only held while opening: the FILE keeps its own fd
+ */
+static FILE *search_log_open(const char *username, const char *name, int flags, const char *mode)
+{
+    USER_DIRECTORY *directory = user_directory_acquire(username);
+    if (directory == NULL)
+    {
+        return NULL;
+    }
+    FILE *file = search_log_open_at(directory, name, flags, mode);
+    user_directory_release(directory);
+    return file;
+}
+
+/**
+ * @brief Appends one record with a single write() (O_APPEND), so a torn tail is detected by the checksum and ignored
+ * @note Caller holds the index lock of the user. Without a persistent storage engine there is no log: the index lives in memory only
+ */
+static ERROR_CODE search_log_append(const char *username, SEARCH_INDEX_RECORD_TYPE type, message_id_t id, const char *payload, uint32_t payload_bytes)
+{
+    if (!storage_engine->persistent)
+    {
+        return NO_ERROR;
+    }
+    USER_DIRECTORY *directory = user_directory_acquire(username);
+    char *record = malloc(sizeof(SEARCH_INDEX_RECORD_HEADER) + payload_bytes);
+    if (unlikely(directory == NULL || record == NULL))
+    {
+        PSE("Failed to prepare a search index record of [%s]", username);
+        user_directory_release(directory);
+        free(record);
+        return SYSCALL_ERROR;
+    }
+    SEARCH_INDEX_RECORD_HEADER header;
+    memset(&header, 0, sizeof(header)); // Padding included, the checksum covers raw bytes
+    header.magic = SEARCH_INDEX_MAGIC;
+    header.type = type;
+    header.message_id = id;
+    header.payload_bytes = payload_bytes;
+    header.checksum = search_record_checksum(&header, payload);
+    memcpy(record, &header, sizeof(header));
+    if (payload_bytes > 0)
+    {
+        memcpy(record + sizeof(header), payload, payload_bytes);
+    }
+
+    ERROR_CODE result = NO_ERROR;
+    int fd = openat(directory->fd, search_index_filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    user_directory_release(directory);
+    if (unlikely(fd < 0 || write(fd, record, sizeof(header) + payload_bytes) != (ssize_t)(sizeof(header) + payload_bytes)))
+    {
+        PSE("Failed to append to the search index of [%s]", username);
+        result = SYSCALL_ERROR;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(record);
+    return result;
+}
+
+/**
+ * @brief Reads the next valid record of @p file into @p header and @p payload (SEARCH_INDEX_MAX_PAYLOAD_BYTES bytes)
+ * @return 1 on success, 0 at the end of the log or at the first torn/invalid record (everything after it is ignored)
+ */
+static int search_log_next(FILE *file, SEARCH_INDEX_RECORD_HEADER *header, char *payload)
+{
+    if (fread(header, sizeof(*header), 1, file) != 1 || header->magic != SEARCH_INDEX_MAGIC ||
+        (header->type != SEARCH_INDEX_ADD && header->type != SEARCH_INDEX_REMOVE) || header->payload_bytes > SEARCH_INDEX_MAX_PAYLOAD_BYTES)
+    {
+        return 0;
+    }
+    if (header->payload_bytes > 0 && fread(payload, header->payload_bytes, 1, file) != 1)
+    {
+        return 0;
+    }
+    return header->checksum == search_record_checksum(header, payload);
+}
+
+static ERROR_CODE search_grow_ids(message_id_t **ids, size_t *capacity)
+{
+    size_t next_capacity = *capacity == 0 ? 64 : *capacity * 2;
+    message_id_t *reallocated = realloc(*ids, next_capacity * sizeof(message_id_t));
+    if (unlikely(reallocated == NULL))
+    {
+        PSE("Failed to grow the removed messages of a search index replay");
+        return SYSCALL_ERROR;
+    }
+    *ids = reallocated;
+    *capacity = next_capacity;
+    return NO_ERROR;
+}
+
+/**
+ * @brief Replays the log of the index into memory, sorted once at the end
+ * @param out_records receives the number of records replayed
+ * @note Caller holds the index lock
+ */
+static ERROR_CODE search_log_replay(USER_SEARCH_INDEX *index, char *payload, size_t *out_records)
+{
+    *out_records = 0;
+    if (!storage_engine->persistent)
+    {
+        return NO_ERROR; // No log, the reconciliation indexes the whole mailbox
+    }
+    FILE *file = search_log_open(index->username, search_index_filename, O_RDONLY, "rb");
+    if (file == NULL)
+    {
+        return NO_ERROR; // Never written: the reconciliation indexes the whole folder
+    }
+    ERROR_CODE result = NO_ERROR;
+    // The documents are not sorted (so not found) until the end of the replay: the removes are applied then
+    message_id_t *removed = NULL;
+    size_t removed_used = 0;
+    size_t removed_capacity = 0;
+    SEARCH_INDEX_RECORD_HEADER header;
+    while (result == NO_ERROR && search_log_next(file, &header, payload))
+    {
+        if (header.type == SEARCH_INDEX_ADD)
+        {
+            result = search_add_document(index, header.message_id, payload, header.payload_bytes);
+        }
+        else if (removed_used < removed_capacity || (result = search_grow_ids(&removed, &removed_capacity)) == NO_ERROR)
+        {
+            removed[removed_used++] = header.message_id;
+        }
+        (*out_records)++;
+    }
+    fclose(file);
+    search_sort_documents(index);
+    for (size_t i = 0; result == NO_ERROR && i < removed_used; i++)
+    {
+        search_remove_document(index, removed[i]);
+    }
+    free(removed);
+    return result;
+}
+
+/**
+ * @brief Rewrites the log with the ADD records of the live documents only (temporary file + rename)
+ * @note Caller holds the index lock. A failure is harmless, the old log stays
+ */
+static void search_log_compact(USER_SEARCH_INDEX *index, char *payload)
+{
+    if (!storage_engine->persistent)
+    {
+        return;
+    }
+    USER_DIRECTORY *directory = user_directory_acquire(index->username);
+    if (unlikely(directory == NULL))
+    {
+        return;
+    }
+    FILE *input = search_log_open_at(directory, search_index_filename, O_RDONLY, "rb");
+    FILE *output = search_log_open_at(directory, search_index_temp_filename, O_WRONLY | O_CREAT | O_TRUNC, "wb");
+    int ok = input != NULL && output != NULL;
+    SEARCH_INDEX_RECORD_HEADER header;
+    while (ok && search_log_next(input, &header, payload))
+    {
+        const SEARCH_DOCUMENT *document = search_lookup_document(index, header.message_id);
+        if (header.type != SEARCH_INDEX_ADD || document == NULL || !document->live)
+        {
+            continue;
+        }
+        ok = fwrite(&header, sizeof(header), 1, output) == 1 && (header.payload_bytes == 0 || fwrite(payload, header.payload_bytes, 1, output) == 1);
+    }
+    if (input != NULL)
+    {
+        fclose(input);
+    }
+    if (output != NULL)
+    {
+        ok = fclose(output) == 0 && ok;
+    }
+    if (ok && renameat(directory->fd, search_index_temp_filename, directory->fd, search_index_filename) == 0)
+    {
+        P("Search index: compacted the log of [%s] to %zu messages", index->username, index->live_documents);
+    }
+    else if (output != NULL)
+    {
+        PSE("Search index: failed to compact the log of [%s]", index->username);
+        unlinkat(directory->fd, search_index_temp_filename, 0);
+    }
+    user_directory_release(directory);
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              LOADING AND EVICTION                                             */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct SEARCH_RECONCILE_CONTEXT {
+    USER_SEARCH_INDEX *index;
+    MESSAGE *message;  // Scratch buffer, sizeof(MESSAGE) + MESSAGE_SIZE_CHARS
+    size_t indexed;    // Messages that were missing from the log
+} SEARCH_RECONCILE_CONTEXT;
+
+static ERROR_CODE search_reconcile_message(const char *filename, void *context)
+{
+    SEARCH_RECONCILE_CONTEXT *reconcile = (SEARCH_RECONCILE_CONTEXT *)context;
+    USER_SEARCH_INDEX *index = reconcile->index;
+    message_id_t id = message_id_from_filename(filename);
+    if (id == 0)
+    {
+        return NO_ERROR;
+    }
+    SEARCH_DOCUMENT *document = search_lookup_document(index, id);
+    if (document != NULL)
+    {
+        document->seen = 1;
+        return NO_ERROR;
+    }
+
+    // Missing from the log (crash before the append, or a folder older than the index): read and index it now
+    MESSAGE *message = reconcile->message;
+    ERROR_CODE fetched = storage_engine->fetch(index->username, filename, message, 1);
+    if (fetched == ERROR)
+    {
+        return NO_ERROR; // Deleted in the meantime
+    }
+    if (fetched != NO_ERROR)
+    {
+        P("Search index: skipping bogus message file [%s] of [%s]", filename, index->username);
+        return NO_ERROR;
+    }
+    uint32_t message_length = ntohl(message->message_length);
+
+    char *payload = NULL;
+    uint32_t payload_bytes = 0;
+    if (unlikely(search_build_payload(message, message->message, message_length, &payload, &payload_bytes) != NO_ERROR))
+    {
+        return SYSCALL_ERROR;
+    }
+    ERROR_CODE result = search_add_document(index, id, payload, payload_bytes);
+    if (result == NO_ERROR)
+    {
+        search_log_append(index->username, SEARCH_INDEX_ADD, id, payload, payload_bytes);
+        reconcile->indexed++;
+    }
+    free(payload);
+    return result;
+}
+
+/**
+ * @brief Replays the log, reconciles it with the user folder and compacts it if most of it is dead
+ * @note Caller holds the index lock
+ */
+static ERROR_CODE search_index_ensure_loaded(USER_SEARCH_INDEX *index)
+{
+    if (likely(index->loaded))
+    {
+        return NO_ERROR;
+    }
+    char *payload = malloc(SEARCH_INDEX_MAX_PAYLOAD_BYTES);
+    MESSAGE *message = malloc(sizeof(MESSAGE) + MESSAGE_SIZE_CHARS);
+    if (unlikely(payload == NULL || message == NULL))
+    {
+        PSE("Failed to allocate the search index load of [%s]", index->username);
+        free(payload);
+        free(message);
+        return SYSCALL_ERROR;
+    }
+
+    size_t records = 0;
+    ERROR_CODE result = search_log_replay(index, payload, &records);
+    for (size_t i = 0; i < index->documents_used; i++)
+    {
+        index->documents[i].seen = 0;
+    }
+    SEARCH_RECONCILE_CONTEXT reconcile = {.index = index, .message = message};
+    if (result == NO_ERROR)
+    {
+        result = storage_engine->list(index->username, search_reconcile_message, &reconcile);
+    }
+    search_sort_documents(index);
+    size_t vanished = 0;
+    for (size_t i = 0; result == NO_ERROR && i < index->documents_used; i++)
+    {
+        // In the log but not in the folder: the remove record was lost in a crash
+        if (index->documents[i].live && !index->documents[i].seen && search_remove_document(index, index->documents[i].id))
+        {
+            search_log_append(index->username, SEARCH_INDEX_REMOVE, index->documents[i].id, NULL, 0);
+            vanished++;
+        }
+    }
+    if (unlikely(result != NO_ERROR))
+    {
+        search_index_unload(index); // Start again from scratch next time, the partial state would be wrong
+        free(payload);
+        free(message);
+        return result;
+    }
+
+    if (records + reconcile.indexed + vanished > 2 * index->live_documents + 1024)
+    {
+        search_log_compact(index, payload);
+    }
+    search_purge_dead_documents(index);
+    free(payload);
+    free(message);
+
+    index->loaded = 1;
+    atomic_fetch_add(&search_index_loaded_postings, index->postings);
+    P("Search index: loaded [%s], %zu messages (%zu indexed now, %zu gone), %zu words", index->username,
+      index->live_documents, reconcile.indexed, vanished, index->terms_used);
+    return NO_ERROR;
+}
+
+/**
+ * @brief Drops the least recently searched indexes (never @p keep) until the postings fit in PGM_SEARCH_INDEX_MAX_POSTINGS
+ * @note Caller holds no index lock: the victim is picked under the table lock and emptied under its own lock, never both at once
+ */
+static void search_index_evict(const USER_SEARCH_INDEX *keep)
+{
+    while (atomic_load(&search_index_loaded_postings) > (size_t)search_index_max_postings)
+    {
+        USER_SEARCH_INDEX *victim = NULL;
+        uint_fast64_t victim_searched = 0;
+        pthread_mutex_lock(&search_index_table_lock);
+        for (size_t i = 0; i < search_index_table_capacity; i++)
+        {
+            USER_SEARCH_INDEX *index = search_index_table[i];
+            uint_fast64_t searched = index == NULL ? 0 : atomic_load(&index->last_searched);
+            if (index != NULL && index != keep && searched != 0 && (victim == NULL || searched < victim_searched))
+            {
+                victim = index;
+                victim_searched = searched;
+            }
+        }
+        pthread_mutex_unlock(&search_index_table_lock);
+        if (victim == NULL)
+        {
+            return; // Only the index just searched is left, it stays even if it alone is over the limit
+        }
+        pthread_mutex_lock(&victim->lock);
+        search_index_unload(victim);
+        pthread_mutex_unlock(&victim->lock);
+    }
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              QUERIES                                                          */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+typedef struct SEARCH_MATCH {
+    message_id_t id;
+    double score;
+} SEARCH_MATCH;
+
+static int compare_terms_by_postings(const void *a, const void *b)
+{
+    const SEARCH_TERM *term_a = *(const SEARCH_TERM *const *)a;
+    const SEARCH_TERM *term_b = *(const SEARCH_TERM *const *)b;
+    return (term_a->postings_used > term_b->postings_used) - (term_a->postings_used < term_b->postings_used);
+}
+
+static int compare_matches_by_rank(const void *a, const void *b)
+{
+    const SEARCH_MATCH *match_a = (const SEARCH_MATCH *)a;
+    const SEARCH_MATCH *match_b = (const SEARCH_MATCH *)b;
+    if (match_a->score != match_b->score)
+    {
+        return match_a->score < match_b->score ? 1 : -1; // Best first
+    }
+    return (match_a->id < match_b->id) - (match_a->id > match_b->id); // Then newest first
+}
+
+/**
+ * @brief BM25 weight of one word in one document
+ */
+static double search_bm25(uint32_t frequency, uint32_t document_length, double average_length, double idf)
+{
+    const double k1 = 1.2;
+    const double b = 0.75;
+    double normalization = k1 * (1.0 - b + b * (double)document_length / average_length);
+    return idf * ((double)frequency * (k1 + 1.0)) / ((double)frequency + normalization);
+}
+
+/**
+ * @brief Conjunctive query over the loaded index: walks the shortest postings list and looks the other words up with binary searches
+ * @param out_matches receives a heap allocated array of every live match (to be freed by the caller)
+ * @note Caller holds the index lock
+ */
+static ERROR_CODE search_evaluate(const USER_SEARCH_INDEX *index, SEARCH_TERM **terms, size_t term_count, SEARCH_MATCH **out_matches, size_t *out_count)
+{
+    *out_matches = NULL;
+    *out_count = 0;
+    qsort(terms, term_count, sizeof(SEARCH_TERM *), compare_terms_by_postings);
+    if (terms[0]->postings_used == 0 || index->live_documents == 0)
+    {
+        return NO_ERROR;
+    }
+
+    double idf[SEARCH_MAX_QUERY_TERMS];
+    for (size_t t = 0; t < term_count; t++)
+    {
+        // Document frequencies still count the dead postings until the next purge, close enough for a ranking
+        double document_frequency = (double)terms[t]->postings_used;
+        idf[t] = log(1.0 + ((double)index->live_documents - document_frequency + 0.5) / (document_frequency + 0.5));
+        if (idf[t] < 0.01)
+        {
+            idf[t] = 0.01;
+        }
+    }
+    double average_length = (double)index->live_length / (double)index->live_documents;
+    if (average_length <= 0.0)
+    {
+        average_length = 1.0;
+    }
+
+    SEARCH_MATCH *matches = malloc(terms[0]->postings_used * sizeof(SEARCH_MATCH));
+    if (unlikely(matches == NULL))
+    {
+        PSE("Failed to allocate the search matches of [%s]", index->username);
+        return SYSCALL_ERROR;
+    }
+    size_t cursors[SEARCH_MAX_QUERY_TERMS] = {0};
+    size_t count = 0;
+    for (size_t i = 0; i < terms[0]->postings_used; i++)
+    {
+        const SEARCH_POSTING *candidate = &terms[0]->postings[i];
+        const SEARCH_DOCUMENT *document = search_lookup_document(index, candidate->id);
+        if (document == NULL || !document->live)
+        {
+            continue;
+        }
+        uint32_t document_length = document->length;
+        double score = search_bm25(candidate->frequency, document_length, average_length, idf[0]);
+        int all = 1;
+        for (size_t t = 1; all && t < term_count; t++)
+        {
+            // Candidates come in id order, so every cursor only moves forward
+            cursors[t] = search_lower_bound(terms[t]->postings, cursors[t], terms[t]->postings_used, candidate->id);
+            if (cursors[t] == terms[t]->postings_used || terms[t]->postings[cursors[t]].id != candidate->id)
+            {
+                all = 0;
+            }
+            else
+            {
+                score += search_bm25(terms[t]->postings[cursors[t]].frequency, document_length, average_length, idf[t]);
+            }
+        }
+        if (all)
+        {
+            matches[count].id = candidate->id;
+            matches[count].score = score;
+            count++;
+        }
+    }
+    *out_matches = matches;
+    *out_count = count;
+    return NO_ERROR;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              PUBLIC API                                                       */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+ERROR_CODE search_index_init(void)
+{
+    const char *mode = getenv("PGM_SEARCH_INDEX");
+    search_index_on = mode == NULL || strcasecmp(mode, "off") != 0;
+    search_index_max_postings = read_environment_long("PGM_SEARCH_INDEX_MAX_POSTINGS", SEARCH_INDEX_DEFAULT_MAX_POSTINGS, 1, 1L << 36);
+    if (search_index_on)
+    {
+        P("Search index: on, up to %ld postings in memory", search_index_max_postings);
+    }
+    else
+    {
+        P("Search index: off");
+    }
+    return NO_ERROR;
+}
+
+void search_index_shutdown(void)
+{
+    pthread_mutex_lock(&search_index_table_lock);
+    for (size_t i = 0; i < search_index_table_capacity; i++)
+    {
+        USER_SEARCH_INDEX *index = search_index_table[i];
+        if (index != NULL)
+        {
+            search_index_unload(index);
+            pthread_mutex_destroy(&index->lock);
+            free(index);
+        }
+    }
+    free(search_index_table);
+    search_index_table = NULL;
+    search_index_table_capacity = 0;
+    search_index_table_count = 0;
+    atomic_store(&search_index_loaded_postings, 0);
+    pthread_mutex_unlock(&search_index_table_lock);
+}
+
+int search_index_enabled(void)
+{
+    return search_index_on;
+}
+
+void search_index_message_added(const char *username, const char *filename, const MESSAGE *header, const char *body, uint32_t body_length)
+{
+    message_id_t id = filename == NULL ? 0 : message_id_from_filename(filename);
+    if (!search_index_on || username == NULL || header == NULL || body == NULL || id == 0)
+    {
+        return;
+    }
+    // Tokenized before taking the lock, searches of the recipient only wait for the append
+    char *payload = NULL;
+    uint32_t payload_bytes = 0;
+    if (unlikely(search_build_payload(header, body, body_length, &payload, &payload_bytes) != NO_ERROR))
+    {
+        return; // The reconciliation of the next load indexes it
+    }
+    USER_SEARCH_INDEX *index = search_index_get(username);
+    if (likely(index != NULL))
+    {
+        pthread_mutex_lock(&index->lock);
+        // A load that ran after the file was renamed in already indexed (and logged) it
+        if (!index->loaded || search_lookup_document(index, id) == NULL)
+        {
+            if (search_log_append(username, SEARCH_INDEX_ADD, id, payload, payload_bytes) == NO_ERROR && index->loaded)
+            {
+                search_add_document(index, id, payload, payload_bytes);
+            }
+            else if (index->loaded)
+            {
+                search_index_unload(index); // Memory and log must agree, the next search reconciles from scratch
+            }
+        }
+        pthread_mutex_unlock(&index->lock);
+    }
+    free(payload);
+}
+
+void search_index_message_removed(const char *username, const char *filename)
+{
+    message_id_t id = filename == NULL ? 0 : message_id_from_filename(filename);
+    if (!search_index_on || username == NULL || id == 0)
+    {
+        return;
+    }
+    USER_SEARCH_INDEX *index = search_index_get(username);
+    if (unlikely(index == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&index->lock);
+    search_log_append(username, SEARCH_INDEX_REMOVE, id, NULL, 0); // Lost on failure: the next load sees the file is gone
+    if (index->loaded && search_remove_document(index, id))
+    {
+        search_purge_dead_documents(index);
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+ERROR_CODE search_index_query(const char *username, const char *query, size_t offset, size_t limit, message_id_t **out_ids, size_t *out_count, size_t *out_total)
+{
+    if (unlikely(username == NULL || query == NULL || out_ids == NULL || out_count == NULL || out_total == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    *out_ids = NULL;
+    *out_count = 0;
+    *out_total = 0;
+    if (!search_index_on)
+    {
+        return ERROR;
+    }
+
+    SEARCH_TOKEN_LIST words = {0};
+    if (unlikely(search_tokenize(query, strlen(query), 1, &words) != NO_ERROR))
+    {
+        free(words.tokens);
+        return SYSCALL_ERROR;
+    }
+    search_merge_tokens(&words);
+    if (words.used == 0)
+    {
+        free(words.tokens);
+        return STRING_SIZE_INVALID;
+    }
+    size_t term_count = words.used > SEARCH_MAX_QUERY_TERMS ? SEARCH_MAX_QUERY_TERMS : words.used;
+
+    USER_SEARCH_INDEX *index = search_index_get(username);
+    if (unlikely(index == NULL))
+    {
+        free(words.tokens);
+        return SYSCALL_ERROR;
+    }
+    pthread_mutex_lock(&index->lock);
+    int was_loaded = index->loaded;
+    ERROR_CODE result = search_index_ensure_loaded(index);
+    if (unlikely(result != NO_ERROR))
+    {
+        pthread_mutex_unlock(&index->lock);
+        free(words.tokens);
+        return result;
+    }
+    atomic_store(&index->last_searched, atomic_fetch_add(&search_index_clock, 1) + 1);
+
+    SEARCH_TERM *terms[SEARCH_MAX_QUERY_TERMS];
+    int missing = 0;
+    for (size_t t = 0; t < term_count; t++)
+    {
+        terms[t] = search_lookup_term(index, words.tokens[t].term);
+        missing |= terms[t] == NULL;
+    }
+    free(words.tokens);
+    SEARCH_MATCH *matches = NULL;
+    size_t match_count = 0;
+    if (!missing)
+    {
+        result = search_evaluate(index, terms, term_count, &matches, &match_count);
+    }
+    pthread_mutex_unlock(&index->lock);
+    if (!was_loaded)
+    {
+        search_index_evict(index);
+    }
+    if (unlikely(result != NO_ERROR))
+    {
+        return result;
+    }
+
+    size_t returned = offset >= match_count ? 0 : (match_count - offset < limit ? match_count - offset : limit);
+    message_id_t *ids = returned == 0 ? NULL : malloc(returned * sizeof(message_id_t));
+    if (unlikely(returned != 0 && ids == NULL))
+    {
+        PSE("Failed to allocate the search results of [%s]", username);
+        free(matches);
+        return SYSCALL_ERROR;
+    }
+    if (returned != 0)
+    {
+        qsort(matches, match_count, sizeof(SEARCH_MATCH), compare_matches_by_rank);
+        for (size_t i = 0; i < returned; i++)
+        {
+            ids[i] = matches[offset + i].id;
+        }
+    }
+    free(matches);
+    *out_ids = ids;
+    *out_count = returned;
+    *out_total = match_count;
+    return NO_ERROR;
+}
+
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+/*                                              OFFLINE REBUILD                                                  */
+/* █████████████████████████████████████████████████████████████████████████████████████████████████████████████ */
+
+struct SEARCH_INDEX_REBUILD {
+    char username[USERNAME_SIZE_CHARS];
+    char *path;
+    char *temp_path;
+    FILE *output;      // Buffered: the records of a whole folder are written in a few big writes
+    int failed;
+};
+
+SEARCH_INDEX_REBUILD *search_index_rebuild_begin(const char *username)
+{
+    if (unlikely(username == NULL || strlen(username) >= USERNAME_SIZE_CHARS))
+    {
+        return NULL;
+    }
+    SEARCH_INDEX_REBUILD *rebuild = calloc(1, sizeof(SEARCH_INDEX_REBUILD));
+    if (unlikely(rebuild == NULL))
+    {
+        PSE("Failed to allocate the search index rebuild of [%s]", username);
+        return NULL;
+    }
+    memcpy(rebuild->username, username, strlen(username));
+    rebuild->path = search_index_path(username, search_index_filename);
+    rebuild->temp_path = search_index_path(username, search_index_temp_filename);
+    rebuild->output = rebuild->temp_path == NULL ? NULL : fopen(rebuild->temp_path, "wb");
+    if (unlikely(rebuild->path == NULL || rebuild->output == NULL))
+    {
+        PSE("Search index: failed to start the rebuild of [%s]", username);
+        free(rebuild->path);
+        free(rebuild->temp_path);
+        free(rebuild);
+        return NULL;
+    }
+    return rebuild;
+}
+
+ERROR_CODE search_index_rebuild_add(SEARCH_INDEX_REBUILD *rebuild, const char *filename, const MESSAGE *header, const char *body, uint32_t body_length)
+{
+    message_id_t id = filename == NULL ? 0 : message_id_from_filename(filename);
+    if (unlikely(rebuild == NULL || header == NULL || body == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    if (rebuild->failed || id == 0)
+    {
+        return rebuild->failed ? SYSCALL_ERROR : NO_ERROR;
+    }
+    char *payload = NULL;
+    uint32_t payload_bytes = 0;
+    if (unlikely(search_build_payload(header, body, body_length, &payload, &payload_bytes) != NO_ERROR))
+    {
+        rebuild->failed = 1;
+        return SYSCALL_ERROR;
+    }
+    SEARCH_INDEX_RECORD_HEADER record;
+    memset(&record, 0, sizeof(record)); // Same record search_log_append() writes
+    record.magic = SEARCH_INDEX_MAGIC;
+    record.type = SEARCH_INDEX_ADD;
+    record.message_id = id;
+    record.payload_bytes = payload_bytes;
+    record.checksum = search_record_checksum(&record, payload);
+    if (unlikely(fwrite(&record, sizeof(record), 1, rebuild->output) != 1 ||
+                 (payload_bytes > 0 && fwrite(payload, payload_bytes, 1, rebuild->output) != 1)))
+    {
+        PSE("Search index: failed to write the rebuilt log of [%s]", rebuild->username);
+        rebuild->failed = 1;
+    }
+    free(payload);
+    return rebuild->failed ? SYSCALL_ERROR : NO_ERROR;
+}
+
+ERROR_CODE search_index_rebuild_finish(SEARCH_INDEX_REBUILD *rebuild, int commit)
+{
+    if (unlikely(rebuild == NULL))
+    {
+        return NULL_PARAMETERS;
+    }
+    commit = commit && !rebuild->failed;
+    int ok = fflush(rebuild->output) == 0 && fsync(fileno(rebuild->output)) == 0;
+    ok = fclose(rebuild->output) == 0 && ok;
+    ERROR_CODE result = NO_ERROR;
+    if (commit && ok && rename(rebuild->temp_path, rebuild->path) == 0)
+    {
+        result = NO_ERROR;
+    }
+    else
+    {
+        if (commit)
+        {
+            PSE("Search index: failed to replace the log of [%s]", rebuild->username);
+            result = SYSCALL_ERROR;
+        }
+        unlink(rebuild->temp_path);
+    }
+    free(rebuild->path);
+    free(rebuild->temp_path);
+    free(rebuild);
+    return result;
+}
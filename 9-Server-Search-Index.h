@@ -0,0 +1,122 @@
+/**
+ * @file 9-Server-Search-Index.h
+ * @author Jacopo Rizzuto (jacoporizzuto04@gmail.com)
+ * @brief .h file for the per-user full-text search index (inverted index over subject and body) that serves REQUEST_SEARCH_MESSAGES
+ * @version 0.1
+ * @date 2025-07-17
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#pragma once /** @note Not truly necessary but you never know...*/
+
+#include "3-Global-Variables-and-Functions.h"
+#include "4-Server-Storage.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+/**
+ * Every user folder has an index log (search_index_filename): an append-only list of SEARCH_INDEX_ADD records (message id +
+ * the words of subject and body with their frequency) and SEARCH_INDEX_REMOVE records. Deliveries and deletes only append to it,
+ * whether the index is in memory or not, so keeping it up to date never reads a message.
+ *
+ * The first search of a user replays the log into an in-memory inverted index (word -> postings sorted by message id) and
+ * reconciles it with the user folder (file names only): messages missing from the log are read and indexed, records of messages
+ * that are gone are dropped. A log with too many dead records is rewritten compacted at that point.
+ *
+ * Queries are conjunctive (every word must match), evaluated by intersecting the postings from the shortest list and ranked with BM25.
+ * Words are runs of ASCII letters/digits (lowercased) or UTF-8 bytes, SEARCH_MIN_TERM_CHARS to SEARCH_MAX_TERM_CHARS long, the
+ * words of the subject count twice.
+ *
+ * Configuration (environment variables):
+ *  - PGM_SEARCH_INDEX               "on" (default) or "off" (no log appends, searches are refused)
+ *  - PGM_SEARCH_INDEX_MAX_POSTINGS  postings kept in memory for all users together (default SEARCH_INDEX_DEFAULT_MAX_POSTINGS),
+ *                                   past it the least recently searched indexes are dropped and replayed again when needed
+ */
+
+typedef enum SEARCH_INDEX_RECORD_TYPE
+{
+    SEARCH_INDEX_ADD = 1,
+    SEARCH_INDEX_REMOVE = 2,
+} SEARCH_INDEX_RECORD_TYPE;
+
+/**
+ * @brief Header of a record of the index log, followed by payload_bytes of terms: [uint8_t length][length bytes][uint16_t frequency]...
+ * @note Stored in host byte order: the log never leaves the server machine
+ */
+typedef struct SEARCH_INDEX_RECORD_HEADER {
+    uint32_t magic;         // SEARCH_INDEX_MAGIC
+    uint32_t type;          // SEARCH_INDEX_RECORD_TYPE
+    uint64_t message_id;
+    uint32_t payload_bytes;
+    uint32_t checksum;      // FNV-1a of the header bytes before this field and of the payload
+} SEARCH_INDEX_RECORD_HEADER;
+
+enum search_index_constants {
+    SEARCH_INDEX_MAGIC = 0x50474D49,                 // "PGMI"
+    SEARCH_MIN_TERM_CHARS = 2,
+    SEARCH_MAX_TERM_CHARS = 32,                      // Longer words are cut, they still match on their first SEARCH_MAX_TERM_CHARS bytes
+    SEARCH_MAX_QUERY_TERMS = 8,
+    SEARCH_INDEX_MAX_PAYLOAD_BYTES = 1 << 16,        // Subject + body of the biggest message fit with plenty of room
+    SEARCH_INDEX_DEFAULT_MAX_POSTINGS = 8 * 1024 * 1024, // ~16 bytes each
+    SEARCH_INDEX_TABLE_INITIAL_CAPACITY = 64,        // Slots of the username -> index table, always a power of two
+    SEARCH_INDEX_TERMS_INITIAL_CAPACITY = 256,       // Slots of the word -> postings table of one index, always a power of two
+};
+
+extern const char *search_index_filename; // In every user folder
+
+/**
+ * @brief Reads the configuration, must be called once before any worker thread starts
+ */
+extern ERROR_CODE search_index_init(void);
+
+/**
+ * @brief Frees every index in memory, only to be called once every worker thread has been joined
+ */
+extern void search_index_shutdown(void);
+
+/**
+ * @brief 1 unless PGM_SEARCH_INDEX=off
+ */
+extern int search_index_enabled(void);
+
+/**
+ * @brief A message was stored as @p filename: its words are appended to the index log (and added to the index if it is in memory)
+ * @param header the stored header, message_length in network byte order
+ */
+extern void search_index_message_added(const char *username, const char *filename, const MESSAGE *header, const char *body, uint32_t body_length);
+
+/**
+ * @brief Message @p filename is gone (deleted by its owner or expired)
+ */
+extern void search_index_message_removed(const char *username, const char *filename);
+
+/**
+ * @brief Searches the mailbox of @p username
+ * @param out_ids receives a heap allocated array of at most @p limit message ids, best match first (to be freed by the caller)
+ * @param out_total receives the number of matches, all pages together
+ * @return NO_ERROR on success (also with no match), STRING_SIZE_INVALID if @p query has no searchable word, ERROR if the index is off, SYSCALL_ERROR on I/O errors
+ */
+extern ERROR_CODE search_index_query(const char *username, const char *query, size_t offset, size_t limit, message_id_t **out_ids, size_t *out_count, size_t *out_total);
+
+/**
+ * @brief Offline rebuild of the index log of one user (fsck): the messages are fed one by one, the new log replaces the old one at the end
+ */
+typedef struct SEARCH_INDEX_REBUILD SEARCH_INDEX_REBUILD;
+
+/**
+ * @return the rebuild (to be ended with search_index_rebuild_finish()), NULL if the temporary log cannot be created
+ */
+extern SEARCH_INDEX_REBUILD *search_index_rebuild_begin(const char *username);
+
+/**
+ * @param header the stored header, message_length in network byte order
+ * @return NO_ERROR on success, SYSCALL_ERROR if the record cannot be written (the rebuild must then be finished without commit)
+ */
+extern ERROR_CODE search_index_rebuild_add(SEARCH_INDEX_REBUILD *rebuild, const char *filename, const MESSAGE *header, const char *body, uint32_t body_length);
+
+/**
+ * @brief Ends the rebuild: with @p commit the new log is synced and renamed over the old one, otherwise it is thrown away
+ * @return NO_ERROR on success, SYSCALL_ERROR if the new log could not be committed (the old one stays)
+ */
+extern ERROR_CODE search_index_rebuild_finish(SEARCH_INDEX_REBUILD *rebuild, int commit);